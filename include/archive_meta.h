@@ -0,0 +1,42 @@
+#ifndef ARCHIVE_META_H
+#define ARCHIVE_META_H 1
+
+#include "buffer.h"
+#include "http.h"
+
+/*
+ * What we need to know about an archived document to
+ * revisit it cheaply: the validators the server sent
+ * with it, and the links it contained. Kept in a file
+ * next to the document.
+ */
+
+#define ARCHIVE_META_SUFFIX ".nwmeta"
+#define ARCHIVE_PART_SUFFIX ".nwpart" /* a document still being streamed to disk */
+
+struct archive_meta
+{
+	char etag[HTTP_VALIDATOR_MAX];
+	char last_modified[HTTP_VALIDATOR_MAX];
+	buf_t links; /* full URLs, one per line */
+	int nr_links;
+};
+
+int archive_meta_init(struct archive_meta *) __nonnull((1)) __wur;
+void archive_meta_destroy(struct archive_meta *) __nonnull((1));
+
+/*
+ * The local document and metadata file paths for URL.
+ */
+int archive_doc_path(struct http_t *, char *, buf_t *) __nonnull((1,2,3)) __wur;
+int archive_meta_path(struct http_t *, char *, buf_t *) __nonnull((1,2,3)) __wur;
+
+int archive_meta_load(char *, struct archive_meta *) __nonnull((1,2)) __wur;
+int archive_meta_save(char *, struct archive_meta *) __nonnull((1,2)) __wur;
+
+/*
+ * HTTP_validators_cb_t for documents we archived.
+ */
+int archive_get_validators(struct http_t *, char *, char *, char *) __nonnull((1,2,3,4));
+
+#endif /* !defined ARCHIVE_META_H */
@@ -3,6 +3,7 @@
 
 #include <openssl/ssl.h>
 #include <stdlib.h>
+#include <sys/uio.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -29,11 +30,21 @@ typedef struct buf_t
 
 int buf_init(buf_t *, size_t) __nonnull((1));
 void buf_destroy(buf_t *) __nonnull((1));
+
+/*
+ * Like buf_init() and buf_destroy(), but the memory
+ * comes from (and goes back to) a pool of buffers of
+ * a few fixed sizes. For temporaries.
+ */
+int buf_get(buf_t *, size_t) __nonnull((1));
+void buf_put(buf_t *) __nonnull((1));
 void buf_collapse(buf_t *, off_t, size_t) __nonnull((1));
 void buf_shift(buf_t *, off_t, size_t) __nonnull((1));
 int buf_extend(buf_t *, size_t) __nonnull((1)) __wur;
 int buf_append(buf_t *, char *) __nonnull((1,2)) __wur;
 int buf_append_ex(buf_t *, char *, size_t) __nonnull((1,2)) __wur;
+int buf_append_bytes(buf_t *, void *, size_t) __nonnull((1,2)) __wur;
+int buf_append_iov(buf_t *, struct iovec *, int) __nonnull((1,2)) __wur;
 void buf_append_fmt(buf_t *, char *, ...) __nonnull((1,2));
 void buf_snip(buf_t *, size_t) __nonnull((1));
 void buf_clear(buf_t *) __nonnull((1));
@@ -56,6 +67,41 @@ ssize_t buf_write_fd(int, buf_t *) __nonnull((2)) __wur;
 ssize_t buf_write_socket(int, buf_t *) __nonnull((2)) __wur;
 ssize_t buf_write_tls(SSL *, buf_t *) __nonnull((1,2)) __wur;
 
+/*
+ * A buffer made of fixed-size segments, for data that
+ * grows a piece at a time and is then written out or
+ * copied somewhere in one go. Growing it never moves
+ * what is already in it (so pointers into it stay
+ * good), and it is emptied with writev() without
+ * being made contiguous first.
+ */
+#define BUF_SEG_SIZE 16384
+#define BUF_CHAIN_IOV_MAX 64 /* segments per writev() */
+
+struct buf_seg
+{
+	struct buf_seg *next;
+	size_t len; /* used */
+	char data[];
+};
+
+typedef struct buf_chain_t
+{
+	struct buf_seg *head;
+	struct buf_seg *tail;
+	size_t seg_size;
+	size_t data_len;
+	int nr_segs;
+	unsigned magic;
+} buf_chain_t;
+
+int buf_chain_init(buf_chain_t *, size_t) __nonnull((1)) __wur;
+void buf_chain_destroy(buf_chain_t *) __nonnull((1));
+void buf_chain_clear(buf_chain_t *) __nonnull((1));
+int buf_chain_append(buf_chain_t *, void *, size_t) __nonnull((1,2)) __wur;
+int buf_chain_flatten(buf_chain_t *, buf_t *) __nonnull((1,2)) __wur;
+ssize_t buf_chain_write_fd(int, buf_chain_t *) __nonnull((2)) __wur;
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,42 @@
+#ifndef CONN_POOL_H
+#define CONN_POOL_H 1
+
+#include "http.h"
+
+#define CONN_POOL_MAX 64 /* connections, all hosts */
+#define CONN_POOL_DEFAULT_PER_HOST 4
+#define CONN_POOL_IDLE_TIMEOUT 15 /* seconds before an idle connection is closed */
+
+/*
+ * Get a connected HTTP object for URL's host (and scheme),
+ * waiting if all the connections allowed for the host are
+ * checked out. The caller sets up the request (URL, page,
+ * verb, etc) as it would with an object of its own.
+ *
+ * Returns NULL if no connection could be made.
+ */
+struct http_t *CONN_pool_checkout(const char *) __nonnull((1)) __wur;
+
+/*
+ * Give a connection back. If BROKEN is non-zero (the
+ * request failed, or the server said "Connection: close")
+ * it is closed and replaced by the next checkout.
+ */
+void CONN_pool_checkin(struct http_t *, int) __nonnull((1));
+
+void CONN_pool_set_limits(unsigned int, unsigned int);
+
+/*
+ * Whether to offer HTTP/2 on the connections handed out;
+ * set on each object before it connects. Requests are not
+ * pipelined on pooled connections (each is checked out for
+ * one request at a time), so there is no pipeline depth.
+ */
+void CONN_pool_set_http2(int);
+
+/*
+ * Close and free all connections; none may be checked out.
+ */
+void CONN_pool_destroy(void);
+
+#endif /* !defined CONN_POOL_H */
@@ -0,0 +1,50 @@
+#ifndef CONTENT_CODING_H
+#define CONTENT_CODING_H 1
+
+#include <brotli/decode.h>
+#include <stddef.h>
+#include <zlib.h>
+#include "buffer.h"
+
+/*
+ * Incremental decoding of Content-Encoding'd bodies.
+ */
+
+#define CODING_ACCEPT_ENCODING "gzip, deflate, br"
+#define CODING_DECODED_MAX (64 * 1024 * 1024) /* refuse to inflate a body beyond this */
+
+enum CODING_type
+{
+	CODING_IDENTITY = 0,
+	CODING_GZIP,
+	CODING_DEFLATE,
+	CODING_BROTLI
+};
+
+struct CODING_decoder
+{
+	enum CODING_type type;
+	z_stream zs;
+	int zs_ready; /* deflate: waiting to see if there is a zlib header */
+	BrotliDecoderState *br;
+	int done; /* end of the compressed stream seen */
+	size_t nr_out;
+};
+
+/*
+ * Returns the CODING_* for a Content-Encoding value,
+ * or -1 if it is one we cannot decode.
+ */
+int CODING_type(const char *) __nonnull((1)) __wur;
+
+int CODING_decoder_start(struct CODING_decoder *, enum CODING_type) __nonnull((1)) __wur;
+
+/*
+ * Decode LEN bytes and append the output to the
+ * buffer. May be called any number of times as
+ * the compressed body arrives.
+ */
+int CODING_decode(struct CODING_decoder *, unsigned char *, size_t, buf_chain_t *) __nonnull((1,4)) __wur;
+void CODING_decoder_end(struct CODING_decoder *) __nonnull((1));
+
+#endif /* !defined CONTENT_CODING_H */
@@ -0,0 +1,25 @@
+#ifndef COOKIE_JAR_H
+#define COOKIE_JAR_H 1
+
+#include <stddef.h>
+#include "buffer.h"
+
+#define COOKIE_JAR_MAX 4096 /* cookies we keep at once */
+#define COOKIE_PER_DOMAIN_MAX 64
+#define COOKIE_MAX 4096 /* name=value bytes (RFC 6265 6.1) */
+
+/*
+ * Store the cookie in a Set-Cookie value received
+ * from HOST for a request for PATH.
+ */
+void COOKIE_set(const char *, const char *, const char *, size_t) __nonnull((1,2,3));
+
+/*
+ * Append a Cookie field with every cookie we hold
+ * for HOST and PATH (only those without the Secure
+ * attribute if the third argument is 0). Nothing is
+ * appended if there are none.
+ */
+int COOKIE_put_header(const char *, const char *, int, buf_t *) __nonnull((1,2,4)) __wur;
+
+#endif /* !defined COOKIE_JAR_H */
@@ -0,0 +1,63 @@
+#ifndef DNS_CACHE_H
+#define DNS_CACHE_H 1
+
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#define DNS_MAX_ADDRS 8
+#define DNS_CACHE_MAX 1024 /* entries before we purge expired ones */
+#define DNS_DEFAULT_TTL 300 /* seconds */
+#define DNS_DEFAULT_NEGATIVE_TTL 30 /* seconds */
+#define DNS_DEFAULT_RESOLVERS 4 /* threads in the resolver pool */
+#define DNS_RESOLVERS_MAX 32
+#define DNS_REQUEST_QUEUE_MAX 256 /* lookups waiting for a resolver */
+
+/*
+ * Resolved addresses for a host. The port is
+ * left as zero; the caller fills it in.
+ */
+struct DNS_addrs
+{
+	int nr_addrs;
+	struct sockaddr_storage addrs[DNS_MAX_ADDRS];
+	socklen_t addr_lens[DNS_MAX_ADDRS];
+};
+
+/*
+ * Returns 0 on success, otherwise the (possibly
+ * negatively cached) getaddrinfo() error code.
+ */
+int DNS_lookup(const char *, struct DNS_addrs *) __nonnull((1,2)) __wur;
+void DNS_invalidate(const char *) __nonnull((1));
+void DNS_set_ttl(unsigned int, unsigned int);
+
+/*
+ * Called from a resolver thread when a lookup asked
+ * for with DNS_resolve_async() is done, with the
+ * same arguments DNS_lookup() would have given.
+ */
+typedef void (*DNS_callback_t)(const char *, int, struct DNS_addrs *, void *);
+
+/*
+ * Start (and stop) the threads that do lookups for
+ * DNS_resolve_async() and DNS_prefetch().
+ */
+int DNS_pool_start(int) __wur;
+void DNS_pool_stop(void);
+
+/*
+ * Have a resolver thread look up the host and call
+ * the callback (which may be NULL) with the result.
+ * Returns -1 if the pool is not running or is too
+ * busy, in which case the callback is never called.
+ */
+int DNS_resolve_async(const char *, DNS_callback_t, void *) __nonnull((1));
+
+/*
+ * Resolve the host in the background if we do not
+ * already have its addresses, so that they are in
+ * the cache when a connection to it is wanted.
+ */
+void DNS_prefetch(const char *) __nonnull((1));
+
+#endif /* !defined DNS_CACHE_H */
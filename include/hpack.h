@@ -0,0 +1,59 @@
+#ifndef HPACK_H
+#define HPACK_H 1
+
+#include <stddef.h>
+#include "buffer.h"
+
+/*
+ * HPACK (RFC 7541) header compression for HTTP/2.
+ */
+
+#define HPACK_DEFAULT_TABLE_SIZE 4096
+#define HPACK_ENTRY_OVERHEAD 32
+#define HPACK_STRING_MAX 16384 /* longest decoded name or value we accept */
+
+struct HPACK_entry
+{
+	char *name;
+	char *value;
+	size_t name_len;
+	size_t value_len;
+};
+
+/*
+ * The decoder's dynamic table: a ring of
+ * entries with the newest at HEAD.
+ */
+struct HPACK_table
+{
+	struct HPACK_entry *entries;
+	int capacity;
+	int nr_entries;
+	int head;
+	size_t size; /* as defined in RFC 7541 4.1 */
+	size_t max_size; /* set by dynamic table size updates */
+	size_t settings_max; /* what we advertised in SETTINGS_HEADER_TABLE_SIZE */
+	char *name_buf;
+	char *value_buf;
+};
+
+/*
+ * Called once for each decoded header field, with the
+ * name and value NUL terminated. Return < 0 to stop.
+ */
+typedef int (*HPACK_field_cb_t)(void *, char *, size_t, char *, size_t);
+
+int HPACK_table_init(struct HPACK_table *, size_t) __nonnull((1)) __wur;
+void HPACK_table_reset(struct HPACK_table *) __nonnull((1));
+void HPACK_table_destroy(struct HPACK_table *) __nonnull((1));
+
+int HPACK_decode(struct HPACK_table *, unsigned char *, size_t, HPACK_field_cb_t, void *) __nonnull((1,4)) __wur;
+
+/*
+ * We never add to the peer's dynamic table, so
+ * encoding needs no state beyond the output buffer.
+ */
+int HPACK_encode_field(buf_t *, char *, char *) __nonnull((1,2,3)) __wur;
+int HPACK_encode_table_size(buf_t *, size_t) __nonnull((1)) __wur;
+
+#endif /* !defined HPACK_H */
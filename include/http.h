@@ -7,12 +7,15 @@
 #include "buffer.h"
 #include "cache.h"
 #include "hash_bucket.h"
+#include "scan.h"
 
 #define HTTP_SWITCHING_PROTOCOLS 101u // for successful upgrade to HTTP 2.0
 #define HTTP_OK 200u
+#define HTTP_NO_CONTENT 204u
 #define HTTP_MOVED_PERMANENTLY 301u
 #define HTTP_FOUND 302u // the URI is being temporarily redirected
 #define HTTP_SEE_OTHER 303u
+#define HTTP_NOT_MODIFIED 304u
 #define HTTP_BAD_REQUEST 400u // the user agent sent a malformed request
 #define HTTP_UNAUTHORISED 401u
 #define HTTP_PAYMENT_REQUIRED 402u
@@ -21,6 +24,7 @@
 #define HTTP_METHOD_NOT_ALLOWED 405u
 #define HTTP_REQUEST_TIMEOUT 408u
 #define HTTP_GONE 410u
+#define HTTP_TOO_MANY_REQUESTS 429u
 #define HTTP_INTERNAL_ERROR 500u
 #define HTTP_BAD_GATEWAY 502u
 #define HTTP_SERVICE_UNAV 503u
@@ -35,6 +39,12 @@
 #define HTTP_HNAME_MAX 64 /* Header name */
 #define HTTP_HOST_MAX 256
 #define HTTP_HEADER_FIELD_MAX_LENGTH 2048
+#define HTTP_PIPELINE_MAX 16 /* requests in flight on one connection */
+#define HTTP_VALIDATOR_MAX 256 /* ETag or Last-Modified value */
+
+#define HTTP_VERSION_1_0 0x10000000u
+#define HTTP_VERSION_1_1 0x10100000u
+#define HTTP_VERSION_2_0 0x20000000u
 
 #define HTTP_VERSION		"1.1"
 #define HTTP_USER_AGENT		"Mozilla/5.0 (X11; Ubuntu; Linux x86_64; rv:75.0) Gecko/20100101 Firefox/75.0"
@@ -44,14 +54,25 @@
 
 #define HTTP_DEFAULT_READ_BUF_SIZE	32768
 #define HTTP_DEFAULT_WRITE_BUF_SIZE	4096
+#define HTTP_SINK_WINDOW		65536 /* most body bytes held at once when streaming to a sink */
+#define HTTP_SKIP_DRAIN_MAX		16384 /* read and throw away a skipped body this small to keep the connection */
 
 #define HTTP_PORT	80
 #define HTTPS_PORT	443
 
+/*
+ * Default per-phase deadlines, in seconds.
+ */
+#define HTTP_CONNECT_TIMEOUT	5
+#define HTTP_HANDSHAKE_TIMEOUT	5
+#define HTTP_FIRST_BYTE_TIMEOUT	10 /* request sent -> end of response header */
+#define HTTP_TRANSFER_TIMEOUT	60 /* request sent -> end of response body */
+#define HTTP_CONNECT_ATTEMPT_DELAY	250 /* ms before racing the next address (RFC 8305) */
+
 #define HTTP_EOH(BUF) \
 ({\
 	char *___p_t_r = NULL; \
-	___p_t_r = strstr((BUF)->buf_head, HTTP_EOH_SENTINEL); \
+	___p_t_r = SCAN_find((BUF)->buf_head, (BUF)->data_len, HTTP_EOH_SENTINEL, 4); \
 	if (NULL != ___p_t_r) \
 		___p_t_r += strlen(HTTP_EOH_SENTINEL); \
 	___p_t_r; \
@@ -65,6 +86,99 @@
  */
 //typedef void *(*HTTP_callback_t)(struct http_t *, void *);
 
+struct http_t;
+
+/*
+ * Called when building a GET request for URL. Fill in
+ * the ETag and/or Last-Modified of a copy we already
+ * have (each up to HTTP_VALIDATOR_MAX bytes; leave
+ * empty if unknown) and return 1 to make the request
+ * conditional, or return 0.
+ */
+typedef int (*HTTP_validators_cb_t)(struct http_t *, char *, char *, char *);
+
+/*
+ * Called when a 2xx response with a body arrives for
+ * URL. Return a file descriptor to have the (decoded)
+ * body written there as it is received, instead of
+ * kept in the read buffer, or -1 to keep it. It is
+ * left in http->bodySink for the caller to close.
+ */
+typedef int (*HTTP_sink_cb_t)(struct http_t *);
+
+/*
+ * What to do with a body, decided from its Content-Type
+ * as soon as the response header is in.
+ */
+enum HTTP_body_action
+{
+	HTTP_BODY_DEFAULT = 0, /* no policy for the type; the caller decides */
+	HTTP_BODY_PARSE, /* take links from it and archive it */
+	HTTP_BODY_ARCHIVE, /* archive it as it is */
+	HTTP_BODY_SKIP /* not received (or abandoned part way) */
+};
+
+#define HTTP_TYPE_POLICY_MAX 32
+#define HTTP_MEDIA_TYPE_MAX 64
+
+/*
+ * TYPE is a media type ("application/pdf"), a top-level
+ * type ending in '/' ("video/"), or "*" for everything
+ * else; the most specific one that matches is used. A
+ * body over MAX_SIZE bytes (if not 0) is skipped.
+ */
+struct HTTP_type_policy
+{
+	char type[HTTP_MEDIA_TYPE_MAX];
+	enum HTTP_body_action action;
+	size_t max_size;
+};
+
+/*
+ * Each phase of a request must finish within its own
+ * number of seconds of wall-clock (monotonic) time,
+ * however the server trickles its bytes out.
+ */
+struct HTTP_timeouts
+{
+	int connect;
+	int handshake;
+	int first_byte;
+	int transfer;
+};
+
+/*
+ * Options set on every socket before it connects. A
+ * zero RCVBUF leaves the kernel to size (and grow) the
+ * receive buffer itself; setting it turns that off, so
+ * only do so for links whose bandwidth-delay product
+ * autotuning does not reach. KEEPALIVE is seconds idle
+ * before probing a connection (then HTTP_SOCK_KEEPALIVE_PROBES
+ * probes, HTTP_SOCK_KEEPALIVE_INTVL seconds apart, before
+ * it is given up on) and USER_TIMEOUT the
+ * milliseconds sent data may go unacknowledged before
+ * the connection is dropped (0 leaves either alone).
+ * FAST_OPEN is only used for hosts with one address;
+ * with several, the connect() calls we race would all
+ * appear to succeed at once.
+ */
+struct HTTP_socket_profile
+{
+	int nodelay;
+	int fast_open; /* TCP_FASTOPEN_CONNECT: data in the SYN to hosts we have a cookie for */
+	int rcvbuf;
+	int keepalive;
+	int user_timeout;
+};
+
+#define HTTP_SOCK_NODELAY 1
+#define HTTP_SOCK_FAST_OPEN 0
+#define HTTP_SOCK_RCVBUF 0
+#define HTTP_SOCK_KEEPALIVE 60
+#define HTTP_SOCK_KEEPALIVE_INTVL 5 /* seconds between unanswered probes */
+#define HTTP_SOCK_KEEPALIVE_PROBES 3
+#define HTTP_SOCK_USER_TIMEOUT 30000
+
 typedef struct HTTP_Header
 {
 	char *name;
@@ -88,8 +202,9 @@ struct conn
 	buf_t write_buf;
 	int sock_nonblocking;
 	int ssl_nonblocking;
-	char *host_ipv4;
+	char *host_addr; /* the address we connected to (IPv4 or IPv6) */
 	SSL_CTX *ssl_ctx;
+	int epoll_fd; /* readiness notification for SOCK */
 };
 
 enum request
@@ -106,6 +221,13 @@ struct http_t
 	int code;
 	int followRedirects;
 	int usingSecure;
+	int pipelineDepth; /* <= 1 means no pipelining */
+	int useHTTP2; /* offer h2 with ALPN on TLS connections */
+	HTTP_validators_cb_t getValidators; /* for conditional GETs (may be NULL) */
+	struct HTTP_timeouts timeouts;
+	HTTP_sink_cb_t openSink; /* for streaming bodies to a file (may be NULL) */
+	int bodySink; /* where the last body went, or -1 if it is in the read buffer */
+	enum HTTP_body_action bodyAction; /* what the type policies said about the last body */
 
 	uint32_t id;
 
@@ -137,6 +259,33 @@ size_t httpslen;
 struct http_t *HTTP_new(uint32_t) __wur;
 void HTTP_delete(struct http_t *) __nonnull((1));
 
+/*
+ * Timeouts given to HTTP objects created from now
+ * on (e.g., those made by the connection pool).
+ */
+void HTTP_set_default_timeouts(struct HTTP_timeouts *) __nonnull((1));
+
+/*
+ * Policies applied to the bodies of 2xx responses
+ * received from now on. Call before creating any
+ * worker threads.
+ */
+void HTTP_set_type_policies(struct HTTP_type_policy *, int);
+
+/*
+ * Options for sockets connected from now on. Call
+ * before creating any worker threads.
+ */
+void HTTP_set_socket_profile(struct HTTP_socket_profile *) __nonnull((1));
+
+/*
+ * The values the kernel actually used for the options
+ * on the last socket we connected (it doubles RCVBUF,
+ * for one), and the number of sockets connected. Zero
+ * if we have not connected yet.
+ */
+int HTTP_socket_stats(struct HTTP_socket_profile *) __nonnull((1));
+
 void http_check_host(struct http_t *) __nonnull((1));
 
 /*
@@ -145,6 +294,26 @@ void http_check_host(struct http_t *) __nonnull((1));
 int http_connect(struct http_t *) __nonnull((1)) __wur;
 void http_disconnect(struct http_t *) __nonnull((1));
 int http_reconnect(struct http_t *) __nonnull((1)) __wur;
+int http_connection_closed(struct http_t *) __nonnull((1)) __wur;
+
+/*
+ * Seconds the server asked us to wait before the next
+ * request (Retry-After with a 429 or 503), or 0.
+ */
+int HTTP_retry_after(struct http_t *) __nonnull((1)) __wur;
 int HTTP_upgrade_to_TLS(struct http_t *) __nonnull((1)) __wur;
+int http_wait_readable(struct http_t *, struct timespec *, int *) __nonnull((1,2)) __wur;
+ssize_t http_recv_into(struct http_t *, buf_t *, size_t, struct timespec *) __nonnull((1,2,4)) __wur;
+int http_write_buf(struct http_t *, buf_t *) __nonnull((1,2)) __wur;
+
+/*
+ * HTTP/1.1 pipelining: send several GET requests
+ * for the same host in one write, then read the
+ * responses back in order. Unanswered URLs must
+ * be retried on a new connection.
+ */
+int HTTP_pipeline_send(struct http_t *, char **, int) __nonnull((1,2)) __wur;
+int HTTP_pipeline_recv(struct http_t *) __nonnull((1)) __wur;
+char *HTTP_pipeline_unanswered(struct http_t *) __nonnull((1)) __wur;
 
 #endif /* !defined HTTP_H */
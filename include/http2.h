@@ -0,0 +1,115 @@
+#ifndef HTTP2_H
+#define HTTP2_H 1
+
+#include <stdint.h>
+#include <time.h>
+#include "buffer.h"
+#include "hpack.h"
+
+/*
+ * HTTP/2 (RFC 7540) transport, negotiated with ALPN.
+ * Used by http.c through the HTTP_methods ops table.
+ */
+
+struct http_t;
+
+#define HTTP2_CONNECTION_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define HTTP2_ALPN_PROTOCOLS "\x02h2\x08http/1.1"
+
+#define HTTP2_FRAME_HEADER_LEN 9
+#define HTTP2_DEFAULT_FRAME_SIZE 16384
+#define HTTP2_DEFAULT_WINDOW 65535
+#define HTTP2_MAX_STREAMS 32 /* streams we have open at once */
+#define HTTP2_STREAM_WINDOW 1048576 /* receive window we give each stream */
+#define HTTP2_CONN_WINDOW 16777216 /* ... and the connection */
+#define HTTP2_READ_BLOCK 16384
+
+/*
+ * Error codes (RFC 7540 7).
+ */
+#define HTTP2_NO_ERROR 0x0
+#define HTTP2_PROTOCOL_ERROR 0x1
+#define HTTP2_INTERNAL_ERROR 0x2
+#define HTTP2_FLOW_CONTROL_ERROR 0x3
+#define HTTP2_STREAM_CLOSED 0x5
+#define HTTP2_FRAME_SIZE_ERROR 0x6
+#define HTTP2_REFUSED_STREAM 0x7
+#define HTTP2_CANCEL 0x8
+#define HTTP2_COMPRESSION_ERROR 0x9
+
+struct HTTP2_field
+{
+	char *name;
+	char *value;
+};
+
+enum HTTP2_stream_state
+{
+	HTTP2_STREAM_IDLE = 0,
+	HTTP2_STREAM_OPEN, /* waiting for the response */
+	HTTP2_STREAM_DONE /* END_STREAM or reset */
+};
+
+struct HTTP2_stream
+{
+	uint32_t id;
+	enum HTTP2_stream_state state;
+	int status; /* from :status */
+	int got_headers; /* the final (non-1xx) header block */
+	uint32_t error; /* from RST_STREAM or GOAWAY */
+	uint32_t recv_unacked; /* DATA received since our last WINDOW_UPDATE */
+	buf_t header; /* response header fields as "name: value\r\n" lines */
+	buf_t body;
+};
+
+struct HTTP2_conn
+{
+	struct HPACK_table decoder;
+	buf_t in; /* read but not yet parsed */
+	buf_t out; /* frames waiting to be written */
+	buf_t hblock; /* header block spread over HEADERS + CONTINUATION */
+	uint32_t hblock_stream;
+	int hblock_end_stream;
+	uint32_t next_stream_id;
+	uint32_t peer_max_streams;
+	uint32_t peer_max_frame;
+	uint32_t recv_unacked;
+	int table_size_update; /* next header block we send starts with one */
+	int nr_open;
+	int goaway;
+	int dead;
+	struct HTTP2_stream streams[HTTP2_MAX_STREAMS];
+};
+
+struct HTTP2_conn *HTTP2_conn_new(void) __wur;
+void HTTP2_conn_delete(struct HTTP2_conn *) __nonnull((1));
+
+/*
+ * Reset the state and send the connection preface.
+ */
+int HTTP2_conn_start(struct http_t *, struct HTTP2_conn *) __nonnull((1,2)) __wur;
+
+/*
+ * Queue the HEADERS for a new request. Returns the
+ * stream ID, or 0 if no stream can be opened now
+ * (too many open or the server sent GOAWAY).
+ */
+uint32_t HTTP2_submit(struct HTTP2_conn *, struct HTTP2_field *, int, int) __nonnull((1,2)) __wur;
+int HTTP2_flush(struct http_t *, struct HTTP2_conn *) __nonnull((1,2)) __wur;
+
+/*
+ * Process frames until the stream is done. Waits at most
+ * TIMEOUT seconds between reads, and not past DEADLINE
+ * (CLOCK_MONOTONIC; may be NULL). Returns NULL if the
+ * connection failed; it must then be reconnected.
+ */
+struct HTTP2_stream *HTTP2_await(struct http_t *, struct HTTP2_conn *, uint32_t, int, struct timespec *) __nonnull((1,2)) __wur;
+
+/*
+ * The same, but return as soon as the response header
+ * is in. The stream stays open for HTTP2_await().
+ */
+struct HTTP2_stream *HTTP2_await_headers(struct http_t *, struct HTTP2_conn *, uint32_t, int, struct timespec *) __nonnull((1,2)) __wur;
+void HTTP2_stream_release(struct HTTP2_conn *, struct HTTP2_stream *) __nonnull((1,2));
+
+#endif /* !defined HTTP2_H */
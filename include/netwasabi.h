@@ -8,9 +8,12 @@
 #include "btree.h"
 #include "buffer.h"
 #include "cache.h"
+#include "dns_cache.h"
 #include "graph.h"
 #include "http.h"
 #include "queue.h"
+#include "redirect_map.h"
+#include "utils_url.h"
 
 #define NETWASABI_BUILD		"0.0.3"
 #define NETWASABI_DIR		"NetWasabi_Crawled"
@@ -159,6 +162,26 @@ uint32_t runtime_options;
 #define DEFAULT_CRAWL_DELAY 3
 #define DEFAULT_CRAWL_DEPTH 10
 #define DEFAULT_MAX_QUEUE 100
+#define DEFAULT_PIPELINE_DEPTH 1 /* i.e., off */
+#define DEFAULT_USE_HTTP2 1
+#define DEFAULT_CONNS_PER_HOST 4
+#define DEFAULT_CONNECT_TIMEOUT HTTP_CONNECT_TIMEOUT
+#define DEFAULT_HANDSHAKE_TIMEOUT HTTP_HANDSHAKE_TIMEOUT
+#define DEFAULT_FIRST_BYTE_TIMEOUT HTTP_FIRST_BYTE_TIMEOUT
+#define DEFAULT_TRANSFER_TIMEOUT HTTP_TRANSFER_TIMEOUT
+#define DEFAULT_CONTENT_TYPES \
+	"text/html:parse application/xhtml+xml:parse " \
+	"video/:skip audio/:skip application/octet-stream:skip " \
+	"application/zip:skip application/gzip:skip application/x-tar:skip " \
+	"*:default:64M"
+#define DEFAULT_TCP_NODELAY HTTP_SOCK_NODELAY
+#define DEFAULT_TCP_FAST_OPEN HTTP_SOCK_FAST_OPEN
+#define DEFAULT_RECEIVE_BUFFER HTTP_SOCK_RCVBUF
+#define DEFAULT_KEEPALIVE HTTP_SOCK_KEEPALIVE
+#define DEFAULT_USER_TIMEOUT (HTTP_SOCK_USER_TIMEOUT / 1000)
+#define DEFAULT_PERMANENT_REDIRECT_TTL REDIRECT_DEFAULT_PERMANENT_TTL
+#define DEFAULT_TEMPORARY_REDIRECT_TTL REDIRECT_DEFAULT_TEMPORARY_TTL
+#define DEFAULT_RESOLVER_THREADS DNS_DEFAULT_RESOLVERS
 #define MAX_FAILS 10
 #define MAX_TIME_WAIT 8
 #define RESET_DELAY 3
@@ -175,6 +198,22 @@ struct url_types
 #define MAX_QUEUE_OPTION_NAME "queueMax"
 #define FAST_MODE_OPTION_NAME "fastMode"
 #define XDOMAIN_OPTION_NAME "xdomain"
+#define PIPELINE_DEPTH_OPTION_NAME "pipelineDepth"
+#define HTTP2_OPTION_NAME "http2"
+#define CONNS_PER_HOST_OPTION_NAME "connectionsPerHost"
+#define CONNECT_TIMEOUT_OPTION_NAME "connectTimeout"
+#define HANDSHAKE_TIMEOUT_OPTION_NAME "handshakeTimeout"
+#define FIRST_BYTE_TIMEOUT_OPTION_NAME "firstByteTimeout"
+#define TRANSFER_TIMEOUT_OPTION_NAME "transferTimeout"
+#define CONTENT_TYPES_OPTION_NAME "contentTypes"
+#define TCP_NODELAY_OPTION_NAME "tcpNoDelay"
+#define TCP_FAST_OPEN_OPTION_NAME "tcpFastOpen"
+#define RECEIVE_BUFFER_OPTION_NAME "receiveBuffer"
+#define KEEPALIVE_OPTION_NAME "keepAlive"
+#define USER_TIMEOUT_OPTION_NAME "userTimeout"
+#define PERMANENT_REDIRECT_TTL_OPTION_NAME "permanentRedirectTTL"
+#define TEMPORARY_REDIRECT_TTL_OPTION_NAME "temporaryRedirectTTL"
+#define RESOLVER_THREADS_OPTION_NAME "resolverThreads"
 
 #define stats_nr_bytes(n) ((n)->stats.nr_bytes)
 #define stats_nr_requests(n) ((n)->stats.nr_requests)
@@ -185,6 +224,21 @@ struct url_types
 #define CONFIG_CRAWL_DEPTH(n, v) ((n)->config.crawl_depth = (v))
 #define CONFIG_MAX_QUEUE(n, v) ((n)->config.max_queue = (v))
 #define CONFIG_CROSS_DOMAIN(n, v) ((n)->config.allow_xdomain = (v))
+#define CONFIG_PIPELINE_DEPTH(n, v) ((n)->config.pipeline_depth = (v))
+#define CONFIG_USE_HTTP2(n, v) ((n)->config.use_http2 = (v))
+#define CONFIG_CONNS_PER_HOST(n, v) ((n)->config.conns_per_host = (v))
+#define CONFIG_CONNECT_TIMEOUT(n, v) ((n)->config.timeouts.connect = (v))
+#define CONFIG_HANDSHAKE_TIMEOUT(n, v) ((n)->config.timeouts.handshake = (v))
+#define CONFIG_FIRST_BYTE_TIMEOUT(n, v) ((n)->config.timeouts.first_byte = (v))
+#define CONFIG_TRANSFER_TIMEOUT(n, v) ((n)->config.timeouts.transfer = (v))
+#define CONFIG_TCP_NODELAY(n, v) ((n)->config.socket.nodelay = (v))
+#define CONFIG_TCP_FAST_OPEN(n, v) ((n)->config.socket.fast_open = (v))
+#define CONFIG_RECEIVE_BUFFER(n, v) ((n)->config.socket.rcvbuf = (v))
+#define CONFIG_KEEPALIVE(n, v) ((n)->config.socket.keepalive = (v))
+#define CONFIG_USER_TIMEOUT(n, v) ((n)->config.socket.user_timeout = (v) * 1000)
+#define CONFIG_PERMANENT_REDIRECT_TTL(n, v) ((n)->config.permanent_redirect_ttl = (v))
+#define CONFIG_TEMPORARY_REDIRECT_TTL(n, v) ((n)->config.temporary_redirect_ttl = (v))
+#define CONFIG_RESOLVER_THREADS(n, v) ((n)->config.resolver_threads = (v))
 
 #define STATS_ADD_BYTES(n, b) ((n)->stats.nr_bytes += (b))
 #define STATS_INC_REQS(n) ++((n)->stats.nr_requests)
@@ -242,6 +296,16 @@ struct netwasabi_ctx
 		unsigned int max_queue; // maximum number of URLs allowed in the queue
 		unsigned int allow_xdomain; // can we follow URLs that are on another remote server?
 		unsigned int tslash;
+		unsigned int pipeline_depth; // number of requests to pipeline on the connection
+		unsigned int use_http2; // offer HTTP/2 to servers that support it
+		unsigned int conns_per_host; // connections fast mode workers share per server
+		struct HTTP_timeouts timeouts; // seconds allowed for each phase of a request
+		struct HTTP_type_policy type_policies[HTTP_TYPE_POLICY_MAX]; // what to do with bodies of each Content-Type
+		int nr_type_policies;
+		struct HTTP_socket_profile socket; // options set on each socket before it connects
+		unsigned int permanent_redirect_ttl; // seconds we remember a 301 for
+		unsigned int temporary_redirect_ttl; // seconds we remember a 302 or 303 for
+		unsigned int resolver_threads; // threads looking up servers we have found links to
 	} config;
 
 	struct
@@ -296,8 +360,12 @@ void put_error_msg(const char *, ...) __nonnull ((1));
 
 int check_local_dirs(struct http_t *, buf_t *) __nonnull((1,2)) __wur;
 void replace_with_local_urls(struct http_t *, buf_t *) __nonnull((1,2));
-int archive_page(struct http_t *) __nonnull((1)) __wur;
-int parse_URLs(struct http_t *, queue_obj_t *, btree_obj_t *) __nonnull((1,2,3)) __wur;
+int archive_page(struct http_t *, buf_t *, struct URL_edits *) __nonnull((1)) __wur;
+int archive_open_sink(struct http_t *) __nonnull((1));
+void archive_discard_sink(struct http_t *) __nonnull((1));
+int document_parseable(struct http_t *) __nonnull((1));
+int archive_revisit(struct http_t *, queue_obj_t *, btree_obj_t *) __nonnull((1,2,3)) __wur;
+int parse_URLs(struct http_t *, queue_obj_t *, btree_obj_t *, buf_t *) __nonnull((1,2,3)) __wur;
 
 int Crawl_WebSite(struct http_t *, queue_obj_t *, btree_obj_t *) __nonnull((1,2,3)) __wur;
 
@@ -0,0 +1,24 @@
+#ifndef REDIRECT_MAP_H
+#define REDIRECT_MAP_H 1
+
+#include <stddef.h>
+
+#define REDIRECT_MAP_MAX 4096 /* entries before we purge expired ones */
+#define REDIRECT_CHAIN_MAX 8 /* hops we follow before calling it a loop */
+#define REDIRECT_DEFAULT_PERMANENT_TTL 86400 /* seconds, for a 301 */
+#define REDIRECT_DEFAULT_TEMPORARY_TTL 300 /* seconds, for a 302 or 303 */
+
+/*
+ * Remember that FROM redirects to TO. A URL that
+ * redirects to itself is recorded with TO == FROM.
+ */
+void REDIRECT_put(const char *, const char *, int) __nonnull((1,2));
+
+/*
+ * If we know where URL redirects to, copy it to the
+ * buffer (of the given size) and return 1, else 0.
+ */
+int REDIRECT_lookup(const char *, char *, size_t) __nonnull((1,2)) __wur;
+void REDIRECT_set_ttl(unsigned int, unsigned int);
+
+#endif /* !defined REDIRECT_MAP_H */
@@ -0,0 +1,32 @@
+#ifndef __SCAN_H__
+#define __SCAN_H__ 1
+
+#include <sys/types.h>
+
+/*
+ * Searching (pointer, length) spans, sixteen or thirty-two
+ * bytes at a time where the CPU allows it. Which kernels
+ * are used is decided once, the first time one is needed;
+ * build with SCAN_NO_SIMD to always use the plain C ones.
+ */
+
+#define SCAN_SET_MAX 16 /* most bytes in a set searched for with SIMD */
+
+/*
+ * The first occurrence of NEEDLE (NLEN bytes) in
+ * the LEN bytes at P, or NULL.
+ */
+char *SCAN_find(const char *, size_t, const char *, size_t) __nonnull((1,3)) __wur;
+
+/*
+ * The first of the LEN bytes at P that is any of
+ * the NSET bytes in SET, or NULL.
+ */
+char *SCAN_find_any(const char *, size_t, const char *, size_t) __nonnull((1,3)) __wur;
+
+/*
+ * "avx2", "sse2" or "scalar".
+ */
+const char *SCAN_kernel(void);
+
+#endif /* !defined __SCAN_H__ */
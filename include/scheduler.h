@@ -0,0 +1,90 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H 1
+
+#include <pthread.h>
+#include <time.h>
+#include "http.h"
+#include "queue.h"
+
+/*
+ * Hands out URLs to crawl so that each server gets at
+ * most MAX_PER_HOST requests at a time, and a request
+ * at most once every DELAY milliseconds. Rather than
+ * sleeping through a server's delay, the caller gets
+ * a URL for another server that is ready, if any.
+ */
+
+#define SCHED_HOST_BUCKETS 256
+#define SCHED_BACKOFF_MAX 600 /* most seconds we honour in a Retry-After */
+
+/*
+ * Return non-zero for a URL that should not be
+ * fetched after all (already archived, dead...).
+ * Called with the scheduler locked.
+ */
+typedef int (*SCHED_filter_t)(char *, void *);
+
+struct sched_host
+{
+	char name[HTTP_HOST_MAX];
+	queue_obj_t *URLs; /* waiting to be taken */
+	struct timespec next; /* earliest the next request may go (CLOCK_MONOTONIC) */
+	int in_flight;
+	int heap_idx; /* in the ready heap, or -1 */
+	struct sched_host *hnext; /* hash chain */
+};
+
+struct scheduler
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	struct sched_host *hosts[SCHED_HOST_BUCKETS];
+
+	/*
+	 * Hosts with URLs waiting and a request to spare,
+	 * ordered by when they may next be sent one.
+	 */
+	struct sched_host **heap;
+	int nr_heap;
+	int heap_size;
+
+	int delay; /* milliseconds between requests to a host */
+	int max_per_host;
+	int nr_in_flight;
+
+	SCHED_filter_t filter;
+	void *filter_arg;
+};
+
+struct scheduler *SCHED_new(int, int, SCHED_filter_t, void *) __wur;
+void SCHED_delete(struct scheduler *) __nonnull((1));
+
+/*
+ * Move every URL in the queue to the scheduler.
+ */
+int SCHED_admit(struct scheduler *, queue_obj_t *) __nonnull((1,2));
+
+/*
+ * Wait for a URL whose server may be sent a request
+ * now. Returns NULL once there are no URLs left and
+ * none in flight (which could bring more). The item
+ * is the caller's to free, and SCHED_done() must be
+ * called for its URL when the request is over.
+ */
+queue_item_t *SCHED_take(struct scheduler *) __nonnull((1)) __wur;
+
+/*
+ * Another URL for the same server as URL, to go out
+ * with it (pipelined); it shares its request slot.
+ * Does not wait; NULL if there is none.
+ */
+queue_item_t *SCHED_take_more(struct scheduler *, char *) __nonnull((1,2)) __wur;
+
+/*
+ * The request for URL is over. If the server asked
+ * us to back off (Retry-After), pass the seconds.
+ */
+void SCHED_done(struct scheduler *, char *, int) __nonnull((1,2));
+
+#endif /* !defined SCHEDULER_H */
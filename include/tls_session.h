@@ -0,0 +1,22 @@
+#ifndef TLS_SESSION_H
+#define TLS_SESSION_H 1
+
+#include <openssl/ssl.h>
+
+#define TLS_SESSION_CACHE_SIZE 64
+#define TLS_SESSION_MAX_AGE 7200 /* seconds */
+
+/*
+ * One client context for the whole process.
+ * Do not SSL_CTX_free() what this returns.
+ */
+SSL_CTX *TLS_client_ctx(void) __wur;
+
+/*
+ * Set SNI for HOST and offer a previously
+ * cached session for it if we have one.
+ */
+void TLS_session_resume(SSL *, const char *) __nonnull((1,2));
+void TLS_session_forget(const char *) __nonnull((1));
+
+#endif /* !defined TLS_SESSION_H */
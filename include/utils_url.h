@@ -20,4 +20,33 @@ int has_extension(char *) __nonnull((1)) __wur;
 int URL_parseable(char *);
 void transform_document_URLs(struct http_t *);
 
+/*
+ * Localising the links in a document as a list of
+ * edits against it: each replaces LEN bytes at OFF
+ * with TEXT_LEN bytes at TEXT_OFF in TEXT.
+ */
+#define URL_EDITS_IOV_MAX 64 /* pieces per writev() */
+
+struct URL_edit
+{
+	off_t off; /* from the head of the read buffer */
+	size_t len;
+	off_t text_off;
+	size_t text_len;
+};
+
+struct URL_edits
+{
+	struct URL_edit *list;
+	int nr;
+	int size;
+	buf_t text; /* the replacements, back to back */
+};
+
+int URL_edits_init(struct URL_edits *) __nonnull((1)) __wur;
+void URL_edits_destroy(struct URL_edits *) __nonnull((1));
+int URL_find_edits(struct http_t *, struct URL_edits *) __nonnull((1,2)) __wur;
+int URL_apply_edits(buf_t *, struct URL_edits *) __nonnull((1,2)) __wur;
+ssize_t URL_write_edits(int, buf_t *, off_t, struct URL_edits *) __nonnull((2,4)) __wur;
+
 #endif /* !defined UTILS_URL_H */
@@ -0,0 +1,273 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "archive_meta.h"
+#include "buffer.h"
+#include "http.h"
+#include "netwasabi.h"
+#include "utils_url.h"
+
+/*
+ * The metadata file is plain text:
+ *
+ * etag: "abc123"
+ * last-modified: Mon, 05 Oct 2020 09:00:00 GMT
+ * link: https://example.com/page
+ * link: ...
+ */
+
+#define META_ETAG "etag: "
+#define META_LAST_MODIFIED "last-modified: "
+#define META_LINK "link: "
+#define META_LINE_MAX (HTTP_URL_MAX + HTTP_VALIDATOR_MAX)
+
+int
+archive_meta_init(struct archive_meta *meta)
+{
+	assert(meta);
+
+	meta->etag[0] = 0;
+	meta->last_modified[0] = 0;
+	meta->nr_links = 0;
+
+	return buf_init(&meta->links, HTTP_URL_MAX);
+}
+
+void
+archive_meta_destroy(struct archive_meta *meta)
+{
+	assert(meta);
+
+	buf_destroy(&meta->links);
+
+	return;
+}
+
+int
+archive_doc_path(struct http_t *http, char *URL, buf_t *path)
+{
+	assert(http);
+	assert(URL);
+	assert(path);
+
+	buf_t tmp;
+	int rv;
+
+	if (buf_get(&tmp, HTTP_URL_MAX) < 0)
+		return -1;
+
+	if (buf_append(&tmp, URL) < 0)
+		rv = -1;
+	else
+		rv = make_local_url(http, &tmp, path);
+
+	buf_put(&tmp);
+
+	if (rv < 0)
+		return -1;
+
+	buf_collapse(path, (off_t)0, strlen("file://"));
+
+	return 0;
+}
+
+int
+archive_meta_path(struct http_t *http, char *URL, buf_t *path)
+{
+	assert(http);
+	assert(URL);
+	assert(path);
+
+	if (archive_doc_path(http, URL, path) < 0)
+		return -1;
+
+	if (buf_append(path, ARCHIVE_META_SUFFIX) < 0)
+		return -1;
+
+	return 0;
+}
+
+/**
+ * __copy_value - copy a validator, dropping the line ending
+ */
+static void
+__copy_value(char *dest, char *value)
+{
+	size_t len = strcspn(value, "\r\n");
+
+	if (len >= HTTP_VALIDATOR_MAX)
+		len = HTTP_VALIDATOR_MAX - 1;
+
+	memcpy(dest, value, len);
+	dest[len] = 0;
+
+	return;
+}
+
+int
+archive_meta_load(char *path, struct archive_meta *meta)
+{
+	assert(path);
+	assert(meta);
+
+	FILE *fp;
+	char *line;
+	size_t len;
+
+	if (!(fp = fopen(path, "r")))
+		return -1;
+
+	if (!(line = malloc(META_LINE_MAX)))
+		goto fail_close;
+
+	while (fgets(line, META_LINE_MAX, fp))
+	{
+		if (!strncmp(line, META_ETAG, strlen(META_ETAG)))
+		{
+			__copy_value(meta->etag, line + strlen(META_ETAG));
+		}
+		else
+		if (!strncmp(line, META_LAST_MODIFIED, strlen(META_LAST_MODIFIED)))
+		{
+			__copy_value(meta->last_modified, line + strlen(META_LAST_MODIFIED));
+		}
+		else
+		if (!strncmp(line, META_LINK, strlen(META_LINK)))
+		{
+			len = strcspn(line + strlen(META_LINK), "\r\n");
+
+			if (!len || len >= HTTP_URL_MAX)
+				continue;
+
+			if (buf_append_ex(&meta->links, line + strlen(META_LINK), len) < 0
+			|| buf_append(&meta->links, "\n") < 0)
+				goto fail_free;
+
+			++meta->nr_links;
+		}
+	}
+
+	free(line);
+	fclose(fp);
+
+	return 0;
+
+fail_free:
+
+	free(line);
+
+fail_close:
+
+	fclose(fp);
+	return -1;
+}
+
+/**
+ * archive_meta_save - write the metadata file
+ *
+ * Written to a temporary file first and renamed so that
+ * an interrupted crawl never leaves a truncated one.
+ */
+int
+archive_meta_save(char *path, struct archive_meta *meta)
+{
+	assert(path);
+	assert(meta);
+
+	FILE *fp;
+	buf_t tmp_path;
+	char *p;
+	char *e;
+
+	if (buf_get(&tmp_path, path_max) < 0)
+		return -1;
+
+	if (buf_append(&tmp_path, path) < 0 || buf_append(&tmp_path, ".tmp") < 0)
+		goto fail;
+
+	if (!(fp = fopen(tmp_path.buf_head, "w")))
+		goto fail;
+
+	if (meta->etag[0])
+		fprintf(fp, META_ETAG "%s\n", meta->etag);
+
+	if (meta->last_modified[0])
+		fprintf(fp, META_LAST_MODIFIED "%s\n", meta->last_modified);
+
+	p = meta->links.buf_head;
+
+	while (p < meta->links.buf_tail && (e = memchr(p, '\n', meta->links.buf_tail - p)))
+	{
+		fprintf(fp, META_LINK "%.*s\n", (int)(e - p), p);
+		p = e + 1;
+	}
+
+	if (fclose(fp) != 0)
+		goto fail_unlink;
+
+	if (rename(tmp_path.buf_head, path) < 0)
+		goto fail_unlink;
+
+	buf_put(&tmp_path);
+
+	return 0;
+
+fail_unlink:
+
+	unlink(tmp_path.buf_head);
+
+fail:
+
+	buf_put(&tmp_path);
+	return -1;
+}
+
+int
+archive_get_validators(struct http_t *http, char *URL, char *etag, char *last_modified)
+{
+	assert(http);
+	assert(URL);
+	assert(etag);
+	assert(last_modified);
+
+	struct archive_meta meta;
+	buf_t path;
+	int rv = 0;
+
+	if (buf_get(&path, path_max) < 0)
+		return 0;
+
+	if (archive_meta_init(&meta) < 0)
+		goto out_destroy_path;
+
+/*
+ * Validators are no use if the document
+ * they describe has since been deleted.
+ */
+	if (archive_doc_path(http, URL, &path) < 0 || access(path.buf_head, F_OK) != 0)
+		goto out;
+
+	if (buf_append(&path, ARCHIVE_META_SUFFIX) < 0)
+		goto out;
+
+	if (archive_meta_load(path.buf_head, &meta) < 0)
+		goto out;
+
+	strcpy(etag, meta.etag);
+	strcpy(last_modified, meta.last_modified);
+
+	rv = (etag[0] || last_modified[0]);
+
+out:
+
+	archive_meta_destroy(&meta);
+
+out_destroy_path:
+
+	buf_put(&path);
+
+	return rv;
+}
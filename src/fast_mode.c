@@ -8,14 +8,17 @@
 #include <pthread.h>
 #include <signal.h>
 #include <unistd.h>
+#include "archive_meta.h"
 #include "btree.h"
 #include "buffer.h"
 #include "cache.h"
 #include "cache_management.h"
+#include "conn_pool.h"
 #include "fast_mode.h"
 #include "http.h"
 #include "malloc.h"
 #include "queue.h"
+#include "scheduler.h"
 #include "screen_utils.h"
 #include "netwasabi.h"
 #include "utils_url.h"
@@ -32,14 +35,13 @@ typedef pthread_mutex_t mutex_t;
 #define mutex_destroy(m) pthread_mutex_destroy(&(m))
 
 #define queue_lock() mutex_lock(Mutex_Queue)
-#define queue_unlock() mutex_lock(Mutex_Queue)
+#define queue_unlock() mutex_unlock(Mutex_Queue)
 #define tree_lock() mutex_lock(Mutex_Tree)
 #define tree_unlock() mutex_unlock(Mutex_Tree)
 
 static mutex_t Mutex_Queue;
 static mutex_t Mutex_Tree;
 static mutex_t Mutex_Finished;
-static mutex_t Mutex_Reconnect;
 
 #if 0
 #ifdef __linux__
@@ -110,34 +112,17 @@ static volatile int Nr_Threads_Working = FAST_MODE_NR_WORKERS;
 
 //static volatile int nr_workers_eoc = 0;
 
-static volatile int nr_reconnected = 0;
-static volatile sig_atomic_t __do_reconnect = 0;
 static struct sigaction __old_sigpipe;
 static struct sigaction __new_sigpipe;
 
 static cache_t *Dead_URL_cache;
+static struct scheduler *Scheduler = NULL;
 
 #ifdef DEBUG
 # define WLOG_FILE "./fast_mode_log.txt"
 FILE *wlogfp = NULL;
 #endif
 
-/**
- * A worker may write to a broken pipe after the
- * remote server resets the connection (possible
- * due to high volume of parallel requests). So
- * get all workers to disconnect and reconnect.
- */
-static void
-catch_sigpipe(int signo)
-{
-	if (SIGPIPE != signo)
-		return;
-
-	__do_reconnect = 1;
-	return;
-}
-
 static void
 wlog(const char *fmt, ...)
 {
@@ -162,9 +147,16 @@ __ctor __fast_mode_init(void)
 	wlogfp = fdopen(open(WLOG_FILE, O_RDWR|O_TRUNC|O_CREAT, S_IRUSR|S_IWUSR), "r+");
 #endif
 
+/*
+ * A worker may write to a broken pipe after the
+ * remote server resets the connection (possible
+ * due to high volume of parallel requests). The
+ * write then fails with EPIPE and the worker gives
+ * that connection back to the pool as broken.
+ */
 	clear_struct(&__new_sigpipe);
 	__new_sigpipe.sa_flags = 0;
-	__new_sigpipe.sa_handler = catch_sigpipe;
+	__new_sigpipe.sa_handler = SIG_IGN;
 	sigemptyset(&__new_sigpipe.sa_mask);
 
 	if (sigaction(SIGPIPE, &__new_sigpipe, &__old_sigpipe) < 0)
@@ -244,56 +236,107 @@ worker_signal_fin(struct worker_thread *wt)
 }
 
 /**
- * worker_signal_recon - signal that thread has done a reconnect after
- *			signal handler set __do_reconnect to non-zero.
+ * worker_filter - SCHED_filter_t: drop URLs we archived or know to be dead
  */
-static inline void
-worker_signal_recon(void)
+static int
+worker_filter(char *URL, void *arg)
 {
-/*
- * Mutex not locked/unlocked here as should already be locked before
- * calling this func as we are also protecting __DO_RECONNECT with it.
+	int drop;
+
+	(void)arg;
+
+	cache_lock(Dead_URL_cache);
+	// O(n)
+	drop = (search_dead_URL(Dead_URL_cache, URL) != NULL);
+	cache_unlock(Dead_URL_cache);
+
+	if (drop)
+		return 1;
+
+	tree_lock();
+	// ~O(logN)
+	drop = (BTREE_search_data(tree_archived, (void *)URL, strlen(URL)) != NULL);
+	tree_unlock();
+
+	return drop;
+}
+
+/**
+ * worker_done - give the scheduler the URLs we found, then the request slot for URL
+ *
+ * In that order, so that no worker finds the scheduler
+ * empty with nothing in flight while we still have
+ * URLs to give it.
  */
-	++nr_reconnected;
+static void
+worker_done(char *URL, int retry_after)
+{
+	queue_lock();
+	SCHED_admit(Scheduler, URL_queue);
+	queue_unlock();
+
+	SCHED_done(Scheduler, URL, retry_after);
+
 	return;
 }
 
+/**
+ * worker_checkout - get a pooled connection for URL and set up the request
+ */
+static struct http_t *
+worker_checkout(struct worker_thread *wt, char *URL)
+{
+	struct http_t *http;
+
+	if (!(http = CONN_pool_checkout(URL)))
+		return NULL;
+
+	http->followRedirects = 1;
+	http->verb = GET;
+	http->getValidators = archive_get_validators;
+	http->openSink = archive_open_sink;
+
+	strcpy(http->URL, URL);
+	http->URL_len = strlen(URL);
+
+	http->ops->URL_parse_page(URL, http->page);
+	http->ops->URL_parse_host(wt->main_url, http->primary_host);
+
+	return http;
+}
+
 static void *
 worker_crawl(void *args)
 {
 	struct worker_thread *wt = (struct worker_thread *)args;
 	struct http_t *http = NULL;
 	queue_item_t *item = NULL;
-	Dead_URL_t *dead = NULL;
 
 	char *main_url = NULL;
 	char URL[HTTP_URL_MAX];
 	int status_code;
+	int broken;
+	int retry_after;
 	size_t URL_len;
+	buf_t links;
+	struct URL_edits edits;
+	struct URL_edits *to_edit;
 
 	main_url = wt->main_url;
 
-	if (!(http = HTTP_new((uint32_t)pthread_self())))
+	if (buf_init(&links, HTTP_URL_MAX) < 0)
 	{
-		put_error_msg("failed to get new HTTP object");
-		goto thread_fail;
+		put_error_msg("failed to initialise links buffer");
+		worker_signal_fin(wt);
+		pthread_exit((void *)-1);
 	}
 
-	http->followRedirects = 1;
-	http->verb = GET;
-
-	strcpy(http->URL, main_url);
-	http->URL_len = strlen(main_url);
-
-	http->ops->URL_parse_host(http->URL, http->host);
-	http->ops->URL_parse_page(http->URL, http->page);
-
-	strcpy(http->primary_host, http->host);
-
-	if (http_connect(http) < 0)
+	if (URL_edits_init(&edits) < 0)
 	{
-		put_error_msg("failed to connect to remove server");
-		goto thread_fail;
+		put_error_msg("failed to initialise link edits");
+		buf_destroy(&links);
+		worker_signal_fin(wt);
+		pthread_exit((void *)-1);
 	}
 
 /*
@@ -308,11 +351,55 @@ worker_crawl(void *args)
 
 	if (Initializing_Worker == pthread_self())
 	{
-		http->ops->send_request(http);
-		http->ops->recv_response(http);
+		if (!(http = worker_checkout(wt, main_url)))
+		{
+			put_error_msg("failed to connect to remote server");
+			Threads_Exit = 1;
+			goto initial_done;
+		}
+
+		broken = (http->ops->send_request(http) < 0 || http->ops->recv_response(http) < 0);
 
 		status_code = http->code;
 
+/*
+ * On a re-crawl the seed page is fetched conditionally like any
+ * other, so it may come back 304. Start from the links we kept
+ * when we archived it; failing that, ask for the page in full.
+ */
+		if (!broken && HTTP_NOT_MODIFIED == status_code)
+		{
+			if (archive_revisit(http, URL_queue, tree_archived) < 0)
+			{
+				wlog("[0x%lx] no archived links for unmodified %s; fetching it again\n", pthread_self(), http->URL);
+
+				archive_discard_sink(http);
+				http->getValidators = NULL;
+
+				broken = (http->ops->send_request(http) < 0 || http->ops->recv_response(http) < 0);
+
+				status_code = http->code;
+			}
+		}
+
+		if (broken)
+		{
+			Threads_Exit = 1;
+		}
+		else
+		if (HTTP_NOT_MODIFIED == status_code)
+		{
+			if (!URL_queue->nr_items)
+			{
+				wlog("No URLs archived for initial page\n");
+				Threads_Exit = 1;
+			}
+			else
+			{
+				wlog("Revisited %d URLs from initial page\n", URL_queue->nr_items);
+			}
+		}
+		else
 		if (HTTP_OK != status_code)
 		{
 			wlog("[0x%lx] HTTP status code = %d\n", pthread_self(), status_code);
@@ -321,7 +408,7 @@ worker_crawl(void *args)
 		else
 		{
 			wlog("[0x%lx] calling parse_URLs()\n", pthread_self());
-			parse_URLs(http, URL_queue, tree_archived);
+			parse_URLs(http, URL_queue, tree_archived, NULL);
 
 			if (!URL_queue->nr_items)
 			{
@@ -333,8 +420,14 @@ worker_crawl(void *args)
 				wlog("Parsed %d URLs from initial page\n", URL_queue->nr_items);
 			}
 		}
+
+		archive_discard_sink(http);
+		CONN_pool_checkin(http, broken || http_connection_closed(http));
+		http = NULL;
 	}
 
+initial_done:
+
 /*
  * Workers that weren't the first ones to call pthread_once() wait
  * here before starting to process the URLs in the DRAINING cache.
@@ -348,54 +441,59 @@ worker_crawl(void *args)
 		goto thread_exit;
 	}
 
+	queue_lock();
+	SCHED_admit(Scheduler, URL_queue);
+	queue_unlock();
+
+/*
+ * The scheduler hands us URLs for servers that are
+ * ready for another request; the archived and dead
+ * ones are filtered out (worker_filter()).
+ */
 	while (1)
 	{
-		queue_lock();
-
-		item = QUEUE_dequeue(URL_queue);
-
-		queue_unlock();
-
-		if (!item)
-		{
+		if (Threads_Exit || !(item = SCHED_take(Scheduler)))
 			goto thread_exit;
-		}
 
 		URL_len = item->data_len;
 		strncpy(URL, (char *)item->data, URL_len);
 		URL[URL_len] = 0;
 
-		cache_lock(Dead_URL_cache);
-		// O(n)
-		dead = search_dead_URL(Dead_URL_cache, URL);
+		free(item->data);
+		free(item);
 
-		if (dead)
+	/*
+	 * Hold the connection only for as long as we
+	 * need the response in its read buffer.
+	 */
+		if (!(http = worker_checkout(wt, URL)))
 		{
-			cache_unlock(Dead_URL_cache);
+			wlog("[0x%lx] No connection for %s\n", pthread_self(), URL);
+			worker_done(URL, 0);
 			continue;
 		}
 
-		cache_unlock(Dead_URL_cache);
-
-		tree_lock();
-		// ~O(logN)
-		if (BTREE_search_data(tree_archived, (void *)URL, URL_len))
+		if (http->ops->send_request(http) < 0 || http->ops->recv_response(http) < 0)
 		{
-			tree_unlock();
+			wlog("[0x%lx] Request for %s failed\n", pthread_self(), URL);
+			archive_discard_sink(http);
+			CONN_pool_checkin(http, 1);
+			http = NULL;
+			worker_done(URL, 0);
 			continue;
 		}
 
-		tree_unlock();
-
-		strcpy(http->URL, URL);
-
-		http->ops->URL_parse_host(URL, http->host);
-		http->ops->URL_parse_page(URL, http->page);
+		update_current_url(URL);
+		retry_after = HTTP_retry_after(http);
 
-		http->ops->send_request(http);
-		http->ops->recv_response(http);
+		if (HTTP_BODY_SKIP == http->bodyAction)
+		{
+			tree_lock();
+			BTREE_put_data(tree_archived, (void *)URL, strlen(URL));
+			tree_unlock();
 
-		update_current_url(URL);
+			goto next;
+		}
 
 		switch(http->code)
 		{
@@ -403,6 +501,22 @@ worker_crawl(void *args)
 
 				break;
 
+			case HTTP_NOT_MODIFIED:
+
+				queue_lock();
+				tree_lock();
+
+				if (archive_revisit(http, URL_queue, tree_archived) < 0)
+				{
+					wlog("[0x%lx] failed to revisit %s\n", pthread_self(), http->URL);
+					BTREE_put_data(tree_archived, (void *)http->URL, strlen(http->URL));
+				}
+
+				tree_unlock();
+				queue_unlock();
+
+				goto next;
+
 			case HTTP_NOT_FOUND:
 
 				cache_lock(Dead_URL_cache);
@@ -418,72 +532,44 @@ worker_crawl(void *args)
 		BTREE_put_data(tree_archived, (void *)URL, strlen(URL));
 		tree_unlock();
 
-		if (URL_parseable(http->URL))
+		buf_clear(&links);
+		to_edit = NULL;
+
+		if (document_parseable(http))
 		{
 			queue_lock();
 			tree_lock();
 
-			parse_URLs(http, URL_queue, tree_archived);
+			parse_URLs(http, URL_queue, tree_archived, &links);
 
 			tree_unlock();
 			queue_unlock();
 
-			transform_document_URLs(http);
+			if (URL_find_edits(http, &edits) == 0)
+				to_edit = &edits;
 		}
 
-		archive_page(http);
+		archive_page(http, &links, to_edit);
 
 	next:
 
-		pthread_mutex_lock(&Mutex_Reconnect);
-
-		if (__do_reconnect)
-		{
-			http_disconnect(http);
-			http_connect(http);
+		archive_discard_sink(http);
+		CONN_pool_checkin(http, http_connection_closed(http));
+		http = NULL;
 
-			wlog("[0x%lx] Doing reconnect!\n");
-
-			++nr_reconnected;
-
-			if (nr_reconnected >= FAST_MODE_NR_WORKERS)
-			{
-				__do_reconnect = 0;
-				nr_reconnected = 0;
-			}
-		}
-
-		pthread_mutex_unlock(&Mutex_Reconnect);
+		worker_done(URL, retry_after);
 	}
 
 thread_exit:
 
 	wlog("[0x%lx] Exiting\n", pthread_self());
 
-	if (http)
-	{
-		http_disconnect(http);
-		HTTP_delete(http);
-	}
-
+	buf_destroy(&links);
+	URL_edits_destroy(&edits);
 	worker_signal_fin(wt);
 	//worker_signal_eoc();
 
 	pthread_exit((void *)0);
-
-thread_fail:
-
-	wlog("[0x%lx] Failed -- exiting\n", pthread_self());
-	worker_signal_fin(wt);
-	//worker_signal_eoc();
-
-	if (http)
-	{
-		http_disconnect(http);
-		HTTP_delete(http);
-	}
-
-	pthread_exit((void *)-1);
 }
 
 /**
@@ -553,13 +639,27 @@ do_fast_mode(char *remote_host)
 		goto fail;
 	}
 
+/*
+ * A server gets no more requests at once than it has
+ * pooled connections, so workers are never left
+ * waiting in CONN_pool_checkout() while there is
+ * another server they could be fetching from.
+ */
+	if (!(Scheduler = SCHED_new(nwctx.config.crawl_delay * 1000, nwctx.config.conns_per_host, worker_filter, NULL)))
+	{
+		fprintf(stderr, "do_fast_mode: failed to create URL scheduler\n");
+		goto fail;
+	}
+
 	pthread_barrier_init(&start_barrier, NULL, FAST_MODE_NR_WORKERS);
 
 	mutex_create(Mutex_Queue);
 	mutex_create(Mutex_Tree);
 	//mutex_create(&eoc_mtx, NULL);
 	mutex_create(Mutex_Finished);
-	mutex_create(Mutex_Reconnect);
+
+	CONN_pool_set_limits(nwctx.config.conns_per_host, CONN_POOL_IDLE_TIMEOUT);
+	CONN_pool_set_http2((int)nwctx.config.use_http2);
 
 	//pthread_cond_init(&cache_switch_cond, NULL);
 
@@ -607,12 +707,16 @@ do_fast_mode(char *remote_host)
 	mutex_destroy(Mutex_Tree);
 	//mutex_destroy(&eoc_mtx);
 	mutex_destroy(Mutex_Finished);
-	mutex_destroy(Mutex_Reconnect);
 
 	//pthread_cond_destroy(&cache_switch_cond);
 
 	pthread_barrier_destroy(&start_barrier);
 
+	CONN_pool_destroy();
+
+	SCHED_delete(Scheduler);
+	Scheduler = NULL;
+
 	cache_clear_all(Dead_URL_cache);
 	cache_destroy(Dead_URL_cache);
 
@@ -629,7 +733,6 @@ fail_release_mem:
 	mutex_destroy(Mutex_Tree);
 	//mutex_destroy(&eoc_mtx);
 	mutex_destroy(Mutex_Finished);
-	mutex_destroy(Mutex_Reconnect);
 
 	//pthread_cond_destroy(&cache_switch_cond);
 
@@ -637,6 +740,11 @@ fail_release_mem:
 
 fail:
 
+	if (Scheduler)
+		SCHED_delete(Scheduler);
+
+	Scheduler = NULL;
+
 	if (Dead_URL_cache)
 		cache_destroy(Dead_URL_cache);
 
@@ -0,0 +1,376 @@
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include "conn_pool.h"
+#include "http.h"
+
+/*
+ * Process-wide pool of keep-alive connections, keyed by
+ * host and scheme (the port follows from the scheme).
+ *
+ * Fast mode workers check a connection out for each URL
+ * and give it back when done with the response, so the
+ * number of sockets open to a server is bounded by the
+ * per-host limit rather than by the number of workers.
+ * A connection that breaks is closed on its own and
+ * reopened by whichever worker next checks it out,
+ * instead of every worker reconnecting at once.
+ */
+
+struct POOL_conn
+{
+	struct http_t *http;
+	char host[HTTP_HOST_MAX];
+	int secure;
+	int connected;
+	int busy;
+	time_t last_used; /* CLOCK_MONOTONIC seconds */
+};
+
+static struct POOL_conn __pool[CONN_POOL_MAX];
+static unsigned int __per_host = CONN_POOL_DEFAULT_PER_HOST;
+static unsigned int __idle_timeout = CONN_POOL_IDLE_TIMEOUT;
+static int __use_http2 = 0;
+
+static pthread_mutex_t __pool_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t __pool_cond = PTHREAD_COND_INITIALIZER;
+
+static void
+pLog(char *fmt, ...)
+{
+#ifdef DEBUG
+	va_list args;
+
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+#else
+	(void)fmt;
+#endif
+}
+
+static time_t
+__now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+/**
+ * __parse_key - get the host and scheme of URL
+ */
+static int
+__parse_key(const char *URL, char *host, int *secure)
+{
+	const char *p;
+	const char *e;
+	size_t len;
+
+	*secure = !strncmp(URL, "https://", 8);
+
+	if ((p = strstr(URL, "://")))
+		p += 3;
+	else
+		p = URL;
+
+	e = p + strcspn(p, "/:?#");
+	len = (e - p);
+
+	if (!len || len >= HTTP_HOST_MAX)
+		return -1;
+
+	memcpy(host, p, len);
+	host[len] = 0;
+
+	return 0;
+}
+
+/**
+ * __connection_alive - check an idle connection was not closed by the server
+ *
+ * Nothing should arrive on a connection with no
+ * request outstanding, so EOF, an error or data
+ * (e.g., a TLS close_notify) all mean it is unusable.
+ */
+static int
+__connection_alive(struct http_t *http)
+{
+	ssize_t n;
+	char c;
+
+	if (http->usingSecure && http_tls(http) && SSL_pending(http_tls(http)) > 0)
+		return 0;
+
+	n = recv(http_socket(http), &c, 1, MSG_PEEK|MSG_DONTWAIT);
+
+	if (n < 0 && (EAGAIN == errno || EWOULDBLOCK == errno))
+		return 1;
+
+	return 0;
+}
+
+/*
+ * The following __functions are called with __POOL_MTX held.
+ */
+static void
+__close(struct POOL_conn *pc)
+{
+	if (!pc->connected)
+		return;
+
+	http_disconnect(pc->http);
+	pc->connected = 0;
+
+	return;
+}
+
+static void
+__reap_idle(time_t now)
+{
+	struct POOL_conn *pc;
+	int i;
+
+	for (i = 0; i < CONN_POOL_MAX; ++i)
+	{
+		pc = &__pool[i];
+
+		if (pc->http && pc->connected && !pc->busy && now - pc->last_used >= (time_t)__idle_timeout)
+		{
+			pLog("POOL: closing idle connection to %s\n", pc->host);
+			__close(pc);
+		}
+	}
+
+	return;
+}
+
+/**
+ * __find_conn - pick the connection to hand out for HOST
+ *
+ * An idle one for HOST if there is one (preferring one
+ * still connected), else a new one if HOST is under its
+ * limit (an unused slot, whose HTTP object the caller
+ * creates), else the least recently used idle connection
+ * to another host. NULL means wait.
+ */
+static struct POOL_conn *
+__find_conn(const char *host, int secure)
+{
+	struct POOL_conn *pc;
+	struct POOL_conn *idle = NULL;
+	struct POOL_conn *unused = NULL;
+	struct POOL_conn *victim = NULL;
+	unsigned int nr_host = 0;
+	int i;
+
+	for (i = 0; i < CONN_POOL_MAX; ++i)
+	{
+		pc = &__pool[i];
+
+		if (!pc->http)
+		{
+			if (!unused)
+				unused = pc;
+
+			continue;
+		}
+
+		if (pc->secure == secure && !strcmp(pc->host, host))
+		{
+			++nr_host;
+
+			if (!pc->busy && (!idle || (pc->connected && !idle->connected)))
+				idle = pc;
+		}
+		else
+		if (!pc->busy && (!victim || pc->last_used < victim->last_used))
+		{
+			victim = pc;
+		}
+	}
+
+	if (idle)
+		return idle;
+
+	if (nr_host >= __per_host)
+		return NULL;
+
+	if (unused)
+		victim = unused;
+
+	if (victim)
+	{
+		__close(victim);
+		strcpy(victim->host, host);
+		victim->secure = secure;
+	}
+
+	return victim;
+}
+
+struct http_t *
+CONN_pool_checkout(const char *URL)
+{
+	assert(URL);
+
+	struct POOL_conn *pc;
+	struct http_t *http;
+	char host[HTTP_HOST_MAX];
+	int secure;
+
+	if (__parse_key(URL, host, &secure) < 0)
+		return NULL;
+
+	pthread_mutex_lock(&__pool_mtx);
+
+	__reap_idle(__now());
+
+	while (!(pc = __find_conn(host, secure)))
+		pthread_cond_wait(&__pool_cond, &__pool_mtx);
+
+	if (!pc->http && !(pc->http = HTTP_new((uint32_t)pthread_self())))
+	{
+		pthread_mutex_unlock(&__pool_mtx);
+		return NULL;
+	}
+
+	pc->busy = 1;
+
+	pc->http->useHTTP2 = __use_http2;
+
+	pthread_mutex_unlock(&__pool_mtx);
+
+/*
+ * The connection is ours now; connect
+ * without holding up the other workers.
+ */
+	http = pc->http;
+
+	if (pc->connected && !__connection_alive(http))
+	{
+		pLog("POOL: connection to %s was closed; replacing it\n", host);
+		http_disconnect(http);
+		pc->connected = 0;
+	}
+
+	if (!pc->connected)
+	{
+		strcpy(http->host, host);
+		http->usingSecure = secure;
+
+		if (http_connect(http) < 0)
+		{
+			pLog("POOL: failed to connect to %s\n", host);
+
+			pthread_mutex_lock(&__pool_mtx);
+			pc->busy = 0;
+			pc->last_used = __now();
+			pthread_cond_broadcast(&__pool_cond);
+			pthread_mutex_unlock(&__pool_mtx);
+
+			return NULL;
+		}
+
+		pc->connected = 1;
+	}
+
+	return http;
+}
+
+void
+CONN_pool_checkin(struct http_t *http, int broken)
+{
+	assert(http);
+
+	struct POOL_conn *pc = NULL;
+	int i;
+
+	pthread_mutex_lock(&__pool_mtx);
+
+	for (i = 0; i < CONN_POOL_MAX; ++i)
+	{
+		if (__pool[i].http == http)
+		{
+			pc = &__pool[i];
+			break;
+		}
+	}
+
+	assert(pc);
+	assert(pc->busy);
+
+	if (broken)
+		__close(pc);
+
+	pc->busy = 0;
+	pc->last_used = __now();
+
+	pthread_cond_broadcast(&__pool_cond);
+	pthread_mutex_unlock(&__pool_mtx);
+
+	return;
+}
+
+void
+CONN_pool_set_limits(unsigned int per_host, unsigned int idle_timeout)
+{
+	pthread_mutex_lock(&__pool_mtx);
+
+	__per_host = (per_host ? per_host : 1);
+	__idle_timeout = idle_timeout;
+
+	pthread_mutex_unlock(&__pool_mtx);
+
+	return;
+}
+
+void
+CONN_pool_set_http2(int use_http2)
+{
+	pthread_mutex_lock(&__pool_mtx);
+
+	__use_http2 = use_http2;
+
+	pthread_mutex_unlock(&__pool_mtx);
+
+	return;
+}
+
+void
+CONN_pool_destroy(void)
+{
+	struct POOL_conn *pc;
+	int i;
+
+	pthread_mutex_lock(&__pool_mtx);
+
+	for (i = 0; i < CONN_POOL_MAX; ++i)
+	{
+		pc = &__pool[i];
+
+		if (!pc->http)
+			continue;
+
+		assert(!pc->busy);
+
+		__close(pc);
+		HTTP_delete(pc->http);
+		free(pc->http);
+
+		memset(pc, 0, sizeof(*pc));
+	}
+
+	pthread_mutex_unlock(&__pool_mtx);
+
+	return;
+}
@@ -0,0 +1,253 @@
+#include <assert.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "content_coding.h"
+
+#define CODING_OUT_BLOCK 16384
+
+static void
+cLog(char *fmt, ...)
+{
+#ifdef DEBUG
+	va_list args;
+
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+#else
+	(void)fmt;
+#endif
+}
+
+int
+CODING_type(const char *value)
+{
+	assert(value);
+
+	while (*value == ' ' || *value == '\t')
+		++value;
+
+	if (!*value || !strcasecmp("identity", value))
+		return CODING_IDENTITY;
+
+	if (!strcasecmp("gzip", value) || !strcasecmp("x-gzip", value))
+		return CODING_GZIP;
+
+	if (!strcasecmp("deflate", value))
+		return CODING_DEFLATE;
+
+	if (!strcasecmp("br", value))
+		return CODING_BROTLI;
+
+	return -1;
+}
+
+int
+CODING_decoder_start(struct CODING_decoder *dec, enum CODING_type type)
+{
+	assert(dec);
+
+	memset(dec, 0, sizeof(*dec));
+	dec->type = type;
+
+	switch(type)
+	{
+		case CODING_GZIP:
+
+			if (inflateInit2(&dec->zs, 15 + 16) != Z_OK)
+				return -1;
+
+			dec->zs_ready = 1;
+			break;
+
+		case CODING_DEFLATE:
+
+		/*
+		 * Initialised on the first bytes; see __deflate_init().
+		 */
+			break;
+
+		case CODING_BROTLI:
+
+			if (!(dec->br = BrotliDecoderCreateInstance(NULL, NULL, NULL)))
+				return -1;
+
+			break;
+
+		default:
+
+			break;
+	}
+
+	return 0;
+}
+
+/**
+ * __deflate_init - set up zlib for "deflate", which is not always what it says
+ *
+ * RFC 9110 "deflate" is a zlib stream, but some
+ * servers send raw deflate data. A zlib header is
+ * a multiple of 31 with compression method 8.
+ */
+static int
+__deflate_init(struct CODING_decoder *dec, unsigned char *data, size_t len)
+{
+	int window = 15;
+
+	if (len >= 2 && ((data[0] & 0x0f) != 8 || ((data[0] << 8) | data[1]) % 31))
+	{
+		cLog("deflate content is missing its zlib header\n");
+		window = -15;
+	}
+
+	if (inflateInit2(&dec->zs, window) != Z_OK)
+		return -1;
+
+	dec->zs_ready = 1;
+
+	return 0;
+}
+
+static int
+__append_out(struct CODING_decoder *dec, unsigned char *out, size_t len, buf_chain_t *buf)
+{
+	if (!len)
+		return 0;
+
+	dec->nr_out += len;
+
+	if (dec->nr_out > CODING_DECODED_MAX)
+	{
+		cLog("decoded body is over %d bytes\n", CODING_DECODED_MAX);
+		return -1;
+	}
+
+	return buf_chain_append(buf, out, len);
+}
+
+static int
+__inflate(struct CODING_decoder *dec, unsigned char *data, size_t len, buf_chain_t *buf)
+{
+	unsigned char out[CODING_OUT_BLOCK];
+	int rv;
+
+	if (!dec->zs_ready && __deflate_init(dec, data, len) < 0)
+		return -1;
+
+	dec->zs.next_in = data;
+	dec->zs.avail_in = (uInt)len;
+
+	while (dec->zs.avail_in && !dec->done)
+	{
+		dec->zs.next_out = out;
+		dec->zs.avail_out = sizeof(out);
+
+		rv = inflate(&dec->zs, Z_NO_FLUSH);
+
+		if (rv != Z_OK && rv != Z_STREAM_END && rv != Z_BUF_ERROR)
+		{
+			cLog("inflate: %s\n", dec->zs.msg ? dec->zs.msg : "error");
+			return -1;
+		}
+
+		if (__append_out(dec, out, sizeof(out) - dec->zs.avail_out, buf) < 0)
+			return -1;
+
+		if (Z_STREAM_END == rv)
+		{
+		/*
+		 * gzip allows several members back to back.
+		 */
+			if (CODING_GZIP == dec->type && dec->zs.avail_in)
+				inflateReset(&dec->zs);
+			else
+				dec->done = 1;
+		}
+		else
+		if (Z_BUF_ERROR == rv && dec->zs.avail_out)
+		{
+			break;
+		}
+	}
+
+	return 0;
+}
+
+static int
+__unbrotli(struct CODING_decoder *dec, unsigned char *data, size_t len, buf_chain_t *buf)
+{
+	unsigned char out[CODING_OUT_BLOCK];
+	const uint8_t *next_in = data;
+	size_t avail_in = len;
+	uint8_t *next_out;
+	size_t avail_out;
+	BrotliDecoderResult rv;
+
+	do
+	{
+		next_out = out;
+		avail_out = sizeof(out);
+
+		rv = BrotliDecoderDecompressStream(dec->br, &avail_in, &next_in, &avail_out, &next_out, NULL);
+
+		if (BROTLI_DECODER_RESULT_ERROR == rv)
+		{
+			cLog("brotli: %s\n", BrotliDecoderErrorString(BrotliDecoderGetErrorCode(dec->br)));
+			return -1;
+		}
+
+		if (__append_out(dec, out, sizeof(out) - avail_out, buf) < 0)
+			return -1;
+
+	} while (BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT == rv);
+
+	if (BROTLI_DECODER_RESULT_SUCCESS == rv)
+		dec->done = 1;
+
+	return 0;
+}
+
+int
+CODING_decode(struct CODING_decoder *dec, unsigned char *data, size_t len, buf_chain_t *buf)
+{
+	assert(dec);
+	assert(buf);
+
+	if (!len || dec->done)
+		return 0;
+
+	switch(dec->type)
+	{
+		case CODING_GZIP:
+		case CODING_DEFLATE:
+
+			return __inflate(dec, data, len, buf);
+
+		case CODING_BROTLI:
+
+			return __unbrotli(dec, data, len, buf);
+
+		default:
+
+			return __append_out(dec, data, len, buf);
+	}
+}
+
+void
+CODING_decoder_end(struct CODING_decoder *dec)
+{
+	assert(dec);
+
+	if (dec->zs_ready)
+		inflateEnd(&dec->zs);
+
+	if (dec->br)
+		BrotliDecoderDestroyInstance(dec->br);
+
+	memset(dec, 0, sizeof(*dec));
+
+	return;
+}
@@ -0,0 +1,533 @@
+#include <assert.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include "buffer.h"
+#include "cookie_jar.h"
+#include "http.h"
+#include "string_utils.h"
+
+/*
+ * Process-wide cookie jar (RFC 6265), shared by every HTTP
+ * object so that a session one fast mode worker logs into
+ * is the session all of them use.
+ *
+ * Cookies are filed under the domain they are for, each
+ * domain's list kept longest path first (the order they go
+ * in the Cookie field). A request for a.b.example.com looks
+ * at that domain and then each parent, so the work done
+ * per request depends on the depth of the host name, not
+ * the number of cookies. Each cookie keeps its name=value
+ * pair ready to be copied into the field.
+ *
+ * There is no public suffix list; a Domain attribute is
+ * only refused if it does not cover the host that sent it
+ * or has no dot in it.
+ */
+
+#define COOKIE_NR_BUCKETS 256
+#define COOKIE_NAME_MAX HTTP_HOST_MAX
+
+struct COOKIE_entry
+{
+	char *pair; /* name=value */
+	size_t name_len;
+	size_t pair_len;
+	char *path;
+	size_t path_len;
+	time_t expires; /* 0 for a session cookie */
+	int host_only; /* no Domain attribute: not for subdomains */
+	int secure;
+	struct COOKIE_entry *next;
+};
+
+struct COOKIE_domain
+{
+	char *name;
+	struct COOKIE_entry *cookies;
+	int nr_cookies;
+	struct COOKIE_domain *next;
+};
+
+static struct COOKIE_domain *__buckets[COOKIE_NR_BUCKETS];
+static int __nr_cookies = 0;
+
+static pthread_rwlock_t __jar_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static void
+cLog(char *fmt, ...)
+{
+#ifdef DEBUG
+	va_list args;
+
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+#else
+	(void)fmt;
+#endif
+}
+
+static unsigned int
+__hash_domain(const char *name)
+{
+	uint32_t h = 2166136261u;
+
+	while (*name)
+	{
+		h ^= (unsigned char)*name++;
+		h *= 16777619u;
+	}
+
+	return (unsigned int)(h % COOKIE_NR_BUCKETS);
+}
+
+/**
+ * __canon_host - lower case HOST, without a port or trailing '/'
+ */
+static int
+__canon_host(const char *host, size_t len, char *out)
+{
+	size_t i;
+
+	while (len && host[len - 1] == '/')
+		--len;
+
+	if (memchr(host, ':', len))
+		len = (char *)memchr(host, ':', len) - host;
+
+	while (len && *host == '.')
+	{
+		++host;
+		--len;
+	}
+
+	if (!len || len >= COOKIE_NAME_MAX)
+		return -1;
+
+	for (i = 0; i < len; ++i)
+		out[i] = tolower((unsigned char)host[i]);
+
+	out[len] = 0;
+
+	return 0;
+}
+
+/**
+ * __domain_match - does HOST fall under DOMAIN (RFC 6265 5.1.3)
+ */
+static int
+__domain_match(const char *host, const char *domain)
+{
+	size_t hlen = strlen(host);
+	size_t dlen = strlen(domain);
+
+	if (hlen == dlen)
+		return !strcmp(host, domain);
+
+	return (hlen > dlen && host[hlen - dlen - 1] == '.' && !strcmp(host + (hlen - dlen), domain));
+}
+
+/**
+ * __path_match - does the request PATH fall under the cookie's (RFC 6265 5.1.4)
+ */
+static int
+__path_match(const char *path, size_t len, struct COOKIE_entry *c)
+{
+	if (len < c->path_len || memcmp(path, c->path, c->path_len))
+		return 0;
+
+	return (len == c->path_len || c->path[c->path_len - 1] == '/' || path[c->path_len] == '/');
+}
+
+static void
+__free_cookie(struct COOKIE_entry *c)
+{
+	free(c->pair);
+	free(c->path);
+	free(c);
+
+	return;
+}
+
+/*
+ * All of the following __functions are called
+ * with __JAR_LOCK held (for writing, unless they
+ * only read).
+ */
+static struct COOKIE_domain *
+__find_domain(const char *name, int create)
+{
+	struct COOKIE_domain *d;
+	unsigned int idx = __hash_domain(name);
+
+	for (d = __buckets[idx]; d; d = d->next)
+	{
+		if (!strcmp(d->name, name))
+			return d;
+	}
+
+	if (!create)
+		return NULL;
+
+	if (!(d = calloc(1, sizeof(*d))))
+		return NULL;
+
+	if (!(d->name = strdup(name)))
+	{
+		free(d);
+		return NULL;
+	}
+
+	d->next = __buckets[idx];
+	__buckets[idx] = d;
+
+	return d;
+}
+
+static void
+__purge_expired(struct COOKIE_domain *d, time_t now)
+{
+	struct COOKIE_entry **pp = &d->cookies;
+	struct COOKIE_entry *c;
+
+	while ((c = *pp))
+	{
+		if (c->expires && c->expires <= now)
+		{
+			*pp = c->next;
+			__free_cookie(c);
+			--d->nr_cookies;
+			--__nr_cookies;
+			continue;
+		}
+
+		pp = &c->next;
+	}
+
+	return;
+}
+
+static void
+__purge_all_expired(time_t now)
+{
+	struct COOKIE_domain *d;
+	int i;
+
+	for (i = 0; i < COOKIE_NR_BUCKETS; ++i)
+	{
+		for (d = __buckets[i]; d; d = d->next)
+			__purge_expired(d, now);
+	}
+
+	return;
+}
+
+/**
+ * __store - put C in D's list, replacing the cookie with the same name and path
+ *
+ * An expired C only removes the one it replaces.
+ */
+static void
+__store(struct COOKIE_domain *d, struct COOKIE_entry *c)
+{
+	struct COOKIE_entry **pp;
+	struct COOKIE_entry *old;
+	time_t now = time(NULL);
+	int expired = (c->expires && c->expires <= now);
+
+	for (pp = &d->cookies; (old = *pp); pp = &old->next)
+	{
+		if (old->name_len == c->name_len
+		&& old->path_len == c->path_len
+		&& !memcmp(old->pair, c->pair, c->name_len)
+		&& !strcmp(old->path, c->path))
+		{
+			*pp = old->next;
+			__free_cookie(old);
+			--d->nr_cookies;
+			--__nr_cookies;
+			break;
+		}
+	}
+
+	if (!expired && d->nr_cookies >= COOKIE_PER_DOMAIN_MAX)
+		__purge_expired(d, now);
+
+	if (!expired && __nr_cookies >= COOKIE_JAR_MAX)
+		__purge_all_expired(now);
+
+	if (expired || d->nr_cookies >= COOKIE_PER_DOMAIN_MAX || __nr_cookies >= COOKIE_JAR_MAX)
+	{
+		if (!expired)
+			cLog("Cookie jar full; dropping cookie for %s\n", d->name);
+
+		__free_cookie(c);
+		return;
+	}
+
+/*
+ * Longest path first; among equals, the
+ * older cookie first (RFC 6265 5.4).
+ */
+	for (pp = &d->cookies; *pp && (*pp)->path_len >= c->path_len; pp = &(*pp)->next)
+		;
+
+	c->next = *pp;
+	*pp = c;
+	++d->nr_cookies;
+	++__nr_cookies;
+
+	return;
+}
+
+/**
+ * __attribute_value - copy the value of the cookie attribute at P (up to END)
+ */
+static void
+__attribute_value(const char *p, const char *end, char *out, size_t size)
+{
+	size_t len;
+
+	while (p < end && *p == ' ')
+		++p;
+
+	while (end > p && end[-1] == ' ')
+		--end;
+
+	len = (size_t)(end - p);
+
+	if (len >= size)
+		len = size - 1;
+
+	memcpy(out, p, len);
+	out[len] = 0;
+
+	return;
+}
+
+/**
+ * COOKIE_set - store the cookie in a Set-Cookie value
+ * @host: the host that sent it
+ * @path: the path of the URL that was requested
+ * @value: the Set-Cookie field value
+ * @len: its length
+ */
+void
+COOKIE_set(const char *host, const char *path, const char *value, size_t len)
+{
+	assert(host);
+	assert(path);
+	assert(value);
+
+	struct COOKIE_entry *c;
+	struct COOKIE_domain *d;
+	const char *end = value + len;
+	const char *p;
+	const char *q;
+	const char *eq;
+	char canon[COOKIE_NAME_MAX];
+	char domain[COOKIE_NAME_MAX];
+	char attr[COOKIE_NAME_MAX];
+	time_t expires = 0;
+	int have_max_age = 0;
+	long max_age;
+
+	if (__canon_host(host, strlen(host), canon) < 0)
+		return;
+
+	if (!(c = calloc(1, sizeof(*c))))
+		return;
+
+	strcpy(domain, canon);
+	c->host_only = 1;
+
+/*
+ * The name=value pair runs up to the first ';'.
+ */
+	if (!(q = memchr(value, ';', len)))
+		q = end;
+
+	while (value < q && *value == ' ')
+		++value;
+
+	if (!(eq = memchr(value, '=', q - value)) || eq == value || (size_t)(q - value) >= COOKIE_MAX)
+		goto fail;
+
+	c->name_len = (size_t)(eq - value);
+	c->pair_len = (size_t)(q - value);
+
+	while (c->pair_len && value[c->pair_len - 1] == ' ')
+		--c->pair_len;
+
+	if (!(c->pair = strndup(value, c->pair_len)))
+		goto fail;
+
+	for (p = q; p < end; p = q)
+	{
+		++p;
+
+		if (!(q = memchr(p, ';', end - p)))
+			q = end;
+
+		while (p < q && *p == ' ')
+			++p;
+
+		if (!(eq = memchr(p, '=', q - p)))
+			eq = q;
+
+		if ((eq - p) == 7 && !strncasecmp(p, "expires", 7))
+		{
+			__attribute_value(eq + 1, q, attr, sizeof(attr));
+
+			if (!have_max_age)
+				expires = date_string_to_timestamp(attr);
+		}
+		else
+		if ((eq - p) == 7 && !strncasecmp(p, "max-age", 7))
+		{
+			__attribute_value(eq + 1, q, attr, sizeof(attr));
+
+			max_age = strtol(attr, NULL, 10);
+			expires = (max_age > 0 ? time(NULL) + max_age : 1);
+			have_max_age = 1;
+		}
+		else
+		if ((eq - p) == 6 && !strncasecmp(p, "domain", 6) && eq < q)
+		{
+			__attribute_value(eq + 1, q, attr, sizeof(attr));
+
+			if (__canon_host(attr, strlen(attr), domain) < 0
+			|| !strchr(domain, '.')
+			|| !__domain_match(canon, domain))
+			{
+				cLog("Refusing cookie from %s for domain %s\n", canon, attr);
+				goto fail;
+			}
+
+			c->host_only = 0;
+		}
+		else
+		if ((eq - p) == 4 && !strncasecmp(p, "path", 4) && eq < q)
+		{
+			__attribute_value(eq + 1, q, attr, sizeof(attr));
+
+			if (attr[0] == '/')
+				c->path = strdup(attr);
+		}
+		else
+		if ((eq - p) == 6 && !strncasecmp(p, "secure", 6))
+		{
+			c->secure = 1;
+		}
+	}
+
+	if (expires < 0)
+		expires = 0;
+
+	c->expires = expires;
+
+/*
+ * Default path: the directory of the request path.
+ */
+	if (!c->path)
+	{
+		len = strcspn(path, "?#");
+
+		while (len > 1 && path[len - 1] != '/')
+			--len;
+
+		if (len > 1)
+			--len;
+
+		if (!(c->path = strndup((path[0] == '/' ? path : "/"), (path[0] == '/' ? len : 1))))
+			goto fail;
+	}
+
+	c->path_len = strlen(c->path);
+
+	pthread_rwlock_wrlock(&__jar_lock);
+
+	if (!(d = __find_domain(domain, 1)))
+	{
+		pthread_rwlock_unlock(&__jar_lock);
+		goto fail;
+	}
+
+	cLog("Cookie for %s%s: %s\n", domain, c->path, c->pair);
+	__store(d, c);
+
+	pthread_rwlock_unlock(&__jar_lock);
+
+	return;
+
+fail:
+
+	free(c->pair);
+	free(c->path);
+	free(c);
+
+	return;
+}
+
+int
+COOKIE_put_header(const char *host, const char *path, int secure, buf_t *buf)
+{
+	assert(host);
+	assert(path);
+	assert(buf);
+
+	struct COOKIE_domain *d;
+	struct COOKIE_entry *c;
+	char canon[COOKIE_NAME_MAX];
+	const char *domain;
+	time_t now = time(NULL);
+	size_t path_len = strcspn(path, "?#");
+	int nr = 0;
+	int rv = 0;
+
+	if (__canon_host(host, strlen(host), canon) < 0)
+		return 0;
+
+	pthread_rwlock_rdlock(&__jar_lock);
+
+	for (domain = canon; domain; domain = strchr(domain, '.'))
+	{
+		if (*domain == '.')
+			++domain;
+
+		if (!(d = __find_domain(domain, 0)))
+			continue;
+
+		for (c = d->cookies; c; c = c->next)
+		{
+			if ((c->host_only && domain != canon)
+			|| (c->secure && !secure)
+			|| (c->expires && c->expires <= now)
+			|| !__path_match(path, path_len, c))
+				continue;
+
+			if ((nr++ ? buf_append_ex(buf, "; ", 2) : buf_append_ex(buf, "Cookie: ", 8)) < 0
+			|| buf_append_ex(buf, c->pair, c->pair_len) < 0)
+			{
+				rv = -1;
+				goto out;
+			}
+		}
+	}
+
+	if (nr && buf_append_ex(buf, "\r\n", 2) < 0)
+		rv = -1;
+
+out:
+
+	pthread_rwlock_unlock(&__jar_lock);
+
+	return rv;
+}
@@ -0,0 +1,553 @@
+#include <assert.h>
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "dns_cache.h"
+
+/*
+ * Process-wide cache of resolved addresses, keyed by host.
+ *
+ * getaddrinfo() blocks and does not tell us the record TTL,
+ * so entries live for a fixed (configurable) time. Failed
+ * lookups are cached for a shorter time so that a dead host
+ * does not cost a resolver round trip on every URL.
+ *
+ * Lookups for a host that is already being resolved wait for
+ * that resolution to finish rather than issuing their own
+ * (single flight), which is what stops a reconnect storm
+ * from hitting the resolver once per worker.
+ *
+ * A small pool of resolver threads takes lookups off a queue
+ * so that nobody has to wait for them: hosts are prefetched
+ * as soon as we find links to them, and by the time a worker
+ * wants to connect the lookup is done (or in flight, and the
+ * worker waits for that rather than starting another).
+ */
+
+#define DNS_NR_BUCKETS 256
+
+enum DNS_state
+{
+	DNS_RESOLVING = 0,
+	DNS_READY
+};
+
+struct DNS_entry
+{
+	char *host;
+	enum DNS_state state;
+	int error; /* 0 or EAI_* from getaddrinfo() */
+	time_t expires; /* CLOCK_MONOTONIC seconds */
+	int nr_waiting;
+	struct DNS_addrs addrs;
+	struct DNS_entry *next;
+};
+
+static struct DNS_entry *__buckets[DNS_NR_BUCKETS];
+static int __nr_entries = 0;
+static unsigned int __ttl = DNS_DEFAULT_TTL;
+static unsigned int __negative_ttl = DNS_DEFAULT_NEGATIVE_TTL;
+
+static pthread_mutex_t __dns_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t __dns_cond = PTHREAD_COND_INITIALIZER;
+
+struct DNS_request
+{
+	char *host;
+	DNS_callback_t cb;
+	void *arg;
+	struct DNS_request *next;
+};
+
+/*
+ * The resolver pool; also under __DNS_MTX.
+ */
+static struct DNS_request *__requests = NULL;
+static struct DNS_request *__requests_tail = NULL;
+static int __nr_requests = 0;
+static int __nr_resolvers = 0;
+static int __pool_stopping = 0;
+static pthread_cond_t __request_cond = PTHREAD_COND_INITIALIZER;
+
+static void
+dLog(char *fmt, ...)
+{
+#ifdef DEBUG
+	va_list args;
+
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+#else
+	(void)fmt;
+#endif
+}
+
+static time_t
+__now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static unsigned int
+__hash_host(const char *host)
+{
+	uint32_t h = 2166136261u;
+
+	while (*host)
+	{
+		h ^= (unsigned char)*host++;
+		h *= 16777619u;
+	}
+
+	return (unsigned int)(h % DNS_NR_BUCKETS);
+}
+
+/*
+ * All of the following __functions are
+ * called with __DNS_MTX held.
+ */
+static struct DNS_entry *
+__find_entry(const char *host)
+{
+	struct DNS_entry *e = __buckets[__hash_host(host)];
+
+	while (e)
+	{
+		if (!strcmp(e->host, host))
+			return e;
+
+		e = e->next;
+	}
+
+	return NULL;
+}
+
+static struct DNS_entry *
+__new_entry(const char *host)
+{
+	struct DNS_entry *e = calloc(1, sizeof(struct DNS_entry));
+	unsigned int idx = __hash_host(host);
+
+	if (!e)
+		return NULL;
+
+	if (!(e->host = strdup(host)))
+	{
+		free(e);
+		return NULL;
+	}
+
+	e->next = __buckets[idx];
+	__buckets[idx] = e;
+	++__nr_entries;
+
+	return e;
+}
+
+/**
+ * __purge_expired - free entries nobody is using that have expired
+ */
+static void
+__purge_expired(void)
+{
+	struct DNS_entry **pp;
+	struct DNS_entry *e;
+	time_t now = __now();
+	int i;
+
+	for (i = 0; i < DNS_NR_BUCKETS; ++i)
+	{
+		pp = &__buckets[i];
+
+		while ((e = *pp))
+		{
+			if (DNS_READY == e->state && !e->nr_waiting && e->expires <= now)
+			{
+				*pp = e->next;
+				free(e->host);
+				free(e);
+				--__nr_entries;
+				continue;
+			}
+
+			pp = &e->next;
+		}
+	}
+
+	return;
+}
+
+/**
+ * __resolve - the actual (blocking) lookup; called without the lock held
+ */
+static int
+__resolve(const char *host, struct DNS_addrs *out)
+{
+	struct addrinfo hints;
+	struct addrinfo *ainf = NULL;
+	struct addrinfo *aip = NULL;
+	int err;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	memset(out, 0, sizeof(*out));
+
+	if ((err = getaddrinfo(host, NULL, &hints, &ainf)) != 0)
+	{
+		dLog("DNS: failed to resolve %s (%s)\n", host, gai_strerror(err));
+		return err;
+	}
+
+	for (aip = ainf; aip && out->nr_addrs < DNS_MAX_ADDRS; aip = aip->ai_next)
+	{
+		if (aip->ai_addrlen > sizeof(struct sockaddr_storage))
+			continue;
+
+		memcpy(&out->addrs[out->nr_addrs], aip->ai_addr, aip->ai_addrlen);
+		out->addr_lens[out->nr_addrs] = aip->ai_addrlen;
+		++out->nr_addrs;
+	}
+
+	freeaddrinfo(ainf);
+
+	if (!out->nr_addrs)
+		return EAI_NONAME;
+
+	return 0;
+}
+
+int
+DNS_lookup(const char *host, struct DNS_addrs *out)
+{
+	assert(host);
+	assert(out);
+
+	struct DNS_entry *e;
+	struct DNS_addrs resolved;
+	int err;
+
+	pthread_mutex_lock(&__dns_mtx);
+
+	e = __find_entry(host);
+
+	while (e && DNS_RESOLVING == e->state)
+	{
+		++e->nr_waiting;
+		pthread_cond_wait(&__dns_cond, &__dns_mtx);
+		--e->nr_waiting;
+	}
+
+	if (e && __now() < e->expires)
+	{
+		memcpy(out, &e->addrs, sizeof(*out));
+		err = e->error;
+
+		pthread_mutex_unlock(&__dns_mtx);
+		return err;
+	}
+
+	if (!e)
+	{
+		if (__nr_entries >= DNS_CACHE_MAX)
+			__purge_expired();
+
+		if (!(e = __new_entry(host)))
+		{
+			pthread_mutex_unlock(&__dns_mtx);
+			return EAI_MEMORY;
+		}
+	}
+
+	e->state = DNS_RESOLVING;
+
+	pthread_mutex_unlock(&__dns_mtx);
+
+	err = __resolve(host, &resolved);
+
+	pthread_mutex_lock(&__dns_mtx);
+
+	memcpy(&e->addrs, &resolved, sizeof(resolved));
+	e->error = err;
+
+/*
+ * Out of memory and the like say nothing about
+ * the host, so don't remember them.
+ */
+	if (EAI_MEMORY == err || EAI_SYSTEM == err)
+		e->expires = 0;
+	else
+		e->expires = __now() + (err ? __negative_ttl : __ttl);
+
+	e->state = DNS_READY;
+	pthread_cond_broadcast(&__dns_cond);
+
+	memcpy(out, &e->addrs, sizeof(*out));
+
+	pthread_mutex_unlock(&__dns_mtx);
+
+	return err;
+}
+
+/**
+ * DNS_invalidate - forget what we know about HOST
+ *
+ * For when connecting to the cached addresses
+ * failed; the next lookup goes to the resolver.
+ */
+void
+DNS_invalidate(const char *host)
+{
+	assert(host);
+
+	struct DNS_entry *e;
+
+	pthread_mutex_lock(&__dns_mtx);
+
+	e = __find_entry(host);
+
+	if (e && DNS_READY == e->state)
+		e->expires = 0;
+
+	pthread_mutex_unlock(&__dns_mtx);
+
+	return;
+}
+
+void
+DNS_set_ttl(unsigned int ttl, unsigned int negative_ttl)
+{
+	pthread_mutex_lock(&__dns_mtx);
+
+	__ttl = ttl;
+	__negative_ttl = negative_ttl;
+
+	pthread_mutex_unlock(&__dns_mtx);
+
+	return;
+}
+
+static void
+__free_request(struct DNS_request *r)
+{
+	free(r->host);
+	free(r);
+
+	return;
+}
+
+/**
+ * __resolver - take lookups off the queue until the pool is stopped
+ */
+static void *
+__resolver(void *arg)
+{
+	struct DNS_request *r;
+	struct DNS_addrs addrs;
+	int err;
+
+	(void)arg;
+
+	pthread_mutex_lock(&__dns_mtx);
+
+	while (1)
+	{
+		while (!__requests && !__pool_stopping)
+			pthread_cond_wait(&__request_cond, &__dns_mtx);
+
+		if (__pool_stopping)
+			break;
+
+		r = __requests;
+		__requests = r->next;
+
+		if (!__requests)
+			__requests_tail = NULL;
+
+		--__nr_requests;
+
+		pthread_mutex_unlock(&__dns_mtx);
+
+		err = DNS_lookup(r->host, &addrs);
+
+		if (r->cb)
+			r->cb(r->host, err, &addrs, r->arg);
+
+		__free_request(r);
+
+		pthread_mutex_lock(&__dns_mtx);
+	}
+
+	--__nr_resolvers;
+
+	pthread_mutex_unlock(&__dns_mtx);
+
+	return NULL;
+}
+
+/**
+ * DNS_pool_start - start NR resolver threads
+ *
+ * Returns the number started, which may be fewer
+ * (and is 0 if NR is).
+ */
+int
+DNS_pool_start(int nr)
+{
+	pthread_attr_t attr;
+	pthread_t tid;
+	int i;
+
+	if (nr > DNS_RESOLVERS_MAX)
+		nr = DNS_RESOLVERS_MAX;
+
+/*
+ * Nobody joins them: one stuck in getaddrinfo()
+ * should not hold up our exit.
+ */
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	pthread_mutex_lock(&__dns_mtx);
+
+	__pool_stopping = 0;
+
+	for (i = 0; i < nr; ++i)
+	{
+		if (pthread_create(&tid, &attr, __resolver, NULL) != 0)
+		{
+			dLog("DNS: failed to start resolver thread (%s)\n", strerror(errno));
+			break;
+		}
+
+		++__nr_resolvers;
+	}
+
+	pthread_mutex_unlock(&__dns_mtx);
+	pthread_attr_destroy(&attr);
+
+	return i;
+}
+
+/**
+ * DNS_pool_stop - stop the resolver threads and drop lookups not yet started
+ *
+ * Threads in the middle of a lookup finish it
+ * (and call its callback) first.
+ */
+void
+DNS_pool_stop(void)
+{
+	struct DNS_request *r;
+
+	pthread_mutex_lock(&__dns_mtx);
+
+	__pool_stopping = 1;
+
+	while ((r = __requests))
+	{
+		__requests = r->next;
+		__free_request(r);
+	}
+
+	__requests_tail = NULL;
+	__nr_requests = 0;
+
+	pthread_cond_broadcast(&__request_cond);
+	pthread_mutex_unlock(&__dns_mtx);
+
+	return;
+}
+
+/*
+ * Called with __DNS_MTX held.
+ */
+static int
+__submit(const char *host, DNS_callback_t cb, void *arg)
+{
+	struct DNS_request *r;
+
+	if (!__nr_resolvers || __pool_stopping || __nr_requests >= DNS_REQUEST_QUEUE_MAX)
+		return -1;
+
+	if (!(r = calloc(1, sizeof(*r))))
+		return -1;
+
+	if (!(r->host = strdup(host)))
+	{
+		free(r);
+		return -1;
+	}
+
+	r->cb = cb;
+	r->arg = arg;
+
+	if (__requests_tail)
+		__requests_tail->next = r;
+	else
+		__requests = r;
+
+	__requests_tail = r;
+	++__nr_requests;
+
+	pthread_cond_signal(&__request_cond);
+
+	return 0;
+}
+
+int
+DNS_resolve_async(const char *host, DNS_callback_t cb, void *arg)
+{
+	assert(host);
+
+	int rv;
+
+	pthread_mutex_lock(&__dns_mtx);
+	rv = __submit(host, cb, arg);
+	pthread_mutex_unlock(&__dns_mtx);
+
+	return rv;
+}
+
+void
+DNS_prefetch(const char *host)
+{
+	assert(host);
+
+	struct DNS_entry *e;
+	struct DNS_request *r;
+
+	pthread_mutex_lock(&__dns_mtx);
+
+	if (!__nr_resolvers)
+		goto out;
+
+	if ((e = __find_entry(host)) && (DNS_RESOLVING == e->state || __now() < e->expires))
+		goto out;
+
+	for (r = __requests; r; r = r->next)
+	{
+		if (!strcmp(r->host, host))
+			goto out;
+	}
+
+	if (__submit(host, NULL, NULL) == 0)
+		dLog("DNS: prefetching %s\n", host);
+
+out:
+
+	pthread_mutex_unlock(&__dns_mtx);
+
+	return;
+}
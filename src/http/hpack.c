@@ -0,0 +1,765 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hpack.h"
+
+/*
+ * HPACK decoding keeps a dynamic table in step with the
+ * peer's encoder. Our own encoder never indexes anything
+ * (static table references and literals only), which
+ * costs a few bytes per request but means there is no
+ * encoder state to get out of step.
+ */
+
+#define HPACK_STATIC_TABLE_LEN 61
+#define HPACK_EOS 256
+
+struct HPACK_static_field
+{
+	char *name;
+	char *value;
+};
+
+static struct HPACK_static_field __static_table[HPACK_STATIC_TABLE_LEN] =
+{
+	{ ":authority", "" },
+	{ ":method", "GET" },
+	{ ":method", "POST" },
+	{ ":path", "/" },
+	{ ":path", "/index.html" },
+	{ ":scheme", "http" },
+	{ ":scheme", "https" },
+	{ ":status", "200" },
+	{ ":status", "204" },
+	{ ":status", "206" },
+	{ ":status", "304" },
+	{ ":status", "400" },
+	{ ":status", "404" },
+	{ ":status", "500" },
+	{ "accept-charset", "" },
+	{ "accept-encoding", "gzip, deflate" },
+	{ "accept-language", "" },
+	{ "accept-ranges", "" },
+	{ "accept", "" },
+	{ "access-control-allow-origin", "" },
+	{ "age", "" },
+	{ "allow", "" },
+	{ "authorization", "" },
+	{ "cache-control", "" },
+	{ "content-disposition", "" },
+	{ "content-encoding", "" },
+	{ "content-language", "" },
+	{ "content-length", "" },
+	{ "content-location", "" },
+	{ "content-range", "" },
+	{ "content-type", "" },
+	{ "cookie", "" },
+	{ "date", "" },
+	{ "etag", "" },
+	{ "expect", "" },
+	{ "expires", "" },
+	{ "from", "" },
+	{ "host", "" },
+	{ "if-match", "" },
+	{ "if-modified-since", "" },
+	{ "if-none-match", "" },
+	{ "if-range", "" },
+	{ "if-unmodified-since", "" },
+	{ "last-modified", "" },
+	{ "link", "" },
+	{ "location", "" },
+	{ "max-forwards", "" },
+	{ "proxy-authenticate", "" },
+	{ "proxy-authorization", "" },
+	{ "range", "" },
+	{ "referer", "" },
+	{ "refresh", "" },
+	{ "retry-after", "" },
+	{ "server", "" },
+	{ "set-cookie", "" },
+	{ "strict-transport-security", "" },
+	{ "transfer-encoding", "" },
+	{ "user-agent", "" },
+	{ "vary", "" },
+	{ "via", "" },
+	{ "www-authenticate", "" }
+};
+
+struct HPACK_huffman_code
+{
+	uint32_t code;
+	uint8_t bits;
+};
+
+/*
+ * RFC 7541 Appendix B, indexed by symbol.
+ */
+static struct HPACK_huffman_code __huffman_codes[HPACK_EOS + 1] =
+{
+	{ 0x1ff8, 13 }, { 0x7fffd8, 23 }, { 0xfffffe2, 28 }, { 0xfffffe3, 28 },
+	{ 0xfffffe4, 28 }, { 0xfffffe5, 28 }, { 0xfffffe6, 28 }, { 0xfffffe7, 28 },
+	{ 0xfffffe8, 28 }, { 0xffffea, 24 }, { 0x3ffffffc, 30 }, { 0xfffffe9, 28 },
+	{ 0xfffffea, 28 }, { 0x3ffffffd, 30 }, { 0xfffffeb, 28 }, { 0xfffffec, 28 },
+	{ 0xfffffed, 28 }, { 0xfffffee, 28 }, { 0xfffffef, 28 }, { 0xffffff0, 28 },
+	{ 0xffffff1, 28 }, { 0xffffff2, 28 }, { 0x3ffffffe, 30 }, { 0xffffff3, 28 },
+	{ 0xffffff4, 28 }, { 0xffffff5, 28 }, { 0xffffff6, 28 }, { 0xffffff7, 28 },
+	{ 0xffffff8, 28 }, { 0xffffff9, 28 }, { 0xffffffa, 28 }, { 0xffffffb, 28 },
+	{ 0x14, 6 }, { 0x3f8, 10 }, { 0x3f9, 10 }, { 0xffa, 12 },
+	{ 0x1ff9, 13 }, { 0x15, 6 }, { 0xf8, 8 }, { 0x7fa, 11 },
+	{ 0x3fa, 10 }, { 0x3fb, 10 }, { 0xf9, 8 }, { 0x7fb, 11 },
+	{ 0xfa, 8 }, { 0x16, 6 }, { 0x17, 6 }, { 0x18, 6 },
+	{ 0x0, 5 }, { 0x1, 5 }, { 0x2, 5 }, { 0x19, 6 },
+	{ 0x1a, 6 }, { 0x1b, 6 }, { 0x1c, 6 }, { 0x1d, 6 },
+	{ 0x1e, 6 }, { 0x1f, 6 }, { 0x5c, 7 }, { 0xfb, 8 },
+	{ 0x7ffc, 15 }, { 0x20, 6 }, { 0xffb, 12 }, { 0x3fc, 10 },
+	{ 0x1ffa, 13 }, { 0x21, 6 }, { 0x5d, 7 }, { 0x5e, 7 },
+	{ 0x5f, 7 }, { 0x60, 7 }, { 0x61, 7 }, { 0x62, 7 },
+	{ 0x63, 7 }, { 0x64, 7 }, { 0x65, 7 }, { 0x66, 7 },
+	{ 0x67, 7 }, { 0x68, 7 }, { 0x69, 7 }, { 0x6a, 7 },
+	{ 0x6b, 7 }, { 0x6c, 7 }, { 0x6d, 7 }, { 0x6e, 7 },
+	{ 0x6f, 7 }, { 0x70, 7 }, { 0x71, 7 }, { 0x72, 7 },
+	{ 0xfc, 8 }, { 0x73, 7 }, { 0xfd, 8 }, { 0x1ffb, 13 },
+	{ 0x7fff0, 19 }, { 0x1ffc, 13 }, { 0x3ffc, 14 }, { 0x22, 6 },
+	{ 0x7ffd, 15 }, { 0x3, 5 }, { 0x23, 6 }, { 0x4, 5 },
+	{ 0x24, 6 }, { 0x5, 5 }, { 0x25, 6 }, { 0x26, 6 },
+	{ 0x27, 6 }, { 0x6, 5 }, { 0x74, 7 }, { 0x75, 7 },
+	{ 0x28, 6 }, { 0x29, 6 }, { 0x2a, 6 }, { 0x7, 5 },
+	{ 0x2b, 6 }, { 0x76, 7 }, { 0x2c, 6 }, { 0x8, 5 },
+	{ 0x9, 5 }, { 0x2d, 6 }, { 0x77, 7 }, { 0x78, 7 },
+	{ 0x79, 7 }, { 0x7a, 7 }, { 0x7b, 7 }, { 0x7ffe, 15 },
+	{ 0x7fc, 11 }, { 0x3ffd, 14 }, { 0x1ffd, 13 }, { 0xffffffc, 28 },
+	{ 0xfffe6, 20 }, { 0x3fffd2, 22 }, { 0xfffe7, 20 }, { 0xfffe8, 20 },
+	{ 0x3fffd3, 22 }, { 0x3fffd4, 22 }, { 0x3fffd5, 22 }, { 0x7fffd9, 23 },
+	{ 0x3fffd6, 22 }, { 0x7fffda, 23 }, { 0x7fffdb, 23 }, { 0x7fffdc, 23 },
+	{ 0x7fffdd, 23 }, { 0x7fffde, 23 }, { 0xffffeb, 24 }, { 0x7fffdf, 23 },
+	{ 0xffffec, 24 }, { 0xffffed, 24 }, { 0x3fffd7, 22 }, { 0x7fffe0, 23 },
+	{ 0xffffee, 24 }, { 0x7fffe1, 23 }, { 0x7fffe2, 23 }, { 0x7fffe3, 23 },
+	{ 0x7fffe4, 23 }, { 0x1fffdc, 21 }, { 0x3fffd8, 22 }, { 0x7fffe5, 23 },
+	{ 0x3fffd9, 22 }, { 0x7fffe6, 23 }, { 0x7fffe7, 23 }, { 0xffffef, 24 },
+	{ 0x3fffda, 22 }, { 0x1fffdd, 21 }, { 0xfffe9, 20 }, { 0x3fffdb, 22 },
+	{ 0x3fffdc, 22 }, { 0x7fffe8, 23 }, { 0x7fffe9, 23 }, { 0x1fffde, 21 },
+	{ 0x7fffea, 23 }, { 0x3fffdd, 22 }, { 0x3fffde, 22 }, { 0xfffff0, 24 },
+	{ 0x1fffdf, 21 }, { 0x3fffdf, 22 }, { 0x7fffeb, 23 }, { 0x7fffec, 23 },
+	{ 0x1fffe0, 21 }, { 0x1fffe1, 21 }, { 0x3fffe0, 22 }, { 0x1fffe2, 21 },
+	{ 0x7fffed, 23 }, { 0x3fffe1, 22 }, { 0x7fffee, 23 }, { 0x7fffef, 23 },
+	{ 0xfffea, 20 }, { 0x3fffe2, 22 }, { 0x3fffe3, 22 }, { 0x3fffe4, 22 },
+	{ 0x7ffff0, 23 }, { 0x3fffe5, 22 }, { 0x3fffe6, 22 }, { 0x7ffff1, 23 },
+	{ 0x3ffffe0, 26 }, { 0x3ffffe1, 26 }, { 0xfffeb, 20 }, { 0x7fff1, 19 },
+	{ 0x3fffe7, 22 }, { 0x7ffff2, 23 }, { 0x3fffe8, 22 }, { 0x1ffffec, 25 },
+	{ 0x3ffffe2, 26 }, { 0x3ffffe3, 26 }, { 0x3ffffe4, 26 }, { 0x7ffffde, 27 },
+	{ 0x7ffffdf, 27 }, { 0x3ffffe5, 26 }, { 0xfffff1, 24 }, { 0x1ffffed, 25 },
+	{ 0x7fff2, 19 }, { 0x1fffe3, 21 }, { 0x3ffffe6, 26 }, { 0x7ffffe0, 27 },
+	{ 0x7ffffe1, 27 }, { 0x3ffffe7, 26 }, { 0x7ffffe2, 27 }, { 0xfffff2, 24 },
+	{ 0x1fffe4, 21 }, { 0x1fffe5, 21 }, { 0x3ffffe8, 26 }, { 0x3ffffe9, 26 },
+	{ 0xffffffd, 28 }, { 0x7ffffe3, 27 }, { 0x7ffffe4, 27 }, { 0x7ffffe5, 27 },
+	{ 0xfffec, 20 }, { 0xfffff3, 24 }, { 0xfffed, 20 }, { 0x1fffe6, 21 },
+	{ 0x3fffe9, 22 }, { 0x1fffe7, 21 }, { 0x1fffe8, 21 }, { 0x7ffff3, 23 },
+	{ 0x3fffea, 22 }, { 0x3fffeb, 22 }, { 0x1ffffee, 25 }, { 0x1ffffef, 25 },
+	{ 0xfffff4, 24 }, { 0xfffff5, 24 }, { 0x3ffffea, 26 }, { 0x7ffff4, 23 },
+	{ 0x3ffffeb, 26 }, { 0x7ffffe6, 27 }, { 0x3ffffec, 26 }, { 0x3ffffed, 26 },
+	{ 0x7ffffe7, 27 }, { 0x7ffffe8, 27 }, { 0x7ffffe9, 27 }, { 0x7ffffea, 27 },
+	{ 0x7ffffeb, 27 }, { 0xffffffe, 28 }, { 0x7ffffec, 27 }, { 0x7ffffed, 27 },
+	{ 0x7ffffee, 27 }, { 0x7ffffef, 27 }, { 0x7fffff0, 27 }, { 0x3ffffee, 26 },
+	{ 0x3fffffff, 30 },
+};
+
+/*
+ * Decoding tree built from the codes above. A child > 0
+ * is the index of another node; a child < 0 is the leaf
+ * for symbol -(child + 1). The root is node 0, which is
+ * never anyone's child, so 0 means there is no such code.
+ */
+#define HPACK_HUFFMAN_NODES 256
+
+static int16_t __huffman_tree[HPACK_HUFFMAN_NODES][2];
+static pthread_once_t __huffman_once = PTHREAD_ONCE_INIT;
+
+static void
+hLog(char *fmt, ...)
+{
+#ifdef DEBUG
+	va_list args;
+
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+#else
+	(void)fmt;
+#endif
+}
+
+static void
+__build_huffman_tree(void)
+{
+	int nr_nodes = 1;
+	int sym;
+	int bit;
+	int node;
+	int b;
+
+	for (sym = 0; sym <= HPACK_EOS; ++sym)
+	{
+		node = 0;
+
+		for (bit = __huffman_codes[sym].bits - 1; bit > 0; --bit)
+		{
+			b = (__huffman_codes[sym].code >> bit) & 1;
+
+			if (!__huffman_tree[node][b])
+			{
+				assert(nr_nodes < HPACK_HUFFMAN_NODES);
+				__huffman_tree[node][b] = nr_nodes++;
+			}
+
+			node = __huffman_tree[node][b];
+		}
+
+		__huffman_tree[node][__huffman_codes[sym].code & 1] = -(sym + 1);
+	}
+
+	return;
+}
+
+static int
+__huffman_decode(unsigned char *src, size_t len, char *dst, size_t *out_len)
+{
+	size_t n = 0;
+	size_t i;
+	int node = 0;
+	int child;
+	int depth = 0; /* bits since the last symbol */
+	int all_ones = 1;
+	int bit;
+	int b;
+
+	for (i = 0; i < len; ++i)
+	{
+		for (bit = 7; bit >= 0; --bit)
+		{
+			b = (src[i] >> bit) & 1;
+			child = __huffman_tree[node][b];
+
+			if (!child)
+				return -1;
+
+			all_ones &= b;
+			++depth;
+
+			if (child > 0)
+			{
+				node = child;
+				continue;
+			}
+
+			if (HPACK_EOS == -(child + 1) || n >= HPACK_STRING_MAX)
+				return -1;
+
+			dst[n++] = (char)-(child + 1);
+
+			node = 0;
+			depth = 0;
+			all_ones = 1;
+		}
+	}
+
+/*
+ * What's left must be padding: the most
+ * significant bits of EOS, under a byte.
+ */
+	if (depth > 7 || !all_ones)
+		return -1;
+
+	dst[n] = 0;
+	*out_len = n;
+
+	return 0;
+}
+
+static int
+__decode_int(unsigned char **pp, unsigned char *end, int prefix, size_t *value)
+{
+	unsigned char *p = *pp;
+	size_t max = ((size_t)1 << prefix) - 1;
+	size_t v;
+	int shift = 0;
+
+	if (p >= end)
+		return -1;
+
+	v = (*p++ & max);
+
+	if (v == max)
+	{
+		do
+		{
+			if (p >= end || shift > 28)
+				return -1;
+
+			v += ((size_t)(*p & 0x7f) << shift);
+			shift += 7;
+		}
+		while (*p++ & 0x80);
+	}
+
+	*pp = p;
+	*value = v;
+
+	return 0;
+}
+
+static int
+__decode_string(unsigned char **pp, unsigned char *end, char *dst, size_t *len)
+{
+	int huffman;
+	size_t slen;
+
+	if (*pp >= end)
+		return -1;
+
+	huffman = (**pp & 0x80);
+
+	if (__decode_int(pp, end, 7, &slen) < 0)
+		return -1;
+
+	if (slen > (size_t)(end - *pp))
+		return -1;
+
+	if (huffman)
+	{
+		if (__huffman_decode(*pp, slen, dst, len) < 0)
+			return -1;
+	}
+	else
+	{
+		if (slen > HPACK_STRING_MAX)
+			return -1;
+
+		memcpy(dst, *pp, slen);
+		dst[slen] = 0;
+		*len = slen;
+	}
+
+	*pp += slen;
+
+	return 0;
+}
+
+/**
+ * __lookup - find the field at IDX in the static table or dynamic table
+ */
+static int
+__lookup(struct HPACK_table *t, size_t idx, struct HPACK_entry *out)
+{
+	struct HPACK_entry *e;
+
+	if (!idx)
+		return -1;
+
+	if (idx <= HPACK_STATIC_TABLE_LEN)
+	{
+		out->name = __static_table[idx - 1].name;
+		out->value = __static_table[idx - 1].value;
+		out->name_len = strlen(out->name);
+		out->value_len = strlen(out->value);
+
+		return 0;
+	}
+
+	idx -= (HPACK_STATIC_TABLE_LEN + 1);
+
+	if (idx >= (size_t)t->nr_entries)
+		return -1;
+
+	e = &t->entries[(t->head - (int)idx + t->capacity) % t->capacity];
+	memcpy(out, e, sizeof(*out));
+
+	return 0;
+}
+
+static void
+__evict_to(struct HPACK_table *t, size_t limit)
+{
+	struct HPACK_entry *e;
+
+	while (t->nr_entries && t->size > limit)
+	{
+		e = &t->entries[(t->head - (t->nr_entries - 1) + t->capacity) % t->capacity];
+
+		t->size -= (e->name_len + e->value_len + HPACK_ENTRY_OVERHEAD);
+		free(e->name);
+		e->name = e->value = NULL;
+
+		--t->nr_entries;
+	}
+
+	return;
+}
+
+static int
+__table_add(struct HPACK_table *t, char *name, size_t name_len, char *value, size_t value_len)
+{
+	size_t esize = (name_len + value_len + HPACK_ENTRY_OVERHEAD);
+	struct HPACK_entry *e;
+
+/*
+ * An entry bigger than the table empties
+ * it and is not added (RFC 7541 4.4).
+ */
+	if (esize > t->max_size)
+	{
+		__evict_to(t, 0);
+		return 0;
+	}
+
+	__evict_to(t, t->max_size - esize);
+	assert(t->nr_entries < t->capacity);
+
+	t->head = (t->head + 1) % t->capacity;
+	e = &t->entries[t->head];
+
+	if (!(e->name = malloc(name_len + value_len + 2)))
+		return -1;
+
+	e->value = (e->name + name_len + 1);
+	memcpy(e->name, name, name_len + 1);
+	memcpy(e->value, value, value_len + 1);
+	e->name_len = name_len;
+	e->value_len = value_len;
+
+	t->size += esize;
+	++t->nr_entries;
+
+	return 0;
+}
+
+/**
+ * __decode_literal - decode a literal field whose name is indexed or follows
+ */
+static int
+__decode_literal(struct HPACK_table *t, unsigned char **pp, unsigned char *end, int prefix, struct HPACK_entry *field)
+{
+	struct HPACK_entry named;
+	size_t idx;
+
+	if (__decode_int(pp, end, prefix, &idx) < 0)
+		return -1;
+
+	if (idx)
+	{
+	/*
+	 * Copy the name: adding this field to
+	 * the table may evict the one it's in.
+	 */
+		if (__lookup(t, idx, &named) < 0)
+			return -1;
+
+		memcpy(t->name_buf, named.name, named.name_len + 1);
+		field->name_len = named.name_len;
+	}
+	else
+	{
+		if (__decode_string(pp, end, t->name_buf, &field->name_len) < 0)
+			return -1;
+	}
+
+	if (__decode_string(pp, end, t->value_buf, &field->value_len) < 0)
+		return -1;
+
+	field->name = t->name_buf;
+	field->value = t->value_buf;
+
+	return 0;
+}
+
+int
+HPACK_table_init(struct HPACK_table *t, size_t max_size)
+{
+	assert(t);
+
+	memset(t, 0, sizeof(*t));
+
+	t->capacity = (int)(max_size / HPACK_ENTRY_OVERHEAD) + 1;
+	t->max_size = t->settings_max = max_size;
+
+	t->entries = calloc(t->capacity, sizeof(struct HPACK_entry));
+	t->name_buf = malloc(HPACK_STRING_MAX + 1);
+	t->value_buf = malloc(HPACK_STRING_MAX + 1);
+
+	if (!t->entries || !t->name_buf || !t->value_buf)
+	{
+		HPACK_table_destroy(t);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * HPACK_table_reset - empty the table for a new connection
+ */
+void
+HPACK_table_reset(struct HPACK_table *t)
+{
+	assert(t);
+
+	__evict_to(t, 0);
+
+	t->head = 0;
+	t->max_size = t->settings_max;
+
+	return;
+}
+
+void
+HPACK_table_destroy(struct HPACK_table *t)
+{
+	assert(t);
+
+	if (t->entries)
+		__evict_to(t, 0);
+
+	free(t->entries);
+	free(t->name_buf);
+	free(t->value_buf);
+
+	memset(t, 0, sizeof(*t));
+
+	return;
+}
+
+/**
+ * HPACK_decode - decode a complete header block
+ * @t: the connection's decoder table
+ * @block: the header block (HEADERS plus any CONTINUATION payloads)
+ * @len: length of the block
+ * @cb: called for each field
+ * @arg: passed to @cb
+ *
+ * Returns 0, or -1 on a malformed block, which
+ * is a connection error (COMPRESSION_ERROR): the
+ * table can no longer be trusted.
+ */
+int
+HPACK_decode(struct HPACK_table *t, unsigned char *block, size_t len, HPACK_field_cb_t cb, void *arg)
+{
+	assert(t);
+	assert(cb);
+
+	unsigned char *p = block;
+	unsigned char *end = block + len;
+	struct HPACK_entry field;
+	size_t value;
+	int nr_fields = 0;
+
+	pthread_once(&__huffman_once, __build_huffman_tree);
+
+	while (p < end)
+	{
+		if (*p & 0x80)
+		{
+		/*
+		 * Indexed header field.
+		 */
+			if (__decode_int(&p, end, 7, &value) < 0)
+				goto fail;
+
+			if (__lookup(t, value, &field) < 0)
+				goto fail;
+		}
+		else
+		if (*p & 0x40)
+		{
+		/*
+		 * Literal with incremental indexing.
+		 */
+			if (__decode_literal(t, &p, end, 6, &field) < 0)
+				goto fail;
+
+			if (__table_add(t, field.name, field.name_len, field.value, field.value_len) < 0)
+				goto fail;
+		}
+		else
+		if (*p & 0x20)
+		{
+		/*
+		 * Dynamic table size update; only allowed
+		 * before the first field in the block.
+		 */
+			if (nr_fields)
+				goto fail;
+
+			if (__decode_int(&p, end, 5, &value) < 0)
+				goto fail;
+
+			if (value > t->settings_max)
+				goto fail;
+
+			t->max_size = value;
+			__evict_to(t, value);
+
+			continue;
+		}
+		else
+		{
+		/*
+		 * Literal without indexing, or never indexed;
+		 * they are the same to us.
+		 */
+			if (__decode_literal(t, &p, end, 4, &field) < 0)
+				goto fail;
+		}
+
+		++nr_fields;
+
+		if (cb(arg, field.name, field.name_len, field.value, field.value_len) < 0)
+			return -1;
+	}
+
+	return 0;
+
+fail:
+
+	hLog("HPACK: malformed header block (%lu bytes in)\n", (size_t)(p - block));
+	return -1;
+}
+
+static int
+__put_int(buf_t *buf, unsigned char flags, int prefix, size_t value)
+{
+	unsigned char bytes[16];
+	size_t max = ((size_t)1 << prefix) - 1;
+	int n = 0;
+
+	if (value < max)
+	{
+		bytes[n++] = (flags | (unsigned char)value);
+	}
+	else
+	{
+		bytes[n++] = (flags | (unsigned char)max);
+		value -= max;
+
+		while (value >= 0x80)
+		{
+			bytes[n++] = (unsigned char)((value & 0x7f) | 0x80);
+			value >>= 7;
+		}
+
+		bytes[n++] = (unsigned char)value;
+	}
+
+	return buf_append_bytes(buf, bytes, n);
+}
+
+static int
+__put_string(buf_t *buf, char *s)
+{
+	size_t len = strlen(s);
+	size_t bits = 0;
+	size_t hlen;
+	size_t i;
+	size_t n = 0;
+	uint64_t acc = 0;
+	int nr_bits = 0;
+	struct HPACK_huffman_code *c;
+	unsigned char *out;
+	int rv;
+
+	for (i = 0; i < len; ++i)
+		bits += __huffman_codes[(unsigned char)s[i]].bits;
+
+	hlen = ((bits + 7) / 8);
+
+	if (hlen >= len)
+	{
+		if (__put_int(buf, 0x00, 7, len) < 0)
+			return -1;
+
+		return len ? buf_append_bytes(buf, s, len) : 0;
+	}
+
+	if (!(out = malloc(hlen)))
+		return -1;
+
+	for (i = 0; i < len; ++i)
+	{
+		c = &__huffman_codes[(unsigned char)s[i]];
+
+		acc = ((acc << c->bits) | c->code);
+		nr_bits += c->bits;
+
+		while (nr_bits >= 8)
+		{
+			nr_bits -= 8;
+			out[n++] = (unsigned char)(acc >> nr_bits);
+		}
+	}
+
+/*
+ * Pad with the most significant bits of EOS (all 1s).
+ */
+	if (nr_bits)
+		out[n++] = (unsigned char)((acc << (8 - nr_bits)) | (0xff >> nr_bits));
+
+	assert(n == hlen);
+
+	rv = __put_int(buf, 0x80, 7, hlen);
+	if (!rv)
+		rv = buf_append_bytes(buf, out, hlen);
+
+	free(out);
+
+	return rv;
+}
+
+/**
+ * HPACK_encode_field - append an encoded header field to BUF
+ *
+ * Uses the static table where it can and a literal
+ * without indexing otherwise. NAME must be lower case.
+ */
+int
+HPACK_encode_field(buf_t *buf, char *name, char *value)
+{
+	assert(buf);
+	assert(name);
+	assert(value);
+
+	size_t name_idx = 0;
+	int i;
+
+	for (i = 0; i < HPACK_STATIC_TABLE_LEN; ++i)
+	{
+		if (strcmp(name, __static_table[i].name))
+			continue;
+
+		if (!strcmp(value, __static_table[i].value))
+			return __put_int(buf, 0x80, 7, (size_t)(i + 1));
+
+		if (!name_idx)
+			name_idx = (size_t)(i + 1);
+	}
+
+	if (__put_int(buf, 0x00, 4, name_idx) < 0)
+		return -1;
+
+	if (!name_idx && __put_string(buf, name) < 0)
+		return -1;
+
+	return __put_string(buf, value);
+}
+
+/**
+ * HPACK_encode_table_size - append a dynamic table size update
+ */
+int
+HPACK_encode_table_size(buf_t *buf, size_t size)
+{
+	assert(buf);
+
+	return __put_int(buf, 0x20, 5, size);
+}
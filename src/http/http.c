@@ -1,3 +1,4 @@
+#define _GNU_SOURCE /* splice(2), pipe2(2) */
 #include <arpa/inet.h>
 #include <assert.h>
 #include <arpa/inet.h>
@@ -6,69 +7,47 @@
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <openssl/conf.h>
 #include <openssl/err.h>
 #include <openssl/ssl.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/epoll.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 #include "buffer.h"
 #include "cache.h"
+#include "content_coding.h"
+#include "cookie_jar.h"
+#include "dns_cache.h"
 #include "http.h"
+#include "http2.h"
 #include "malloc.h"
 #include "netwasabi.h"
+#include "redirect_map.h"
+#include "scan.h"
 #include "string_utils.h"
+#include "tls_session.h"
 
 /*
  * TODO
  *
  * Gracefully handle 3xx/4xx/5xx codes.
  *
- * Upgrade to handle HTTP 2.0
- *
  * Decouple this file and the netwasabi header
  * because we want the internals of this module
  * to be opaque and therefore reusable elsewhere.
  *
  */
 
-typedef struct HTTP_Cookie
-{
-	char *whole_cookie;
-	size_t cookie_len;
-	time_t expires;
-	char *for_path;
-	char *for_domain;
-} cookie_t;
-
-#define HTTP_VERSION_1_0 0x10000000u
-#define HTTP_VERSION_1_1 0x10100000u
-#define HTTP_VERSION_2_0 0x20000000u
 #define HTTP_DEFAULT_VERSION HTTP_VERSION_1_1
 
-/*
- * Definitions related to HTTP 2.0
- *
- * This MUST be followed by a SETTINGS frame,
- * which MAY be empty (RFC 7540)
- */
-#define HTTP_2_0_CONNECTION_PREFACE_START_SEQUENCE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
-#define HTTP_2_0_SETTINGS_MAX_FRAME_SIZE 1048576u // 2^20
-
-#define HTTP_UPGRADE_HEADER_FIELD_CLEAR	"Upgrade: h2c"
-#define HTTP_UPGRADE_HEADER_FIELD_TLS	"Upgrade: h2"
-
-struct HTTP_frame
-{
-	uint32_t len:24;
-	uint32_t type:8;
-	uint8_t flags;
-	uint32_t streamId;
-} __attribute__((packed));
-
 #define HTTP_SKIP_HOST_PART(PTR, URL)\
 do {\
 	char *____s_p = NULL;\
@@ -93,8 +72,13 @@ do {\
 
 #define set_verb(h, v) ((h)->verb = (v))
 
-#define HTTP_SMALL_READ_BLOCK 256
-#define HTTP_MAX_WAIT_TIME 6
+#define HTTP_HEADER_READ_BLOCK 16384
+#define HTTP_HEADER_MAX 262144 /* longest response header we will read */
+#define HTTP_MAX_WAIT_TIME 6 /* longest silence while reading a body */
+
+#define HTTP_HEADER_FIELDS_MAX 96 /* fields beyond this in a response are ignored */
+#define HTTP_REQUEST_FIXED_MAX 1024
+#define HTTP_REQUEST_IOV_MAX 8
 
 #define CREATION_FLAGS O_RDWR|O_CREAT|O_TRUNC
 #define CREATION_MODE S_IRUSR|S_IWUSR
@@ -107,6 +91,63 @@ static enum Error_Code
 */
 
 
+/*
+ * The header fields we act on, identified
+ * once when the response is parsed.
+ */
+enum http_header_slot
+{
+	HDR_CONNECTION = 0,
+	HDR_CONTENT_ENCODING,
+	HDR_CONTENT_LENGTH,
+	HDR_CONTENT_TYPE,
+	HDR_ETAG,
+	HDR_LAST_MODIFIED,
+	HDR_LOCATION,
+	HDR_SET_COOKIE,
+	HDR_TRANSFER_ENCODING,
+	HDR_NR_SLOTS,
+	HDR_OTHER = HDR_NR_SLOTS
+};
+
+static const struct
+{
+	const char *name;
+	size_t len;
+} header_slot_names[HDR_NR_SLOTS] = {
+	{ "connection", 10 },
+	{ "content-encoding", 16 },
+	{ "content-length", 14 },
+	{ "content-type", 12 },
+	{ "etag", 4 },
+	{ "last-modified", 13 },
+	{ "location", 8 },
+	{ "set-cookie", 10 },
+	{ "transfer-encoding", 17 }
+};
+
+/*
+ * A response header field, as offsets into the
+ * read buffer (which may move when it grows).
+ */
+struct http_header_field
+{
+	uint32_t name_off;
+	uint32_t name_len;
+	uint32_t value_off;
+	uint32_t value_len;
+	int slot;
+	int next; /* next field in the same slot, or -1 */
+};
+
+struct http_header_index
+{
+	struct http_header_field fields[HTTP_HEADER_FIELDS_MAX];
+	int nr_fields;
+	int first[HDR_NR_SLOTS]; /* -1 if absent */
+	int last[HDR_NR_SLOTS];
+};
+
 /*
  * User gets struct http_t which does not
  * include the caches.
@@ -115,9 +156,85 @@ struct HTTP_private
 {
 	struct http_t http;
 
-	bucket_obj_t *headers;
-	cache_t *cookies;
-	bucket_obj_t *redirects;
+	/*
+	 * Fields of the response header in the read
+	 * buffer, and a copy of the last value that
+	 * was asked for with fetch_header().
+	 */
+	struct http_header_index headers;
+	char header_value[HTTP_HEADER_FIELD_MAX_LENGTH];
+
+	/*
+	 * The request header fields that are the same
+	 * for every GET to REQUEST_HOST.
+	 */
+	char request_fixed[HTTP_REQUEST_FIXED_MAX];
+	size_t request_fixed_len;
+	char request_host[HTTP_HOST_MAX+1];
+
+	/*
+	 * Where read_until_eoh() found the end of the
+	 * header, so it is not searched for again (0
+	 * if the header did not come that way).
+	 */
+	off_t eoh_off;
+
+
+	/*
+	 * Requests written but not yet answered,
+	 * in the order they were sent.
+	 */
+	char *pipeline[HTTP_PIPELINE_MAX];
+	int pipeline_next;
+	int nr_pipelined;
+	int nr_skipped; /* URLs not sent, kept from the end of PIPELINE */
+	int pipelining; /* receiving a pipelined response */
+
+	/*
+	 * Bytes read past the end of the previous
+	 * response: the start of the next one.
+	 */
+	buf_t carry;
+
+	/*
+	 * HTTP/2 connection state, if ALPN gave us h2,
+	 * and the stream of the request last sent.
+	 */
+	struct HTTP2_conn *h2;
+	uint32_t h2_stream;
+	uint32_t pipeline_stream[HTTP_PIPELINE_MAX];
+	int pipeline_failed;
+
+	/*
+	 * Content-Encoding of the body being received;
+	 * it is decoded into DECODED as it arrives.
+	 */
+	struct CODING_decoder decoder;
+	int decoding;
+	buf_chain_t decoded;
+
+	/*
+	 * When the response currently being received
+	 * must be complete (http->timeouts.transfer).
+	 */
+	struct timespec transfer_deadline;
+
+	/*
+	 * The body being received is going to
+	 * http->bodySink; SINK_PIPE is for
+	 * splicing it there from the socket.
+	 */
+	int sinking;
+	int sink_pipe[2];
+
+	/*
+	 * The size cap for the body being received
+	 * (from its type policy; 0 for none), and
+	 * whether we had to drop the connection to
+	 * get rid of a body we did not want.
+	 */
+	size_t body_max;
+	int body_dropped;
 };
 
 void http_check_host(struct http_t *) __nonnull((1));
@@ -125,6 +242,9 @@ int http_connection_closed(struct http_t *) __nonnull((1)) __wur;
 
 static int send_request_1_1(struct http_t *);
 static int recv_response_1_1(struct http_t *);
+static int send_request_2_0(struct http_t *);
+static int recv_response_2_0(struct http_t *);
+static uint32_t http2_submit_request(struct http_t *);
 static int build_request_header_1_1(struct http_t *);
 static int append_header_1_1(struct http_t *, char *, char *);
 static char *fetch_header_1_1(struct http_t *, char *);
@@ -132,7 +252,6 @@ static char *URL_parse_host(char *, char *);
 static char *URL_parse_page(char *, char *);
 static const char *code_as_string(struct http_t *);
 
-static void append_cookies_1_1(struct http_t *);
 
 static int http_status_code_int(buf_t *) __nonnull((1));
 
@@ -148,9 +267,22 @@ struct HTTP_methods Methods_v1_1 = {
 	.code_as_string = code_as_string
 };
 
-struct HTTP_methods *Default_Version_Methods = &Methods_v1_1;
+/*
+ * HTTP/2 requests are translated from the
+ * HTTP/1.1 header build_header() writes.
+ */
+struct HTTP_methods Methods_v2_0 = {
+	.send_request = send_request_2_0,
+	.recv_response = recv_response_2_0,
+	.build_header = build_request_header_1_1,
+	.append_header = append_header_1_1,
+	.fetch_header = fetch_header_1_1,
+	.URL_parse_host = URL_parse_host,
+	.URL_parse_page = URL_parse_page,
+	.code_as_string = code_as_string
+};
 
-//struct HTTP_methods Methods_v2_0;
+struct HTTP_methods *Default_Version_Methods = &Methods_v1_1;
 
 /*
  * Cache redirected URLs so that we can obtain
@@ -172,6 +304,28 @@ struct HTTP_redirected
 	time_t when; // When we first encountered the original URL
 };
 
+static struct HTTP_timeouts default_timeouts = {
+	HTTP_CONNECT_TIMEOUT,
+	HTTP_HANDSHAKE_TIMEOUT,
+	HTTP_FIRST_BYTE_TIMEOUT,
+	HTTP_TRANSFER_TIMEOUT
+};
+
+static struct HTTP_type_policy type_policies[HTTP_TYPE_POLICY_MAX];
+static int nr_type_policies = 0;
+
+static struct HTTP_socket_profile socket_profile = {
+	HTTP_SOCK_NODELAY,
+	HTTP_SOCK_FAST_OPEN,
+	HTTP_SOCK_RCVBUF,
+	HTTP_SOCK_KEEPALIVE,
+	HTTP_SOCK_USER_TIMEOUT
+};
+
+static pthread_mutex_t socket_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct HTTP_socket_profile socket_effective;
+static int nr_sockets = 0;
+
 #ifdef DEBUG
 # define PATH_MAX_GUESS 1024
 static char *LOG_FILE = NULL;
@@ -235,42 +389,6 @@ __dtor private_fini(void)
 	return;
 }
 
-static int
-cookie_cache_ctor(void *cookieObj)
-{
-	if (!cookieObj)
-		return -1;
-
-	cookie_t *cookie = (cookie_t *)cookieObj;
-
-	memset(cookie, 0, sizeof(*cookie));
-
-	cookie->whole_cookie = calloc(HTTP_ALIGN_SIZE(HTTP_COOKIE_MAX), 1);
-	cookie->for_path = calloc(HTTP_ALIGN_SIZE(HTTP_COOKIE_MAX), 1);
-	cookie->for_domain = calloc(HTTP_ALIGN_SIZE(HTTP_COOKIE_MAX), 1);
-
-	assert(cookie->whole_cookie);
-	assert(cookie->for_path);
-	assert(cookie->for_domain);
-
-	return 0;
-}
-
-static void
-cookie_cache_dtor(void *cookieObj)
-{
-	if (!cookieObj)
-		return;
-
-	cookie_t *cookie = (cookie_t *)cookieObj;
-
-	free(cookie->whole_cookie);
-	free(cookie->for_path);
-	free(cookie->for_domain);
-
-	return;
-}
-
 //#define LOG_FILE "./http_debug_log.txt"
 
 /*
@@ -302,145 +420,135 @@ use_rand:
 }
 */
 
+/*
+ * ================================================================================================
+ *
+ * The response header index. Fields are kept as offsets into the read
+ * buffer rather than copied out, and the ones we act on are put in their
+ * HDR_* slot as they are parsed so that finding them costs nothing.
+ *
+ * ================================================================================================
+ */
+
 static void
-parse_cookies(struct http_t *http)
+http_header_reset(struct http_header_index *index)
 {
-	assert(http);
-
-	struct HTTP_private *private = (struct HTTP_private *)http;
-	bucket_t *bucket = private->headers->get(private->headers, "set-cookie");
-	if (!bucket)
-		return;
+	int i;
 
-	cache_clear_all(private->cookies);
-
-	char *p = NULL;
-	char *q = NULL;
-	char *end = NULL;
-	cookie_t *cookie = NULL;
+	index->nr_fields = 0;
 
-	while (bucket)
+	for (i = 0; i < HDR_NR_SLOTS; ++i)
 	{
-		cookie = cache_alloc(private->cookies, NULL);
-
-		memcpy((void *)cookie->whole_cookie, bucket->data, bucket->data_len);
-		cookie->whole_cookie[bucket->data_len] = 0;
-
-		p = (char *)bucket->data;
-		end = (char *)bucket->data + bucket->data_len;
-
-		q = memchr(p, ';', (end - p));
-
-		if (!q)
-		{
-			bucket = bucket->next;
-			continue;
-		}
-
-		p = ++q;
+		index->first[i] = -1;
+		index->last[i] = -1;
+	}
 
-		while (1)
-		{
-			if (p >= end)
-				break;
+	return;
+}
 
-			while (*p == ' ' && p < end)
-				++p;
+/**
+ * http_header_slot - the HDR_* slot for a field name (matched without regard to case)
+ */
+static int
+http_header_slot(const char *name, size_t len)
+{
+	int i;
 
-			if (p == end)
-			{
-				break;
-			}
+	for (i = 0; i < HDR_NR_SLOTS; ++i)
+	{
+		if (len == header_slot_names[i].len && !strncasecmp(name, header_slot_names[i].name, len))
+			return i;
+	}
 
-			q = memchr(p, '=', (end - p));
+	return HDR_OTHER;
+}
 
-			if (!q)
-			{
-				break;
-			}
+static int
+http_header_add(struct http_header_index *index, char *base, char *name, size_t name_len, char *value, size_t value_len)
+{
+	struct http_header_field *field;
+	int slot;
 
-			if (!memcmp((void *)p, (void *)"expires", 7))
-			{
-				char expiry[64];
+	if (index->nr_fields >= HTTP_HEADER_FIELDS_MAX)
+		return -1;
 
-				p = ++q;
-				q = memchr(p, ';', (end - p));
-				if (!q)
-					q = end;
+	field = &index->fields[index->nr_fields];
 
-				memcpy((void *)expiry, (void *)p, (q - p));
-				expiry[q - p] = 0;
+	field->name_off = (uint32_t)(name - base);
+	field->name_len = (uint32_t)name_len;
+	field->value_off = (uint32_t)(value - base);
+	field->value_len = (uint32_t)value_len;
+	field->next = -1;
+	field->slot = slot = http_header_slot(name, name_len);
 
-				cookie->expires = date_string_to_timestamp(expiry);
+	if (HDR_OTHER != slot)
+	{
+		if (index->last[slot] < 0)
+			index->first[slot] = index->nr_fields;
+		else
+			index->fields[index->last[slot]].next = index->nr_fields;
 
-				p = ++q;
-			}
-			else
-			if (!memcmp((void *)p, (void *)"domain", 6))
-			{
-				char domain[128];
+		index->last[slot] = index->nr_fields;
+	}
 
-				p = ++q;
-				q = memchr(p, ';', (end  - p));
-				if (!q)
-					q = end;
+	++index->nr_fields;
 
-				memcpy((void *)domain, (void *)p, (q - p));
-				domain[q - p] = 0;
+	return 0;
+}
 
-				memcpy((void *)cookie->for_domain, (void *)p, (q - p));
-				cookie->for_domain[q - p] = 0;
+/**
+ * http_header_field_value - the value of the Ith header field
+ * @len: set to its length; the value is not nul-terminated
+ */
+static char *
+http_header_field_value(struct http_t *http, int i, size_t *len)
+{
+	struct http_header_field *field = &(HTTP_private(http))->headers.fields[i];
 
-				p = ++q;
-			}
-			else
-			if (!memcmp((void *)p, (void *)"path", 4))
-			{
-				char Path[128];
+	*len = field->value_len;
 
-				p = ++q;
-				q = memchr(p, ';', (end  - p));
-				if (!q)
-					q = end;
+	return http_rbuf(http).buf_head + field->value_off;
+}
 
-				memcpy((void *)Path, (void *)p, (q - p));
-				Path[q - p] = 0;
+/**
+ * http_header - the value of the first header field in SLOT, or NULL
+ * @len: set to its length; the value is not nul-terminated
+ */
+static char *
+http_header(struct http_t *http, enum http_header_slot slot, size_t *len)
+{
+	int i = (HTTP_private(http))->headers.first[slot];
 
-				memcpy((void *)cookie->for_path, (void *)p, (q - p));
-				cookie->for_path[q - p] = 0;
+	if (i < 0)
+		return NULL;
 
-				p = ++q;
-			}
-			else
-			{
-				p = ++q;
-				q = memchr(p, ';', (end - p));
-				if (!q)
-					break;
+	return http_header_field_value(http, i, len);
+}
 
-				p = ++q;
-			}
-		} // while (1)
+/**
+ * parse_cookies - put the cookies the server sent us in the cookie jar
+ */
+static void
+parse_cookies(struct http_t *http)
+{
+	assert(http);
 
-		_log(
-			"Cookie\n\n"
-			"value: %s\n"
-			"expires timestamp: %ld\n"
-			"for domain: %s\n"
-			"for path: %s\n",
-			cookie->whole_cookie,
-			cookie->expires,
-			cookie->for_domain,
-			cookie->for_path);
+	struct HTTP_private *private = HTTP_private(http);
+	int field;
+	char *value;
+	size_t len;
 
-		bucket = bucket->next;
+	for (field = private->headers.first[HDR_SET_COOKIE]; field >= 0; field = private->headers.fields[field].next)
+	{
+		value = http_header_field_value(http, field, &len);
+		COOKIE_set(http->host, http->page, value, len);
 	}
 
 	return;
 }
 
 /**
- * Parse the response header fields into a hash bucket.
+ * Index the response header fields in the read buffer.
  */
 static int
 parse_response_header_1_1(struct http_t *http)
@@ -453,32 +561,27 @@ parse_response_header_1_1(struct http_t *http)
 	char *eoh = NULL; // end of header
 	char *p = NULL;
 	char *q = NULL;
-	char field_name[1024];
-	char field_value[2048];
+	char *e = NULL; // end of field name
 	struct HTTP_private *private = (struct HTTP_private *)http;
 
-	_log("\nBEGIN FIRST 10 BYTES OF HEADER:\n%*.*s\nEND FIRST 10 BYTES OF HEADER\n", 10, 10, buf->buf_head);
-	eoh = HTTP_EOH(buf);
-	eoh -= 2;
+	http_header_reset(&private->headers);
 
-	size_t hlen = (eoh - buf->buf_head);
+	_log("\nBEGIN FIRST 10 BYTES OF HEADER:\n%*.*s\nEND FIRST 10 BYTES OF HEADER\n", 10, 10, buf->buf_head);
 
-	if (2048 < hlen)
-	{
-		//_drain_socket(http); TODO
+	if (private->eoh_off && (size_t)private->eoh_off <= buf->data_len)
+		eoh = buf->buf_head + private->eoh_off;
+	else
+	if (!(eoh = HTTP_EOH(buf)))
 		return -1;
-	}
-
-	sol = buf->buf_head;
-
-	private->headers->reset(private->headers, 0);
 
-	assert(0 == private->headers->nr_buckets_used);
+	private->eoh_off = 0;
+	eoh -= 2;
 
 /*
  * Skip the initial line showing the status of the request (200 OK...)
  */
-	eol = memchr(sol, '\r', (eol - sol));
+	sol = buf->buf_head;
+	eol = memchr(sol, '\r', (eoh - sol));
 	if (!eol)
 		return -1;
 
@@ -491,97 +594,109 @@ parse_response_header_1_1(struct http_t *http)
 		if (!eol)
 			break;
 
-		p = sol;
-		q = memchr(p, ':', (eol - p));
+		e = memchr(sol, ':', (eol - sol));
 
-		if (!q)
+		if (!e)
 			break;
 
-		memcpy((void *)field_name, (void *)p, (q - p));
-		field_name[q - p] = 0;
-		to_lower_case(field_name);
-
-		p = ++q;
-
 	/*
-	 * XXX	Determine rule regarding more than one
-	 *	bit of WS between the ':' after the
-	 *	field name and the following field value.
+	 * The value is between P and Q, without
+	 * the whitespace around it.
 	 */
-		while (*p == ' ' && p < eol)
+		p = e + 1;
+
+		while ((*p == ' ' || *p == '\t') && p < eol)
 			++p;
 
-		if (p == eol)
-		{
-			break;
-		}
+		q = eol;
 
-		size_t value_len = (eol - p);
-		memcpy((void *)field_value, (void *)p, value_len);
-		field_value[value_len] = 0;
+		while (q > p && (q[-1] == ' ' || q[-1] == '\t'))
+			--q;
 
-		_log("Putting header field \"%s\" (%s) into hash table\n", field_name, field_value);
+		if (p < q)
+		{
+			_log("Header field \"%.*s\" (%.*s)\n", (int)(e - sol), sol, (int)(q - p), p);
 
-		/*
-		 * BUCKET_put_data(bucket_obj_t *bObj, char *key, void *data, size_t len, int flags);
-		 * Flags available:
-		 *
-		 * BUCKET_FL_NO_FREE
-		 *	If we allocated memory on the heap and copied the data from DATA,
-		 *	then we would pass this flag when freeing buckets.
-		 *
-		 * BUCKET_FL_NO_COPY
-		 *	If we use this flag, the data pointed to by DATA will not be copied.
-		 *	The value of the pointer in DATA itself will just be stored.
-		 *
-		 */
-		private->headers->put(private->headers, field_name, (void *)field_value, value_len, 0);
+			if (http_header_add(&private->headers, buf->buf_head, sol, (size_t)(e - sol), p, (size_t)(q - p)) < 0)
+			{
+				_log("More than %d header fields; ignoring the rest\n", HTTP_HEADER_FIELDS_MAX);
+				break;
+			}
+		}
 
 		sol = eol + 2;
-
-#ifdef DEBUG
-		bucket_t *bucket = private->headers->get(private->headers, field_name);
-		assert(bucket);
-
-		value_len = strlen(field_value);
-		char *k = private->headers->get_key(private->headers, (void *)field_value, value_len);
-		bucket_t *b = private->headers->get_bucket_from_list_for_value(bucket, (void *)field_value, value_len);
-
-		assert(!memcmp((void *)k, (void *)field_name, strlen(field_name)));
-		assert(!memcmp((void *)field_value, b->data, value_len));
-#endif
 	}
 
 	parse_cookies(http);
 	return 0;
 }
 
-#define HTTP_HEADER_BUFSIZE 8192
+#define HTTP_IOV(v, n, p, l) \
+do { \
+	(v)[(n)].iov_base = (void *)(p); \
+	(v)[(n)++].iov_len = (l); \
+} while (0)
+
+#define HTTP_IOV_STR(v, n, s) HTTP_IOV((v), (n), (s), sizeof(s) - 1)
+
+/**
+ * http_render_fixed_fields - render the request header fields that never change
+ * @http: our HTTP object
+ *
+ * Done once per connection (or when the host changes
+ * under us with a redirect); every GET then starts
+ * from a copy of them.
+ */
+static void
+http_render_fixed_fields(struct http_t *http)
+{
+	assert(http);
+
+	struct HTTP_private *private = HTTP_private(http);
+	size_t host_len = strlen(http->host);
+
+	if (private->request_fixed_len && !strcmp(private->request_host, http->host))
+		return;
+
+	if (host_len && http->host[host_len - 1] == '/')
+		--host_len;
+
+	private->request_fixed_len = (size_t)snprintf(private->request_fixed, HTTP_REQUEST_FIXED_MAX,
+			"User-Agent: %s\r\n"
+			"Accept: %s\r\n"
+			"Accept-Encoding: %s\r\n"
+			"Host: %.*s\r\n"
+			"Connection: keep-alive\r\n",
+			HTTP_USER_AGENT,
+			HTTP_ACCEPT,
+			CODING_ACCEPT_ENCODING,
+			(int)host_len, http->host);
+
+	assert(private->request_fixed_len < HTTP_REQUEST_FIXED_MAX);
+	strcpy(private->request_host, http->host);
+
+	return;
+}
 
 /**
  * HTTP 1.1
  * Build a request header
  *
  * @http HTTP object.
+ *
+ * The header is gathered into the write buffer from
+ * its parts (the request line, the fixed fields, and
+ * those particular to this request) in one pass.
  */
 int
 build_request_header_1_1(struct http_t *http)
 {
 	assert(http);
 
+	struct HTTP_private *private = HTTP_private(http);
 	buf_t *buf = &http->conn.write_buf;
-	buf_t tmp;
-	/*
-	 * Cannot use static memory since we
-	 * need to be thread-safe.
-	 */
-	//static char header_buf[4096];
-	char *header_buf = calloc(HTTP_ALIGN_SIZE(HTTP_HEADER_BUFSIZE), 1);
-
-	if (NULL == header_buf)
-		return -1;
-
-	buf_init(&tmp, HTTP_URL_MAX);
+	struct iovec iov[HTTP_REQUEST_IOV_MAX];
+	int nr = 0;
 /*
  * RFC 7230:
  *
@@ -605,52 +720,58 @@ build_request_header_1_1(struct http_t *http)
  * correct encoding present in the Location header.
  */
 
+	char conditional[(HTTP_VALIDATOR_MAX * 2) + 64];
+	char etag[HTTP_VALIDATOR_MAX];
+	char last_modified[HTTP_VALIDATOR_MAX];
+	int len = 0;
+
 	switch(http->verb)
 	{
 		case HEAD:
 
-		buf_append(&tmp, "https://");
-		buf_append(&tmp, http->host);
-		buf_append(&tmp, http->page);
-
-		sprintf(header_buf,
-			"HEAD %s HTTP/1.1\r\n"
-			"Host: %s\r\n"
-			"User-Agent: %s%s",
-			tmp.buf_head,
-			http->host,
-			HTTP_USER_AGENT, HTTP_EOH_SENTINEL);
+		HTTP_IOV_STR(iov, nr, "HEAD https://");
+		HTTP_IOV(iov, nr, http->host, strlen(http->host));
+		HTTP_IOV(iov, nr, http->page, strlen(http->page));
+		HTTP_IOV_STR(iov, nr, " HTTP/1.1\r\nHost: ");
+		HTTP_IOV(iov, nr, http->host, strlen(http->host));
+		HTTP_IOV_STR(iov, nr, "\r\nUser-Agent: " HTTP_USER_AGENT "\r\n");
 		break;
 
 		default:
 		case GET:
 
-		buf_append(&tmp, http->host);
+		http_render_fixed_fields(http);
 
-		if (*(tmp.buf_tail - 1) == '/')
-			buf_snip(&tmp, 1);
+	/*
+	 * If we archived this before, only ask
+	 * for it again if it has changed.
+	 */
+		etag[0] = last_modified[0] = 0;
 
-		sprintf(header_buf,
-			"GET %s HTTP/1.1\r\n"
-			"User-Agent: %s\r\n"
-			"Accept: %s\r\n"
-			"Host: %s\r\n"
-			"Connection: keep-alive%s",
-			http->URL,
-			HTTP_USER_AGENT,
-			HTTP_ACCEPT,
-			tmp.buf_head,
-			HTTP_EOH_SENTINEL);
-	}
+		if (http->getValidators && http->getValidators(http, http->URL, etag, last_modified) > 0)
+		{
+			if (etag[0])
+				len += snprintf(conditional + len, sizeof(conditional) - len,
+						"If-None-Match: %.*s\r\n", HTTP_VALIDATOR_MAX - 1, etag);
 
-	buf_append(buf, header_buf);
+			if (last_modified[0])
+				len += snprintf(conditional + len, sizeof(conditional) - len,
+						"If-Modified-Since: %.*s\r\n", HTTP_VALIDATOR_MAX - 1, last_modified);
+		}
 
-	free(header_buf);
-	header_buf = NULL;
+		HTTP_IOV_STR(iov, nr, "GET ");
+		HTTP_IOV(iov, nr, http->URL, strlen(http->URL));
+		HTTP_IOV_STR(iov, nr, " HTTP/1.1\r\n");
+		HTTP_IOV(iov, nr, private->request_fixed, private->request_fixed_len);
+		HTTP_IOV(iov, nr, conditional, (size_t)len);
+	}
 
-	append_cookies_1_1(http);
+	assert(nr <= HTTP_REQUEST_IOV_MAX);
 
-	buf_destroy(&tmp);
+	if (buf_append_iov(buf, iov, nr) < 0
+	|| COOKIE_put_header(http->host, http->page, http->usingSecure, buf) < 0
+	|| buf_append_bytes(buf, HTTP_EOL, 2) < 0)
+		return -1;
 
 	return 0;
 }
@@ -698,49 +819,107 @@ check_target_URL(struct http_t *http, int wantSecure)
 	return;
 }
 
-int
-send_request_1_1(struct http_t *http)
+/**
+ * http_follow_known_redirects - skip to the end of any redirect chain we already know for HTTP->URL
+ * @http: our HTTP object
+ *
+ * Redirects found by any HTTP object are shared (see
+ * redirect_map.c). Only hops that stay on HTTP->host
+ * are taken, since the request goes out on this
+ * connection. Returns -1 if the URL is known to
+ * redirect to itself (or round in a loop).
+ */
+static int
+http_follow_known_redirects(struct http_t *http)
 {
 	assert(http);
 
-	//struct HTTP_private *private = (struct HTTP_private *)http;
+	char next[HTTP_URL_MAX];
+	char host[HTTP_HOST_MAX+1];
+	size_t len;
+	int hops;
 
-	buf_t *buf = &http->conn.write_buf;
-	buf_clear(buf);
+	for (hops = 0; hops < REDIRECT_CHAIN_MAX; ++hops)
+	{
+		if (!REDIRECT_lookup(http->URL, next, sizeof(next)))
+			return 0;
 
-	check_target_URL(http, http->usingSecure);
+		if (!strcmp(next, http->URL))
+			return -1;
 
-/*
- * Check if this URL has a redirect URL that we cached.
+		if (!http->ops->URL_parse_host(next, host) || strcmp(host, http->host))
+			return 0;
+
+		len = strnlen(next, sizeof(next));
+
+		if (len >= HTTP_URL_MAX)
+			return 0;
+
+		_log("Known redirect: %s -> %s\n", http->URL, next);
+
+		memcpy(http->URL, next, len);
+		http->URL[len] = 0;
+		http->URL_len = len;
+		http->ops->URL_parse_page(http->URL, http->page);
+	}
+
+	return -1;
+}
+
+/**
+ * prepare_request_1_1 - build the request header for HTTP->URL in the write buffer
+ * @http: our HTTP object
  *
- * If the redirect we received was the exact same URL
- * as the redirected one, we put the empty string ""
- * in as the data for the key. Check for zero length
- * and return -1 if we find it.
+ * Returns -1 if we already know the URL only
+ * redirects to itself and should not be sent.
  */
-	struct HTTP_private *private = (struct HTTP_private *)http;
-	bucket_t *bucket = private->redirects->get(private->redirects, http->URL);
-	if (bucket)
-	{
-		if (0 < strlen((char *)bucket->data))
-			memcpy(http->URL, bucket->data, bucket->data_len);
-		else
-			return -1;
-	}
+static int
+prepare_request_1_1(struct http_t *http)
+{
+	assert(http);
+
+	buf_t *buf = &http->conn.write_buf;
+	buf_clear(buf);
+
+	check_target_URL(http, http->usingSecure);
+
+	if (http_follow_known_redirects(http) < 0)
+		return -1;
+
 	//set_verb(http, GET);
-	build_request_header_1_1(http);
+	if (build_request_header_1_1(http) < 0)
+		return -1;
 
 #ifdef DEBUG
 	_log("Request header:\n\n");
 	_log(buf->buf_head);
 #endif
 
+	return 0;
+}
+
+int
+http_write_buf(struct http_t *http, buf_t *buf)
+{
+	assert(http);
+	assert(buf);
+
+/*
+ * Left without a connection by a reconnect that failed.
+ */
+	if (http_socket(http) < 0)
+	{
+		_log("No connection to %s\n", http->host);
+		return -1;
+	}
+
 	if (http->usingSecure)
 	{
 		if (buf_write_tls(http->conn.ssl, buf) < 0)
 		{
 			_log("Error writing to SSL socket\n");
-			goto fail;
+			TLS_session_forget(http->host);
+			return -1;
 		}
 	}
 	else
@@ -748,1474 +927,3477 @@ send_request_1_1(struct http_t *http)
 		if (buf_write_socket(http->conn.sock, buf) < 0)
 		{
 			_log("Error writing to socket\n");
-			goto fail;
+			return -1;
 		}
 	}
 
 	return 0;
-
-fail:
-	return -1;
 }
 
-#define CYCLES_MAX 100000000
+int
+send_request_1_1(struct http_t *http)
+{
+	assert(http);
+
+	if (prepare_request_1_1(http) < 0)
+		return -1;
 
-static int
-read_until_eoh(struct http_t *http, char **p)
+	return http_write_buf(http, &http->conn.write_buf);
+}
+
+/**
+ * HTTP_pipeline_send - write several GET requests back to back
+ * @http: our HTTP object
+ * @URLs: the URLs to request; all should be on the same host
+ * @nr: number of URLs (at most HTTP_PIPELINE_MAX are sent)
+ *
+ * The requests go out in a single write. Their responses
+ * are then collected, in the same order, with
+ * HTTP_pipeline_recv(). On an HTTP/2 connection each
+ * request gets its own stream, so a slow response does
+ * not hold up the ones behind it.
+ *
+ * If the first URL is for another host we move the
+ * connection there first, and we reconnect if the
+ * connection is gone (or, with HTTP/2, the server sent
+ * GOAWAY). Any URL that cannot be sent (on a host other
+ * than the first's, known to redirect to itself, or
+ * with no stream free for it) is not lost: it is handed
+ * back by HTTP_pipeline_unanswered().
+ *
+ * Returns the number of requests in flight, or -1 if
+ * the write failed (we will have tried to reconnect;
+ * http_socket() is -1 if that failed too).
+ */
+int
+HTTP_pipeline_send(struct http_t *http, char **URLs, int nr)
 {
 	assert(http);
+	assert(URLs);
 
-	ssize_t n;
-	int is_http = 0;
-	int bytes = 0;
-	buf_t *buf = &http->conn.read_buf;
-	register int cycles = 0;
+	struct HTTP_private *private = HTTP_private(http);
+	char host[HTTP_HOST_MAX+1];
+	buf_t batch;
+	uint32_t stream;
+	int rv = 0;
+	int i;
 
-	_log("In read_until_eoh\n");
+	private->pipeline_next = 0;
+	private->nr_pipelined = 0;
+	private->nr_skipped = 0;
+	private->pipeline_failed = 0;
 
-	while (!(*p))
+	if (nr > HTTP_PIPELINE_MAX)
+		nr = HTTP_PIPELINE_MAX;
+
+	if (nr)
 	{
-		++cycles;
+		assert(strlen(URLs[0]) < HTTP_URL_MAX);
+
+		strcpy(http->URL, URLs[0]);
+		http_check_host(http);
 
-		if (cycles >= CYCLES_MAX)
+		if (http_socket(http) < 0
+		|| (HTTP_VERSION_2_0 == http->version && (private->h2->goaway || private->h2->dead)))
 		{
-			return HTTP_OPERATION_TIMEOUT;
+			_log("Connection to %s is gone: reconnecting\n", http->host);
+
+			if (http_reconnect(http) < 0)
+			{
+				_log("Failed to reconnect to %s\n", http->host);
+				return -1;
+			}
 		}
+	}
 
-		if (http->usingSecure)
-			n = buf_read_tls(http_tls(http), buf, HTTP_SMALL_READ_BLOCK);
-		else
-			n = buf_read_socket(http_socket(http), buf, HTTP_SMALL_READ_BLOCK);
+	clear_struct(&batch);
+	if (buf_init(&batch, HTTP_DEFAULT_WRITE_BUF_SIZE) < 0)
+		return -1;
 
-		if (n == -1)
+	set_verb(http, GET);
+
+	for (i = 0; i < nr; ++i)
+	{
+		assert(strlen(URLs[i]) < HTTP_URL_MAX);
+
+		http->ops->URL_parse_host(URLs[i], host);
+		if (strcmp(host, http->host))
 		{
-			_log("buf_read_%s returned -1...\n", http->usingSecure ? "tls" : "socket");
-			return -1;
+			_log("Not pipelining %s: not for %s\n", URLs[i], http->host);
+			goto skip;
 		}
 
-		switch(n)
-		{
-			case 0:
+		strcpy(http->URL, URLs[i]);
+		http->ops->URL_parse_page(http->URL, http->page);
 
-				//_log("Read 0 bytes: continuing\n");
-				continue;
-				break;
+		if (prepare_request_1_1(http) < 0)
+			goto skip;
 
-			default:
+	/*
+	 * A request we have no stream for (the server's
+	 * concurrency limit) gets 0 and was not sent.
+	 */
+		if (HTTP_VERSION_2_0 == http->version)
+		{
+			if (!(stream = http2_submit_request(http)))
+				goto skip;
 
-				_log("read %d bytes\n", n);
+			private->pipeline_stream[private->nr_pipelined] = stream;
+		}
+		else
+		if (buf_append(&batch, http->conn.write_buf.buf_head) < 0)
+		{
+			goto skip;
+		}
 
-				bytes += (int)n;
+		strcpy(private->pipeline[private->nr_pipelined++], http->URL);
+		continue;
 
-				if (!strstr(buf->buf_head, "HTTP/") && strncmp("\r\n", buf->buf_head, 2))
-					goto out;
+	skip:
 
-				*p = strstr(buf->buf_head, HTTP_EOH_SENTINEL);
+	/*
+	 * There are never more sent and skipped
+	 * together than there are slots.
+	 */
+		++private->nr_skipped;
+		strcpy(private->pipeline[HTTP_PIPELINE_MAX - private->nr_skipped], URLs[i]);
+	}
 
-				if (*p)
-				{
-					is_http = 1;
-					goto out;
-				}
-		}
+	if (private->nr_pipelined)
+	{
+		if (HTTP_VERSION_2_0 == http->version)
+			rv = HTTP2_flush(http, private->h2);
+		else
+			rv = http_write_buf(http, &batch);
 	}
 
-out:
+	buf_destroy(&batch);
 
-	if (is_http)
+	if (rv < 0)
 	{
-		assert(!strncmp(HTTP_EOH_SENTINEL, *p, strlen(HTTP_EOH_SENTINEL)));
-		*p += strlen(HTTP_EOH_SENTINEL);
+		private->nr_pipelined = 0;
+		private->nr_skipped = 0;
+		goto fallback;
 	}
 
-	_log("Returning %d bytes\n", bytes);
-	return bytes;
-}
+	_log("Pipelined %d requests (%d not sent)\n", private->nr_pipelined, private->nr_skipped);
 
-#ifdef DEBUG
-static void
-__dump_buf(buf_t *buf)
-{
-	assert(buf);
+	return private->nr_pipelined;
 
-	int fd = -1;
+fallback:
 
-	fd = open("./DUMPED_BUF.LOG", O_RDWR|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
-	
-	if (fd != -1)
-	{
-		buf_write_fd(fd, buf);
-		sync();
-		close(fd);
-		fd = -1;
-	}
+	if (HTTP_VERSION_2_0 != http->version)
+		http->pipelineDepth = 0;
 
-	return;
+	if (http_reconnect(http) < 0)
+		_log("Failed to reconnect to %s\n", http->host);
+
+	return -1;
 }
-#endif
 
-static ssize_t
-read_bytes(struct http_t *http, size_t toread)
+/**
+ * HTTP_pipeline_recv - receive the response to the next pipelined request
+ * @http: our HTTP object
+ *
+ * HTTP->URL, host and page are set to those of the
+ * request being answered. Redirects are not followed
+ * here (the connection has other responses queued on
+ * it); the 3xx is returned with HTTP->URL set to the
+ * new location.
+ *
+ * If the server closes the connection or we can't
+ * make sense of a response, pipelining is switched
+ * off for this object (HTTP/1.1 only), we reconnect,
+ * and the requests that went unanswered can be had
+ * with HTTP_pipeline_unanswered().
+ */
+int
+HTTP_pipeline_recv(struct http_t *http)
 {
 	assert(http);
-	assert(toread > 0);
-
-	ssize_t n;
-	size_t read = 0;
-	size_t r = toread;
-	buf_t *buf = &http->conn.read_buf;
-	register int cycles = 0;
 
-/*
- * XXX
- *
- * CYCLES_MAX is our crude way of
- * deciding we have timed out.
- */
-	while (r)
-	{
-		++cycles;
-		if (cycles > CYCLES_MAX)
-			break;
+	struct HTTP_private *private = HTTP_private(http);
+	int rv;
 
-		if (http->usingSecure)
-			n = buf_read_tls(http_tls(http), buf, r);
-		else
-			n = buf_read_socket(http_socket(http), buf, r);
+	if (!private->nr_pipelined || private->pipeline_failed)
+		return -1;
 
-		if (n < 0)
-			return -1;
-		else
-		if (!n)
-			continue;
-		else
+	if (HTTP_VERSION_2_0 == http->version)
+	{
+		if (!(private->h2_stream = private->pipeline_stream[private->pipeline_next]))
 		{
-			r -= n;
-			read += n;
+			_log("No stream for pipelined request\n");
+			goto fallback;
 		}
 	}
 
-	return read;
-}
+	strcpy(http->URL, private->pipeline[private->pipeline_next]);
+	http->URL_len = strlen(http->URL);
 
-#define HTTP_MAX_CHUNK_STR 10
+	http->ops->URL_parse_host(http->URL, http->host);
+	http->ops->URL_parse_page(http->URL, http->page);
 
-/*
- * In chunked transfer encoding, the data is sent in chunks
- * with each chunk being preceded with the number of bytes
- * of the chunk (this is used for pages that are created
- * dynamically and therefore the HTTP server cannot send
- * a Content-Length header.
- *
- * The data is encoding thus:
- *
- * \r\n[CHUNKSIZE]\r\n...DATA...\r\n[CHUNKSIZE]\r\n...DATA...\r\n0\r\n
- *
- */
-static void
-read_until_next_chunk_size(struct http_t *http, buf_t *buf, char **cur_pos)
-{
-	assert(http);
-	assert(buf);
-	assert(cur_pos);
-	assert(buf_integrity(buf));
+	private->pipelining = 1;
+	rv = http->ops->recv_response(http);
+	private->pipelining = 0;
 
-	off_t cur_pos_off = (*cur_pos - buf->buf_head);
-	char *q;
-	char *tail = buf->buf_tail;
+	if (rv < 0)
+	{
+		_log("Pipelined response failed: falling back to serial requests\n");
+		goto fallback;
+	}
+
+	++private->pipeline_next;
+	--private->nr_pipelined;
 
 /*
- * We want to produce the following state:
- *
- *        \r\n[CHUNKSIZE]\r\n
- *        ^
- *     CUR_POS
- *
- * We may already have this in our buffer
- * and therefore simply need to point
- * CUR_POS accordingly.
- *
- * Otherwise, do small reads until
- * we have the metadata.
+ * The rest of the responses went with the
+ * connection; we already have a new one.
  */
+	if (private->body_dropped && private->nr_pipelined)
+	{
+		_log("Dropped the connection with %d pipelined requests outstanding\n", private->nr_pipelined);
+		private->pipeline_failed = 1;
+		return rv;
+	}
 
-	if (*cur_pos < tail)
+	if (http_connection_closed(http))
 	{
-		if (**cur_pos == 0x0d)
+		if (private->nr_pipelined)
 		{
-			while ((**cur_pos == 0x0d || **cur_pos == 0x0a) && *cur_pos < tail)
-				++(*cur_pos);
-
-			if (*cur_pos != tail)
-			{
-				q = *cur_pos;
-
-				while (*q != 0x0d && q < tail)
-					++q;
-
-			/*
-			 * Then we don't need to do
-			 * anymore reads. We have already
-			 * got \r\n[CHUNKSIZE]\r\n in the
-			 * buffer.
-			 *
-			 * Adjust CUR_POS to point to the
-			 * carriage return immediately after
-			 * the final byte of the previous
-			 * chunk.
-			 */
-				if (q != tail)
-				{
-					*cur_pos -= 2;
-					return;
-				}
-			}
+			_log("Server closing connection with %d pipelined requests outstanding\n", private->nr_pipelined);
+			goto fallback;
 		}
+
+		if (http_reconnect(http) < 0)
+			return -1;
 	}
 
+	return rv;
+
+fallback:
+
+	private->pipeline_failed = 1;
+
 /*
- * We enter this function having pointed CUR_POS
- * to START_OF_PREVIOUS_CHUNK + PREVIOUS_CHUNK_SIZE.
- * We need at least two bytes here to get the \r\n
- * at the start of the metadata.
- *
- * NB - everytime we do a read, the location of
- * our buffer on the heap may change due to a
- * transparent realloc(). So we need to re-point
- * TAIL and *CUR_POS afterwards.
- */
-	read_bytes(http, 2);
-	*cur_pos = (buf->buf_head + cur_pos_off);
-	tail = buf->buf_tail;
-	*cur_pos += 2;
-	cur_pos_off += 2;
+ * Pipelining on HTTP/1.1 is what failed; on HTTP/2
+ * it was just the connection, and a new one will do.
+ */
+	if (HTTP_VERSION_2_0 != http->version)
+		http->pipelineDepth = 0;
 
-	while (1)
-	{
-		read_bytes(http, 1);
-		tail = buf->buf_tail;
-		*cur_pos = (buf->buf_head + cur_pos_off);
-		q = memchr(*cur_pos, 0x0a, (tail - *cur_pos));
-		if (q)
-		{
-			*cur_pos -= 2;
-			break;
-		}
-	}
+	if (http_reconnect(http) < 0)
+		_log("Failed to reconnect to %s\n", http->host);
 
-	return;
+	return -1;
 }
 
 /**
- * Obsolete from HTTP 2.0
- *
- * Receive an unknown amount of data from the
- * webserver (dynamically created page which
- * therefore had no Content-Length header).
- * This is common for example with pages that
- * use a script in a CGI bin and so the length
- * of the output data is variable.
- *
- * Data is sent in chunks, with each chunk
- * preceded by metadata indicating the size
- * of the chunk of data to receive.
- *
- * Ends with sequence \r\n0\r\n
+ * HTTP_pipeline_unanswered - take the next pipelined URL that got no response
  *
+ * Those that were never sent come after those that
+ * were. Returns NULL when there are none left. The
+ * string is only valid until the next
+ * HTTP_pipeline_send().
  */
-static size_t
-do_chunked_recv(struct http_t *http)
+char *
+HTTP_pipeline_unanswered(struct http_t *http)
 {
 	assert(http);
 
-	char *p;
-	char *e;
-	off_t chunk_offset;
-	buf_t *buf = &http->conn.read_buf;
-	size_t chunk_size;
-	size_t save_size;
-	size_t overread;
-	size_t total_bytes = 0;
-	static char tmp[HTTP_MAX_CHUNK_STR];
-	char *t;
-	size_t range;
-#if 0
-#ifndef DEBUG
-	char *t;
-	size_t range;
-#else
-	int chunk_nr = 0;
-#endif
-#endif
-
-	p = HTTP_EOH(buf);
+	struct HTTP_private *private = HTTP_private(http);
 
-	while (!p)
+	if (private->nr_pipelined)
 	{
-		total_bytes += read_bytes(http, 1);
-		p = HTTP_EOH(buf);
+		--private->nr_pipelined;
+		return private->pipeline[private->pipeline_next++];
 	}
 
-	if (!p)
-	{
-		fprintf(stderr, "do_chunked_recv: failed to find end of header sentinel\n");
-		return -1;
-	}
+	if (private->nr_skipped)
+		return private->pipeline[HTTP_PIPELINE_MAX - private->nr_skipped--];
 
-	read_until_next_chunk_size(http, buf, &p);
+	return NULL;
+}
 
-	while (1)
-	{
 /*
- * Skip the first \r\n in "\r\nchunk_size\r\n"
- * and collapse the buffer so we now have
- * "chunk_size\r\n"
+ * ================================================================================================
+ *
+ * Readiness-driven receive engine.
+ *
+ * The sockets are non-blocking once we start reading the response. Rather
+ * than spinning on buf_read_socket()/buf_read_tls() until something turns
+ * up, we sleep in epoll_wait() until the kernel tells us there is data (or
+ * the peer hung up), bounded by a deadline on the monotonic clock.
+ *
+ * ================================================================================================
  */
-		t = p;
-		SKIP_CRNL(p);
 
-		range = (p - t);
-		if (range)
-		{
-			buf_collapse(buf, (off_t)(t - buf->buf_head), range);
-			p = t;
-		}
-#if 0
-		++chunk_nr;
-		_log("Chunk #%d\n", chunk_nr);
-		SKIP_CRNL(p);
-#endif
+#define HTTP_EPOLL_EVENTS (EPOLLIN|EPOLLRDHUP)
 
-		e = memchr(p, 0x0d, HTTP_MAX_CHUNK_STR);
+/**
+ * http_set_deadline - set DEADLINE to SECS seconds from now (monotonic)
+ */
+static void
+http_set_deadline(struct timespec *deadline, int secs)
+{
+	clock_gettime(CLOCK_MONOTONIC, deadline);
+	deadline->tv_sec += secs;
 
-		if (!e)
-		{
-			_log("%s: failed to find next carriage return\n", __func__);
+	return;
+}
 
-#ifdef DEBUG
-			int i;
+/**
+ * http_ms_until - milliseconds remaining until DEADLINE (0 if passed)
+ */
+static int
+http_ms_until(struct timespec *deadline)
+{
+	struct timespec now;
+	long ms;
 
-			__dump_buf(buf);
+	clock_gettime(CLOCK_MONOTONIC, &now);
 
-			p -= 32;
+	ms = ((deadline->tv_sec - now.tv_sec) * 1000) +
+		((deadline->tv_nsec - now.tv_nsec) / 1000000);
 
-			for (i = 0; i < 64; ++i)
-				_log("%02hhx ", p[i]);
+	if (ms < 0)
+		return 0;
 
-			_log("\n");
+	return (int)ms;
+}
 
-			_log("%.*s\n", (int)64, p);
+/**
+ * http_start_transfer - start the clock on receiving a response
+ */
+static void
+http_start_transfer(struct http_t *http)
+{
+	http_set_deadline(&(HTTP_private(http))->transfer_deadline, http->timeouts.transfer);
 
-			_log(
-					"BUF_SIZE=%lu bytes\n"
-					"END - DATA = %lu bytes\n"
-					"TAIL - HEAD = %lu bytes\n"
-					"HEAD @ %p\n"
-					"TAIL @ %p\n"
-					"END @ %p\n",
-					buf->buf_size,
-					(buf->buf_end - buf->data),
-					(buf->buf_tail - buf->buf_head),
-					buf->buf_head,
-					buf->buf_tail,
-					buf->buf_end);
-#endif
+	return;
+}
 
-			return -1;
-		}
-
-/*
- * Now we have chunk_size\r\n
- *             ^         ^
- *             p         e
+/**
+ * http_phase_deadline - set DEADLINE to SECS seconds from now,
+ * but no later than the end of the current transfer
  */
-		strncpy(tmp, p, (e - p));
-		tmp[e - p] = 0;
+static void
+http_phase_deadline(struct http_t *http, struct timespec *deadline, int secs)
+{
+	struct timespec *limit = &(HTTP_private(http))->transfer_deadline;
 
-		chunk_size = strtoul(tmp, NULL, 16);
+	http_set_deadline(deadline, secs);
 
-#ifdef DEBUG
-		_log("%sCHUNK SIZE=%lu BYTES%s\n", COL_ORANGE, chunk_size, COL_END);
-#endif
+	if (deadline->tv_sec > limit->tv_sec ||
+	(deadline->tv_sec == limit->tv_sec && deadline->tv_nsec > limit->tv_nsec))
+		*deadline = *limit;
 
-		if (!chunk_size)
-		{
-/*
- * Then we just dealt with the last chunk and there are no more to come.
- * Collapse the buffer to get rid of the final "0\r\n" sequence.
+	return;
+}
+
+/**
+ * http_wait_socket - wait for the socket to be ready for EVENTS (POLLIN/POLLOUT)
+ *
+ * For connecting and the TLS handshake, where we may
+ * need to wait for writability, which the epoll set
+ * does not watch for. Returns 1 if ready, 0 if DEADLINE
+ * passed, -1 on error.
  */
-			--p;
-			buf_collapse(buf, (off_t)(p - buf->buf_head), (buf->buf_tail - p));
-			break;
+static int
+http_wait_socket(struct http_t *http, short events, struct timespec *deadline)
+{
+	struct pollfd pfd;
+	int rv;
+
+	pfd.fd = http_socket(http);
+	pfd.events = events;
+	pfd.revents = 0;
+
+	while ((rv = poll(&pfd, 1, http_ms_until(deadline))) < 0)
+	{
+		if (errno != EINTR)
+		{
+			_log("%s: poll failed (%s)\n", __func__, strerror(errno));
+			return -1;
 		}
+	}
 
-/*
- * Save the chunk size here because below we may find we already received
- * some of the chunk data, so we will do chunk_size - overread, but we
- * later need to calculate the position BUFFER START + CHUNK OFFSET +
- * CHUNK SIZE, so we need to save this.
- */
-		save_size = chunk_size;
-		total_bytes += save_size;
+	return (rv > 0);
+}
 
-/*
- * Do not use SKIP_CRNL() here, because the first few bytes of data
- * after the \r\nCHUNK_SIZE\r\n could well be one or more \r / \n
- * chars. This would result in jumping too far when we go forward
- * CHUNK_SIZE bytes from start of the chunk data.
+/**
+ * http_epoll_register - add the connection's socket to our epoll set
+ * @http: our HTTP object
+ *
+ * The epoll instance lives as long as the HTTP object. Closing
+ * the socket on disconnect removes it from the set, so this
+ * must be called again after every (re)connect.
  */
-		e += 2;
+static int
+http_epoll_register(struct http_t *http)
+{
+	assert(http);
 
-		buf_collapse(buf, (off_t)(p - buf->buf_head), (e - p));
-		e = p;
+	struct epoll_event ev;
 
-/*
- * Save the offset from the start of the buffer of the chunk data,
- * since reading more data into the buffer can result in a
- * realloc(), which may move our buffer data elsewhere on the heap.
- * So use this to make sure our pointer is pointing in the right
- * place on the heap by doing start of buffer + offset later.
- */
-		chunk_offset = (e - buf->buf_head);
-		overread = (buf->buf_tail - e);
+	if (http->conn.epoll_fd < 0)
+	{
+		http->conn.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
 
-/*
- * Check if we already received some of the chunk data.
- */
-		if (overread >= chunk_size)
-		{
-			p = (e + save_size);
-			read_until_next_chunk_size(http, buf, &p);
-		}
-		else
+		if (http->conn.epoll_fd < 0)
 		{
-			chunk_size -= overread;
+			_log("%s: epoll_create1 failed (%s)\n", __func__, strerror(errno));
+			return -1;
 		}
+	}
 
-		read_bytes(http, chunk_size);
-
-#if 0
-/*
- * Every now and again, we get stuck trying to read more bytes
- * (somehow) even though we already actually have gotten all
- * the data (we have </html>[\r\n]). So just break if we have
- * the closing html tag.
- */
-		if (strstr(buf->buf_head, "</html>"))
-			break;
-#endif
+	clear_struct(&ev);
+	ev.events = HTTP_EPOLL_EVENTS;
+	ev.data.fd = http_socket(http);
 
-/*
- * After this, P should be pointing to where the initial
- * \r is/will be in the "\r\nchunk_size\r\n" sequence.
- */
-		p = (buf->buf_head + chunk_offset + save_size);
-		read_until_next_chunk_size(http, buf, &p);
+	if (epoll_ctl(http->conn.epoll_fd, EPOLL_CTL_ADD, http_socket(http), &ev) < 0)
+	{
+		if (errno != EEXIST)
+		{
+			_log("%s: epoll_ctl failed (%s)\n", __func__, strerror(errno));
+			return -1;
+		}
 	}
 
-	_log("Returning %lu from %s\n", total_bytes, __func__);
-	return total_bytes;
+	return 0;
 }
 
 /**
- * Extract the Location header field from header
- * and set the PAGE and HOST values in http object.
+ * http_wait_readable - sleep until there is something to read
+ * @http: our HTTP object
+ * @deadline: absolute monotonic time after which we give up
+ * @hup: set to 1 if the peer has shut down its side
  *
- * @http The HTTP object
+ * Returns 1 if readable, 0 if DEADLINE passed, -1 on error.
  */
-static int
-set_new_location(struct http_t *http)
+int
+http_wait_readable(struct http_t *http, struct timespec *deadline, int *hup)
 {
 	assert(http);
+	assert(deadline);
 
-	struct HTTP_private *private = (struct HTTP_private *)http;
-#ifdef DEBUG
-	_log("Dumping HTTP response header fields\n");
-	BUCKET_dump_all(private->headers);
-	_log("Finished dumping HTTP response header fields\n");
-#endif
-	bucket_t *bucket = private->headers->get(private->headers, "location");
-
-	if (NULL == bucket)
-		return -1;
+	struct epoll_event ev;
+	int nr_events;
 
-	assert(bucket->data_len < HTTP_URL_MAX);
-	strcpy(http->URL, (char *)bucket->data);
+/*
+ * OpenSSL may already have decrypted data sitting
+ * in its buffer which epoll knows nothing about.
+ */
+	if (http->usingSecure && http_tls(http) && SSL_pending(http_tls(http)) > 0)
+		return 1;
 
-	_log("Got new location: %s\n", (char *)bucket->data);
+	if (http->conn.epoll_fd < 0 && http_epoll_register(http) < 0)
+		return -1;
 
-	if (!http->ops->URL_parse_host(http->URL, http->host))
+	while (1)
 	{
-		_log("%s: failed to parse HOST from URL\n", __func__);
-		return -1;
-	}
+		nr_events = epoll_wait(http->conn.epoll_fd, &ev, 1, http_ms_until(deadline));
 
-	_log("Extracted host: %s\n", http->host);
+		if (nr_events < 0)
+		{
+			if (errno == EINTR)
+				continue;
 
-	if (!http->ops->URL_parse_page(http->URL, http->page))
-	{
-		_log("%s: failed to parse page from URL\n", __func__);
-		return -1;
+			_log("%s: epoll_wait failed (%s)\n", __func__, strerror(errno));
+			return -1;
+		}
+
+		break;
 	}
 
-	_log("Extracted page: %s\n", http->page);
+	if (!nr_events)
+		return 0;
 
-	return 0;
+	if (hup && (ev.events & (EPOLLRDHUP|EPOLLHUP|EPOLLERR)))
+		*hup = 1;
+
+	return 1;
 }
 
 /**
- * http_set_sock_non_blocking - set the O_NONBLOCK flag for socket
+ * http_recv_into - read from the connection, sleeping while there is nothing to read
  * @http: our HTTP object
+ * @buf: buffer to append to
+ * @toread: number of bytes wanted (0 == whatever is available)
+ * @deadline: absolute monotonic time after which we give up
+ *
+ * Returns the number of bytes read (> 0), 0 if the peer closed
+ * the connection, -1 on error, or HTTP_OPERATION_TIMEOUT.
  */
-static void
-http_set_sock_non_blocking(struct http_t *http)
+ssize_t
+http_recv_into(struct http_t *http, buf_t *buf, size_t toread, struct timespec *deadline)
 {
-	int sock_flags = fcntl(http->conn.sock, F_GETFL);
+	assert(http);
+	assert(buf);
 
-	if (!(sock_flags & O_NONBLOCK))
+	ssize_t n;
+	int hup = 0;
+	int rv;
+
+	while (1)
 	{
-		sock_flags |= O_NONBLOCK;
-		fcntl(http->conn.sock, F_SETFL, sock_flags);
+		if (http->usingSecure)
+			n = buf_read_tls(http_tls(http), buf, toread);
+		else
+			n = buf_read_socket(http_socket(http), buf, toread);
 
-		http->conn.sock_nonblocking = 1;
+		if (n != 0)
+			return n;
+
+	/*
+	 * Told the peer hung up and still nothing to read.
+	 */
+		if (hup)
+			return 0;
+
+		rv = http_wait_readable(http, deadline, &hup);
+
+		if (rv < 0)
+			return -1;
+		else
+		if (!rv)
+			return HTTP_OPERATION_TIMEOUT;
 	}
+}
 
-	return;
+static ssize_t
+http_recv_wait(struct http_t *http, size_t toread, struct timespec *deadline)
+{
+	return http_recv_into(http, &http->conn.read_buf, toread, deadline);
 }
 
 /**
- * http_set_ssl_non_blocking - set the READ file descriptor as non blocking
+ * http_stash_overread - keep what we read past the end of the current response
  * @http: our HTTP object
+ * @end: first byte after the response in the read buffer
+ *
+ * With pipelined requests (or a server that sent a
+ * response in the same packet as the previous one),
+ * the bytes after END are the start of the next
+ * response. Move them aside so they are neither
+ * archived with this page nor lost.
  */
 static void
-http_set_ssl_non_blocking(struct http_t *http)
+http_stash_overread(struct http_t *http, char *end)
 {
-	if (!http->conn.ssl)
+	assert(http);
+	assert(end);
+
+	struct HTTP_private *private = HTTP_private(http);
+	buf_t *buf = &http->conn.read_buf;
+	size_t over;
+
+	if (end >= buf->buf_tail)
 		return;
 
-	int rsock = SSL_get_rfd(http->conn.ssl);
-	int flags = fcntl(rsock, F_GETFL);
+	over = (buf->buf_tail - end);
 
-	if (!(flags & O_NONBLOCK))
-	{
-		flags |= O_NONBLOCK;
-		fcntl(rsock, F_SETFL, flags);
+	buf_pull_tail(&private->carry, over);
+	memcpy(private->carry.buf_tail - over, end, over);
 
-		http->conn.ssl_nonblocking = 1;
-	}
+	buf_snip(buf, over);
+
+	_log("Stashed %lu bytes of the next response\n", over);
 
 	return;
 }
 
+/**
+ * http_take_carry - start the read buffer off with any stashed bytes
+ */
 static void
-_drain_socket(struct http_t *http)
+http_take_carry(struct http_t *http)
 {
 	assert(http);
 
-	ssize_t ret = 0;
-	size_t block = 1024;
+	struct HTTP_private *private = HTTP_private(http);
+	buf_t *buf = &http->conn.read_buf;
+	size_t len = private->carry.data_len;
 
-	http_set_ssl_non_blocking(http);
-	http_set_sock_non_blocking(http);
+	if (!len)
+		return;
 
-	_log("Draining socket\n");
-	while (1)
-	{
-		ret = read_bytes(http, block);
-		if (ret < block || 0 == ret)
-			break;
-		_log("Drained %ld bytes from socket\n", ret);
-	}
+	buf_pull_tail(buf, len + 1);
+	buf_push_tail(buf, 1);
+	memcpy(buf->buf_head, private->carry.buf_head, len);
+	BUF_NULL_TERMINATE(buf);
+
+	buf_clear(&private->carry);
 
 	return;
 }
 
 /**
- * recv_response_1_1 - receive HTTP response.
- * @http HTTP object
+ * http_skip_leading_crnl - drop a CRLF left over from the previous message
+ *
+ * e.g., the last CRLF of a chunked body that was
+ * still in flight when that response was done.
  */
-int
-recv_response_1_1(struct http_t *http)
+static void
+http_skip_leading_crnl(buf_t *buf)
 {
-	assert(http);
+	size_t skip = 0;
 
-	char *p = NULL;
-	size_t clen;
-	size_t overread;
-	ssize_t bytes;
-	int retVal = -1;
-	int code = 0;
-	int total_bytes = 0;
-	int needResend = 0;
-	char tmpURL[HTTP_URL_MAX];
-	//http_header_t *content_len = NULL;
-	//http_header_t *transfer_enc = NULL;
-	buf_t *buf = &http->conn.read_buf;
+	while (skip < buf->data_len && (buf->buf_head[skip] == 0x0d || buf->buf_head[skip] == 0x0a))
+		++skip;
+
+	if (skip)
+		buf_collapse(buf, (off_t)(buf->buf_head - buf->data), skip);
+
+	return;
+}
+
+static void
+http_decode_cancel(struct http_t *http)
+{
 	struct HTTP_private *private = HTTP_private(http);
 
-/*
- * Set the (ssl) socket to non-blocking.
- * (just the read fd for ssl).
- */
-	if (!http->conn.sock_nonblocking)
-		http_set_sock_non_blocking(http);
-	if (!http->conn.ssl_nonblocking)
-		http_set_ssl_non_blocking(http);
+	if (!private->decoding)
+		return;
 
-/*
- * Jump back to here to resend a request after dealing with
- * a 3xx URL redirect and resending the request.
- */
-rp_receive:
+	CODING_decoder_end(&private->decoder);
+	private->decoding = 0;
 
-	total_bytes = 0;
-	buf_clear(&http->conn.read_buf);
-/*
- * This wasn't being reset to NULL, so everytime
- * we tried to follow a redirect, read_until_eoh()
- * sent back 0 since the while loop was never
- * entered.
+	return;
+}
+
+/**
+ * http_decode_begin - set up decoding of the body if it has a Content-Encoding
+ * @http: our HTTP object, with the response header parsed
+ *
+ * Returns -1 if the encoding is not one we asked for.
  */
-	p = NULL;
+static int
+http_decode_begin(struct http_t *http)
+{
+	assert(http);
 
-	bytes = read_until_eoh(http, &p);
+	struct HTTP_private *private = HTTP_private(http);
+	char coding[32];
+	char *value;
+	size_t len;
+	int type;
 
-	_log(http->conn.read_buf.buf_head);
+	http_decode_cancel(http);
 
-	if (bytes < 0 || HTTP_OPERATION_TIMEOUT == bytes)
-	{
-		_log("read_until_eoh() returned %d\n", bytes);
-		goto fail;
-	}
+	if (!(value = http_header(http, HDR_CONTENT_ENCODING, &len)))
+		return 0;
 
-	total_bytes += bytes;
+	if (len >= sizeof(coding))
+		goto unknown;
 
-	code = http_status_code_int(buf);
-	_log("got status code %d\n", code);
+	memcpy(coding, value, len);
+	coding[len] = 0;
 
-	http->code = code;
+	if ((type = CODING_type(coding)) < 0)
+		goto unknown;
 
-	int _rv = parse_response_header_1_1(http);
-	if (0 > _rv)
+	if (CODING_IDENTITY == type)
+		return 0;
+
+	buf_chain_clear(&private->decoded);
+
+	if (CODING_decoder_start(&private->decoder, type) < 0)
 		return -1;
 
-/*
- * With HEAD, always send back the code
- * we received. With a GET, we will follow
- * redirects and resend the request
- * transparently.
- */ 
-	if (HEAD == http->verb)
-		goto out;
+	private->decoding = 1;
 
-	bucket_obj_t *bObj = private->headers;
-	assert(bObj);
-/*
- * Check for a URL redirect status code.
- * Regardless of the status code, we
- * always need to break and read more
- * from the socket as there is always
- * a corresponding HTML document.
- */
-	switch((unsigned int)code)
-	{
-		default:
-			break;
+	return 0;
 
-		case HTTP_FOUND:
-		case HTTP_MOVED_PERMANENTLY:
-		case HTTP_SEE_OTHER:
+unknown:
 
-			if (!http->followRedirects)
-				break;
-/*
- * Cache the URL that caused the redirect.
+	_log("Cannot decode content encoding \"%.*s\"\n", (int)len, value);
+	return -1;
+}
+
+/**
+ * http_decode_feed - decode the next LEN bytes of the body
+ *
+ * Called with each run of body bytes as it is read
+ * (or, for chunked bodies, as each chunk completes).
  */
-			memcpy((void *)tmpURL, (void *)http->URL, strlen(http->URL));
-			tmpURL[strlen(http->URL)] = 0;
+static int
+http_decode_feed(struct http_t *http, char *data, size_t len)
+{
+	assert(http);
 
-			if (set_new_location(http) < 0)
-			{
-				_log("set_new_location() returned < 0\n");
-				goto fail;
-			}
+	struct HTTP_private *private = HTTP_private(http);
 
-			_log("Old location: %s - New location: %s\n", tmpURL, http->URL);
+	if (!private->decoding)
+		return 0;
 
-			buf_clear(&http->conn.write_buf);
-			assert(http_wbuf(http).data_len == 0);
+	if (CODING_decode(&private->decoder, (unsigned char *)data, len, &private->decoded) < 0)
+	{
+		http_decode_cancel(http);
+		return -1;
+	}
 
-		/*
-		 * Still need to receive the body of the HTML page
-		 * that comes with the redirect header.
-		 */
-			bucket_obj_t *bObjR = private->redirects;
-			if (!memcmp(tmpURL, http->URL, strlen(http->URL)))
-			{
-				bObjR->put(bObjR, (void *)tmpURL, (void *)"", strlen(http->URL), 0);
-				needResend = 0;
-			}
-			else
-			{
-				bObjR->put(bObjR, (void *)tmpURL, (void *)http->URL, strlen(http->URL), 0);
-				needResend = 1;
-			}
+	return 0;
+}
 
-			break;
-	}
+/**
+ * http_decode_finish - replace the body in the read buffer with the decoded one
+ * @http: our HTTP object
+ * @body_off: offset of the body from the start of the read buffer
+ */
+static int
+http_decode_finish(struct http_t *http, off_t body_off)
+{
+	assert(http);
+
+	struct HTTP_private *private = HTTP_private(http);
+	buf_t *buf = &http->conn.read_buf;
+
+	if (!private->decoding)
+		return 0;
+
+	http_decode_cancel(http);
+
+	buf_snip(buf, (buf->buf_tail - (buf->buf_head + body_off)));
+
+	_log("Decoded %lu byte body\n", private->decoded.data_len);
+
+	return buf_chain_flatten(&private->decoded, buf);
+}
+
+/*
+ * ================================================================================================
+ *
+ * Streaming bodies to a file (http->openSink). Only the response header stays in the read
+ * buffer; the body is written out as it is read, at most HTTP_SINK_WINDOW bytes at a time,
+ * and spliced straight from the socket when nothing needs doing to it on the way.
+ *
+ * ================================================================================================
+ */
+
+/**
+ * http_sink_begin - ask the caller for a sink for the body of this response
+ */
+static void
+http_sink_begin(struct http_t *http)
+{
+	assert(http);
+
+	struct HTTP_private *private = HTTP_private(http);
+	int fd;
+
+	private->sinking = 0;
+
+	if (!http->openSink || http->code < (int)HTTP_OK || http->code >= 300)
+		return;
+
+	if ((fd = http->openSink(http)) < 0)
+		return;
+
+	http->bodySink = fd;
+	private->sinking = 1;
+
+	return;
+}
 
-	bucket_t *bucket = NULL;
-	bucket = bObj->get(bObj, "transfer-encoding");
+static int
+http_sink_write(struct http_t *http, char *data, size_t len)
+{
+	ssize_t n;
 
-	if (bucket && !strcasecmp((char *)bucket->data, "chunked"))
+	while (len)
 	{
-		if (do_chunked_recv(http) == -1)
+		if ((n = write(http->bodySink, data, len)) < 0)
 		{
-			_log("do_chunked_recv() returned -1\n");
-			goto fail;
+			if (EINTR == errno)
+				continue;
+
+			_log("%s: write failed (%s)\n", __func__, strerror(errno));
+			return -1;
 		}
 
-		goto done_reading;
+		data += n;
+		len -= (size_t)n;
 	}
 
-	bucket = bObj->get(bObj, "content-length");
+	return 0;
+}
+
+/**
+ * http_sink_flush - write out the body received so far and drop it from the read buffer
+ * @http: our HTTP object
+ * @body_off: offset of the body from the start of the read buffer
+ */
+static int
+http_sink_flush(struct http_t *http, off_t body_off)
+{
+	assert(http);
+
+	struct HTTP_private *private = HTTP_private(http);
+	buf_t *buf = &http->conn.read_buf;
+	size_t len = (buf->buf_tail - (buf->buf_head + body_off));
 
-	if (bucket)
+	if (private->decoding)
 	{
-		clen = strtoul((char *)bucket->data, NULL, 0);
+		if (private->decoded.data_len
+		&& buf_chain_write_fd(http->bodySink, &private->decoded) != (ssize_t)private->decoded.data_len)
+		{
+			_log("%s: write failed (%s)\n", __func__, strerror(errno));
+			return -1;
+		}
 
-		overread = (buf->buf_tail - p);
+		buf_chain_clear(&private->decoded);
+	}
+	else
+	if (http_sink_write(http, buf->buf_head + body_off, len) < 0)
+	{
+		return -1;
+	}
 
-		if (overread < clen)
+	if (len)
+		buf_snip(buf, len);
+
+	return 0;
+}
+
+static void
+http_sink_pipe_close(struct HTTP_private *private)
+{
+	if (private->sink_pipe[0] < 0)
+		return;
+
+	close(private->sink_pipe[0]);
+	close(private->sink_pipe[1]);
+	private->sink_pipe[0] = private->sink_pipe[1] = -1;
+
+	return;
+}
+
+/**
+ * http_sink_splice - move LEN body bytes from the socket to the sink without copying them
+ * @http: our HTTP object
+ * @len: the number of bytes left in the body
+ *
+ * Only for plaintext bodies that are not being decoded.
+ * Returns 0 once all LEN bytes are in the sink, 1 if
+ * splice() cannot be used (nothing has been moved and
+ * the caller should read the body instead) or -1.
+ */
+static int
+http_sink_splice(struct http_t *http, size_t len)
+{
+	assert(http);
+
+	struct HTTP_private *private = HTTP_private(http);
+	struct timespec deadline;
+	ssize_t in;
+	ssize_t out;
+	int moved = 0;
+	int rv;
+
+	if (private->sink_pipe[0] < 0 && pipe2(private->sink_pipe, O_CLOEXEC) < 0)
+		return 1;
+
+	while (len)
+	{
+		in = splice(http_socket(http), NULL, private->sink_pipe[1], NULL,
+				(len < HTTP_SINK_WINDOW ? len : HTTP_SINK_WINDOW),
+				SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+		if (in < 0)
 		{
-			clen -= overread;
+			if (EINTR == errno)
+				continue;
 
-			while (clen)
+			if (EAGAIN == errno)
 			{
-				if (http->usingSecure)
-					bytes = buf_read_tls(http_tls(http), buf, clen);
-				else
-					bytes = buf_read_socket(http_socket(http), buf, clen);
+				http_phase_deadline(http, &deadline, HTTP_MAX_WAIT_TIME);
 
-				if (bytes < 0)
+				if ((rv = http_wait_readable(http, &deadline, NULL)) <= 0)
 				{
-					_log("buf_read_[tls/socket]() returned %d\n", retVal);
+					_log("%s: %s\n", __func__, (rv ? "error waiting for body" : "timed out"));
 					goto fail;
 				}
-				else
-				if (!bytes)
-				{
-					continue;	
-				}
-				else
-				{
-					total_bytes += (int)bytes;
-					clen -= bytes;
-				}
+
+				continue;
 			}
+
+			if (EINVAL == errno && !moved)
+				return 1;
+
+			goto fail;
+		}
+
+		if (!in)
+		{
+			_log("%s: connection closed with %lu bytes of body to come\n", __func__, len);
+			goto fail;
+		}
+
+		moved = 1;
+		len -= (size_t)in;
+
+		while (in)
+		{
+			out = splice(private->sink_pipe[0], NULL, http->bodySink, NULL, (size_t)in, SPLICE_F_MOVE);
+
+			if (out < 0 && EINTR == errno)
+				continue;
+
+			if (out <= 0)
+				goto fail;
+
+			in -= out;
 		}
 	}
-	else
+
+	return 0;
+
+fail:
+
+/*
+ * Whatever is left in the pipe belongs to this body.
+ */
+	http_sink_pipe_close(private);
+	return -1;
+}
+
+/**
+ * http_body_finish - the whole body has been received
+ * @http: our HTTP object
+ * @body_off: offset of the body from the start of the read buffer
+ */
+static int
+http_body_finish(struct http_t *http, off_t body_off)
+{
+	assert(http);
+
+	struct HTTP_private *private = HTTP_private(http);
+	int rv;
+
+	if (!private->sinking)
+		return http_decode_finish(http, body_off);
+
+	rv = http_sink_flush(http, body_off);
+	http_decode_cancel(http);
+
+	return rv;
+}
+
+/*
+ * ================================================================================================
+ *
+ * Content-Type policies (HTTP_set_type_policies()). Checked as soon as the response header is
+ * in, so that a body we do not want is never received: we throw away what little is left of
+ * it to keep the connection, or drop the connection if there is more than that.
+ *
+ * ================================================================================================
+ */
+
+/**
+ * http_type_policy - find the most specific policy for a media type
+ * @type: the media type (not NUL terminated; may be NULL if LEN is 0)
+ * @len: its length
+ */
+static struct HTTP_type_policy *
+http_type_policy(char *type, size_t len)
+{
+	struct HTTP_type_policy *best = NULL;
+	size_t best_len = 0;
+	size_t plen;
+	int i;
+
+	for (i = 0; i < nr_type_policies; ++i)
 	{
-		_log("No Content-Length or chunked transfer encoding header fields");
-		total_bytes = 0;
-		goto fail;
+		if (!strcmp("*", type_policies[i].type))
+		{
+			if (!best)
+				best = &type_policies[i];
+
+			continue;
+		}
+
+		plen = strlen(type_policies[i].type);
+
+		if (plen > len || strncasecmp(type_policies[i].type, type, plen))
+			continue;
+
+		if (plen < len && '/' != type_policies[i].type[plen - 1])
+			continue;
+
+		if (plen > best_len)
+		{
+			best = &type_policies[i];
+			best_len = plen;
+		}
+	}
+
+	return best;
+}
+
+/**
+ * http_body_check - apply the type policies to the response whose header we have
+ * @http: our HTTP object, with the response header parsed
+ *
+ * Sets HTTP->bodyAction. Returns 1 if the body should
+ * not be received (its type is skipped or it is bigger
+ * than the policy allows), otherwise 0. If we cannot
+ * know the size yet, it is checked as the body arrives.
+ */
+static int
+http_body_check(struct http_t *http)
+{
+	assert(http);
+
+	struct HTTP_private *private = HTTP_private(http);
+	struct HTTP_type_policy *policy;
+	char *value;
+	size_t len;
+	size_t type_len = 0;
+
+	http->bodyAction = HTTP_BODY_DEFAULT;
+	private->body_max = 0;
+
+	if (!nr_type_policies || http->code < (int)HTTP_OK || http->code >= 300)
+		return 0;
+
+	if ((value = http_header(http, HDR_CONTENT_TYPE, &len)))
+	{
+		while (type_len < len && ';' != value[type_len] && !isspace((unsigned char)value[type_len]))
+			++type_len;
+	}
+
+	if (!(policy = http_type_policy(value, type_len)))
+		return 0;
+
+	http->bodyAction = policy->action;
+	private->body_max = policy->max_size;
+
+	if (HTTP_BODY_SKIP == policy->action)
+	{
+		_log("Skipping %.*s body of %s\n", (int)type_len, value, http->URL);
+		return 1;
+	}
+
+	if (policy->max_size && (value = http_header(http, HDR_CONTENT_LENGTH, &len))
+	&& strtoul(value, NULL, 10) > policy->max_size)
+	{
+		_log("Skipping body of %s: over %lu bytes\n", http->URL, policy->max_size);
+		http->bodyAction = HTTP_BODY_SKIP;
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * http_body_abort - stop receiving a body we do not want
+ * @http: our HTTP object
+ * @body_off: offset of the body from the start of the read buffer
+ * @remaining: how much of it there is still to come, or -1 if we cannot know
+ *
+ * What we have of it is dropped from the read buffer. If
+ * the rest is small, it is read and thrown away so the
+ * connection can be used again; otherwise we reconnect,
+ * since the server would go on sending it.
+ */
+static int
+http_body_abort(struct http_t *http, off_t body_off, ssize_t remaining)
+{
+	assert(http);
+
+	struct HTTP_private *private = HTTP_private(http);
+	buf_t *buf = &http->conn.read_buf;
+	struct timespec deadline;
+	ssize_t n;
+
+	http->bodyAction = HTTP_BODY_SKIP;
+	http_decode_cancel(http);
+
+	if (remaining > 0 && remaining <= HTTP_SKIP_DRAIN_MAX)
+	{
+		while (remaining > 0)
+		{
+			http_phase_deadline(http, &deadline, HTTP_MAX_WAIT_TIME);
+
+			if ((n = http_recv_wait(http, (size_t)remaining, &deadline)) <= 0)
+				break;
+
+			remaining -= n;
+		}
 	}
 
-done_reading:
+	if (buf->buf_tail > (buf->buf_head + body_off))
+		buf_snip(buf, (size_t)(buf->buf_tail - (buf->buf_head + body_off)));
+
+	if (!remaining)
+		return 0;
+
+	_log("Dropping the connection to %s to abandon a body\n", http->host);
+	private->body_dropped = 1;
+
+	return http_reconnect(http);
+}
+
+/**
+ * http_body_skip - do not receive the body that starts at BODY
+ */
+static int
+http_body_skip(struct http_t *http, char *body)
+{
+	assert(http);
+	assert(body);
+
+	buf_t *buf = &http->conn.read_buf;
+	char *value;
+	size_t len;
+	size_t clen;
+	size_t overread = (buf->buf_tail - body);
+	ssize_t remaining = -1;
+
+	if (!http_header(http, HDR_TRANSFER_ENCODING, &len)
+	&& (value = http_header(http, HDR_CONTENT_LENGTH, &len)))
+	{
+		clen = strtoul(value, NULL, 10);
+
+		if (overread > clen)
+		{
+			http_stash_overread(http, body + clen);
+			overread = clen;
+		}
+
+		remaining = (ssize_t)(clen - overread);
+	}
+
+	return http_body_abort(http, (off_t)(body - buf->buf_head), remaining);
+}
+
+/**
+ * read_until_eoh - read until we have the whole response header
+ * @http: our HTTP object
+ * @p: set to the first byte after the header (the start of the body)
+ *
+ * Reads are as large as whatever the socket has for us,
+ * and each one is only searched for the end of the header
+ * from where the last search stopped, so a long header
+ * (cookies and all) is read in a few reads and scanned
+ * once. Whatever body came with it is left after *P for
+ * the caller to feed straight to the body decoder.
+ *
+ * Returns the number of bytes read, with *P left NULL if
+ * what we got is not an HTTP response, or -1 or
+ * HTTP_OPERATION_TIMEOUT.
+ */
+static int
+read_until_eoh(struct http_t *http, char **p)
+{
+	assert(http);
+
+	struct HTTP_private *private = HTTP_private(http);
+	buf_t *buf = &http->conn.read_buf;
+	struct timespec deadline;
+	size_t scanned = 0; /* bytes already searched for the sentinel */
+	size_t from;
+	ssize_t n;
+	int bytes = (int)buf->data_len;
+
+	_log("In read_until_eoh\n");
+
+	http_phase_deadline(http, &deadline, http->timeouts.first_byte);
+	private->eoh_off = 0;
+
+/*
+ * The buffer may already hold (some of) the response,
+ * carried over from the read of the previous one.
+ */
+	while (1)
+	{
+		if (!scanned)
+			http_skip_leading_crnl(buf);
+
+		if (strncmp(buf->buf_head, "HTTP/", (buf->data_len < 5 ? buf->data_len : 5)))
+		{
+			_log("Not an HTTP response\n");
+			break;
+		}
+
+	/*
+	 * The sentinel may straddle the
+	 * end of the last search.
+	 */
+		from = (scanned > 3 ? scanned - 3 : 0);
+
+		if ((*p = SCAN_find(buf->buf_head + from, buf->data_len - from, HTTP_EOH_SENTINEL, 4)))
+		{
+			*p += 4;
+			private->eoh_off = (off_t)(*p - buf->buf_head);
+			break;
+		}
+
+		scanned = buf->data_len;
+
+		if (scanned >= HTTP_HEADER_MAX)
+		{
+			_log("Response header is over %d bytes\n", HTTP_HEADER_MAX);
+			return -1;
+		}
+
+		n = http_recv_wait(http, HTTP_HEADER_READ_BLOCK, &deadline);
+
+		if (HTTP_OPERATION_TIMEOUT == n)
+		{
+			_log("Timed out waiting for response header\n");
+			return HTTP_OPERATION_TIMEOUT;
+		}
+
+		if (n <= 0)
+		{
+			_log("http_recv_wait returned %ld...\n", n);
+			return -1;
+		}
+
+		_log("read %d bytes\n", n);
+
+		bytes += (int)n;
+	}
+
+	_log("Returning %d bytes\n", bytes);
+	return bytes;
+}
+
+#ifdef DEBUG
+static void
+__dump_buf(buf_t *buf)
+{
+	assert(buf);
+
+	int fd = -1;
+
+	fd = open("./DUMPED_BUF.LOG", O_RDWR|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
+	
+	if (fd != -1)
+	{
+		buf_write_fd(fd, buf);
+		sync();
+		close(fd);
+		fd = -1;
+	}
+
+	return;
+}
+#endif
+
+#define HTTP_CHUNK_READ_BLOCK 16384
+#define HTTP_CHUNK_READ_MAX (HTTP_CHUNK_READ_BLOCK * 16) /* most asked of one read */
+#define HTTP_CHUNK_DIGITS_MAX 15 /* hex digits in a chunk size */
+
+enum chunk_state
+{
+	CHUNK_SIZE = 0,
+	CHUNK_EXT, /* ;name=value after the size, which we ignore */
+	CHUNK_DATA,
+	CHUNK_DATA_END, /* the CRLF after the data */
+	CHUNK_TRAILER, /* start of a trailer line, or the final CRLF */
+	CHUNK_TRAILER_LINE,
+	CHUNK_DONE
+};
+
+/*
+ * In chunked transfer encoding, the data is sent in chunks
+ * with each chunk being preceded with the number of bytes
+ * of the chunk (this is used for pages that are created
+ * dynamically and therefore the HTTP server cannot send
+ * a Content-Length header.
+ *
+ * The data is encoding thus:
+ *
+ * [CHUNKSIZE]\r\n...DATA...\r\n[CHUNKSIZE]\r\n...DATA...\r\n0\r\n\r\n
+ *
+ * IN and OUT are offsets from the head of the read buffer:
+ * IN is the next byte to parse, OUT is where the next byte
+ * of chunk data goes. Everything before OUT is body.
+ */
+struct http_chunked
+{
+	enum chunk_state state;
+	size_t remaining; /* of the current chunk's data */
+	int nr_digits;
+	off_t in;
+	off_t out;
+};
+
+/**
+ * http_chunked_parse - run the decoder over everything read so far
+ * @ch: decoder state
+ * @buf: the read buffer
+ *
+ * Chunk data only moves if framing came before it in
+ * the same read; otherwise it was read to where it
+ * belongs (see do_chunked_recv()). Returns 1 after the
+ * last chunk and trailer, 0 if it needs more input and
+ * -1 if the framing is malformed.
+ */
+static int
+http_chunked_parse(struct http_chunked *ch, buf_t *buf)
+{
+	char *head = buf->buf_head;
+	char *tail = buf->buf_tail;
+	char *in = head + ch->in;
+	char *out = head + ch->out;
+	size_t n;
+	int c;
+	int digit;
+
+	while (in < tail && CHUNK_DONE != ch->state)
+	{
+		if (CHUNK_DATA == ch->state)
+		{
+			n = (size_t)(tail - in);
+
+			if (n > ch->remaining)
+				n = ch->remaining;
+
+			if (out != in)
+				memmove(out, in, n);
+
+			in += n;
+			out += n;
+			ch->remaining -= n;
+
+			if (!ch->remaining)
+				ch->state = CHUNK_DATA_END;
+
+			continue;
+		}
+
+		c = (unsigned char)*in++;
+
+		switch(ch->state)
+		{
+			case CHUNK_SIZE:
+
+				if (isxdigit(c))
+				{
+					if (++ch->nr_digits > HTTP_CHUNK_DIGITS_MAX)
+						return -1;
+
+					digit = isdigit(c) ? (c - '0') : (tolower(c) - 'a' + 10);
+					ch->remaining = (ch->remaining << 4) | (size_t)digit;
+					break;
+				}
+
+				if (!ch->nr_digits)
+					return -1;
+
+				if (c == ';' || c == ' ' || c == '\t' || c == '\r')
+				{
+					ch->state = CHUNK_EXT;
+					break;
+				}
+
+				if (c != '\n')
+					return -1;
+
+			/* fall through */
+			case CHUNK_EXT:
+
+				if (c != '\n')
+					break;
+
+				ch->nr_digits = 0;
+				ch->state = (ch->remaining ? CHUNK_DATA : CHUNK_TRAILER);
+				break;
+
+			case CHUNK_DATA_END:
+
+				if (c == '\r')
+					break;
+
+				if (c != '\n')
+					return -1;
+
+				ch->state = CHUNK_SIZE;
+				break;
+
+			case CHUNK_TRAILER:
+
+				if (c == '\r')
+					break;
+
+				ch->state = (c == '\n' ? CHUNK_DONE : CHUNK_TRAILER_LINE);
+				break;
+
+			case CHUNK_TRAILER_LINE:
+
+				if (c == '\n')
+					ch->state = CHUNK_TRAILER;
+
+				break;
+
+			default:
+
+				break;
+		}
+	}
+
+	ch->in = (in - head);
+	ch->out = (out - head);
+
+	return (CHUNK_DONE == ch->state);
+}
+
+/**
+ * do_chunked_recv - receive a body sent with chunked transfer encoding
+ * @http: our HTTP object
+ * @body: first byte after the response header in the read buffer
+ *
+ * Reads are as large as what is on its way (at least
+ * HTTP_CHUNK_READ_BLOCK, at most HTTP_CHUNK_READ_MAX
+ * or what is left under the body limit, so a huge
+ * chunk takes several) and the framing is stripped
+ * as they arrive. Once everything read has been parsed
+ * the buffer is cut back to OUT, so data in the next
+ * read that is not preceded by framing lands in place.
+ * That is also when the body is written out if it is
+ * going to a sink.
+ *
+ * Returns the length of the body or -1.
+ */
+static ssize_t
+do_chunked_recv(struct http_t *http, char *body)
+{
+	assert(http);
+	assert(body);
+
+	struct HTTP_private *private = HTTP_private(http);
+	buf_t *buf = &http->conn.read_buf;
+	struct http_chunked ch;
+	struct timespec deadline;
+	off_t body_off = (body - buf->buf_head);
+	off_t fed;
+	size_t sunk = 0; /* body length, with what went to the sink */
+	size_t toread;
+	ssize_t n;
+	int rv;
+
+	memset(&ch, 0, sizeof(ch));
+	ch.state = CHUNK_SIZE;
+	ch.in = ch.out = fed = body_off;
+
+	while (1)
+	{
+		if ((rv = http_chunked_parse(&ch, buf)) < 0)
+		{
+			_log("%s: malformed chunk framing at offset %ld\n", __func__, (long)ch.in);
+#ifdef DEBUG
+			__dump_buf(buf);
+#endif
+			goto fail;
+		}
+
+		if (ch.out > fed)
+		{
+			if (http_decode_feed(http, buf->buf_head + fed, (size_t)(ch.out - fed)) < 0)
+				goto fail;
+
+			fed = ch.out;
+		}
+
+		if (private->body_max && sunk + (size_t)(ch.out - body_off) > private->body_max)
+		{
+			_log("%s: body of %s is over %lu bytes\n", __func__, http->URL, private->body_max);
+			http_body_abort(http, body_off, -1);
+			return -1;
+		}
+
+		if (rv)
+			break;
+
+	/*
+	 * Everything read has been parsed; drop the
+	 * framing at the end so the next read goes
+	 * straight after the data we have.
+	 */
+		if (ch.in > ch.out)
+		{
+			buf_snip(buf, (size_t)(ch.in - ch.out));
+			ch.in = ch.out;
+		}
+
+		toread = HTTP_CHUNK_READ_BLOCK;
+
+		if (CHUNK_DATA == ch.state && ch.remaining > toread)
+		{
+			toread = ch.remaining;
+
+			if (toread > HTTP_CHUNK_READ_MAX)
+				toread = HTTP_CHUNK_READ_MAX;
+
+		/*
+		 * No use reading much past the limit; a block
+		 * over it is enough to see the body is too big.
+		 */
+			if (private->body_max)
+			{
+				size_t left = private->body_max - (sunk + (size_t)(ch.out - body_off));
+
+				if (toread > left + HTTP_CHUNK_READ_BLOCK)
+					toread = left + HTTP_CHUNK_READ_BLOCK;
+			}
+		}
+
+	/*
+	 * The buffer now ends with the body, so what
+	 * we have of it can go out to the sink.
+	 */
+		if (private->sinking)
+		{
+			if (http_sink_flush(http, body_off) < 0)
+				goto fail;
+
+			sunk += (size_t)(ch.out - body_off);
+			ch.in = ch.out = fed = body_off;
+
+			if (toread > HTTP_SINK_WINDOW)
+				toread = HTTP_SINK_WINDOW;
+		}
+
+		http_phase_deadline(http, &deadline, HTTP_MAX_WAIT_TIME);
+		n = http_recv_wait(http, toread, &deadline);
+
+		if (n <= 0)
+		{
+			_log("%s: http_recv_wait returned %ld\n", __func__, n);
+			goto fail;
+		}
+	}
+
+/*
+ * Anything after the trailer is the start of the
+ * next response; then lose the trailing framing.
+ */
+	http_stash_overread(http, buf->buf_head + ch.in);
+
+	if (buf->buf_tail > buf->buf_head + ch.out)
+		buf_snip(buf, (size_t)(buf->buf_tail - (buf->buf_head + ch.out)));
+
+	sunk += (size_t)(ch.out - body_off);
+
+	if (http_body_finish(http, body_off) < 0)
+		return -1;
+
+	_log("Returning %lu from %s\n", sunk, __func__);
+	return (ssize_t)sunk;
+
+fail:
+
+	http_decode_cancel(http);
+	return -1;
+}
+
+/**
+ * Extract the Location header field from header
+ * and set the PAGE and HOST values in http object.
+ *
+ * @http The HTTP object
+ */
+static int
+set_new_location(struct http_t *http)
+{
+	assert(http);
+
+	char *location;
+	size_t len;
+
+	if (!(location = http_header(http, HDR_LOCATION, &len)))
+		return -1;
+
+	if (len >= HTTP_URL_MAX)
+	{
+		_log("%s: location is too long\n", __func__);
+		return -1;
+	}
+
+	memcpy(http->URL, location, len);
+	http->URL[len] = 0;
+
+	_log("Got new location: %s\n", http->URL);
+
+	if (!http->ops->URL_parse_host(http->URL, http->host))
+	{
+		_log("%s: failed to parse HOST from URL\n", __func__);
+		return -1;
+	}
+
+	_log("Extracted host: %s\n", http->host);
+
+	if (!http->ops->URL_parse_page(http->URL, http->page))
+	{
+		_log("%s: failed to parse page from URL\n", __func__);
+		return -1;
+	}
+
+	_log("Extracted page: %s\n", http->page);
+
+	return 0;
+}
+
+/**
+ * http_set_sock_non_blocking - set the O_NONBLOCK flag for socket
+ * @http: our HTTP object
+ */
+static void
+http_set_sock_non_blocking(struct http_t *http)
+{
+	int sock_flags = fcntl(http->conn.sock, F_GETFL);
+
+	if (!(sock_flags & O_NONBLOCK))
+	{
+		sock_flags |= O_NONBLOCK;
+		fcntl(http->conn.sock, F_SETFL, sock_flags);
+
+		http->conn.sock_nonblocking = 1;
+	}
+
+	return;
+}
+
+/**
+ * http_set_ssl_non_blocking - set the READ file descriptor as non blocking
+ * @http: our HTTP object
+ */
+static void
+http_set_ssl_non_blocking(struct http_t *http)
+{
+	if (!http->conn.ssl)
+		return;
+
+	int rsock = SSL_get_rfd(http->conn.ssl);
+	int flags = fcntl(rsock, F_GETFL);
+
+	if (!(flags & O_NONBLOCK))
+	{
+		flags |= O_NONBLOCK;
+		fcntl(rsock, F_SETFL, flags);
+
+		http->conn.ssl_nonblocking = 1;
+	}
+
+	return;
+}
+
+static void
+_drain_socket(struct http_t *http)
+{
+	assert(http);
+
+	ssize_t ret = 0;
+	size_t block = 1024;
+
+	http_set_ssl_non_blocking(http);
+	http_set_sock_non_blocking(http);
+
+/*
+ * Only take what is already there; we do not
+ * want to sleep waiting for more here.
+ */
+	_log("Draining socket\n");
+	while (1)
+	{
+		if (http->usingSecure)
+			ret = buf_read_tls(http_tls(http), &http->conn.read_buf, block);
+		else
+			ret = buf_read_socket(http_socket(http), &http->conn.read_buf, block);
+
+		if (ret < block || 0 >= ret)
+			break;
+
+		_log("Drained %ld bytes from socket\n", ret);
+	}
+
+	return;
+}
+
+/**
+ * http_handle_redirect - act on a 3xx response
+ * @http: our HTTP object
+ *
+ * Returns 1 if the request should be resent for
+ * the new location (now in HTTP->URL), 0 if not,
+ * or -1 on error.
+ */
+static int
+http_handle_redirect(struct http_t *http)
+{
+	assert(http);
+
+	struct HTTP_private *private = HTTP_private(http);
+	char tmpURL[HTTP_URL_MAX];
+	int needResend;
+
+	switch((unsigned int)http->code)
+	{
+		case HTTP_FOUND:
+		case HTTP_MOVED_PERMANENTLY:
+		case HTTP_SEE_OTHER:
+			break;
+
+		default:
+			return 0;
+	}
+
+	if (!http->followRedirects)
+		return 0;
+
+/*
+ * Cache the URL that caused the redirect.
+ */
+	memcpy((void *)tmpURL, (void *)http->URL, strlen(http->URL));
+	tmpURL[strlen(http->URL)] = 0;
+
+	if (set_new_location(http) < 0)
+	{
+		_log("set_new_location() returned < 0\n");
+		return -1;
+	}
+
+	_log("Old location: %s - New location: %s\n", tmpURL, http->URL);
+
+	buf_clear(&http->conn.write_buf);
+	assert(http_wbuf(http).data_len == 0);
+
+/*
+ * Still need to receive the body of the HTML page
+ * that comes with the redirect header. Only a
+ * redirect to exactly the same URL is a loop; one
+ * to a prefix of it (/dir/ -> /dir) is not.
+ */
+	if (!strcmp(tmpURL, http->URL))
+	{
+		REDIRECT_put(tmpURL, tmpURL, HTTP_MOVED_PERMANENTLY == (unsigned int)http->code);
+		needResend = 0;
+	}
+	else
+	{
+		REDIRECT_put(tmpURL, http->URL, HTTP_MOVED_PERMANENTLY == (unsigned int)http->code);
+		needResend = 1;
+	}
+
+/*
+ * Other responses are queued on the connection
+ * ahead of anything we would send now; leave it
+ * to the caller to request the new location.
+ */
+	if (private->pipelining)
+		needResend = 0;
+
+	return needResend;
+}
+
+/**
+ * recv_response_1_1 - receive HTTP response.
+ * @http HTTP object
+ */
+int
+recv_response_1_1(struct http_t *http)
+{
+	assert(http);
+
+	char *p = NULL;
+	char *value;
+	size_t value_len;
+	size_t clen;
+	size_t overread;
+	size_t body_len;
+	off_t body_off;
+	ssize_t bytes;
+	int code = 0;
+	int total_bytes = 0;
+	int needResend = 0;
+	size_t toread;
+	struct timespec deadline;
+	//http_header_t *content_len = NULL;
+	//http_header_t *transfer_enc = NULL;
+	buf_t *buf = &http->conn.read_buf;
+	struct HTTP_private *private = HTTP_private(http);
+
+/*
+ * Set the (ssl) socket to non-blocking.
+ * (just the read fd for ssl).
+ */
+	if (!http->conn.sock_nonblocking)
+		http_set_sock_non_blocking(http);
+	if (!http->conn.ssl_nonblocking)
+		http_set_ssl_non_blocking(http);
+
+/*
+ * Jump back to here to resend a request after dealing with
+ * a 3xx URL redirect and resending the request.
+ */
+rp_receive:
+
+	total_bytes = 0;
+	buf_clear(&http->conn.read_buf);
+	http_take_carry(http);
+	http_start_transfer(http);
+	private->sinking = 0;
+	private->body_dropped = 0;
+	http->bodyAction = HTTP_BODY_DEFAULT;
+/*
+ * This wasn't being reset to NULL, so everytime
+ * we tried to follow a redirect, read_until_eoh()
+ * sent back 0 since the while loop was never
+ * entered.
+ */
+	p = NULL;
+
+	bytes = read_until_eoh(http, &p);
+
+	_log(http->conn.read_buf.buf_head);
+
+	if (bytes < 0 || HTTP_OPERATION_TIMEOUT == bytes)
+	{
+		_log("read_until_eoh() returned %d\n", bytes);
+		goto fail;
+	}
+
+	total_bytes += bytes;
+
+	code = http_status_code_int(buf);
+	_log("got status code %d\n", code);
+
+	http->code = code;
+
+	int _rv = parse_response_header_1_1(http);
+	if (0 > _rv)
+		return -1;
+
+/*
+ * With HEAD, always send back the code
+ * we received. With a GET, we will follow
+ * redirects and resend the request
+ * transparently.
+ */ 
+	if (HEAD == http->verb)
+	{
+		http_stash_overread(http, p);
+		goto out;
+	}
+
+/*
+ * These never have a body, whatever
+ * the header says (RFC 9112 6.3).
+ */
+	if (HTTP_NOT_MODIFIED == code || HTTP_NO_CONTENT == code)
+	{
+		http_stash_overread(http, p);
+		goto out;
+	}
+
+/*
+ * Check for a URL redirect status code.
+ * Regardless of the status code, we
+ * always need to break and read more
+ * from the socket as there is always
+ * a corresponding HTML document.
+ */
+	if ((needResend = http_handle_redirect(http)) < 0)
+		goto fail;
+
+	if (!needResend && http_body_check(http))
+	{
+		if (http_body_skip(http, p) < 0)
+			return -1;
+
+		goto out;
+	}
+
+	if (!needResend)
+		http_sink_begin(http);
+
+	if (http_decode_begin(http) < 0)
+		goto fail;
+
+	value = http_header(http, HDR_TRANSFER_ENCODING, &value_len);
+
+	if (value && value_len == 7 && !strncasecmp(value, "chunked", 7))
+	{
+		if (do_chunked_recv(http, p) < 0)
+		{
+			if (HTTP_BODY_SKIP == http->bodyAction)
+				goto out;
+
+			_log("do_chunked_recv() returned -1\n");
+			goto fail;
+		}
+
+		goto done_reading;
+	}
+
+	value = http_header(http, HDR_CONTENT_LENGTH, &value_len);
+
+	if (value)
+	{
+	/*
+	 * The value is followed by the field's CRLF,
+	 * so strtoul() stops there.
+	 */
+		clen = strtoul(value, NULL, 10);
+
+		body_off = (p - buf->buf_head);
+		body_len = clen;
+		overread = (buf->buf_tail - p);
+
+		if (overread > clen)
+		{
+			http_stash_overread(http, p + clen);
+			overread = clen;
+		}
+
+		if (http_decode_feed(http, p, overread) < 0)
+			goto fail;
+
+		if (private->sinking && http_sink_flush(http, body_off) < 0)
+			goto fail;
+
+		if (overread < clen)
+		{
+			clen -= overread;
+
+		/*
+		 * Nothing to do to the rest of the body
+		 * but put it in the file, so the kernel
+		 * can move it there.
+		 */
+			if (private->sinking && !private->decoding && !http->usingSecure)
+			{
+				switch(http_sink_splice(http, clen))
+				{
+					case 0:
+
+						total_bytes += (int)clen;
+						clen = 0;
+						break;
+
+					case 1:
+
+						break;
+
+					default:
+
+						goto fail;
+				}
+			}
+
+			while (clen)
+			{
+				toread = clen;
+
+				if (private->sinking && toread > HTTP_SINK_WINDOW)
+					toread = HTTP_SINK_WINDOW;
+
+				http_phase_deadline(http, &deadline, HTTP_MAX_WAIT_TIME);
+				bytes = http_recv_wait(http, toread, &deadline);
+
+				if (bytes <= 0)
+				{
+					_log("http_recv_wait() returned %ld\n", bytes);
+					goto fail;
+				}
+
+				if (http_decode_feed(http, buf->buf_tail - bytes, (size_t)bytes) < 0)
+					goto fail;
+
+				if (private->sinking && http_sink_flush(http, body_off) < 0)
+					goto fail;
+
+				total_bytes += (int)bytes;
+				clen -= bytes;
+			}
+
+			assert(private->sinking || buf->buf_tail == (buf->buf_head + body_off + body_len));
+		}
+
+		if (http_body_finish(http, body_off) < 0)
+			goto fail;
+	}
+	else
+	{
+		_log("No Content-Length or chunked transfer encoding header fields");
+		total_bytes = 0;
+		goto fail;
+	}
+
+done_reading:
+
+	if (needResend)
+	{
+		_log("Resending request to web server\n");
+		http->ops->send_request(http);
+		needResend = 0;
+		_log("Sent request. Jumping to retry\n");
+		goto rp_receive;
+	}
+
+out:
+	return total_bytes;
+
+fail:
+	http_decode_cancel(http);
+	_drain_socket(http);
+	return -1;
+}
+
+/*
+ * Headers that only mean something to an HTTP/1.1
+ * connection and must not be sent on HTTP/2.
+ */
+static char *http2_skip_fields[] =
+{
+	"host",
+	"connection",
+	"keep-alive",
+	"proxy-connection",
+	"transfer-encoding",
+	"upgrade",
+	NULL
+};
+
+#define HTTP2_REQUEST_FIELDS_MAX 32
+
+/**
+ * http2_submit_request - open a stream for the request in the write buffer
+ * @http: our HTTP object
+ *
+ * The request header is built the same way as for
+ * HTTP/1.1 and translated here, so anything added
+ * to build_header() applies to both. Returns the
+ * stream ID or 0.
+ */
+static uint32_t
+http2_submit_request(struct http_t *http)
+{
+	assert(http);
+
+	struct HTTP_private *private = HTTP_private(http);
+	struct HTTP2_field fields[HTTP2_REQUEST_FIELDS_MAX];
+	char *header = strdup(http->conn.write_buf.buf_head);
+	char *line;
+	char *eol;
+	char *sp;
+	char *value;
+	uint32_t id;
+	int nr_fields = 0;
+	int i;
+
+	if (!header)
+		return 0;
+
+	if (!(eol = strstr(header, HTTP_EOL)) || !(sp = memchr(header, ' ', (eol - header))))
+	{
+		free(header);
+		return 0;
+	}
+
+	*eol = 0;
+	*sp = 0;
+
+	fields[nr_fields].name = ":method";
+	fields[nr_fields++].value = header;
+	fields[nr_fields].name = ":scheme";
+	fields[nr_fields++].value = (http->usingSecure ? "https" : "http");
+	fields[nr_fields].name = ":authority";
+	fields[nr_fields++].value = http->host;
+	fields[nr_fields].name = ":path";
+	fields[nr_fields++].value = (*http->page ? http->page : "/");
+
+	for (line = eol + 2; nr_fields < HTTP2_REQUEST_FIELDS_MAX; line = eol + 2)
+	{
+		if (!(eol = strstr(line, HTTP_EOL)) || eol == line)
+			break;
+
+		*eol = 0;
+
+		if (!(value = strchr(line, ':')))
+			continue;
+
+		*value++ = 0;
+		while (*value == ' ')
+			++value;
+
+		to_lower_case(line);
+
+		for (i = 0; http2_skip_fields[i]; ++i)
+		{
+			if (!strcmp(line, http2_skip_fields[i]))
+				break;
+		}
+
+		if (http2_skip_fields[i])
+			continue;
+
+		fields[nr_fields].name = line;
+		fields[nr_fields++].value = value;
+	}
+
+	id = HTTP2_submit(private->h2, fields, nr_fields, 1);
+
+	free(header);
+
+	return id;
+}
+
+static int
+send_request_2_0(struct http_t *http)
+{
+	assert(http);
+
+	struct HTTP_private *private = HTTP_private(http);
+
+	if (prepare_request_1_1(http) < 0)
+		return -1;
+
+	if (!(private->h2_stream = http2_submit_request(http)))
+	{
+		_log("No HTTP/2 stream available for %s\n", http->URL);
+		return -1;
+	}
+
+	return HTTP2_flush(http, private->h2);
+}
+
+/**
+ * recv_response_2_0 - receive the response on the stream of the last request
+ * @http: our HTTP object
+ *
+ * The response is put in the read buffer as an
+ * HTTP/1.1 response (status line, header, body)
+ * so that nothing else needs to know which
+ * version we spoke.
+ */
+static int
+recv_response_2_0(struct http_t *http)
+{
+	assert(http);
+
+	struct HTTP_private *private = HTTP_private(http);
+	struct HTTP2_stream *stream;
+	buf_t *buf = &http->conn.read_buf;
+	off_t body_off;
+	int total_bytes;
+	int needResend;
+
+rp_receive:
+
+	buf_clear(buf);
+	http->bodyAction = HTTP_BODY_DEFAULT;
+
+	if (!private->h2_stream)
+		return -1;
+
+	http_start_transfer(http);
+
+/*
+ * Look at the header before waiting for the body
+ * so we can turn down a body we do not want.
+ */
+	stream = HTTP2_await_headers(http, private->h2, private->h2_stream,
+			HTTP_MAX_WAIT_TIME, &private->transfer_deadline);
+
+	if (!stream)
+		goto lost;
+
+	if (stream->error || !stream->got_headers)
+		goto stream_failed;
+
+	buf_append_fmt(buf, "HTTP/2 %d \r\n", stream->status);
+
+	if (buf_append_bytes(buf, stream->header.buf_head, stream->header.data_len) < 0
+	|| buf_append_bytes(buf, HTTP_EOL, 2) < 0)
+		goto fail_release;
+
+	body_off = (off_t)buf->data_len;
+
+	http->code = http_status_code_int(buf);
+	_log("got status code %d\n", http->code);
+
+	if (parse_response_header_1_1(http) < 0)
+		goto fail_release;
+
+	if (HEAD != http->verb && http_body_check(http))
+	{
+	/*
+	 * Releasing the stream before the server
+	 * is done with it resets it.
+	 */
+		HTTP2_stream_release(private->h2, stream);
+		private->h2_stream = 0;
+
+		if (HTTP2_flush(http, private->h2) < 0)
+			return -1;
+
+		return (int)buf->data_len;
+	}
+
+	stream = HTTP2_await(http, private->h2, private->h2_stream,
+			HTTP_MAX_WAIT_TIME, &private->transfer_deadline);
+
+	if (!stream)
+		goto lost;
+
+	if (stream->error)
+		goto stream_failed;
+
+	private->h2_stream = 0;
+
+	if (private->body_max && stream->body.data_len > private->body_max)
+	{
+		_log("Body of %s is over %lu bytes\n", http->URL, private->body_max);
+		http->bodyAction = HTTP_BODY_SKIP;
+		HTTP2_stream_release(private->h2, stream);
+		return (int)buf->data_len;
+	}
+
+	if (buf_append_bytes(buf, stream->body.buf_head, stream->body.data_len) < 0)
+	{
+		HTTP2_stream_release(private->h2, stream);
+		return -1;
+	}
+
+	HTTP2_stream_release(private->h2, stream);
+
+	total_bytes = (int)buf->data_len;
+
+	if (HEAD == http->verb)
+		return total_bytes;
+
+	http_sink_begin(http);
+
+/*
+ * The whole body is here already, so it
+ * is decoded in one go.
+ */
+	if (http_decode_begin(http) < 0
+	|| http_decode_feed(http, buf->buf_head + body_off, buf->data_len - body_off) < 0
+	|| http_body_finish(http, body_off) < 0)
+		return -1;
+
+	if ((needResend = http_handle_redirect(http)) < 0)
+		return -1;
+
+	if (needResend)
+	{
+		if (http->ops->send_request(http) < 0)
+			return -1;
+
+		goto rp_receive;
+	}
+
+	return total_bytes;
+
+lost:
+
+	_log("Lost HTTP/2 connection to %s\n", http->host);
+	private->h2_stream = 0;
+	return -1;
+
+stream_failed:
+
+	_log("HTTP/2 stream %u failed (error 0x%x)\n", stream->id, stream->error);
+
+fail_release:
+
+	HTTP2_stream_release(private->h2, stream);
+	private->h2_stream = 0;
+	return -1;
+}
+
+/**
+ * Return the HTTP code in the response header (200, 404...)
+ *
+ * @buf The buffer holding the web server's response.
+ */
+int
+http_status_code_int(buf_t *buf)
+{
+	assert(buf);
+
+	char *p = NULL;
+	char *q = NULL;
+	char *eol = memchr(buf->buf_head, '\n', buf->data_len);
+	char code_str[16];
+
+	if (!eol)
+		return -1;
+
+	p = buf->buf_head;
+
+	/*
+	 * HTTP/1.1 200 OK\r\n
+	 */
+
+	p = memchr(p, ' ', (eol - p));
+	if (!p)
+		return -1;
+
+	++p;
+
+	if (!(q = memchr(p, ' ', (eol - p))))
+		q = memchr(p, '\r', (eol - p));
+
+	if (!q)
+		return -1;
+
+	if ((q - p) > 3)
+		return -1;
+
+	strncpy(code_str, p, (q - p));
+	code_str[q - p] = 0;
+
+	return atoi(code_str);
+}
+
+const char *
+code_as_string(struct http_t *http)
+{
+	assert(http);
+
+	//char code_string[64];
+
+	switch((unsigned int)http->code)
+	{
+		case HTTP_SWITCHING_PROTOCOLS:
+			return "101 Switching Protocols";
+			break;
+		case HTTP_OK:
+			//sprintf(code_string, "%s%u OK%s", COL_DARKGREEN, HTTP_OK, COL_END);
+			return "200 OK";
+			break;
+		case HTTP_NO_CONTENT:
+			return "204 No content";
+			break;
+		case HTTP_MOVED_PERMANENTLY:
+			//sprintf(code_string, "%s%u Moved Permanently%s", COL_ORANGE, HTTP_MOVED_PERMANENTLY, COL_END);
+			return "301 Moved permanently";
+			break;
+		case HTTP_FOUND:
+			//sprintf(code_string, "%s%u Found%s", COL_ORANGE, HTTP_FOUND, COL_END);
+			return "302 Found";
+			break;
+		case HTTP_SEE_OTHER:
+			//sprintf(code_string, "%s%u See Other%s", COL_ORANGE, HTTP_SEE_OTHER, COL_END);
+			break;
+		case HTTP_NOT_MODIFIED:
+			return "304 Not modified";
+			break;
+		case HTTP_BAD_REQUEST:
+			//sprintf(code_string, "%s%u Bad Request%s", COL_RED, HTTP_BAD_REQUEST, COL_END);
+			return "400 Bad request";
+			break;
+		case HTTP_UNAUTHORISED:
+			//sprintf(code_string, "%s%u Unauthorised%s", COL_RED, HTTP_UNAUTHORISED, COL_END);
+			return "401 Unauthorised";
+			break;
+		case HTTP_FORBIDDEN:
+			//sprintf(code_string, "%s%u Forbidden%s", COL_RED, HTTP_FORBIDDEN, COL_END);
+			//return code_string;
+			return "403 Forbidden";
+			break;
+		case HTTP_NOT_FOUND:
+			//sprintf(code_string, "%s%u Not Found%s", COL_RED, HTTP_NOT_FOUND, COL_END);
+			return "404 Not found";
+			break;
+		case HTTP_METHOD_NOT_ALLOWED:
+			//sprintf(code_string, "%s%u Method Not Allowed%s", COL_RED, HTTP_METHOD_NOT_ALLOWED, COL_END);
+			return "405 Method Not Allowed";
+			break;
+		case HTTP_REQUEST_TIMEOUT:
+			//sprintf(code_string, "%s%u Request Timeout%s", COL_RED, HTTP_REQUEST_TIMEOUT, COL_END);
+			return "408 Request timeout";
+			break;
+		case HTTP_INTERNAL_ERROR:
+			//sprintf(code_string, "%s%u Internal Server Error%s", COL_RED, HTTP_INTERNAL_ERROR, COL_END);
+			return "500 Internal server error";
+			break;
+		case HTTP_BAD_GATEWAY:
+			//sprintf(code_string, "%s%u Bad Gateway%s", COL_RED, HTTP_BAD_GATEWAY, COL_END);
+			return "502 Bad gateway";
+			break;
+		case HTTP_SERVICE_UNAV:
+			//sprintf(code_string, "%s%u Service Unavailable%s", COL_RED, HTTP_SERVICE_UNAV, COL_END);
+			return "503 Service unavailable";
+			break;
+		case HTTP_GATEWAY_TIMEOUT:
+			//sprintf(code_string, "%s%u Gateway Timeout%s", COL_RED, HTTP_GATEWAY_TIMEOUT, COL_END);
+			return "504 Gateway timeout";
+			break;
+		default:
+			//sprintf(code_string, "%sUnknown (%u)%s", COL_RED, code, COL_END);
+			return "Unknown";
+	}
+
+	return "Unknown";
+
+//	return code_string;
+}
+
+ssize_t
+http_response_header_len(buf_t *buf)
+{
+	assert(buf);
+
+	char	*p;
+
+	if (!buf_integrity(buf))
+		return -1;
+
+	p = HTTP_EOH(buf);
+
+	return (p - buf->buf_head);
+}
+
+char *
+URL_parse_host(char *url, char *host)
+{
+	char *p;
+	size_t url_len = strlen(url);
+	char *endp;
+
+	host[0] = 0;
+
+	p = url;
+	url_len = strlen(url);
+
+	if (!strncmp("http:", url, 5) || !strncmp("https:", url, 6))
+	{
+		p += strlen("http://");
+	}
+
+	while (*p == '/')
+		++p;
+
+	endp = memchr(p, ':', ((url + url_len) - p));
+
+/*
+ * Sometimes, a server may send a 301 with a location header
+ * that includes the port (https://website.com:443/page).
+ * However, some pages (such as wiki pages), have a colon
+ * in the page name (https://wiki.website.com/wiki/page_name:more_name)
+ * So actually check to see if there is a port number. If not,
+ * use the '/' as the delimitation.
+ */
+
+	if (endp)
+	{
+		if (strncmp("80", endp+1, 2) && strncmp("443", endp+1, 3))
+			endp = NULL;
+	}
+
+	if (!endp)
+		endp = memchr(p, '/', ((url + url_len) - p));
+
+	if (!endp)
+		endp = url + url_len;
+
+	strncpy(host, p, endp - p);
+	host[endp - p] = 0;
+
+	return host;
+}
+
+char *
+URL_parse_page(char *url, char *page)
+{
+	char *p;
+	char *q;
+	size_t url_len = strlen(url);
+	char *endp = (url + url_len);
+
+	p = url;
+	q = endp;
+
+	page[0] = 0;
+
+	if (!url_len)
+		return NULL;
+
+	if (!strncmp("http:", url, 5) || !strncmp("https:", url, 6))
+	{
+		if (url_len < httplen || url_len < httpslen)
+			return NULL;
+
+		p += strlen("http://");
+	}
+
+#if 0
+	if (!keep_trailing_slash(nwctx))
+	{
+		if (*(endp - 1) == '/')
+		{
+			--endp;
+			*endp = 0;
+		}
+	}
+#endif
+
+	while (*p == '/')
+		++p;
+
+	q = memchr(p, '/', (endp - p));
+
+	if (!q || (q + 1) == endp)
+	{
+		strncpy(page, "/", 1);
+		page[1] = 0;
+		return page;
+	}
+
+	strncpy(page, q, (endp - q));
+	page[endp - q] = 0;
+
+	return page;
+}
+
+/**
+ * http_check_header - check existence of header
+ * @buf: buffer containing header
+ * @name: name of the header
+ * @off: the offset from within the header to start search
+ * @ret_off: offset where header found returned here
+ *
+ * We might want to check for several of the same header
+ * type (like Set-Cookie). So returning the offset at which
+ * we found a header field allows us to continue a search
+ * past that point for more.
+ *
+int
+check_header_1_1(buf_t *buf, const char *name, off_t off, off_t *ret_off)
+{
+	assert(buf);
+	assert(name);
+
+	char *check_from = buf->buf_head + off;
+	char *p;
+	char *tail = buf->buf_tail;
+
+	if ((p = strstr(check_from, name)))
+	{
+		if (p < tail)
+		{
+			*ret_off = (off_t)(p - buf->buf_head);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+*/
+
+/*
+#define HTTP_STATUS(b) \
+({ \
+	char *__p;\
+	char *__q;\
+	char *__eoh = HTTP_EOH((b));\
+	int __st = 0;\
+	__p = (b)->buf_head;\
+	__q = memchr(__p, ' ', (__eoh - __p));\
+	if (__q){\
+		__p = ++__q;\
+		__q = memchr(__p, ' ', (__eoh - __p));\
+		if (__q){\
+			__st = (int)strtoul(__p, &__q, 10);\
+		}\
+	}\
+	__st;\
+})
+
+int
+http_parse_header(buf_t *buf, struct http_header *head)
+{
+	assert(buf);
+	assert(head);
+
+	head->next = NULL;
+	head->status = -1;
+
+	char *eoh = HTTP_EOH(buf);
+	struct http_field *f = NULL;
+
+	if (!eoh)
+		return -1;
+
+	head->status = HTTP_STATUS(buf);
+	if (!head->status)
+		return -1;
+
+	char *p = NULL;
+	char *q = NULL;
+
+	q = buf->buf_head;
+	p = memchr(q, '\r', (eoh - q));
+
+	if (!p)
+		return -1;
+
+	++p;
+
+	head->field = nw_malloc(sizeof(struct http_field));
+	if (!head->field)
+		return -1;
+
+	f = head->field;
+
+	while (1)
+	{
+		q = memchr(p, ':', (eoh - p));
+		if (!q)
+			break;
+
+		f = nw_malloc(sizeof(struct http_field));
+		if (!f)
+			goto fail;
+
+		f->nlen = (q - p);
+		f->name = nw_calloc(f->nlen+1, 1);
+		if (!f->name)
+			goto fail;
+
+		memcpy(f->name, p, f->nlen);
+		f->name[f->nlen] = 0;
+
+		p = ++q;
+		if (*p == ' ')
+			++p;
+
+		q = memchr(p, '\r', (eoh - p));
+		if (!q)
+			goto fail;
+
+		f->vlen = (q - p);
+		f->value = nw_calloc(f->vlen+1, 1);
+		if (!f->value)
+			goto fail;
+
+		memcpy(f->value, p, f->vlen);
+		f->value[f->vlen] = 0;
+
+		f->next = NULL;
+	}
+}
+*/
+
+/**
+ * Get a header field value from the last response.
+ *
+ * @http: our HTTP object
+ * @key: header field name (e.g., content-length)
+ *
+ * The value is copied out of the read buffer and
+ * is good until the next call.
+ */
+char *
+fetch_header_1_1(struct http_t *http, char *key)
+{
+	assert(http);
+	assert(key);
+
+	struct HTTP_private *private = (struct HTTP_private *)http;
+	struct http_header_field *field;
+	size_t key_len = strlen(key);
+	int slot = http_header_slot(key, key_len);
+	int i = -1;
+	char *value;
+	size_t len;
+
+	if (HDR_OTHER != slot)
+	{
+		i = private->headers.first[slot];
+	}
+	else
+	{
+		for (i = 0; i < private->headers.nr_fields; ++i)
+		{
+			field = &private->headers.fields[i];
+
+			if (field->name_len == key_len &&
+			!strncasecmp(http_rbuf(http).buf_head + field->name_off, key, key_len))
+				break;
+		}
 
-	if (needResend)
-	{
-		_log("Resending request to web server\n");
-		http->ops->send_request(http);
-		needResend = 0;
-		_log("Sent request. Jumping to retry\n");
-		goto rp_receive;
+		if (i == private->headers.nr_fields)
+			i = -1;
 	}
 
-out:
-	return total_bytes;
+	if (i < 0)
+		return NULL;
 
-fail:
-	_drain_socket(http);
-	return -1;
+	value = http_header_field_value(http, i, &len);
+
+	if (len >= HTTP_HEADER_FIELD_MAX_LENGTH)
+		len = HTTP_HEADER_FIELD_MAX_LENGTH - 1;
+
+	memcpy(private->header_value, value, len);
+	private->header_value[len] = 0;
+
+	return private->header_value;
 }
 
 /**
- * Return the HTTP code in the response header (200, 404...)
+ * Append a new header field to the request
+ * header in the buffer.
  *
- * @buf The buffer holding the web server's response.
+ * @http Our HTTP object.
+ * @key The name of the header field.
  */
+//append_header_1_1(buf_t *buf, http_header_t *hh)
 int
-http_status_code_int(buf_t *buf)
+append_header_1_1(struct http_t *http, char *field_name, char *field_value)
 {
-	assert(buf);
-
-	char *p = NULL;
-	char *q = NULL;
-	char *eoh = HTTP_EOH(buf);
-	char code_str[16];
-
-	if (!eoh)
-		return -1;
-
-	p = buf->buf_head;
-
-	/*
-	 * HTTP/1.1 200 OK\r\n
-	 */
-
-	p = memchr(p, ' ', (eoh - p));
-	if (!p)
-		return -1;
-
-	++p;
+	assert(http);
+	assert(field_name);
+	assert(field_value);
 
-	q = memchr(p, ' ', (eoh - p));
+	buf_t *buf = &http->conn.write_buf;
+	struct iovec iov[4];
+	int nr = 0;
 
-	if (!q)
+/*
+ * The header ends the buffer, so drop the final
+ * CRLF and put it back after the new field.
+ */
+	if (buf->data_len < 4 || memcmp(buf->buf_tail - 4, HTTP_EOH_SENTINEL, 4))
 		return -1;
 
-	if ((q - p) > 3)
-		return -1;
+	buf_snip(buf, 2);
 
-	strncpy(code_str, p, (q - p));
-	code_str[q - p] = 0;
+	HTTP_IOV(iov, nr, field_name, strlen(field_name));
+	HTTP_IOV_STR(iov, nr, ": ");
+	HTTP_IOV(iov, nr, field_value, strlen(field_value));
+	HTTP_IOV_STR(iov, nr, HTTP_EOH_SENTINEL);
 
-	return atoi(code_str);
+	return buf_append_iov(buf, iov, nr);
 }
 
-const char *
-code_as_string(struct http_t *http)
+/**
+ * The URL for which the next request is to be
+ * made may be on a different server. We would
+ * need establish a new connection in that case.
+ */
+void
+http_check_host(struct http_t *http)
 {
 	assert(http);
 
-	//char code_string[64];
+	char old_host[HTTP_HNAME_MAX];
+	//struct HTTP_private *private = (struct HTTP_private *)http;
 
-	switch((unsigned int)http->code)
+	if (!http->URL[0])
+		return;
+
+	assert(strlen(http->host) < HTTP_HNAME_MAX);
+	strcpy(old_host, http->host);
+	http->ops->URL_parse_host(http->URL, http->host);
+
+	if (strcmp(http->host, old_host))
 	{
-		case HTTP_SWITCHING_PROTOCOLS:
-			return "101 Switching Protocols";
-			break;
-		case HTTP_OK:
-			//sprintf(code_string, "%s%u OK%s", COL_DARKGREEN, HTTP_OK, COL_END);
-			return "200 OK";
-			break;
-		case HTTP_MOVED_PERMANENTLY:
-			//sprintf(code_string, "%s%u Moved Permanently%s", COL_ORANGE, HTTP_MOVED_PERMANENTLY, COL_END);
-			return "301 Moved permanently";
-			break;
-		case HTTP_FOUND:
-			//sprintf(code_string, "%s%u Found%s", COL_ORANGE, HTTP_FOUND, COL_END);
-			return "302 Found";
-			break;
-		case HTTP_SEE_OTHER:
-			//sprintf(code_string, "%s%u See Other%s", COL_ORANGE, HTTP_SEE_OTHER, COL_END);
-			break;
-		case HTTP_BAD_REQUEST:
-			//sprintf(code_string, "%s%u Bad Request%s", COL_RED, HTTP_BAD_REQUEST, COL_END);
-			return "400 Bad request";
-			break;
-		case HTTP_UNAUTHORISED:
-			//sprintf(code_string, "%s%u Unauthorised%s", COL_RED, HTTP_UNAUTHORISED, COL_END);
-			return "401 Unauthorised";
-			break;
-		case HTTP_FORBIDDEN:
-			//sprintf(code_string, "%s%u Forbidden%s", COL_RED, HTTP_FORBIDDEN, COL_END);
-			//return code_string;
-			return "403 Forbidden";
-			break;
-		case HTTP_NOT_FOUND:
-			//sprintf(code_string, "%s%u Not Found%s", COL_RED, HTTP_NOT_FOUND, COL_END);
-			return "404 Not found";
-			break;
-		case HTTP_METHOD_NOT_ALLOWED:
-			//sprintf(code_string, "%s%u Method Not Allowed%s", COL_RED, HTTP_METHOD_NOT_ALLOWED, COL_END);
-			return "405 Method Not Allowed";
-			break;
-		case HTTP_REQUEST_TIMEOUT:
-			//sprintf(code_string, "%s%u Request Timeout%s", COL_RED, HTTP_REQUEST_TIMEOUT, COL_END);
-			return "408 Request timeout";
-			break;
-		case HTTP_INTERNAL_ERROR:
-			//sprintf(code_string, "%s%u Internal Server Error%s", COL_RED, HTTP_INTERNAL_ERROR, COL_END);
-			return "500 Internal server error";
-			break;
-		case HTTP_BAD_GATEWAY:
-			//sprintf(code_string, "%s%u Bad Gateway%s", COL_RED, HTTP_BAD_GATEWAY, COL_END);
-			return "502 Bad gateway";
-			break;
-		case HTTP_SERVICE_UNAV:
-			//sprintf(code_string, "%s%u Service Unavailable%s", COL_RED, HTTP_SERVICE_UNAV, COL_END);
-			return "503 Service unavailable";
-			break;
-		case HTTP_GATEWAY_TIMEOUT:
-			//sprintf(code_string, "%s%u Gateway Timeout%s", COL_RED, HTTP_GATEWAY_TIMEOUT, COL_END);
-			return "504 Gateway timeout";
-			break;
-		default:
-			//sprintf(code_string, "%sUnknown (%u)%s", COL_RED, code, COL_END);
-			return "Unknown";
+		http_reconnect(http);
 	}
 
-	return "Unknown";
-
-//	return code_string;
+	return;
 }
 
-ssize_t
-http_response_header_len(buf_t *buf)
+/**
+ * Check if the HTTP connection has been closed.
+ *
+ * XXX - Not sure about this function.
+ */
+int
+http_connection_closed(struct http_t *http)
 {
-	assert(buf);
-
-	char	*p;
+	assert(http);
 
-	if (!buf_integrity(buf))
-		return -1;
+	size_t len;
+	char *value = http_header(http, HDR_CONNECTION, &len);
 
-	p = HTTP_EOH(buf);
+	if (value && len == 5 && !strncasecmp("close", value, 5))
+		return 1;
 
-	return (p - buf->buf_head);
+	return 0;
 }
 
-char *
-URL_parse_host(char *url, char *host)
+int
+HTTP_retry_after(struct http_t *http)
 {
-	char *p;
-	size_t url_len = strlen(url);
-	char *endp;
-
-	host[0] = 0;
+	assert(http);
 
-	p = url;
-	url_len = strlen(url);
+	char *value;
+	struct tm tm;
+	time_t delta;
 
-	if (!strncmp("http:", url, 5) || !strncmp("https:", url, 6))
-	{
-		p += strlen("http://");
-	}
+	if (HTTP_TOO_MANY_REQUESTS != http->code && HTTP_SERVICE_UNAV != http->code)
+		return 0;
 
-	while (*p == '/')
-		++p;
+	if (!(value = http->ops->fetch_header(http, "Retry-After")))
+		return 0;
 
-	endp = memchr(p, ':', ((url + url_len) - p));
+	if (isdigit((unsigned char)*value))
+		return atoi(value);
 
 /*
- * Sometimes, a server may send a 301 with a location header
- * that includes the port (https://website.com:443/page).
- * However, some pages (such as wiki pages), have a colon
- * in the page name (https://wiki.website.com/wiki/page_name:more_name)
- * So actually check to see if there is a port number. If not,
- * use the '/' as the delimitation.
+ * Otherwise it is an HTTP-date.
  */
+	memset(&tm, 0, sizeof(tm));
 
-	if (endp)
-	{
-		if (strncmp("80", endp+1, 2) && strncmp("443", endp+1, 3))
-			endp = NULL;
-	}
-
-	if (!endp)
-		endp = memchr(p, '/', ((url + url_len) - p));
-
-	if (!endp)
-		endp = url + url_len;
+	if (!strptime(value, "%a, %d %b %Y %H:%M:%S GMT", &tm))
+		return 0;
 
-	strncpy(host, p, endp - p);
-	host[endp - p] = 0;
+	delta = timegm(&tm) - time(NULL);
 
-	return host;
+	return (delta > 0 ? (int)delta : 0);
 }
 
-char *
-URL_parse_page(char *url, char *page)
+static int
+HTTP_init_object(struct HTTP_private *private, uint32_t id)
 {
-	char *p;
-	char *q;
-	size_t url_len = strlen(url);
-	char *endp = (url + url_len);
+	struct http_t *http;
+	int i;
 
-	p = url;
-	q = endp;
+	http = (struct http_t *)private;
+	http->id = id;
 
-	page[0] = 0;
+	http_header_reset(&private->headers);
+	private->request_fixed_len = 0;
+	private->eoh_off = 0;
 
-	if (!url_len)
-		return NULL;
+	http->host = calloc(HTTP_HOST_MAX+1, 1);
+	http->conn.host_addr = calloc(HTTP_ALIGN_SIZE(INET6_ADDRSTRLEN+1), 1);
+	http->primary_host = calloc(HTTP_HOST_MAX+1, 1);
+	http->page = calloc(HTTP_URL_MAX+1, 1);
+	http->URL = calloc(HTTP_URL_MAX+1, 1);
 
-	if (!strncmp("http:", url, 5) || !strncmp("https:", url, 6))
-	{
-		if (url_len < httplen || url_len < httpslen)
-			return NULL;
+	http->ops = Default_Version_Methods;
+	http->version = HTTP_DEFAULT_VERSION;
 
-		p += strlen("http://");
-	}
+	http->conn.sock = -1;
+	http->conn.ssl = NULL;
+	http->conn.epoll_fd = -1;
 
-#if 0
-	if (!keep_trailing_slash(nwctx))
+	for (i = 0; i < HTTP_PIPELINE_MAX; ++i)
 	{
-		if (*(endp - 1) == '/')
-		{
-			--endp;
-			*endp = 0;
-		}
+		if (!(private->pipeline[i] = calloc(HTTP_URL_MAX+1, 1)))
+			goto fail;
 	}
-#endif
-
-	while (*p == '/')
-		++p;
 
-	q = memchr(p, '/', (endp - p));
+	private->pipeline_next = 0;
+	private->nr_pipelined = 0;
+	private->pipelining = 0;
+	private->pipeline_failed = 0;
+	http->pipelineDepth = 0;
 
-	if (!q || (q + 1) == endp)
-	{
-		strncpy(page, "/", 1);
-		page[1] = 0;
-		return page;
-	}
+	private->h2 = NULL;
+	private->h2_stream = 0;
+	http->useHTTP2 = 0;
 
-	strncpy(page, q, (endp - q));
-	page[endp - q] = 0;
+	http->getValidators = NULL;
+	http->timeouts = default_timeouts;
+	clear_struct(&private->transfer_deadline);
 
-	return page;
-}
+	http->openSink = NULL;
+	http->bodySink = -1;
+	private->sinking = 0;
+	private->sink_pipe[0] = private->sink_pipe[1] = -1;
 
-/**
- * http_check_header - check existence of header
- * @buf: buffer containing header
- * @name: name of the header
- * @off: the offset from within the header to start search
- * @ret_off: offset where header found returned here
- *
- * We might want to check for several of the same header
- * type (like Set-Cookie). So returning the offset at which
- * we found a header field allows us to continue a search
- * past that point for more.
- *
-int
-check_header_1_1(buf_t *buf, const char *name, off_t off, off_t *ret_off)
-{
-	assert(buf);
-	assert(name);
+	http->bodyAction = HTTP_BODY_DEFAULT;
+	private->body_max = 0;
+	private->body_dropped = 0;
 
-	char *check_from = buf->buf_head + off;
-	char *p;
-	char *tail = buf->buf_tail;
+	private->decoding = 0;
+	clear_struct(&private->decoder);
 
-	if ((p = strstr(check_from, name)))
+	clear_struct(&private->decoded);
+	if (buf_chain_init(&private->decoded, BUF_SEG_SIZE) < 0)
+		goto fail;
+
+	clear_struct(&private->carry);
+	if (buf_init(&private->carry, HTTP_DEFAULT_READ_BUF_SIZE) < 0)
+		goto fail;
+
+	if (buf_init(&http->conn.read_buf, HTTP_DEFAULT_READ_BUF_SIZE) < 0)
 	{
-		if (p < tail)
-		{
-			*ret_off = (off_t)(p - buf->buf_head);
-			return 1;
-		}
+		fprintf(stderr, "HTTP_init_object: failed to initialise read buf\n");
+		goto fail;
 	}
 
-	return 0;
-}
-*/
+	if (buf_init(&http->conn.write_buf, HTTP_DEFAULT_WRITE_BUF_SIZE) < 0)
+	{
+		fprintf(stderr, "HTTP_init_object: failed to initialise write buf\n");
+		goto fail;
+	}
 
-/*
-#define HTTP_STATUS(b) \
-({ \
-	char *__p;\
-	char *__q;\
-	char *__eoh = HTTP_EOH((b));\
-	int __st = 0;\
-	__p = (b)->buf_head;\
-	__q = memchr(__p, ' ', (__eoh - __p));\
-	if (__q){\
-		__p = ++__q;\
-		__q = memchr(__p, ' ', (__eoh - __p));\
-		if (__q){\
-			__st = (int)strtoul(__p, &__q, 10);\
-		}\
-	}\
-	__st;\
-})
+	assert(http->host);
+	assert(http->conn.host_addr);
+	assert(http->primary_host);
+	assert(http->page);
+	assert(http->URL);
 
-int
-http_parse_header(buf_t *buf, struct http_header *head)
-{
-	assert(buf);
-	assert(head);
+	return 0;
 
-	head->next = NULL;
-	head->status = -1;
+fail:
 
-	char *eoh = HTTP_EOH(buf);
-	struct http_field *f = NULL;
+	buf_destroy(&http->conn.read_buf);
 
-	if (!eoh)
-		return -1;
+	return -1;
+}
 
-	head->status = HTTP_STATUS(buf);
-	if (!head->status)
-		return -1;
+/**
+ * HTTP_set_default_timeouts - set the deadlines new HTTP objects start with
+ *
+ * Call before creating any worker threads.
+ */
+void
+HTTP_set_default_timeouts(struct HTTP_timeouts *timeouts)
+{
+	assert(timeouts);
 
-	char *p = NULL;
-	char *q = NULL;
+	default_timeouts = *timeouts;
 
-	q = buf->buf_head;
-	p = memchr(q, '\r', (eoh - q));
+	return;
+}
 
-	if (!p)
-		return -1;
+/**
+ * HTTP_set_type_policies - set what to do with bodies of each Content-Type
+ * @policies: the policies (copied)
+ * @nr: how many; any past HTTP_TYPE_POLICY_MAX are ignored
+ */
+void
+HTTP_set_type_policies(struct HTTP_type_policy *policies, int nr)
+{
+	if (nr > HTTP_TYPE_POLICY_MAX)
+		nr = HTTP_TYPE_POLICY_MAX;
 
-	++p;
+	if (nr > 0)
+		memcpy(type_policies, policies, nr * sizeof(*policies));
 
-	head->field = nw_malloc(sizeof(struct http_field));
-	if (!head->field)
-		return -1;
+	nr_type_policies = (nr > 0 ? nr : 0);
 
-	f = head->field;
+	return;
+}
 
-	while (1)
-	{
-		q = memchr(p, ':', (eoh - p));
-		if (!q)
-			break;
+/**
+ * HTTP_set_socket_profile - set the options given to sockets we connect
+ */
+void
+HTTP_set_socket_profile(struct HTTP_socket_profile *profile)
+{
+	assert(profile);
 
-		f = nw_malloc(sizeof(struct http_field));
-		if (!f)
-			goto fail;
+	socket_profile = *profile;
 
-		f->nlen = (q - p);
-		f->name = nw_calloc(f->nlen+1, 1);
-		if (!f->name)
-			goto fail;
+	return;
+}
 
-		memcpy(f->name, p, f->nlen);
-		f->name[f->nlen] = 0;
+int
+HTTP_socket_stats(struct HTTP_socket_profile *effective)
+{
+	assert(effective);
 
-		p = ++q;
-		if (*p == ' ')
-			++p;
+	int nr;
 
-		q = memchr(p, '\r', (eoh - p));
-		if (!q)
-			goto fail;
+	pthread_mutex_lock(&socket_stats_lock);
 
-		f->vlen = (q - p);
-		f->value = nw_calloc(f->vlen+1, 1);
-		if (!f->value)
-			goto fail;
+	*effective = socket_effective;
+	nr = nr_sockets;
 
-		memcpy(f->value, p, f->vlen);
-		f->value[f->vlen] = 0;
+	pthread_mutex_unlock(&socket_stats_lock);
 
-		f->next = NULL;
-	}
+	return nr;
 }
-*/
 
 /**
- * Get a header field value from our hash bucket.
+ * Create a new HTTP object instance.
  *
- * @http: our HTTP object
- * @key: header field name (e.g., content-length)
+ * @id The id to identify the object (e.g., thread ID)
  */
-char *
-fetch_header_1_1(struct http_t *http, char *key)
+struct http_t *
+HTTP_new(uint32_t id)
 {
-	assert(http);
-	assert(key);
+	struct HTTP_private *private = malloc(sizeof(struct HTTP_private));
 
-	struct HTTP_private *private = (struct HTTP_private *)http;
-	bucket_t *bucket = private->headers->get(private->headers, key);
-	if (!bucket)
-		return NULL;
+	if (!private)
+	{
+		_log("http_new: failed to allocate memory for new HTTP object\n");
+		goto fail;
+	}
+
+	if (HTTP_init_object(private, id) < 0)
+	{
+		_log("http_new: failed to initialise HTTP object\n");
+		goto fail;
+	}
+
+	_log("Created HTTP object @ %p\n", private);
+	return (struct http_t *)private;
 
-	return (char *)bucket->data;
+fail:
+	return NULL;
 }
 
 void
-append_cookies_1_1(struct http_t *http)
+HTTP_delete(struct http_t *http)
 {
 	assert(http);
 
 	struct HTTP_private *private = (struct HTTP_private *)http;
+	int i;
 
-	bucket_t *bucket = private->headers->get(private->headers, "set-cookie");
+	free(http->host);
+	free(http->page);
+	free(http->primary_host);
+	free(http->conn.host_addr);
+	free(http->URL);
 
-	if (!bucket)
-		return;
+	buf_destroy(&http->conn.read_buf);
+	buf_destroy(&http->conn.write_buf);
+	buf_destroy(&private->carry);
 
-	buf_t *buf = &http->conn.write_buf;
-	buf_t tmp;
-	char *p = HTTP_EOH(buf);
+	http_decode_cancel(http);
+	buf_chain_destroy(&private->decoded);
 
-	if (!p)
-		return;
+	http_sink_pipe_close(private);
+
+	for (i = 0; i < HTTP_PIPELINE_MAX; ++i)
+		free(private->pipeline[i]);
+
+	if (private->h2)
+		HTTP2_conn_delete(private->h2);
+
+	if (http->conn.epoll_fd != -1)
+	{
+		close(http->conn.epoll_fd);
+		http->conn.epoll_fd = -1;
+	}
 
-	p -= 2;
+	_log("Deleted HTTP object\n");
+
+	return;
+}
+
+/*
+ * ================================================================================================
+ *
+ * Start of functions related to connection with remote web server.
+ *
+ * ================================================================================================
+ */
+
+/**
+ * http_order_addrs - put the addresses in the order we will try them (RFC 8305 4)
+ *
+ * The resolver's first choice goes first; after that
+ * the families alternate, so that a broken IPv6 (or
+ * IPv4) path costs us one attempt delay, not all of
+ * its addresses. Anything but IPv4 and IPv6 is left
+ * out. The port is filled in.
+ */
+static void
+http_order_addrs(struct http_t *http, struct DNS_addrs *in, struct DNS_addrs *out)
+{
+	int used[DNS_MAX_ADDRS];
+	in_port_t port = htons(http->usingSecure ? HTTPS_PORT : HTTP_PORT);
+	sa_family_t family;
+	int nr = 0;
+	int i;
+
+	out->nr_addrs = 0;
+
+	for (i = 0; i < in->nr_addrs; ++i)
+	{
+		used[i] = (AF_INET != in->addrs[i].ss_family && AF_INET6 != in->addrs[i].ss_family);
+		nr += !used[i];
+	}
 
-	buf_init(&tmp, HTTP_COOKIE_MAX+256);
+	family = AF_UNSPEC;
 
-	while (bucket)
+	while (out->nr_addrs < nr)
 	{
-		buf_append(&tmp, "Cookie: ");
-		buf_append_ex(&tmp, (char *)bucket->data, bucket->data_len);
-		buf_append_ex(&tmp, HTTP_EOL, 2);
+		for (i = 0; i < in->nr_addrs; ++i)
+		{
+			if (!used[i] && (AF_UNSPEC == family || in->addrs[i].ss_family == family))
+				break;
+		}
+
+	/*
+	 * None of that family left; take the next of the other.
+	 */
+		if (i == in->nr_addrs)
+		{
+			for (i = 0; used[i]; ++i)
+				;
+		}
 
-		buf_shift(buf, (off_t)(p - buf->buf_head), tmp.data_len);
+		used[i] = 1;
 
-		strncpy(p, tmp.buf_head, tmp.data_len);
+		memcpy(&out->addrs[out->nr_addrs], &in->addrs[i], in->addr_lens[i]);
+		out->addr_lens[out->nr_addrs] = in->addr_lens[i];
 
-		p += tmp.data_len;
+		if (AF_INET6 == in->addrs[i].ss_family)
+			((struct sockaddr_in6 *)&out->addrs[out->nr_addrs])->sin6_port = port;
+		else
+			((struct sockaddr_in *)&out->addrs[out->nr_addrs])->sin_port = port;
 
-		buf_clear(&tmp);
+		++out->nr_addrs;
 
-		bucket = bucket->next;
+		family = (AF_INET6 == in->addrs[i].ss_family ? AF_INET : AF_INET6);
 	}
 
-	buf_destroy(&tmp);
+	return;
 }
 
 /**
- * Append a new header field to the request
- * header in the buffer.
+ * http_socket_tune - apply the socket profile to a socket about to connect
  *
- * @http Our HTTP object.
- * @key The name of the header field.
+ * The receive buffer has to be set before connecting
+ * for the window scale we offer to allow for it. None
+ * of the options are essential, so failures are only
+ * logged. FAST_OPEN says whether this attempt may use
+ * TCP Fast Open, if the profile asks for it.
  */
-//append_header_1_1(buf_t *buf, http_header_t *hh)
-int
-append_header_1_1(struct http_t *http, char *field_name, char *field_value)
+static void
+http_socket_tune(int fd, int fast_open)
 {
-	assert(http);
-	assert(field_name);
-	assert(field_value);
-
-	buf_t *buf = &http->conn.write_buf;
-	buf_t tmp;
-	char *p = HTTP_EOH(buf);
-
-	p -= 2;
-/*
- * \r\n\r\n
- *      ^
- *      p
- */
+	struct HTTP_socket_profile *p = &socket_profile;
+	int on = 1;
+	int idle;
+	int intvl = HTTP_SOCK_KEEPALIVE_INTVL;
+	int probes = HTTP_SOCK_KEEPALIVE_PROBES;
+
+	if (p->nodelay && setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0)
+		_log("%s: TCP_NODELAY (%s)\n", __func__, strerror(errno));
+
+#ifdef TCP_FASTOPEN_CONNECT
+	if (fast_open && p->fast_open && setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &on, sizeof(on)) < 0)
+		_log("%s: TCP_FASTOPEN_CONNECT (%s)\n", __func__, strerror(errno));
+#endif
 
-	buf_init(&tmp, HTTP_HEADER_FIELD_MAX_LENGTH+2);
+	if (p->rcvbuf > 0 && setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &p->rcvbuf, sizeof(p->rcvbuf)) < 0)
+		_log("%s: SO_RCVBUF (%s)\n", __func__, strerror(errno));
 
-	buf_append(&tmp, field_name);
-	buf_append(&tmp, ": ");
-	buf_append(&tmp, field_value);
-	buf_append_ex(&tmp, HTTP_EOL, 2);
+	if (p->keepalive > 0)
+	{
+		idle = p->keepalive;
 
-	buf_shift(buf, (off_t)(p - buf->buf_head), tmp.data_len);
-	memcpy((void *)p, (void *)tmp.buf_head, tmp.data_len);
+		if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)) < 0
+		|| setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle)) < 0
+		|| setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &intvl, sizeof(intvl)) < 0
+		|| setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &probes, sizeof(probes)) < 0)
+			_log("%s: keepalive (%s)\n", __func__, strerror(errno));
+	}
 
-	buf_destroy(&tmp);
+	if (p->user_timeout > 0
+	&& setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &p->user_timeout, sizeof(p->user_timeout)) < 0)
+		_log("%s: TCP_USER_TIMEOUT (%s)\n", __func__, strerror(errno));
 
-	return 0;
+	return;
 }
 
 /**
- * The URL for which the next request is to be
- * made may be on a different server. We would
- * need establish a new connection in that case.
+ * http_socket_record - note the option values the kernel settled on for a connected socket
  */
-void
-http_check_host(struct http_t *http)
+static void
+http_socket_record(int fd)
 {
-	assert(http);
+	struct HTTP_socket_profile e;
+	socklen_t len;
+	int val;
 
-	char old_host[HTTP_HNAME_MAX];
-	//struct HTTP_private *private = (struct HTTP_private *)http;
+	clear_struct(&e);
 
-	if (!http->URL[0])
-		return;
+	len = sizeof(e.nodelay);
+	getsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &e.nodelay, &len);
 
-	assert(strlen(http->host) < HTTP_HNAME_MAX);
-	strcpy(old_host, http->host);
-	http->ops->URL_parse_host(http->URL, http->host);
+#ifdef TCP_FASTOPEN_CONNECT
+	len = sizeof(e.fast_open);
+	getsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &e.fast_open, &len);
+#endif
 
-	if (strcmp(http->host, old_host))
-	{
-		//if (cache_nr_used(private->cookies) > 0)
-		//	cache_clear_all(private->cookies);
+	len = sizeof(e.rcvbuf);
+	getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &e.rcvbuf, &len);
 
-		http_reconnect(http);
+	len = sizeof(val);
+	if (!getsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &val, &len) && val)
+	{
+		len = sizeof(e.keepalive);
+		getsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &e.keepalive, &len);
 	}
 
+	len = sizeof(e.user_timeout);
+	getsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &e.user_timeout, &len);
+
+	pthread_mutex_lock(&socket_stats_lock);
+
+	socket_effective = e;
+	++nr_sockets;
+
+	pthread_mutex_unlock(&socket_stats_lock);
+
 	return;
 }
 
 /**
- * Check if the HTTP connection has been closed.
+ * http_connect_start - open a non-blocking socket and start connecting it to ADDR
  *
- * XXX - Not sure about this function.
+ * Returns the socket, or -1 if the attempt failed
+ * straight away.
  */
-int
-http_connection_closed(struct http_t *http)
+static int
+http_connect_start(struct sockaddr_storage *addr, socklen_t addr_len, int fast_open)
 {
-	assert(http);
+	int fd;
 
-	char *header_value = http->ops->fetch_header(http, "connection");
+	if ((fd = socket(addr->ss_family, SOCK_STREAM|SOCK_NONBLOCK, 0)) < 0)
+		return -1;
 
-	if (!header_value)
-		return 0;
+	http_socket_tune(fd, fast_open);
 
-	if (!strcasecmp("close", header_value))
-		return 1;
+	if (connect(fd, (struct sockaddr *)addr, addr_len) < 0 && EINPROGRESS != errno)
+	{
+		close(fd);
+		return -1;
+	}
 
-	return 0;
+	return fd;
 }
 
+/**
+ * http_connect_eyeballs - connect to whichever of the addresses answers first
+ * @http: our HTTP object
+ * @addrs: the addresses, in the order to try them, with the port filled in
+ *
+ * A new attempt is started every HTTP_CONNECT_ATTEMPT_DELAY
+ * milliseconds (or as soon as one fails) while the earlier
+ * ones are left pending, so an address that does not answer
+ * costs us that delay rather than a SYN timeout (RFC 8305 5).
+ * The first socket to connect becomes http_socket(http) and
+ * the others are closed. All of it is bounded by
+ * http->timeouts.connect.
+ *
+ * With TCP Fast Open a non-blocking connect() "succeeds"
+ * at once, reachable or not (the SYN waits for the first
+ * write), which would make the first address win every
+ * race. So Fast Open is only used when there is just the
+ * one address and nothing to race.
+ *
+ * Returns the index of the address we connected to, or -1.
+ */
 static int
-HTTP_init_object(struct HTTP_private *private, uint32_t id)
+http_connect_eyeballs(struct http_t *http, struct DNS_addrs *addrs)
 {
-	struct http_t *http;
-	char cache_name[128];
+	assert(http);
+	assert(addrs);
+
+	struct pollfd pfds[DNS_MAX_ADDRS];
+	int which[DNS_MAX_ADDRS]; /* the address pfds[i] is connecting to */
+	struct timespec deadline;
+	struct timespec next_attempt;
+	int fast_open = (1 == addrs->nr_addrs);
+	int nr_pending = 0;
+	int next = 0;
+	int winner = -1;
+	int timeout;
+	int err;
+	socklen_t err_len;
+	int i;
+
+	http_set_deadline(&deadline, http->timeouts.connect);
+	clock_gettime(CLOCK_MONOTONIC, &next_attempt);
+
+	while (winner < 0)
+	{
+		if (next < addrs->nr_addrs && !http_ms_until(&next_attempt))
+		{
+			if ((pfds[nr_pending].fd = http_connect_start(&addrs->addrs[next], addrs->addr_lens[next], fast_open)) >= 0)
+			{
+				pfds[nr_pending].events = POLLOUT;
+				pfds[nr_pending].revents = 0;
+				which[nr_pending++] = next;
 
-	http = (struct http_t *)private;
-	http->id = id;
+				clock_gettime(CLOCK_MONOTONIC, &next_attempt);
+				next_attempt.tv_nsec += (HTTP_CONNECT_ATTEMPT_DELAY * 1000000L);
 
-	private->headers = BUCKET_object_new();
-	snprintf(cache_name, 128, "HTTP_cookie_cache-%x", id);
+				if (next_attempt.tv_nsec >= 1000000000L)
+				{
+					++next_attempt.tv_sec;
+					next_attempt.tv_nsec -= 1000000000L;
+				}
+			}
 
-	private->cookies = cache_create(
-			cache_name,
-			sizeof(cookie_t),
-			0,
-			cookie_cache_ctor,
-			cookie_cache_dtor);
+			++next;
+			continue;
+		}
 
-	if (!private->cookies)
-		goto fail;
+		if (!nr_pending)
+		{
+			_log("no address for %s would take a connection\n", http->host);
+			break;
+		}
 
-	private->redirects = BUCKET_object_new();
-	if (!private->redirects)
-		goto fail;
+		if (!(timeout = http_ms_until(&deadline)))
+		{
+			_log("timed out connecting to %s\n", http->host);
+			break;
+		}
 
-	http->host = calloc(HTTP_HOST_MAX+1, 1);
-	http->conn.host_ipv4 = calloc(HTTP_ALIGN_SIZE(INET_ADDRSTRLEN+1), 1);
-	http->primary_host = calloc(HTTP_HOST_MAX+1, 1);
-	http->page = calloc(HTTP_URL_MAX+1, 1);
-	http->URL = calloc(HTTP_URL_MAX+1, 1);
+		if (next < addrs->nr_addrs && http_ms_until(&next_attempt) < timeout)
+			timeout = http_ms_until(&next_attempt);
 
-	http->ops = Default_Version_Methods;
-	http->version = HTTP_DEFAULT_VERSION;
+		if (poll(pfds, nr_pending, timeout) < 0)
+		{
+			if (EINTR == errno)
+				continue;
 
-	if (buf_init(&http->conn.read_buf, HTTP_DEFAULT_READ_BUF_SIZE) < 0)
-	{
-		fprintf(stderr, "HTTP_init_object: failed to initialise read buf\n");
-		goto fail;
-	}
+			_log("%s: poll failed (%s)\n", __func__, strerror(errno));
+			break;
+		}
 
-	if (buf_init(&http->conn.write_buf, HTTP_DEFAULT_WRITE_BUF_SIZE) < 0)
-	{
-		fprintf(stderr, "HTTP_init_object: failed to initialise write buf\n");
-		goto fail;
-	}
+		for (i = 0; i < nr_pending; )
+		{
+			if (!pfds[i].revents)
+			{
+				++i;
+				continue;
+			}
 
-	assert(http->host);
-	assert(http->conn.host_ipv4);
-	assert(http->primary_host);
-	assert(http->page);
-	assert(http->URL);
+			err = 0;
+			err_len = sizeof(err);
 
-	return 0;
+			if (!getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR, &err, &err_len) && !err)
+			{
+				winner = i;
+				break;
+			}
 
-fail:
+			_log("attempt %d to connect to %s failed (%s)\n", which[i], http->host, strerror(err));
 
-	buf_destroy(&http->conn.read_buf);
+		/*
+		 * Try the next address now rather than
+		 * when the attempt delay is up.
+		 */
+			close(pfds[i].fd);
+			pfds[i] = pfds[--nr_pending];
+			which[i] = which[nr_pending];
+			clock_gettime(CLOCK_MONOTONIC, &next_attempt);
+		}
+	}
 
-	if (private->headers)
-		private->headers->destroy(private->headers, 0);
+	for (i = 0; i < nr_pending; ++i)
+	{
+		if (i != winner)
+			close(pfds[i].fd);
+	}
 
-	if (private->cookies)
-		cache_destroy(private->cookies);
+	if (winner < 0)
+		return -1;
 
-	if (private->redirects)
-		private->redirects->destroy(private->redirects, 0);
+	http_socket(http) = pfds[winner].fd;
+	fcntl(http_socket(http), F_SETFL, fcntl(http_socket(http), F_GETFL) & ~O_NONBLOCK);
+	http_socket_record(http_socket(http));
 
-	return -1;
+	return which[winner];
 }
 
 /**
- * Create a new HTTP object instance.
+ * http_tls_handshake - do the TLS handshake, bounded by http->timeouts.handshake
  *
- * @id The id to identify the object (e.g., thread ID)
+ * Done as part of connecting rather than on the first
+ * write so that a server that stalls the handshake is
+ * given up on in good time, and so that we know what
+ * the server chose with ALPN before sending a request.
  */
-struct http_t *
-HTTP_new(uint32_t id)
+static int
+http_tls_handshake(struct http_t *http)
 {
-	struct HTTP_private *private = malloc(sizeof(struct HTTP_private));
+	assert(http);
 
-	if (!private)
+	struct timespec deadline;
+	int flags = fcntl(http_socket(http), F_GETFL);
+	int ready = 1;
+	int rv;
+
+	fcntl(http_socket(http), F_SETFL, flags | O_NONBLOCK);
+	http_set_deadline(&deadline, http->timeouts.handshake);
+
+	while ((rv = SSL_connect(http_tls(http))) != 1)
 	{
-		_log("http_new: failed to allocate memory for new HTTP object\n");
-		goto fail;
+		switch(SSL_get_error(http_tls(http), rv))
+		{
+			case SSL_ERROR_WANT_READ:
+
+				ready = http_wait_socket(http, POLLIN, &deadline);
+				break;
+
+			case SSL_ERROR_WANT_WRITE:
+
+				ready = http_wait_socket(http, POLLOUT, &deadline);
+				break;
+
+			default:
+
+				ready = -1;
+		}
+
+		if (ready <= 0)
+			break;
 	}
 
-	if (HTTP_init_object(private, id) < 0)
+	fcntl(http_socket(http), F_SETFL, flags);
+
+	if (rv != 1)
 	{
-		_log("http_new: failed to initialise HTTP object\n");
-		goto fail;
+		_log("TLS handshake with %s %s\n", http->host, (!ready ? "timed out" : "failed"));
+		return -1;
 	}
 
-	_log("Created HTTP object @ %p\n", private);
-	return (struct http_t *)private;
-
-fail:
-	return NULL;
+	return 0;
 }
 
-void
-HTTP_delete(struct http_t *http)
+/**
+ * http_negotiate_version - pick HTTP/2 or HTTP/1.1 for a new connection
+ */
+static int
+http_negotiate_version(struct http_t *http)
 {
 	assert(http);
 
-	struct HTTP_private *private = (struct HTTP_private *)http;
+	struct HTTP_private *private = HTTP_private(http);
+	const unsigned char *proto = NULL;
+	unsigned int proto_len = 0;
 
-	free(http->host);
-	free(http->page);
-	free(http->primary_host);
-	free(http->conn.host_ipv4);
-	free(http->URL);
+	http->version = HTTP_VERSION_1_1;
+	http->ops = &Methods_v1_1;
 
-	private->headers->destroy(private->headers, 0);
-	private->redirects->destroy(private->redirects, 0);
-	cache_clear_all(private->cookies);
-	cache_destroy(private->cookies);
+	if (!http->usingSecure || !http->useHTTP2)
+		return 0;
 
-	buf_destroy(&http->conn.read_buf);
-	buf_destroy(&http->conn.write_buf);
+	SSL_get0_alpn_selected(http_tls(http), &proto, &proto_len);
 
-	_log("Deleted HTTP object\n");
+	if (proto_len != 2 || memcmp(proto, "h2", 2))
+		return 0;
 
-	return;
-}
+	if (!private->h2 && !(private->h2 = HTTP2_conn_new()))
+		return -1;
 
-/*
- * ================================================================================================
- *
- * Start of functions related to connection with remote web server.
- *
- * ================================================================================================
- */
+	http_set_sock_non_blocking(http);
 
-/*
- * We need to make sure that OpenSSL
- * initialised once and once only.
- */
-static pthread_once_t __ossl_init_once = PTHREAD_ONCE_INIT;
+	if (HTTP2_conn_start(http, private->h2) < 0)
+		return -1;
 
-/**
- * __init_openssl - initialise the openssl library
- */
-static inline void
-__init_openssl(void)
-{
-	SSL_library_init();
-	SSL_load_error_strings();
-	OpenSSL_add_all_algorithms();
-	//OPENSSL_config(NULL); // this became deprecated 
-	ERR_load_crypto_strings();
+	http->version = HTTP_VERSION_2_0;
+	http->ops = &Methods_v2_0;
+
+	_log("Using HTTP/2 with %s\n", http->host);
+
+	return 0;
 }
 
 /**
@@ -2227,77 +4409,102 @@ http_connect(struct http_t *http)
 {
 	assert(http);
 
-	struct sockaddr_in sock4;
-	struct addrinfo *ainf = NULL;
-	struct addrinfo *aip = NULL;
+	struct DNS_addrs resolved;
+	struct DNS_addrs addrs;
+	void *in_addr;
+	int i;
+	int err;
 
-	clear_struct(&sock4);
+/*
+ * Anything left over from the last connection
+ * is of no use on a new one.
+ */
+	buf_clear(&(HTTP_private(http))->carry);
+	(HTTP_private(http))->request_fixed_len = 0;
 
-	if (getaddrinfo(http->host, NULL, NULL, &ainf) < 0)
+/*
+ * Resolved addresses are shared between all HTTP
+ * objects, so a reconnect (or eight workers starting
+ * on the same host) doesn't cost a resolver round trip.
+ */
+	if ((err = DNS_lookup(http->host, &resolved)) != 0)
 	{
-		_log("error getting address information for remote host\n");
+		_log("error getting address information for remote host (%s)\n", gai_strerror(err));
 		goto fail;
 	}
 
-	for (aip = ainf; aip; aip = aip->ai_next)
-	{
-		if (aip->ai_family == AF_INET && aip->ai_socktype == SOCK_STREAM)
-		{
-			memcpy(&sock4, aip->ai_addr, aip->ai_addrlen);
-			break;
-		}
-	}
+	http_order_addrs(http, &resolved, &addrs);
 
-	if (!aip)
+	if ((i = http_connect_eyeballs(http, &addrs)) < 0)
+	{
+		_log("error connecting to remote host\n");
+		DNS_invalidate(http->host);
 		goto fail;
+	}
 
-	assert(http->conn.host_ipv4);
-	sprintf(http->conn.host_ipv4, "%s", inet_ntoa(sock4.sin_addr));
+	assert(http_socket(http) > 2);
 
-	if (http->usingSecure)
-		sock4.sin_port = htons(HTTPS_PORT);
+	if (AF_INET6 == addrs.addrs[i].ss_family)
+		in_addr = &((struct sockaddr_in6 *)&addrs.addrs[i])->sin6_addr;
 	else
-		sock4.sin_port = htons(HTTP_PORT);
+		in_addr = &((struct sockaddr_in *)&addrs.addrs[i])->sin_addr;
 
-	if ((http_socket(http) = socket(AF_INET, SOCK_STREAM, 0)) < 0)
-	{
-		_log("error opening socket\n");
-		goto fail_release_ainf;
-	}
-
-	assert(http_socket(http) > 2);
+	assert(http->conn.host_addr);
+	inet_ntop(addrs.addrs[i].ss_family, in_addr, http->conn.host_addr, INET6_ADDRSTRLEN);
 
-	if (connect(http_socket(http), (struct sockaddr *)&sock4, (socklen_t)sizeof(sock4)) != 0)
-	{
-		_log("error connecting to remote host\n");
-		goto fail_release_ainf;
-	}
+	if (http_epoll_register(http) < 0)
+		goto fail_close_sock;
 
 	if (http->usingSecure)	
 	{
 /*
- * Calling __init_openssl() more than once (multithreaded)
- * has in some instances caused segfaults. Thus, use
- * pthread_once() to do it once only.
+ * The context is shared by every HTTP object and
+ * initialised (along with OpenSSL itself) once only.
  */
-		pthread_once(&__ossl_init_once, __init_openssl);
-		http->conn.ssl_ctx = SSL_CTX_new(TLSv1_2_client_method());
+		if (!(http->conn.ssl_ctx = TLS_client_ctx()))
+			goto fail_close_sock;
+
 		http_tls(http) = SSL_new(http->conn.ssl_ctx);
 
 		SSL_set_fd(http_tls(http), http_socket(http)); /* Set the socket for reading/writing */
+		TLS_session_resume(http_tls(http), http->host); /* SNI and abbreviated handshake if we can */
 		SSL_set_connect_state(http_tls(http)); /* Set as client */
+
+		if (http->useHTTP2)
+			SSL_set_alpn_protos(http_tls(http), (unsigned char *)HTTP2_ALPN_PROTOCOLS, strlen(HTTP2_ALPN_PROTOCOLS));
 	}
 
 	http->conn.sock_nonblocking = 0;
 	http->conn.ssl_nonblocking = 0;
 
-	freeaddrinfo(ainf);
+	if (http->usingSecure && http_tls_handshake(http) < 0)
+	{
+		TLS_session_forget(http->host);
+		http_disconnect(http);
+		goto fail;
+	}
+
+	if (http_negotiate_version(http) < 0)
+	{
+		http_disconnect(http);
+		goto fail;
+	}
+
 	return 0;
 
-fail_release_ainf:
-	freeaddrinfo(ainf);
+fail_close_sock:
+	close(http_socket(http));
+	http_socket(http) = -1;
 
 fail:
+
+/*
+ * Whatever the last connection spoke is no
+ * guide to the next; don't keep using it.
+ */
+	http->version = HTTP_VERSION_1_1;
+	http->ops = &Methods_v1_1;
+
 	return -1;
 }
 
@@ -2310,9 +4517,14 @@ http_disconnect(struct http_t *http)
 	close(http_socket(http));
 	http_socket(http) = -1;
 
-	if (http->usingSecure)
+	if (http->usingSecure && http_tls(http))
 	{
-		SSL_CTX_free(http->conn.ssl_ctx);
+	/*
+	 * Quiet shutdown (see tls_session.c) so the
+	 * session remains resumable. The context is
+	 * shared and must not be freed here.
+	 */
+		SSL_shutdown(http_tls(http));
 		SSL_free(http_tls(http));
 		http->conn.ssl_ctx = NULL;
 		http_tls(http) = NULL;
@@ -2324,81 +4536,11 @@ http_disconnect(struct http_t *http)
 int
 http_reconnect(struct http_t *http)
 {
-	struct sockaddr_in sock4;
-	struct addrinfo *ainf = NULL;
-	struct addrinfo *aip = NULL;
-
-	shutdown(http_socket(http), SHUT_RDWR);
-	close(http_socket(http));
-	http_socket(http) = -1;
-
-	if (http->usingSecure)
-	{
-		SSL_CTX_free(http->conn.ssl_ctx);
-		SSL_free(http_tls(http));
-		http->conn.ssl_ctx = NULL;
-		http_tls(http) = NULL;
-	}
-
-	clear_struct(&sock4);
-
-	if (getaddrinfo(http->host, NULL, NULL, &ainf) < 0)
-	{
-		_log("failed to get address information for remote host\n");
-		goto fail;
-	}
-
-	for (aip = ainf; aip; aip = aip->ai_next)
-	{
-		if (aip->ai_family == AF_INET && aip->ai_socktype == SOCK_STREAM)
-		{
-			memcpy(&sock4, aip->ai_addr, aip->ai_addrlen);
-			break;
-		}
-	}
-
-	if (!aip)
-		goto fail;
-
-	sprintf(http->conn.host_ipv4, "%s", inet_ntoa(sock4.sin_addr));
-
-	if (http->usingSecure)
-		sock4.sin_port = htons(HTTPS_PORT);
-	else
-		sock4.sin_port = htons(HTTP_PORT);
-
-	if ((http_socket(http) = socket(AF_INET, SOCK_STREAM, 0)) < 0)
-	{
-		_log("error opening socket\n");
-		goto fail_release_ainf;
-	}
-
-	if (connect(http_socket(http), (struct sockaddr *)&sock4, (socklen_t)sizeof(sock4)) != 0)
-	{
-		_log("error connecting to remote host\n");
-		goto fail_release_ainf;
-	}
-
-	if (http->usingSecure)
-	{
-		http->conn.ssl_ctx = SSL_CTX_new(TLSv1_2_client_method());
-		http_tls(http) = SSL_new(http->conn.ssl_ctx);
-
-		SSL_set_fd(http_tls(http), http_socket(http)); // Set the socket for reading/writing
-		SSL_set_connect_state(http_tls(http)); // Set as client
-	}
-
-	http->conn.sock_nonblocking = 0;
-	http->conn.ssl_nonblocking = 0;
-
-	freeaddrinfo(ainf);
-	return 0;
+	assert(http);
 
-	fail_release_ainf:
-	freeaddrinfo(ainf);
+	http_disconnect(http);
 
-	fail:
-	return -1;
+	return http_connect(http);
 }
 
 int
@@ -0,0 +1,952 @@
+#include <assert.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "buffer.h"
+#include "hpack.h"
+#include "http.h"
+#include "http2.h"
+
+/*
+ * Client side of HTTP/2.
+ *
+ * We only ever send GET/HEAD requests, so the only DATA
+ * flowing is towards us: we give each stream (and the
+ * connection) a large receive window and top it back up
+ * once half of it has been used. The peer's windows
+ * (WINDOW_UPDATE, SETTINGS_INITIAL_WINDOW_SIZE) do not
+ * concern us beyond validating them.
+ *
+ * Responses are buffered per stream as their frames
+ * arrive, so a slow stream does not hold up any other;
+ * the caller collects them with HTTP2_await().
+ */
+
+#define H2_DATA 0x0
+#define H2_HEADERS 0x1
+#define H2_PRIORITY 0x2
+#define H2_RST_STREAM 0x3
+#define H2_SETTINGS 0x4
+#define H2_PUSH_PROMISE 0x5
+#define H2_PING 0x6
+#define H2_GOAWAY 0x7
+#define H2_WINDOW_UPDATE 0x8
+#define H2_CONTINUATION 0x9
+
+#define H2_FL_END_STREAM 0x1
+#define H2_FL_ACK 0x1
+#define H2_FL_END_HEADERS 0x4
+#define H2_FL_PADDED 0x8
+#define H2_FL_PRIORITY 0x20
+
+#define H2_SETTINGS_HEADER_TABLE_SIZE 0x1
+#define H2_SETTINGS_ENABLE_PUSH 0x2
+#define H2_SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define H2_SETTINGS_INITIAL_WINDOW_SIZE 0x4
+#define H2_SETTINGS_MAX_FRAME_SIZE 0x5
+
+#define H2_MAX_FRAME_SIZE_LIMIT 16777215u
+#define H2_MAX_WINDOW 0x7fffffffu
+
+#define H2_STREAM_BUF_SIZE 4096
+
+static void
+h2Log(char *fmt, ...)
+{
+#ifdef DEBUG
+	va_list args;
+
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+#else
+	(void)fmt;
+#endif
+}
+
+static uint32_t
+__get32(unsigned char *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static void
+__put32(unsigned char *p, uint32_t v)
+{
+	p[0] = (unsigned char)(v >> 24);
+	p[1] = (unsigned char)(v >> 16);
+	p[2] = (unsigned char)(v >> 8);
+	p[3] = (unsigned char)v;
+}
+
+static int
+__put_frame(buf_t *buf, uint8_t type, uint8_t flags, uint32_t stream_id, void *payload, uint32_t len)
+{
+	unsigned char h[HTTP2_FRAME_HEADER_LEN];
+
+	h[0] = (unsigned char)(len >> 16);
+	h[1] = (unsigned char)(len >> 8);
+	h[2] = (unsigned char)len;
+	h[3] = type;
+	h[4] = flags;
+	__put32(&h[5], stream_id & H2_MAX_WINDOW);
+
+	if (buf_append_bytes(buf, h, HTTP2_FRAME_HEADER_LEN) < 0)
+		return -1;
+
+	if (len && buf_append_bytes(buf, payload, len) < 0)
+		return -1;
+
+	return 0;
+}
+
+static int
+__put_window_update(struct HTTP2_conn *c, uint32_t stream_id, uint32_t increment)
+{
+	unsigned char p[4];
+
+	__put32(p, increment & H2_MAX_WINDOW);
+	return __put_frame(&c->out, H2_WINDOW_UPDATE, 0, stream_id, p, 4);
+}
+
+static int
+__put_rst_stream(struct HTTP2_conn *c, uint32_t stream_id, uint32_t error)
+{
+	unsigned char p[4];
+
+	__put32(p, error);
+	return __put_frame(&c->out, H2_RST_STREAM, 0, stream_id, p, 4);
+}
+
+static int
+__put_goaway(struct HTTP2_conn *c, uint32_t error)
+{
+	unsigned char p[8];
+
+/*
+ * We never accept streams from the server
+ * so the last stream ID is always 0.
+ */
+	__put32(&p[0], 0);
+	__put32(&p[4], error);
+
+	return __put_frame(&c->out, H2_GOAWAY, 0, 0, p, 8);
+}
+
+static struct HTTP2_stream *
+__find_stream(struct HTTP2_conn *c, uint32_t id)
+{
+	int i;
+
+	if (!id)
+		return NULL;
+
+	for (i = 0; i < HTTP2_MAX_STREAMS; ++i)
+	{
+		if (c->streams[i].id == id)
+			return &c->streams[i];
+	}
+
+	return NULL;
+}
+
+/**
+ * __header_cb - HPACK_decode() callback for response header fields
+ */
+static int
+__header_cb(void *arg, char *name, size_t name_len, char *value, size_t value_len)
+{
+	struct HTTP2_stream *s = (struct HTTP2_stream *)arg;
+
+/*
+ * Trailers, after the body; nothing there we want.
+ */
+	if (s->got_headers)
+		return 0;
+
+	if (*name == ':')
+	{
+		if (!strcmp(name, ":status"))
+			s->status = atoi(value);
+
+		return 0;
+	}
+
+	if (buf_append_bytes(&s->header, name, name_len) < 0
+	|| buf_append_bytes(&s->header, ": ", 2) < 0
+	|| buf_append_bytes(&s->header, value, value_len) < 0
+	|| buf_append_bytes(&s->header, HTTP_EOL, 2) < 0)
+		return -1;
+
+	return 0;
+}
+
+/**
+ * __discard_cb - for header blocks on streams we no longer care about
+ *
+ * They must still be decoded to keep our
+ * HPACK table in step with the server's.
+ */
+static int
+__discard_cb(void *arg, char *name, size_t name_len, char *value, size_t value_len)
+{
+	(void)arg;
+	(void)name;
+	(void)name_len;
+	(void)value;
+	(void)value_len;
+
+	return 0;
+}
+
+static int
+__end_header_block(struct HTTP2_conn *c)
+{
+	struct HTTP2_stream *s = __find_stream(c, c->hblock_stream);
+	unsigned char *block = (unsigned char *)c->hblock.buf_head;
+	size_t len = c->hblock.data_len;
+	int rv;
+
+	if (s && HTTP2_STREAM_OPEN == s->state)
+		rv = HPACK_decode(&c->decoder, block, len, __header_cb, (void *)s);
+	else
+		rv = HPACK_decode(&c->decoder, block, len, __discard_cb, NULL);
+
+	if (rv < 0)
+		return HTTP2_COMPRESSION_ERROR;
+
+	if (!s && c->hblock_stream >= c->next_stream_id)
+		return HTTP2_PROTOCOL_ERROR;
+
+	if (s && HTTP2_STREAM_OPEN == s->state)
+	{
+		if (!s->got_headers)
+		{
+		/*
+		 * 1xx: an interim response; the real
+		 * one is in a following header block.
+		 */
+			if (s->status >= 100 && s->status < 200)
+			{
+				s->status = 0;
+				buf_clear(&s->header);
+			}
+			else
+			{
+				s->got_headers = 1;
+			}
+		}
+
+		if (c->hblock_end_stream)
+			s->state = HTTP2_STREAM_DONE;
+	}
+
+	c->hblock_stream = 0;
+	buf_clear(&c->hblock);
+
+	return HTTP2_NO_ERROR;
+}
+
+/**
+ * __strip_padding - find the payload inside a (possibly) padded frame
+ */
+static int
+__strip_padding(uint8_t flags, unsigned char **payload, uint32_t *len)
+{
+	uint32_t pad;
+
+	if (!(flags & H2_FL_PADDED))
+		return 0;
+
+	if (*len < 1)
+		return -1;
+
+	pad = **payload;
+
+	if (pad >= *len)
+		return -1;
+
+	++(*payload);
+	*len -= (pad + 1);
+
+	return 0;
+}
+
+static int
+__handle_data(struct HTTP2_conn *c, uint8_t flags, uint32_t id, unsigned char *payload, uint32_t len)
+{
+	struct HTTP2_stream *s = __find_stream(c, id);
+	uint32_t flow_len = len; /* padding counts against the window too */
+
+	if (!id)
+		return HTTP2_PROTOCOL_ERROR;
+
+	if (__strip_padding(flags, &payload, &len) < 0)
+		return HTTP2_PROTOCOL_ERROR;
+
+	c->recv_unacked += flow_len;
+
+	if (s && HTTP2_STREAM_OPEN == s->state)
+	{
+		if (!s->got_headers)
+			return HTTP2_PROTOCOL_ERROR;
+
+		if (len && buf_append_bytes(&s->body, payload, len) < 0)
+			return HTTP2_INTERNAL_ERROR;
+
+		s->recv_unacked += flow_len;
+
+		if (flags & H2_FL_END_STREAM)
+		{
+			s->state = HTTP2_STREAM_DONE;
+		}
+		else
+		if (s->recv_unacked >= (HTTP2_STREAM_WINDOW / 2))
+		{
+			__put_window_update(c, id, s->recv_unacked);
+			s->recv_unacked = 0;
+		}
+	}
+	else
+	if (id >= c->next_stream_id)
+	{
+		return HTTP2_PROTOCOL_ERROR;
+	}
+
+/*
+ * Otherwise it is for a stream we reset or gave
+ * up on, which still uses the connection window.
+ */
+	if (c->recv_unacked >= (HTTP2_CONN_WINDOW / 2))
+	{
+		__put_window_update(c, 0, c->recv_unacked);
+		c->recv_unacked = 0;
+	}
+
+	return HTTP2_NO_ERROR;
+}
+
+static int
+__handle_headers(struct HTTP2_conn *c, uint8_t flags, uint32_t id, unsigned char *payload, uint32_t len)
+{
+	if (!id)
+		return HTTP2_PROTOCOL_ERROR;
+
+	if (__strip_padding(flags, &payload, &len) < 0)
+		return HTTP2_PROTOCOL_ERROR;
+
+	if (flags & H2_FL_PRIORITY)
+	{
+		if (len < 5)
+			return HTTP2_FRAME_SIZE_ERROR;
+
+		payload += 5;
+		len -= 5;
+	}
+
+	buf_clear(&c->hblock);
+
+	if (len && buf_append_bytes(&c->hblock, payload, len) < 0)
+		return HTTP2_INTERNAL_ERROR;
+
+	c->hblock_stream = id;
+	c->hblock_end_stream = (flags & H2_FL_END_STREAM);
+
+	if (flags & H2_FL_END_HEADERS)
+		return __end_header_block(c);
+
+	return HTTP2_NO_ERROR;
+}
+
+static int
+__handle_continuation(struct HTTP2_conn *c, uint8_t flags, uint32_t id, unsigned char *payload, uint32_t len)
+{
+	if (!c->hblock_stream || id != c->hblock_stream)
+		return HTTP2_PROTOCOL_ERROR;
+
+	if (len && buf_append_bytes(&c->hblock, payload, len) < 0)
+		return HTTP2_INTERNAL_ERROR;
+
+	if (flags & H2_FL_END_HEADERS)
+		return __end_header_block(c);
+
+	return HTTP2_NO_ERROR;
+}
+
+static int
+__handle_settings(struct HTTP2_conn *c, uint8_t flags, uint32_t id, unsigned char *payload, uint32_t len)
+{
+	uint32_t value;
+	uint16_t setting;
+	uint32_t i;
+
+	if (id)
+		return HTTP2_PROTOCOL_ERROR;
+
+	if (flags & H2_FL_ACK)
+		return len ? HTTP2_FRAME_SIZE_ERROR : HTTP2_NO_ERROR;
+
+	if (len % 6)
+		return HTTP2_FRAME_SIZE_ERROR;
+
+	for (i = 0; i < len; i += 6)
+	{
+		setting = (uint16_t)((payload[i] << 8) | payload[i+1]);
+		value = __get32(&payload[i+2]);
+
+		switch(setting)
+		{
+			case H2_SETTINGS_MAX_CONCURRENT_STREAMS:
+
+				c->peer_max_streams = value;
+				break;
+
+			case H2_SETTINGS_INITIAL_WINDOW_SIZE:
+
+				if (value > H2_MAX_WINDOW)
+					return HTTP2_FLOW_CONTROL_ERROR;
+
+				break;
+
+			case H2_SETTINGS_MAX_FRAME_SIZE:
+
+				if (value < HTTP2_DEFAULT_FRAME_SIZE || value > H2_MAX_FRAME_SIZE_LIMIT)
+					return HTTP2_PROTOCOL_ERROR;
+
+				c->peer_max_frame = value;
+				break;
+
+			case H2_SETTINGS_ENABLE_PUSH:
+
+				if (value > 1)
+					return HTTP2_PROTOCOL_ERROR;
+
+				break;
+
+		/*
+		 * HEADER_TABLE_SIZE limits an encoder table
+		 * we don't use; anything else is ignored.
+		 */
+			default:
+				break;
+		}
+	}
+
+	if (__put_frame(&c->out, H2_SETTINGS, H2_FL_ACK, 0, NULL, 0) < 0)
+		return HTTP2_INTERNAL_ERROR;
+
+	return HTTP2_NO_ERROR;
+}
+
+static int
+__handle_goaway(struct HTTP2_conn *c, uint32_t id, unsigned char *payload, uint32_t len)
+{
+	uint32_t last_id;
+	uint32_t error;
+	int i;
+
+	if (id)
+		return HTTP2_PROTOCOL_ERROR;
+
+	if (len < 8)
+		return HTTP2_FRAME_SIZE_ERROR;
+
+	last_id = (__get32(payload) & H2_MAX_WINDOW);
+	error = __get32(&payload[4]);
+
+	h2Log("GOAWAY: last stream %u, error 0x%x\n", last_id, error);
+
+	c->goaway = 1;
+
+/*
+ * Streams after LAST_ID were not processed
+ * and are safe to retry on a new connection.
+ */
+	for (i = 0; i < HTTP2_MAX_STREAMS; ++i)
+	{
+		if (HTTP2_STREAM_OPEN == c->streams[i].state && c->streams[i].id > last_id)
+		{
+			c->streams[i].state = HTTP2_STREAM_DONE;
+			c->streams[i].error = HTTP2_REFUSED_STREAM;
+		}
+	}
+
+	return HTTP2_NO_ERROR;
+}
+
+static int
+__handle_frame(struct HTTP2_conn *c, uint8_t type, uint8_t flags, uint32_t id, unsigned char *payload, uint32_t len)
+{
+	struct HTTP2_stream *s;
+
+/*
+ * Nothing may come between the frames
+ * of a header block.
+ */
+	if (c->hblock_stream && H2_CONTINUATION != type)
+		return HTTP2_PROTOCOL_ERROR;
+
+	switch(type)
+	{
+		case H2_DATA:
+
+			return __handle_data(c, flags, id, payload, len);
+
+		case H2_HEADERS:
+
+			return __handle_headers(c, flags, id, payload, len);
+
+		case H2_CONTINUATION:
+
+			return __handle_continuation(c, flags, id, payload, len);
+
+		case H2_SETTINGS:
+
+			return __handle_settings(c, flags, id, payload, len);
+
+		case H2_RST_STREAM:
+
+			if (!id)
+				return HTTP2_PROTOCOL_ERROR;
+
+			if (len != 4)
+				return HTTP2_FRAME_SIZE_ERROR;
+
+			if ((s = __find_stream(c, id)) && HTTP2_STREAM_OPEN == s->state)
+			{
+				s->state = HTTP2_STREAM_DONE;
+				s->error = __get32(payload);
+				h2Log("Stream %u reset (error 0x%x)\n", id, s->error);
+			}
+
+			return HTTP2_NO_ERROR;
+
+		case H2_PING:
+
+			if (id)
+				return HTTP2_PROTOCOL_ERROR;
+
+			if (len != 8)
+				return HTTP2_FRAME_SIZE_ERROR;
+
+			if (!(flags & H2_FL_ACK) && __put_frame(&c->out, H2_PING, H2_FL_ACK, 0, payload, 8) < 0)
+				return HTTP2_INTERNAL_ERROR;
+
+			return HTTP2_NO_ERROR;
+
+		case H2_GOAWAY:
+
+			return __handle_goaway(c, id, payload, len);
+
+		case H2_WINDOW_UPDATE:
+
+			if (len != 4)
+				return HTTP2_FRAME_SIZE_ERROR;
+
+			if (!(__get32(payload) & H2_MAX_WINDOW) && !id)
+				return HTTP2_PROTOCOL_ERROR;
+
+			return HTTP2_NO_ERROR;
+
+		case H2_PRIORITY:
+
+			return (len != 5 ? HTTP2_FRAME_SIZE_ERROR : HTTP2_NO_ERROR);
+
+	/*
+	 * We sent SETTINGS_ENABLE_PUSH = 0.
+	 */
+		case H2_PUSH_PROMISE:
+
+			return HTTP2_PROTOCOL_ERROR;
+
+		default:
+
+			return HTTP2_NO_ERROR;
+	}
+}
+
+/**
+ * __process_frames - handle each complete frame we have read
+ */
+static int
+__process_frames(struct HTTP2_conn *c)
+{
+	unsigned char *p = (unsigned char *)c->in.buf_head;
+	unsigned char *end = (unsigned char *)c->in.buf_tail;
+	uint32_t len;
+	uint32_t id;
+	uint8_t type;
+	uint8_t flags;
+	int error = HTTP2_NO_ERROR;
+
+	while ((end - p) >= HTTP2_FRAME_HEADER_LEN)
+	{
+		len = ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | (uint32_t)p[2];
+		type = p[3];
+		flags = p[4];
+		id = (__get32(&p[5]) & H2_MAX_WINDOW);
+
+	/*
+	 * We never raise SETTINGS_MAX_FRAME_SIZE.
+	 */
+		if (len > HTTP2_DEFAULT_FRAME_SIZE)
+		{
+			error = HTTP2_FRAME_SIZE_ERROR;
+			break;
+		}
+
+		if ((uint32_t)(end - p) < (HTTP2_FRAME_HEADER_LEN + len))
+			break;
+
+		error = __handle_frame(c, type, flags, id, p + HTTP2_FRAME_HEADER_LEN, len);
+
+		if (HTTP2_NO_ERROR != error)
+			break;
+
+		p += (HTTP2_FRAME_HEADER_LEN + len);
+	}
+
+	if (p > (unsigned char *)c->in.buf_head)
+		buf_collapse(&c->in, (off_t)(c->in.buf_head - c->in.data), (size_t)(p - (unsigned char *)c->in.buf_head));
+
+	if (HTTP2_NO_ERROR != error)
+	{
+		h2Log("HTTP/2 connection error 0x%x\n", error);
+
+		__put_goaway(c, error);
+		c->dead = 1;
+
+		return -1;
+	}
+
+	return 0;
+}
+
+static void
+__reset_streams(struct HTTP2_conn *c)
+{
+	int i;
+
+	for (i = 0; i < HTTP2_MAX_STREAMS; ++i)
+	{
+		c->streams[i].id = 0;
+		c->streams[i].state = HTTP2_STREAM_IDLE;
+	}
+
+	c->nr_open = 0;
+
+	return;
+}
+
+struct HTTP2_conn *
+HTTP2_conn_new(void)
+{
+	struct HTTP2_conn *c = calloc(1, sizeof(struct HTTP2_conn));
+	int i;
+
+	if (!c)
+		return NULL;
+
+	if (HPACK_table_init(&c->decoder, HPACK_DEFAULT_TABLE_SIZE) < 0)
+		goto fail;
+
+	if (buf_init(&c->in, HTTP2_READ_BLOCK * 2) < 0
+	|| buf_init(&c->out, H2_STREAM_BUF_SIZE) < 0
+	|| buf_init(&c->hblock, H2_STREAM_BUF_SIZE) < 0)
+		goto fail;
+
+	for (i = 0; i < HTTP2_MAX_STREAMS; ++i)
+	{
+		if (buf_init(&c->streams[i].header, H2_STREAM_BUF_SIZE) < 0
+		|| buf_init(&c->streams[i].body, H2_STREAM_BUF_SIZE) < 0)
+			goto fail;
+	}
+
+	return c;
+
+fail:
+
+	HTTP2_conn_delete(c);
+	return NULL;
+}
+
+void
+HTTP2_conn_delete(struct HTTP2_conn *c)
+{
+	assert(c);
+
+	int i;
+
+	HPACK_table_destroy(&c->decoder);
+
+	if (c->in.data)
+		buf_destroy(&c->in);
+	if (c->out.data)
+		buf_destroy(&c->out);
+	if (c->hblock.data)
+		buf_destroy(&c->hblock);
+
+	for (i = 0; i < HTTP2_MAX_STREAMS; ++i)
+	{
+		if (c->streams[i].header.data)
+			buf_destroy(&c->streams[i].header);
+		if (c->streams[i].body.data)
+			buf_destroy(&c->streams[i].body);
+	}
+
+	free(c);
+
+	return;
+}
+
+int
+HTTP2_conn_start(struct http_t *http, struct HTTP2_conn *c)
+{
+	assert(http);
+	assert(c);
+
+	unsigned char settings[12];
+
+	__reset_streams(c);
+	HPACK_table_reset(&c->decoder);
+
+	buf_clear(&c->in);
+	buf_clear(&c->out);
+	buf_clear(&c->hblock);
+
+	c->hblock_stream = 0;
+	c->next_stream_id = 1;
+	c->peer_max_streams = HTTP2_MAX_STREAMS;
+	c->peer_max_frame = HTTP2_DEFAULT_FRAME_SIZE;
+	c->recv_unacked = 0;
+	c->table_size_update = 1;
+	c->goaway = 0;
+	c->dead = 0;
+
+	settings[0] = 0;
+	settings[1] = H2_SETTINGS_ENABLE_PUSH;
+	__put32(&settings[2], 0);
+	settings[6] = 0;
+	settings[7] = H2_SETTINGS_INITIAL_WINDOW_SIZE;
+	__put32(&settings[8], HTTP2_STREAM_WINDOW);
+
+	if (buf_append_bytes(&c->out, HTTP2_CONNECTION_PREFACE, strlen(HTTP2_CONNECTION_PREFACE)) < 0
+	|| __put_frame(&c->out, H2_SETTINGS, 0, 0, settings, sizeof(settings)) < 0
+	|| __put_window_update(c, 0, HTTP2_CONN_WINDOW - HTTP2_DEFAULT_WINDOW) < 0)
+		return -1;
+
+	return HTTP2_flush(http, c);
+}
+
+uint32_t
+HTTP2_submit(struct HTTP2_conn *c, struct HTTP2_field *fields, int nr_fields, int end_stream)
+{
+	assert(c);
+	assert(fields);
+
+	struct HTTP2_stream *s = NULL;
+	buf_t block;
+	uint32_t chunk;
+	size_t left;
+	char *p;
+	uint8_t type = H2_HEADERS;
+	uint8_t flags;
+	int i;
+
+	if (c->dead || c->goaway || c->next_stream_id > H2_MAX_WINDOW)
+		return 0;
+
+	if ((uint32_t)c->nr_open >= c->peer_max_streams)
+		return 0;
+
+	for (i = 0; i < HTTP2_MAX_STREAMS; ++i)
+	{
+		if (HTTP2_STREAM_IDLE == c->streams[i].state)
+		{
+			s = &c->streams[i];
+			break;
+		}
+	}
+
+	if (!s)
+		return 0;
+
+	memset(&block, 0, sizeof(block));
+	if (buf_init(&block, H2_STREAM_BUF_SIZE) < 0)
+		return 0;
+
+/*
+ * Tell the server up front that we keep no
+ * dynamic table for it to maintain.
+ */
+	if (c->table_size_update)
+	{
+		if (HPACK_encode_table_size(&block, 0) < 0)
+			goto fail;
+
+		c->table_size_update = 0;
+	}
+
+	for (i = 0; i < nr_fields; ++i)
+	{
+		if (HPACK_encode_field(&block, fields[i].name, fields[i].value) < 0)
+			goto fail;
+	}
+
+	p = block.buf_head;
+	left = block.data_len;
+
+	do
+	{
+		chunk = (left > c->peer_max_frame ? c->peer_max_frame : (uint32_t)left);
+		left -= chunk;
+
+		flags = (left ? 0 : H2_FL_END_HEADERS);
+		if (H2_HEADERS == type && end_stream)
+			flags |= H2_FL_END_STREAM;
+
+		if (__put_frame(&c->out, type, flags, c->next_stream_id, p, chunk) < 0)
+			goto fail;
+
+		p += chunk;
+		type = H2_CONTINUATION;
+	}
+	while (left);
+
+	buf_destroy(&block);
+
+	buf_clear(&s->header);
+	buf_clear(&s->body);
+
+	s->id = c->next_stream_id;
+	s->state = HTTP2_STREAM_OPEN;
+	s->status = 0;
+	s->got_headers = 0;
+	s->error = 0;
+	s->recv_unacked = 0;
+
+	c->next_stream_id += 2;
+	++c->nr_open;
+
+	h2Log("Opened stream %u\n", s->id);
+
+	return s->id;
+
+fail:
+
+	buf_destroy(&block);
+	return 0;
+}
+
+int
+HTTP2_flush(struct http_t *http, struct HTTP2_conn *c)
+{
+	assert(http);
+	assert(c);
+
+	if (!c->out.data_len)
+		return 0;
+
+	if (http_write_buf(http, &c->out) < 0)
+	{
+		c->dead = 1;
+		return -1;
+	}
+
+	buf_clear(&c->out);
+
+	return 0;
+}
+
+static struct HTTP2_stream *
+__await(struct http_t *http, struct HTTP2_conn *c, uint32_t id, int timeout, struct timespec *limit, int headers_only)
+{
+	struct HTTP2_stream *s = __find_stream(c, id);
+	struct timespec deadline;
+	ssize_t n;
+
+	if (!s)
+		return NULL;
+
+	while (1)
+	{
+		if (__process_frames(c) < 0)
+			goto fail;
+
+	/*
+	 * SETTINGS/PING acks and window updates.
+	 */
+		if (HTTP2_flush(http, c) < 0)
+			goto fail;
+
+		if (HTTP2_STREAM_DONE == s->state || (headers_only && s->got_headers))
+			return s;
+
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += timeout;
+
+		if (limit && (deadline.tv_sec > limit->tv_sec ||
+		(deadline.tv_sec == limit->tv_sec && deadline.tv_nsec > limit->tv_nsec)))
+			deadline = *limit;
+
+		n = http_recv_into(http, &c->in, HTTP2_READ_BLOCK, &deadline);
+
+		if (n <= 0)
+		{
+			h2Log("HTTP/2 connection %s waiting for stream %u\n",
+				(HTTP_OPERATION_TIMEOUT == n ? "timed out" : "lost"), id);
+			goto fail;
+		}
+	}
+
+fail:
+
+	c->dead = 1;
+	return NULL;
+}
+
+struct HTTP2_stream *
+HTTP2_await(struct http_t *http, struct HTTP2_conn *c, uint32_t id, int timeout, struct timespec *limit)
+{
+	assert(http);
+	assert(c);
+
+	return __await(http, c, id, timeout, limit, 0);
+}
+
+struct HTTP2_stream *
+HTTP2_await_headers(struct http_t *http, struct HTTP2_conn *c, uint32_t id, int timeout, struct timespec *limit)
+{
+	assert(http);
+	assert(c);
+
+	return __await(http, c, id, timeout, limit, 1);
+}
+
+/**
+ * HTTP2_stream_release - finish with a stream
+ *
+ * If the response is not complete, the server
+ * is told to stop sending it.
+ */
+void
+HTTP2_stream_release(struct HTTP2_conn *c, struct HTTP2_stream *s)
+{
+	assert(c);
+	assert(s);
+
+	if (HTTP2_STREAM_IDLE == s->state)
+		return;
+
+	if (HTTP2_STREAM_OPEN == s->state && !c->dead)
+		__put_rst_stream(c, s->id, HTTP2_CANCEL);
+
+	s->id = 0;
+	s->state = HTTP2_STREAM_IDLE;
+	--c->nr_open;
+
+	return;
+}
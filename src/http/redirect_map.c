@@ -0,0 +1,230 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "redirect_map.h"
+
+/*
+ * Process-wide map of the redirects we have followed, so
+ * that no HTTP object (fast mode worker or otherwise)
+ * pays a round trip to learn one another already knows.
+ *
+ * Lookups happen before every request and far outnumber
+ * the redirects found, so the map is behind a read-write
+ * lock. A permanent redirect is kept for much longer
+ * than a temporary one, which the server may change
+ * its mind about at any time.
+ */
+
+#define REDIRECT_NR_BUCKETS 512
+
+struct REDIRECT_entry
+{
+	char *from;
+	char *to;
+	time_t expires; /* CLOCK_MONOTONIC seconds */
+	struct REDIRECT_entry *next;
+};
+
+static struct REDIRECT_entry *__buckets[REDIRECT_NR_BUCKETS];
+static int __nr_entries = 0;
+static unsigned int __permanent_ttl = REDIRECT_DEFAULT_PERMANENT_TTL;
+static unsigned int __temporary_ttl = REDIRECT_DEFAULT_TEMPORARY_TTL;
+
+static pthread_rwlock_t __redirect_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static void
+rLog(char *fmt, ...)
+{
+#ifdef DEBUG
+	va_list args;
+
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+#else
+	(void)fmt;
+#endif
+}
+
+static time_t
+__now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static unsigned int
+__hash_URL(const char *URL)
+{
+	uint32_t h = 2166136261u;
+
+	while (*URL)
+	{
+		h ^= (unsigned char)*URL++;
+		h *= 16777619u;
+	}
+
+	return (unsigned int)(h % REDIRECT_NR_BUCKETS);
+}
+
+/*
+ * All of the following __functions are called
+ * with __REDIRECT_LOCK held (for writing, unless
+ * they only read).
+ */
+static struct REDIRECT_entry *
+__find_entry(const char *URL)
+{
+	struct REDIRECT_entry *e = __buckets[__hash_URL(URL)];
+
+	while (e)
+	{
+		if (!strcmp(e->from, URL))
+			return e;
+
+		e = e->next;
+	}
+
+	return NULL;
+}
+
+static void
+__free_entry(struct REDIRECT_entry *e)
+{
+	free(e->from);
+	free(e->to);
+	free(e);
+
+	return;
+}
+
+static void
+__purge_expired(void)
+{
+	struct REDIRECT_entry **pp;
+	struct REDIRECT_entry *e;
+	time_t now = __now();
+	int i;
+
+	for (i = 0; i < REDIRECT_NR_BUCKETS; ++i)
+	{
+		pp = &__buckets[i];
+
+		while ((e = *pp))
+		{
+			if (e->expires <= now)
+			{
+				*pp = e->next;
+				__free_entry(e);
+				--__nr_entries;
+				continue;
+			}
+
+			pp = &e->next;
+		}
+	}
+
+	return;
+}
+
+/**
+ * REDIRECT_put - remember where a URL redirects to
+ * @from: the URL we requested
+ * @to: the Location the server gave us
+ * @permanent: non-zero for a 301
+ */
+void
+REDIRECT_put(const char *from, const char *to, int permanent)
+{
+	assert(from);
+	assert(to);
+
+	struct REDIRECT_entry *e;
+	char *new_to;
+	unsigned int idx;
+
+	if (!(new_to = strdup(to)))
+		return;
+
+	pthread_rwlock_wrlock(&__redirect_lock);
+
+	if ((e = __find_entry(from)))
+	{
+		free(e->to);
+		e->to = new_to;
+		goto out;
+	}
+
+	if (__nr_entries >= REDIRECT_MAP_MAX)
+		__purge_expired();
+
+	if (__nr_entries >= REDIRECT_MAP_MAX
+	|| !(e = calloc(1, sizeof(*e)))
+	|| !(e->from = strdup(from)))
+	{
+		rLog("Not remembering redirect %s -> %s\n", from, to);
+
+		free(e);
+		free(new_to);
+		goto unlock;
+	}
+
+	e->to = new_to;
+
+	idx = __hash_URL(from);
+	e->next = __buckets[idx];
+	__buckets[idx] = e;
+	++__nr_entries;
+
+out:
+
+	e->expires = __now() + (permanent ? __permanent_ttl : __temporary_ttl);
+
+unlock:
+
+	pthread_rwlock_unlock(&__redirect_lock);
+
+	return;
+}
+
+int
+REDIRECT_lookup(const char *URL, char *to, size_t size)
+{
+	assert(URL);
+	assert(to);
+
+	struct REDIRECT_entry *e;
+	int found = 0;
+
+	pthread_rwlock_rdlock(&__redirect_lock);
+
+	if ((e = __find_entry(URL)) && __now() < e->expires && strlen(e->to) < size)
+	{
+		strcpy(to, e->to);
+		found = 1;
+	}
+
+	pthread_rwlock_unlock(&__redirect_lock);
+
+	return found;
+}
+
+void
+REDIRECT_set_ttl(unsigned int permanent_ttl, unsigned int temporary_ttl)
+{
+	pthread_rwlock_wrlock(&__redirect_lock);
+
+	__permanent_ttl = permanent_ttl;
+	__temporary_ttl = temporary_ttl;
+
+	pthread_rwlock_unlock(&__redirect_lock);
+
+	return;
+}
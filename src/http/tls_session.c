@@ -0,0 +1,237 @@
+#include <assert.h>
+#include <openssl/conf.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "http.h"
+#include "tls_session.h"
+
+/*
+ * A single SSL_CTX shared by every HTTP object
+ * (and so every fast-mode worker), plus a small
+ * per-host cache of client sessions so that a
+ * reconnect can do an abbreviated handshake.
+ *
+ * SSL_CTX is safe to use from several threads
+ * once it has been set up; the session table
+ * is protected by its own mutex.
+ */
+
+struct TLS_cached_session
+{
+	char host[HTTP_HOST_MAX+1];
+	SSL_SESSION *session;
+	time_t when;
+};
+
+static SSL_CTX *__client_ctx = NULL;
+static pthread_once_t __client_ctx_once = PTHREAD_ONCE_INIT;
+
+static struct TLS_cached_session __sessions[TLS_SESSION_CACHE_SIZE];
+static pthread_mutex_t __sessions_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+tLog(char *fmt, ...)
+{
+#ifdef DEBUG
+	va_list args;
+
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+#else
+	(void)fmt;
+#endif
+}
+
+/**
+ * __find_session - find the cache slot for HOST
+ *
+ * Caller holds __SESSIONS_MTX.
+ */
+static struct TLS_cached_session *
+__find_session(const char *host)
+{
+	int i;
+
+	for (i = 0; i < TLS_SESSION_CACHE_SIZE; ++i)
+	{
+		if (__sessions[i].session && !strcmp(__sessions[i].host, host))
+			return &__sessions[i];
+	}
+
+	return NULL;
+}
+
+/**
+ * __evict_slot - get a slot for a new session
+ *
+ * Returns an empty slot if there is one,
+ * otherwise the least recently stored.
+ * Caller holds __SESSIONS_MTX.
+ */
+static struct TLS_cached_session *
+__evict_slot(void)
+{
+	struct TLS_cached_session *oldest = &__sessions[0];
+	int i;
+
+	for (i = 0; i < TLS_SESSION_CACHE_SIZE; ++i)
+	{
+		if (!__sessions[i].session)
+			return &__sessions[i];
+
+		if (__sessions[i].when < oldest->when)
+			oldest = &__sessions[i];
+	}
+
+	SSL_SESSION_free(oldest->session);
+	oldest->session = NULL;
+
+	return oldest;
+}
+
+/**
+ * new_session_cb - OpenSSL hands us each new client session here
+ *
+ * With TLS 1.3 the tickets arrive after the handshake
+ * (on the first SSL_read()), so this is the only
+ * reliable place to capture them. Returning 1 means
+ * we keep the reference we were given.
+ */
+static int
+new_session_cb(SSL *ssl, SSL_SESSION *session)
+{
+	const char *host = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+	struct TLS_cached_session *cached;
+
+	if (!host || strlen(host) > HTTP_HOST_MAX)
+		return 0;
+
+	pthread_mutex_lock(&__sessions_mtx);
+
+	cached = __find_session(host);
+
+	if (cached)
+		SSL_SESSION_free(cached->session);
+	else
+		cached = __evict_slot();
+
+	strcpy(cached->host, host);
+	cached->session = session;
+	cached->when = time(NULL);
+
+	pthread_mutex_unlock(&__sessions_mtx);
+
+	tLog("Cached TLS session for %s\n", host);
+
+	return 1;
+}
+
+static void
+__init_client_ctx(void)
+{
+	SSL_library_init();
+	SSL_load_error_strings();
+	OpenSSL_add_all_algorithms();
+	ERR_load_crypto_strings();
+
+	__client_ctx = SSL_CTX_new(TLS_client_method());
+
+	if (!__client_ctx)
+	{
+		ERR_print_errors_fp(stderr);
+		return;
+	}
+
+	SSL_CTX_set_min_proto_version(__client_ctx, TLS1_2_VERSION);
+
+/*
+ * Keep sessions only in our table (keyed by host),
+ * not in OpenSSL's internal store which is keyed
+ * by session ID and no use to a client.
+ */
+	SSL_CTX_set_session_cache_mode(__client_ctx,
+		SSL_SESS_CACHE_CLIENT|SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(__client_ctx, new_session_cb);
+
+/*
+ * Don't send close_notify on disconnect (the peer
+ * may already be gone and we would take a SIGPIPE),
+ * but do mark the connection as cleanly shut down
+ * so its session stays resumable.
+ */
+	SSL_CTX_set_quiet_shutdown(__client_ctx, 1);
+
+	return;
+}
+
+SSL_CTX *
+TLS_client_ctx(void)
+{
+	pthread_once(&__client_ctx_once, __init_client_ctx);
+	return __client_ctx;
+}
+
+void
+TLS_session_resume(SSL *ssl, const char *host)
+{
+	assert(ssl);
+	assert(host);
+
+	struct TLS_cached_session *cached;
+
+	SSL_set_tlsext_host_name(ssl, host);
+
+	pthread_mutex_lock(&__sessions_mtx);
+
+	cached = __find_session(host);
+
+	if (cached)
+	{
+		if (!SSL_SESSION_is_resumable(cached->session)
+		|| (time(NULL) - cached->when) > TLS_SESSION_MAX_AGE)
+		{
+			SSL_SESSION_free(cached->session);
+			cached->session = NULL;
+		}
+		else
+		{
+		/*
+		 * SSL_set_session() takes its own reference.
+		 */
+			SSL_set_session(ssl, cached->session);
+			tLog("Offering cached TLS session for %s\n", host);
+		}
+	}
+
+	pthread_mutex_unlock(&__sessions_mtx);
+
+	return;
+}
+
+void
+TLS_session_forget(const char *host)
+{
+	assert(host);
+
+	struct TLS_cached_session *cached;
+
+	pthread_mutex_lock(&__sessions_mtx);
+
+	cached = __find_session(host);
+
+	if (cached)
+	{
+		SSL_SESSION_free(cached->session);
+		cached->session = NULL;
+	}
+
+	pthread_mutex_unlock(&__sessions_mtx);
+
+	return;
+}
@@ -12,6 +12,7 @@
 #include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
+#include "archive_meta.h"
 #include "btree.h"
 #include "buffer.h"
 #include "cache.h"
@@ -191,8 +192,10 @@ __noret usage(int exit_status)
 		"Runtime options can be set in the config.xml file in ${HOME}/.NetWasabi\n"
 		"directory. Runtime options include:\n"
 		"\n"
-		"crawlDelay: the number of seconds to wait before sending another GET\n"
-		"request to the remote web server;\n"
+		"crawlDelay: the least number of seconds between two GET requests to the\n"
+		"same web server. NetWasabi fetches from other servers in the meantime\n"
+		"rather than waiting. A server that answers 429 or 503 with Retry-After\n"
+		"is left alone for as long as it asks;\n"
 		"\n"
 		"crawlDepth: the depth at which NetWasabi should stop crawling. For example,\n"
 		"when all the URLs that were parsed from a downloaded document have been\n"
@@ -202,13 +205,63 @@ __noret usage(int exit_status)
 		"at any one time waiting to be downloaded from the webserver.\n"
 		"\n"
 		"fastMode: this option makes requests to the remote web server as fast as\n"
-		"possible using multiple threads. The crawlDelay option is ignored when\n"
-		"this is set to true.\n"
+		"possible using multiple threads. Each server still gets no more than\n"
+		"connectionsPerHost requests at once, and crawlDelay between them, so\n"
+		"crawls that span many servers go fastest.\n"
 		"\n"
 		"xdomain: setting this to true means NetWasabi will make requests to URLs\n"
 		"embedded within an HTML document that belong to another remote web server.\n"
 		"This can result in arching pages from unwanted ads.\n"
 		"\n"
+		"pipelineDepth: the number of GET requests to send back to back on the\n"
+		"connection before reading the responses (HTTP/1.1 pipelining). Values\n"
+		"of 0 or 1 turn this off, which is the default. NetWasabi falls back to\n"
+		"one request at a time if the server does not cope. Fast mode does not\n"
+		"pipeline; its workers send one request at a time each.\n"
+		"\n"
+		"http2: use HTTP/2 with servers that support it (negotiated during the\n"
+		"TLS handshake). Requests for the same server are then sent on their own\n"
+		"streams over the one connection. This is true by default.\n"
+		"\n"
+		"connectionsPerHost: in fast mode, the number of connections to a server\n"
+		"that the worker threads share. Workers wait for a free connection rather\n"
+		"than each opening their own. The default is 4.\n"
+		"\n"
+		"connectTimeout, handshakeTimeout, firstByteTimeout, transferTimeout: the\n"
+		"number of seconds allowed to connect to a server, to complete the TLS\n"
+		"handshake, from sending a request to having the whole response header,\n"
+		"and from sending a request to having the whole response. A request that\n"
+		"overruns any of them is abandoned. The defaults are 5, 5, 10 and 60.\n"
+		"\n"
+		"contentTypes: what to do with a document, decided from its Content-Type\n"
+		"as soon as the response header arrives. A list of TYPE:ACTION[:MAXSIZE]\n"
+		"where TYPE is a media type, a type such as \"video/\", or \"*\"; ACTION\n"
+		"is parse (archive it and follow its links), archive, skip, or default\n"
+		"(go by the extension in the URL); and a document bigger than MAXSIZE\n"
+		"(e.g., 20M) is skipped. Skipped documents are not downloaded. \"none\"\n"
+		"goes by the extension alone. The default is\n"
+		"\"" DEFAULT_CONTENT_TYPES "\".\n"
+		"\n"
+		"tcpNoDelay, tcpFastOpen, receiveBuffer, keepAlive, userTimeout: options\n"
+		"set on each connection. tcpNoDelay sends requests without waiting to\n"
+		"fill a packet (true by default). tcpFastOpen sends the first data in\n"
+		"the SYN to servers we have connected to before (false by default).\n"
+		"receiveBuffer (e.g., 4M) fixes the socket receive buffer, which is\n"
+		"otherwise left for the kernel to grow; only set it for long, fast links.\n"
+		"keepAlive is the seconds a connection may sit idle before it is probed\n"
+		"and userTimeout the seconds sent data may go unacknowledged before the\n"
+		"connection is given up on; the defaults are 60 and 30, and 0 leaves\n"
+		"either to the kernel. The values the kernel used are printed at the end.\n"
+		"\n"
+		"permanentRedirectTTL, temporaryRedirectTTL: the number of seconds a 301,\n"
+		"and a 302 or 303, is remembered for. Until then requests for the old URL\n"
+		"go straight to the new one (on the same server). The defaults are 86400\n"
+		"and 300; 0 turns either off.\n"
+		"\n"
+		"resolverThreads: the number of threads that look up the addresses of\n"
+		"servers as soon as links to them are found, so that crawling does not\n"
+		"wait on the resolver. The default is 4; 0 turns this off.\n"
+		"\n"
 		"An example of a config.xml file is the following:\n"
 		"\n"
 		"<options>\n"
@@ -217,6 +270,13 @@ __noret usage(int exit_status)
 		"\t<queueMax>100</queueMax>\n"
 		"\t<xdomain>false</xdomain>\n"
 		"\t<fastMode>false</fastMode>\n"
+		"\t<pipelineDepth>1</pipelineDepth>\n"
+		"\t<http2>true</http2>\n"
+		"\t<connectionsPerHost>4</connectionsPerHost>\n"
+		"\t<connectTimeout>5</connectTimeout>\n"
+		"\t<transferTimeout>60</transferTimeout>\n"
+		"\t<contentTypes>text/html:parse application/pdf:archive:20M video/:skip</contentTypes>\n"
+		"\t<receiveBuffer>4M</receiveBuffer>\n"
 		"</options>\n\n"
 		"* There is no need for the <?xml version=\"1.0\" ?> line in the config file.\n\n");
 
@@ -280,6 +340,28 @@ else
 	return;
 }
 
+/**
+ * Show the socket options the kernel ended up using,
+ * which can differ from those asked for.
+ */
+static void
+__print_socket_stats(void)
+{
+	struct HTTP_socket_profile e;
+	int nr;
+
+	if (!(nr = HTTP_socket_stats(&e)))
+		return;
+
+	fprintf(stderr,
+		"\nConnections: %d (TCP_NODELAY %s, Fast Open %s, receive buffer %d bytes, "
+		"keepalive %s%d%s, user timeout %dms)\n",
+		nr, (e.nodelay ? "on" : "off"), (e.fast_open ? "on" : "off"), e.rcvbuf,
+		(e.keepalive ? "after " : ""), e.keepalive, (e.keepalive ? "s" : " (off)"), e.user_timeout);
+
+	return;
+}
+
 static void
 catch_signal(int signo)
 {
@@ -339,6 +421,261 @@ _config_hash_options(xml_node_t *node)
 	return;
 }
 
+static char *
+_config_get(char *name)
+{
+	bucket_t *bucket = bObj_hashed_opts->get_bucket(bObj_hashed_opts, name);
+
+	if (!bucket)
+		return NULL;
+
+	return (char *)bucket->data;
+}
+
+static int
+_config_true(char *value)
+{
+	return (!strcasecmp(value, "true") || !strcasecmp(value, "yes") || !strcmp(value, "1"));
+}
+
+/**
+ * A number of bytes, optionally followed by K, M or G.
+ */
+static size_t
+_config_size(char *value)
+{
+	char *end;
+	size_t size = strtoul(value, &end, 0);
+
+	switch(toupper(*end))
+	{
+		case 'G':
+			size <<= 10;
+			/* fall through */
+		case 'M':
+			size <<= 10;
+			/* fall through */
+		case 'K':
+			size <<= 10;
+			/* fall through */
+		default:
+			break;
+	}
+
+	return size;
+}
+
+/**
+ * Parse one TYPE:ACTION[:MAXSIZE] entry of the contentTypes option.
+ */
+static int
+_config_type_policy(char *entry, struct HTTP_type_policy *policy)
+{
+	char *action;
+	char *size;
+
+	memset(policy, 0, sizeof(*policy));
+
+	if (!(action = strchr(entry, ':')) || action == entry || (action - entry) >= HTTP_MEDIA_TYPE_MAX)
+		return -1;
+
+	memcpy(policy->type, entry, action - entry);
+	++action;
+
+	if ((size = strchr(action, ':')))
+		*size++ = 0;
+
+	if (!strcasecmp(action, "parse"))
+		policy->action = HTTP_BODY_PARSE;
+	else
+	if (!strcasecmp(action, "archive"))
+		policy->action = HTTP_BODY_ARCHIVE;
+	else
+	if (!strcasecmp(action, "skip"))
+		policy->action = HTTP_BODY_SKIP;
+	else
+	if (!strcasecmp(action, "default"))
+		policy->action = HTTP_BODY_DEFAULT;
+	else
+		return -1;
+
+	if (size)
+		policy->max_size = _config_size(size);
+
+	return 0;
+}
+
+/**
+ * Set the Content-Type policies from a list of entries
+ * separated by spaces or commas, or "none".
+ */
+static void
+_config_type_policies(char *value)
+{
+	char *list;
+	char *entry;
+	char *save;
+	int nr = 0;
+
+	nwctx.config.nr_type_policies = 0;
+
+	if (!strcasecmp(value, "none") || !(list = strdup(value)))
+		return;
+
+	for (entry = strtok_r(list, " ,\t\r\n", &save); entry; entry = strtok_r(NULL, " ,\t\r\n", &save))
+	{
+		if (nr == HTTP_TYPE_POLICY_MAX)
+		{
+			fprintf(stderr, "Only the first %d " CONTENT_TYPES_OPTION_NAME " entries are used\n", HTTP_TYPE_POLICY_MAX);
+			break;
+		}
+
+		if (_config_type_policy(entry, &nwctx.config.type_policies[nr]) < 0)
+		{
+			fprintf(stderr, "Ignoring bad " CONTENT_TYPES_OPTION_NAME " entry \"%s\"\n", entry);
+			continue;
+		}
+
+		++nr;
+	}
+
+	nwctx.config.nr_type_policies = nr;
+	free(list);
+
+	return;
+}
+
+/**
+ * Set every runtime option to its default; the one
+ * place to add a new option's default value.
+ */
+static void
+_config_apply_defaults(void)
+{
+	CONFIG_CRAWL_DELAY(&nwctx, DEFAULT_CRAWL_DELAY);
+	CONFIG_CRAWL_DEPTH(&nwctx, DEFAULT_CRAWL_DEPTH);
+	CONFIG_MAX_QUEUE(&nwctx, DEFAULT_MAX_QUEUE);
+	CONFIG_PIPELINE_DEPTH(&nwctx, DEFAULT_PIPELINE_DEPTH);
+	CONFIG_USE_HTTP2(&nwctx, DEFAULT_USE_HTTP2);
+	CONFIG_CONNS_PER_HOST(&nwctx, DEFAULT_CONNS_PER_HOST);
+	CONFIG_CONNECT_TIMEOUT(&nwctx, DEFAULT_CONNECT_TIMEOUT);
+	CONFIG_HANDSHAKE_TIMEOUT(&nwctx, DEFAULT_HANDSHAKE_TIMEOUT);
+	CONFIG_FIRST_BYTE_TIMEOUT(&nwctx, DEFAULT_FIRST_BYTE_TIMEOUT);
+	CONFIG_TRANSFER_TIMEOUT(&nwctx, DEFAULT_TRANSFER_TIMEOUT);
+	_config_type_policies(DEFAULT_CONTENT_TYPES);
+	CONFIG_TCP_NODELAY(&nwctx, DEFAULT_TCP_NODELAY);
+	CONFIG_TCP_FAST_OPEN(&nwctx, DEFAULT_TCP_FAST_OPEN);
+	CONFIG_RECEIVE_BUFFER(&nwctx, DEFAULT_RECEIVE_BUFFER);
+	CONFIG_KEEPALIVE(&nwctx, DEFAULT_KEEPALIVE);
+	CONFIG_USER_TIMEOUT(&nwctx, DEFAULT_USER_TIMEOUT);
+	CONFIG_PERMANENT_REDIRECT_TTL(&nwctx, DEFAULT_PERMANENT_REDIRECT_TTL);
+	CONFIG_TEMPORARY_REDIRECT_TTL(&nwctx, DEFAULT_TEMPORARY_REDIRECT_TTL);
+	CONFIG_RESOLVER_THREADS(&nwctx, DEFAULT_RESOLVER_THREADS);
+	FAST_MODE = 0;
+
+	return;
+}
+
+/**
+ * Set the runtime options from the values
+ * hashed from config.xml, using the defaults
+ * for those that are not there.
+ */
+static void
+_config_apply_options(void)
+{
+	char *value;
+
+	_config_apply_defaults();
+
+	if ((value = _config_get(CRAWL_DELAY_OPTION_NAME)))
+		CONFIG_CRAWL_DELAY(&nwctx, (unsigned int)strtoul(value, NULL, 0));
+
+	if ((value = _config_get(CRAWL_DEPTH_OPTION_NAME)))
+		CONFIG_CRAWL_DEPTH(&nwctx, (unsigned int)strtoul(value, NULL, 0));
+
+	if ((value = _config_get(MAX_QUEUE_OPTION_NAME)))
+		CONFIG_MAX_QUEUE(&nwctx, (unsigned int)strtoul(value, NULL, 0));
+
+	if ((value = _config_get(XDOMAIN_OPTION_NAME)))
+		CONFIG_CROSS_DOMAIN(&nwctx, _config_true(value));
+
+	if ((value = _config_get(FAST_MODE_OPTION_NAME)))
+		FAST_MODE = _config_true(value);
+
+	if ((value = _config_get(PIPELINE_DEPTH_OPTION_NAME)))
+	{
+		CONFIG_PIPELINE_DEPTH(&nwctx, (unsigned int)strtoul(value, NULL, 0));
+
+		if (nwctx.config.pipeline_depth > HTTP_PIPELINE_MAX)
+			CONFIG_PIPELINE_DEPTH(&nwctx, HTTP_PIPELINE_MAX);
+	}
+
+	if ((value = _config_get(HTTP2_OPTION_NAME)))
+		CONFIG_USE_HTTP2(&nwctx, _config_true(value));
+
+	if ((value = _config_get(CONNS_PER_HOST_OPTION_NAME)))
+	{
+		CONFIG_CONNS_PER_HOST(&nwctx, (unsigned int)strtoul(value, NULL, 0));
+
+		if (!nwctx.config.conns_per_host)
+			CONFIG_CONNS_PER_HOST(&nwctx, 1);
+	}
+
+/*
+ * A timeout of zero would fail every request;
+ * take it to mean the default.
+ */
+	if ((value = _config_get(CONNECT_TIMEOUT_OPTION_NAME)) && strtoul(value, NULL, 0))
+		CONFIG_CONNECT_TIMEOUT(&nwctx, (int)strtoul(value, NULL, 0));
+
+	if ((value = _config_get(HANDSHAKE_TIMEOUT_OPTION_NAME)) && strtoul(value, NULL, 0))
+		CONFIG_HANDSHAKE_TIMEOUT(&nwctx, (int)strtoul(value, NULL, 0));
+
+	if ((value = _config_get(FIRST_BYTE_TIMEOUT_OPTION_NAME)) && strtoul(value, NULL, 0))
+		CONFIG_FIRST_BYTE_TIMEOUT(&nwctx, (int)strtoul(value, NULL, 0));
+
+	if ((value = _config_get(TRANSFER_TIMEOUT_OPTION_NAME)) && strtoul(value, NULL, 0))
+		CONFIG_TRANSFER_TIMEOUT(&nwctx, (int)strtoul(value, NULL, 0));
+
+	if ((value = _config_get(CONTENT_TYPES_OPTION_NAME)))
+		_config_type_policies(value);
+
+	if ((value = _config_get(TCP_NODELAY_OPTION_NAME)))
+		CONFIG_TCP_NODELAY(&nwctx, _config_true(value));
+
+	if ((value = _config_get(TCP_FAST_OPEN_OPTION_NAME)))
+		CONFIG_TCP_FAST_OPEN(&nwctx, _config_true(value));
+
+/*
+ * Zero, for these, means leave it to the kernel.
+ */
+	if ((value = _config_get(RECEIVE_BUFFER_OPTION_NAME)))
+		CONFIG_RECEIVE_BUFFER(&nwctx, (int)_config_size(value));
+
+	if ((value = _config_get(KEEPALIVE_OPTION_NAME)))
+		CONFIG_KEEPALIVE(&nwctx, (int)strtoul(value, NULL, 0));
+
+	if ((value = _config_get(USER_TIMEOUT_OPTION_NAME)))
+		CONFIG_USER_TIMEOUT(&nwctx, (int)strtoul(value, NULL, 0));
+
+	if ((value = _config_get(PERMANENT_REDIRECT_TTL_OPTION_NAME)))
+		CONFIG_PERMANENT_REDIRECT_TTL(&nwctx, (unsigned int)strtoul(value, NULL, 0));
+
+	if ((value = _config_get(TEMPORARY_REDIRECT_TTL_OPTION_NAME)))
+		CONFIG_TEMPORARY_REDIRECT_TTL(&nwctx, (unsigned int)strtoul(value, NULL, 0));
+
+	if ((value = _config_get(RESOLVER_THREADS_OPTION_NAME)))
+	{
+		CONFIG_RESOLVER_THREADS(&nwctx, (unsigned int)strtoul(value, NULL, 0));
+
+		if (nwctx.config.resolver_threads > DNS_RESOLVERS_MAX)
+			CONFIG_RESOLVER_THREADS(&nwctx, DNS_RESOLVERS_MAX);
+	}
+
+	return;
+}
+
 /**
  * Parse the config.xml file and add runtime
  * options to hash bucket to retrieve when needed.
@@ -348,6 +685,7 @@ static void
 get_configuration(void)
 {
 	char config_file[1024];
+	struct XML *xml = NULL;
 
 	sprintf(config_file, "%s/.NetWasabi/" CONFIG_FILENAME, home_dir);
 	bObj_hashed_opts = NULL;
@@ -355,7 +693,7 @@ get_configuration(void)
 	if (access(config_file, F_OK) != 0)
 		goto _default;
 
-	struct XML *xml = XML_new();
+	xml = XML_new();
 
 	if (0 != XML_parse_file(xml, config_file))
 		goto _default;
@@ -373,13 +711,12 @@ get_configuration(void)
 	XML_for_each_child(n, _config_hash_options);
 	XML_free(xml);
 
+	_config_apply_options();
+
 	return;
 
 _default:
-	CONFIG_CRAWL_DELAY(&nwctx, DEFAULT_CRAWL_DELAY);
-	CONFIG_CRAWL_DEPTH(&nwctx, DEFAULT_CRAWL_DEPTH);
-	CONFIG_MAX_QUEUE(&nwctx, DEFAULT_MAX_QUEUE);
-	FAST_MODE = 0;
+	_config_apply_defaults();
 
 	XML_free(xml);
 	return;
@@ -404,6 +741,14 @@ main(int argc, char *argv[])
 	get_configuration();
 	check_directory();
 
+	HTTP_set_default_timeouts(&nwctx.config.timeouts);
+	HTTP_set_type_policies(nwctx.config.type_policies, nwctx.config.nr_type_policies);
+	HTTP_set_socket_profile(&nwctx.config.socket);
+	REDIRECT_set_ttl(nwctx.config.permanent_redirect_ttl, nwctx.config.temporary_redirect_ttl);
+
+	if (nwctx.config.resolver_threads && !DNS_pool_start((int)nwctx.config.resolver_threads))
+		fprintf(stderr, "Failed to start resolver threads; servers will be looked up as they are needed\n");
+
 	/*
 	 * Must be done here and not in the constructor function
 	 * because the dimensions are not known before main()
@@ -470,6 +815,10 @@ main(int argc, char *argv[])
 	http->followRedirects = 1; // Tell the HTTP module to automatically follow 3XX redirects.
 	http->usingSecure = 1; // Tell the HTTP module to use TLS.
 	http->verb = GET; // We will only be using GET requests anyway.
+	http->pipelineDepth = (int)nwctx.config.pipeline_depth;
+	http->useHTTP2 = (int)nwctx.config.use_http2;
+	http->getValidators = archive_get_validators; // Conditional GETs for pages we already archived.
+	http->openSink = archive_open_sink; // Stream documents we do not parse straight to disk.
 
 	url_len = strlen(url);
 	assert(url_len < HTTP_URL_MAX);
@@ -528,9 +877,9 @@ main(int argc, char *argv[])
 #ifdef DEBUG
 		fprintf(stderr, "URL is parseable - calling parse_URLs()\n");
 #endif
-		parse_URLs(http, URL_queue, tree_archived);
+		parse_URLs(http, URL_queue, tree_archived, NULL);
 		transform_document_URLs(http); // turn href links into file://<path to local dir for pages crawled from this site>
-		archive_page(http);
+		archive_page(http, NULL);
 	}
 	else
 	{
@@ -563,13 +912,16 @@ out_disconnect:
 out:
 
 	screen_updater_stop = 1;
+	DNS_pool_stop();
 
 	usleep(100000);
+	__print_socket_stats();
 	exit(EXIT_SUCCESS);
 
 fail_disconnect:
 
 	screen_updater_stop = 1;
+	DNS_pool_stop();
 	http_disconnect(http);
 	HTTP_delete(http);
 
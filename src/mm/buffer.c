@@ -4,7 +4,7 @@
 #include <limits.h>
 #include <openssl/err.h>
 #include <openssl/ssl.h>
-#include <regex.h>
+#include <pthread.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdarg.h>
@@ -13,9 +13,11 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include "buffer.h"
 #include "malloc.h"
+#include "scan.h"
 
 #define BUF_ALIGN_SIZE(s) (((s) + 0xf) & ~(0xf))
 
@@ -40,11 +42,18 @@ __buf_reset_head(buf_t *buf)
 	buf->buf_head = buf->data;
 }
 
+/*
+ * The byte after the data is kept NUL (when there is
+ * room for it) so the data can be used as a string
+ * without the rest of the buffer having to be zeroed.
+ */
 static inline void
 __buf_push_tail(buf_t *buf, size_t by)
 {
 	buf->buf_tail -= by;
 	buf->data_len -= by;
+	if (buf->buf_tail < buf->buf_end)
+		*buf->buf_tail = 0;
 }
 
 static inline void
@@ -61,6 +70,8 @@ __buf_pull_tail(buf_t *buf, size_t by)
 {
 	buf->buf_tail += by;
 	buf->data_len += by;
+	if (buf->buf_tail < buf->buf_end)
+		*buf->buf_tail = 0;
 }
 
 static inline void
@@ -187,12 +198,22 @@ buf_extend(buf_t *buf, size_t by)
 	return 0;
 }
 
+/**
+ * buf_clear - empty the buffer
+ *
+ * Only the first byte is zeroed; build with
+ * BUF_ZERO_ON_CLEAR to have all of it zeroed
+ * when chasing a bug that reads past the data.
+ */
 void
 buf_clear(buf_t *buf)
 {
+#ifdef BUF_ZERO_ON_CLEAR
 	memset(buf->data, 0, buf->buf_size);
+#endif
 	buf->buf_head = buf->buf_tail = buf->data;
 	buf->data_len = 0;
+	*buf->data = 0;
 }
 
 int
@@ -206,13 +227,69 @@ buf_append(buf_t *buf, char *str)
 		buf_extend(buf, BUF_ALIGN_SIZE(((len - slack) * 2)));
 	}
 
-	strcat(buf->buf_tail, str);
-	
+	memcpy(buf->buf_tail, str, len);
 	__buf_pull_tail(buf, len);
 
 	return 0;
 }
 
+/**
+ * buf_append_bytes - append LEN bytes from DATA, which may include NULs
+ *
+ * Keeps a byte spare after the data so the
+ * buffer can still be NUL terminated.
+ */
+int
+buf_append_bytes(buf_t *buf, void *data, size_t len)
+{
+	size_t room = (buf->buf_end - buf->buf_tail);
+
+	if (len >= room)
+	{
+		if (buf_extend(buf, BUF_ALIGN_SIZE(((len - room + 1) * 2))) < 0)
+			return -1;
+	}
+
+	memcpy(buf->buf_tail, data, len);
+	__buf_pull_tail(buf, len);
+	BUF_NULL_TERMINATE(buf);
+
+	return 0;
+}
+
+/**
+ * buf_append_iov - append the NR pieces of data in IOV, in order
+ *
+ * Room is made for all of it at once, so the
+ * buffer is extended at most one time.
+ */
+int
+buf_append_iov(buf_t *buf, struct iovec *iov, int nr)
+{
+	size_t room = (buf->buf_end - buf->buf_tail);
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < nr; ++i)
+		len += iov[i].iov_len;
+
+	if (len >= room)
+	{
+		if (buf_extend(buf, BUF_ALIGN_SIZE(((len - room + 1) * 2))) < 0)
+			return -1;
+	}
+
+	for (i = 0; i < nr; ++i)
+	{
+		memcpy(buf->buf_tail, iov[i].iov_base, iov[i].iov_len);
+		__buf_pull_tail(buf, iov[i].iov_len);
+	}
+
+	BUF_NULL_TERMINATE(buf);
+
+	return 0;
+}
+
 void
 buf_append_fmt(buf_t *buf, char *fmt, ...)
 {
@@ -238,8 +315,7 @@ buf_append_fmt(buf_t *buf, char *fmt, ...)
 		buf_extend(buf, BUF_ALIGN_SIZE(((len - slack) << 1)));
 	}
 
-	strcat(buf->buf_tail, formatted);
-	
+	memcpy(buf->buf_tail, formatted, len);
 	__buf_pull_tail(buf, len);
 
 	free(formatted);
@@ -305,6 +381,125 @@ buf_init(buf_t *buf, size_t bufsize)
 	return 0;
 }
 
+/*
+ * Memory for short-lived buffers is kept for reuse rather
+ * than given back to malloc, in size classes that are the
+ * powers of two from BUF_POOL_MIN to BUF_POOL_MAX bytes.
+ * Nothing in a pooled block is zeroed but its first byte.
+ */
+#define BUF_POOL_MIN_SHIFT 10
+#define BUF_POOL_MAX_SHIFT 16
+#define BUF_POOL_NR_CLASSES (BUF_POOL_MAX_SHIFT - BUF_POOL_MIN_SHIFT + 1)
+#define BUF_POOL_CLASS_MAX 64 /* free blocks kept in each class */
+
+struct buf_block
+{
+	struct buf_block *next;
+};
+
+static struct buf_block *__pool[BUF_POOL_NR_CLASSES];
+static int __pool_nr[BUF_POOL_NR_CLASSES];
+static pthread_mutex_t __pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * __pool_class - the smallest size class that holds SIZE bytes, or -1
+ */
+static int
+__pool_class(size_t size)
+{
+	int cls;
+
+	for (cls = 0; cls < BUF_POOL_NR_CLASSES; ++cls)
+	{
+		if (size <= ((size_t)1 << (cls + BUF_POOL_MIN_SHIFT)))
+			return cls;
+	}
+
+	return -1;
+}
+
+/**
+ * buf_get - initialise BUF with at least BUFSIZE bytes from the pool
+ *
+ * For temporaries: give it back with buf_put().
+ * Sizes over BUF_POOL_MAX are simply allocated.
+ */
+int
+buf_get(buf_t *buf, size_t bufsize)
+{
+	struct buf_block *block;
+	size_t size;
+	int cls;
+
+	if (buf->magic == BUFFER_MAGIC) /* already initialised */
+		return 0;
+
+	if ((cls = __pool_class(bufsize)) < 0)
+		return buf_init(buf, bufsize);
+
+	size = ((size_t)1 << (cls + BUF_POOL_MIN_SHIFT));
+
+	pthread_mutex_lock(&__pool_lock);
+
+	if ((block = __pool[cls]))
+	{
+		__pool[cls] = block->next;
+		--__pool_nr[cls];
+	}
+
+	pthread_mutex_unlock(&__pool_lock);
+
+	if (!block && !(block = malloc(size)))
+	{
+		perror("buf_get: malloc error");
+		return -1;
+	}
+
+	memset(buf, 0, sizeof(*buf));
+
+	buf->data = (char *)block;
+	*buf->data = 0;
+	buf->buf_size = size;
+	buf->buf_end = (buf->data + size);
+	buf->buf_head = buf->buf_tail = buf->data;
+	buf->magic = BUFFER_MAGIC;
+
+	return 0;
+}
+
+/**
+ * buf_put - finish with BUF, keeping its memory for buf_get() if it is a pool size
+ */
+void
+buf_put(buf_t *buf)
+{
+	assert(buf);
+	assert(buf->magic == BUFFER_MAGIC);
+
+	struct buf_block *block = (struct buf_block *)buf->data;
+	int cls = __pool_class(buf->buf_size);
+
+	if (block && cls >= 0 && buf->buf_size == ((size_t)1 << (cls + BUF_POOL_MIN_SHIFT)))
+	{
+		pthread_mutex_lock(&__pool_lock);
+
+		if (__pool_nr[cls] < BUF_POOL_CLASS_MAX)
+		{
+			block->next = __pool[cls];
+			__pool[cls] = block;
+			++__pool_nr[cls];
+			block = NULL;
+		}
+
+		pthread_mutex_unlock(&__pool_lock);
+	}
+
+	free(block);
+	memset(buf, 0, sizeof(*buf));
+
+	return;
+}
+
 void
 buf_destroy(buf_t *buf)
 {
@@ -918,6 +1113,12 @@ buf_copy(buf_t *to, buf_t *from)
 	return;
 }
 
+/**
+ * buf_replace - replace every occurrence of PATTERN with WITH
+ *
+ * The search carries on after each replacement,
+ * so WITH may itself contain PATTERN.
+ */
 void
 buf_replace(buf_t *buf, char *pattern, char *with)
 {
@@ -925,80 +1126,45 @@ buf_replace(buf_t *buf, char *pattern, char *with)
 	assert(pattern);
 	assert(with);
 
-	regex_t regex;
-	regmatch_t match[1];
-	int ret;
-	int longer = 0;
+	size_t plen = strlen(pattern);
 	size_t rlen = strlen(with);
-	size_t mlen;
-	int diff;
+	off_t off = 0;
+	char *m;
 
-	if (regcomp(&regex, pattern, 0) != 0)
+	if (!plen)
 		return;
 
-	ret = 0;
-	while (1)
+	while ((m = SCAN_find(buf->buf_head + off, buf->data_len - off, pattern, plen)))
 	{
-		ret = regexec(&regex, buf->buf_head, 1, match, 0);
-		if (ret)
-			break;
-
-		mlen = match[0].rm_eo - match[0].rm_so;
-
-		if (!mlen)
-			break;
-
-		diff = rlen - mlen;
-		if (diff < 0)
-			diff *= -1;
-		longer = rlen > mlen;
+		off = (m - buf->buf_head);
 
 #ifdef DEBUG
-		fprintf(stderr, "Substring length: %lu\n", mlen);
-		fprintf(stderr, "Matched substring \"%*.*s\"\n", (int)mlen, (int)mlen, buf->buf_head + match[0].rm_so);
+		fprintf(stderr, "Replacing \"%s\" at offset %ld\n", pattern, (long)off);
 #endif
 
-		if (longer)
-		{
-			buf_shift(buf, (off_t)match[0].rm_so, diff);
-			strncpy(buf->buf_head + match[0].rm_so, with, rlen);
-		}
+		if (rlen > plen)
+			buf_shift(buf, off, rlen - plen);
 		else
-		{
-			if (diff)
-				buf_collapse(buf, (off_t)match[0].rm_so, diff);
+		if (rlen < plen)
+			buf_collapse(buf, (off_t)(m - buf->data), plen - rlen);
 
-			strncpy(buf->buf_head + match[0].rm_so, with, rlen);
-		}
+		memcpy(buf->buf_head + off, with, rlen);
+		off += rlen;
 	}
 
-	regfree(&regex);
 	return;
 }
 
+/**
+ * buf_find - the first occurrence of PATTERN in the buffer, or NULL
+ */
 char *
 buf_find(buf_t *buf, char *pattern)
 {
 	assert(buf);
 	assert(pattern);
 
-	regex_t regex;
-	regmatch_t match[1];
-	int ret;
-	char *m = NULL;
-
-	if (regcomp(&regex, pattern, 0) != 0)
-		return NULL;
-
-	ret = regexec(&regex, buf->buf_head, 1, match, 0);
-	if (ret)
-		goto out;
-
-	m = buf->buf_head + match[0].rm_so;
-
-out:
-	regfree(&regex);
-	return m;
+	return SCAN_find(buf->buf_head, buf->data_len, pattern, strlen(pattern));
 }
 
 void
@@ -1059,3 +1225,265 @@ buf_pull_head(buf_t *buf, size_t by)
 	__buf_pull_head(buf, by);
 	return;
 }
+
+/*
+ * Segmented buffers.
+ */
+
+static struct buf_seg *
+__chain_new_seg(buf_chain_t *chain)
+{
+	struct buf_seg *seg;
+
+	if (!(seg = malloc(sizeof(*seg) + chain->seg_size)))
+	{
+		perror("buf_chain: malloc error");
+		return NULL;
+	}
+
+	seg->next = NULL;
+	seg->len = 0;
+
+	if (chain->tail)
+		chain->tail->next = seg;
+	else
+		chain->head = seg;
+
+	chain->tail = seg;
+	++chain->nr_segs;
+
+	return seg;
+}
+
+/**
+ * __chain_trim - free the empty segments at the end of the chain
+ *
+ * The first segment is kept even if it is empty.
+ */
+static void
+__chain_trim(buf_chain_t *chain)
+{
+	struct buf_seg *seg;
+	struct buf_seg *next;
+	struct buf_seg *last = chain->head;
+
+	if (!last)
+		return;
+
+	for (seg = chain->head->next; seg; seg = seg->next)
+	{
+		if (seg->len)
+			last = seg;
+	}
+
+	for (seg = last->next; seg; seg = next)
+	{
+		next = seg->next;
+		free(seg);
+		--chain->nr_segs;
+	}
+
+	last->next = NULL;
+	chain->tail = last;
+
+	return;
+}
+
+int
+buf_chain_init(buf_chain_t *chain, size_t seg_size)
+{
+	if (chain->magic == BUFFER_MAGIC) /* already initialised */
+		return 0;
+
+	memset(chain, 0, sizeof(*chain));
+
+	chain->seg_size = (seg_size ? seg_size : BUF_SEG_SIZE);
+	chain->magic = BUFFER_MAGIC;
+
+	return 0;
+}
+
+void
+buf_chain_destroy(buf_chain_t *chain)
+{
+	assert(chain);
+	assert(chain->magic == BUFFER_MAGIC);
+
+	struct buf_seg *seg;
+	struct buf_seg *next;
+
+	for (seg = chain->head; seg; seg = next)
+	{
+		next = seg->next;
+		free(seg);
+	}
+
+	memset(chain, 0, sizeof(*chain));
+
+	return;
+}
+
+/**
+ * buf_chain_clear - empty the chain, keeping its first segment for reuse
+ */
+void
+buf_chain_clear(buf_chain_t *chain)
+{
+	assert(chain);
+
+	struct buf_seg *seg;
+
+	for (seg = chain->head; seg; seg = seg->next)
+		seg->len = 0;
+
+	__chain_trim(chain);
+	chain->data_len = 0;
+
+	return;
+}
+
+int
+buf_chain_append(buf_chain_t *chain, void *data, size_t len)
+{
+	assert(chain);
+	assert(data);
+
+	struct buf_seg *seg = chain->tail;
+	char *p = (char *)data;
+	size_t n;
+
+	while (len)
+	{
+		if (!seg || seg->len == chain->seg_size)
+		{
+			if (!(seg = __chain_new_seg(chain)))
+				return -1;
+		}
+
+		n = (chain->seg_size - seg->len);
+
+		if (n > len)
+			n = len;
+
+		memcpy(seg->data + seg->len, p, n);
+
+		seg->len += n;
+		chain->data_len += n;
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/**
+ * buf_chain_flatten - append the contents of CHAIN to BUF
+ *
+ * BUF is extended (at most) once, to fit all of it.
+ */
+int
+buf_chain_flatten(buf_chain_t *chain, buf_t *buf)
+{
+	assert(chain);
+	assert(buf);
+
+	struct buf_seg *seg;
+	size_t slack = (buf->buf_end - buf->buf_tail);
+	char *p;
+
+	if (!chain->data_len)
+		return 0;
+
+	if (chain->data_len >= slack)
+	{
+		if (buf_extend(buf, BUF_ALIGN_SIZE((chain->data_len - slack) + 1)) < 0)
+			return -1;
+	}
+
+	p = buf->buf_tail;
+
+	for (seg = chain->head; seg; seg = seg->next)
+	{
+		memcpy(p, seg->data, seg->len);
+		p += seg->len;
+	}
+
+	__buf_pull_tail(buf, chain->data_len);
+
+	return 0;
+}
+
+/**
+ * buf_chain_write_fd - write out the whole chain, BUF_CHAIN_IOV_MAX segments per writev()
+ */
+ssize_t
+buf_chain_write_fd(int fd, buf_chain_t *chain)
+{
+	assert(chain);
+
+	struct iovec iov[BUF_CHAIN_IOV_MAX];
+	struct buf_seg *seg = chain->head;
+	size_t off = 0; /* into SEG, after a short write */
+	size_t n;
+	ssize_t rv;
+	ssize_t total = 0;
+	struct buf_seg *s;
+	int nr;
+
+	while (seg)
+	{
+		nr = 0;
+
+		for (s = seg; s && nr < BUF_CHAIN_IOV_MAX; s = s->next)
+		{
+			if (s->len <= (s == seg ? off : 0))
+				continue;
+
+			iov[nr].iov_base = s->data + (s == seg ? off : 0);
+			iov[nr].iov_len = s->len - (s == seg ? off : 0);
+			++nr;
+		}
+
+		if (!nr)
+			break;
+
+		rv = writev(fd, iov, nr);
+
+		if (rv < 0)
+		{
+			if (EINTR == errno)
+				continue;
+
+			return -1;
+		}
+
+		if (!rv)
+			break;
+
+		total += rv;
+
+	/*
+	 * Move past what went out.
+	 */
+		for (n = (size_t)rv; seg && n; )
+		{
+			if (n < seg->len - off)
+			{
+				off += n;
+				break;
+			}
+
+			n -= (seg->len - off);
+			off = 0;
+			seg = seg->next;
+		}
+
+		while (seg && seg->len == off)
+		{
+			seg = seg->next;
+			off = 0;
+		}
+	}
+
+	return total;
+}
@@ -0,0 +1,261 @@
+#define _GNU_SOURCE /* memmem(3) */
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include "scan.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__) && !defined(SCAN_NO_SIMD)
+# define SCAN_X86 1
+# include <immintrin.h>
+#endif
+
+/*
+ * Substrings are found by comparing a block of the span with
+ * the first byte of the needle and the same block, offset by
+ * the length of the needle less one, with its last byte. Only
+ * positions where both match are compared in full, so text
+ * that merely shares the first byte costs next to nothing.
+ */
+
+struct scan_kernels
+{
+	char *(*find)(const char *, size_t, const char *, size_t);
+	char *(*find_any)(const char *, size_t, const char *, size_t);
+	const char *name;
+};
+
+static struct scan_kernels kernels;
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+static void
+scLog(char *fmt, ...)
+{
+#ifdef DEBUG
+	va_list args;
+
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+#else
+	(void)fmt;
+#endif
+}
+
+static char *
+__find_scalar(const char *p, size_t len, const char *needle, size_t nlen)
+{
+	return memmem(p, len, needle, nlen);
+}
+
+static char *
+__find_any_scalar(const char *p, size_t len, const char *set, size_t nset)
+{
+	const char *end = (p + len);
+
+	if (1 == nset)
+		return memchr(p, *set, len);
+
+	for (; p < end; ++p)
+	{
+		if (memchr(set, *p, nset))
+			return (char *)p;
+	}
+
+	return NULL;
+}
+
+#ifdef SCAN_X86
+static char *
+__find_sse2(const char *p, size_t len, const char *needle, size_t nlen)
+{
+	__m128i first = _mm_set1_epi8(needle[0]);
+	__m128i last = _mm_set1_epi8(needle[nlen - 1]);
+	__m128i a;
+	__m128i b;
+	unsigned int mask;
+	size_t i;
+	int bit;
+
+	for (i = 0; i + nlen - 1 + 16 <= len; i += 16)
+	{
+		a = _mm_loadu_si128((const __m128i *)(p + i));
+		b = _mm_loadu_si128((const __m128i *)(p + i + nlen - 1));
+
+		mask = (unsigned int)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+
+		while (mask)
+		{
+			bit = __builtin_ctz(mask);
+
+			if (!memcmp(p + i + bit + 1, needle + 1, nlen - 2))
+				return (char *)(p + i + bit);
+
+			mask &= (mask - 1);
+		}
+	}
+
+	return __find_scalar(p + i, len - i, needle, nlen);
+}
+
+static char *
+__find_any_sse2(const char *p, size_t len, const char *set, size_t nset)
+{
+	__m128i want[SCAN_SET_MAX];
+	__m128i v;
+	__m128i hit;
+	unsigned int mask;
+	size_t i;
+	size_t k;
+
+	for (k = 0; k < nset; ++k)
+		want[k] = _mm_set1_epi8(set[k]);
+
+	for (i = 0; i + 16 <= len; i += 16)
+	{
+		v = _mm_loadu_si128((const __m128i *)(p + i));
+		hit = _mm_cmpeq_epi8(v, want[0]);
+
+		for (k = 1; k < nset; ++k)
+			hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, want[k]));
+
+		if ((mask = (unsigned int)_mm_movemask_epi8(hit)))
+			return (char *)(p + i + __builtin_ctz(mask));
+	}
+
+	return __find_any_scalar(p + i, len - i, set, nset);
+}
+
+__attribute__((target("avx2")))
+static char *
+__find_avx2(const char *p, size_t len, const char *needle, size_t nlen)
+{
+	__m256i first = _mm256_set1_epi8(needle[0]);
+	__m256i last = _mm256_set1_epi8(needle[nlen - 1]);
+	__m256i a;
+	__m256i b;
+	unsigned int mask;
+	size_t i;
+	int bit;
+
+	for (i = 0; i + nlen - 1 + 32 <= len; i += 32)
+	{
+		a = _mm256_loadu_si256((const __m256i *)(p + i));
+		b = _mm256_loadu_si256((const __m256i *)(p + i + nlen - 1));
+
+		mask = (unsigned int)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+
+		while (mask)
+		{
+			bit = __builtin_ctz(mask);
+
+			if (!memcmp(p + i + bit + 1, needle + 1, nlen - 2))
+				return (char *)(p + i + bit);
+
+			mask &= (mask - 1);
+		}
+	}
+
+	return __find_sse2(p + i, len - i, needle, nlen);
+}
+
+__attribute__((target("avx2")))
+static char *
+__find_any_avx2(const char *p, size_t len, const char *set, size_t nset)
+{
+	__m256i want[SCAN_SET_MAX];
+	__m256i v;
+	__m256i hit;
+	unsigned int mask;
+	size_t i;
+	size_t k;
+
+	for (k = 0; k < nset; ++k)
+		want[k] = _mm256_set1_epi8(set[k]);
+
+	for (i = 0; i + 32 <= len; i += 32)
+	{
+		v = _mm256_loadu_si256((const __m256i *)(p + i));
+		hit = _mm256_cmpeq_epi8(v, want[0]);
+
+		for (k = 1; k < nset; ++k)
+			hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(v, want[k]));
+
+		if ((mask = (unsigned int)_mm256_movemask_epi8(hit)))
+			return (char *)(p + i + __builtin_ctz(mask));
+	}
+
+	return __find_any_sse2(p + i, len - i, set, nset);
+}
+#endif /* defined SCAN_X86 */
+
+static void
+__pick_kernels(void)
+{
+	kernels.find = __find_scalar;
+	kernels.find_any = __find_any_scalar;
+	kernels.name = "scalar";
+
+#ifdef SCAN_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2"))
+	{
+		kernels.find = __find_avx2;
+		kernels.find_any = __find_any_avx2;
+		kernels.name = "avx2";
+	}
+	else
+	{
+		kernels.find = __find_sse2;
+		kernels.find_any = __find_any_sse2;
+		kernels.name = "sse2";
+	}
+#endif
+
+	scLog("Using %s search kernels\n", kernels.name);
+
+	return;
+}
+
+char *
+SCAN_find(const char *p, size_t len, const char *needle, size_t nlen)
+{
+	if (!nlen)
+		return (char *)p;
+
+	if (nlen > len)
+		return NULL;
+
+	if (1 == nlen)
+		return memchr(p, *needle, len);
+
+	pthread_once(&kernels_once, __pick_kernels);
+
+	return kernels.find(p, len, needle, nlen);
+}
+
+char *
+SCAN_find_any(const char *p, size_t len, const char *set, size_t nset)
+{
+	if (!nset || !len)
+		return NULL;
+
+	if (1 == nset)
+		return memchr(p, *set, len);
+
+	if (nset > SCAN_SET_MAX)
+		return __find_any_scalar(p, len, set, nset);
+
+	pthread_once(&kernels_once, __pick_kernels);
+
+	return kernels.find_any(p, len, set, nset);
+}
+
+const char *
+SCAN_kernel(void)
+{
+	pthread_once(&kernels_once, __pick_kernels);
+
+	return kernels.name;
+}
@@ -7,16 +7,20 @@
 #include <stdlib.h>
 #include <sys/stat.h> /* for mkdir() */
 #include <unistd.h>
+#include "archive_meta.h"
 #include "btree.h"
 #include "buffer.h"
 #include "cache.h"
 #include "cache_management.h"
+#include "dns_cache.h"
 #include "http.h"
 #include "malloc.h"
 #include "screen_utils.h"
 #include "utils_url.h"
 #include "netwasabi.h"
 #include "queue.h"
+#include "scan.h"
+#include "scheduler.h"
 
 #define CREATE_FLAGS O_RDWR|O_CREAT|O_TRUNC
 #define CREATE_MODE S_IRUSR|S_IWUSR
@@ -284,13 +288,13 @@ update_connection_state(struct http_t *http, int state)
 	{
 		default:
 		case FL_CONNECTION_CONNECTED:
-			fprintf(stderr, "%sConnected%s to %s%s%s (%s)", COL_DARKGREEN, COL_END, COL_RED, http->host, COL_END, http->conn.host_ipv4);
+			fprintf(stderr, "%sConnected%s to %s%s%s (%s)", COL_DARKGREEN, COL_END, COL_RED, http->host, COL_END, http->conn.host_addr);
 			break;
 		case FL_CONNECTION_DISCONNECTED:
 			fprintf(stderr, "%sDisconnected%s", COL_LIGHTGREY, COL_END);
 			break;
 		case FL_CONNECTION_CONNECTING:
-			fprintf(stderr, "Connecting to server %s at %s", http->host, http->conn.host_ipv4);
+			fprintf(stderr, "Connecting to server %s at %s", http->host, http->conn.host_addr);
 			break;
 	}
 
@@ -431,7 +435,7 @@ check_local_dirs(struct http_t *http, buf_t *filename)
 	char *name = filename->buf_head;
 	buf_t _tmp;
 
-	buf_init(&_tmp, pathconf("/", _PC_PATH_MAX));
+	buf_get(&_tmp, pathconf("/", _PC_PATH_MAX));
 
 	if (*(filename->buf_tail - 1) == '/')
 		buf_snip(filename, 1);
@@ -487,12 +491,220 @@ check_local_dirs(struct http_t *http, buf_t *filename)
 		buf_clear(&_tmp);
 	}
 
-	buf_destroy(&_tmp);
+	buf_put(&_tmp);
 	return 0;
 }
 
+/**
+ * document_parseable - whether to take links from the document in HTTP's read buffer
+ *
+ * A Content-Type policy has the final say; without
+ * one we go by the extension in the URL.
+ */
 int
-archive_page(struct http_t *http)
+document_parseable(struct http_t *http)
+{
+	assert(http);
+
+	switch(http->bodyAction)
+	{
+		case HTTP_BODY_PARSE:
+
+			return 1;
+
+		case HTTP_BODY_ARCHIVE:
+		case HTTP_BODY_SKIP:
+
+			return 0;
+
+		default:
+
+			return URL_parseable(http->URL);
+	}
+}
+
+/**
+ * archive_part_path - where the body of HTTP->URL is streamed to before it is complete
+ */
+static int
+archive_part_path(struct http_t *http, buf_t *path)
+{
+	if (archive_doc_path(http, http->URL, path) < 0)
+		return -1;
+
+	if (buf_append(path, ARCHIVE_PART_SUFFIX) < 0)
+		return -1;
+
+	return 0;
+}
+
+/**
+ * archive_open_sink - HTTP_sink_cb_t: stream documents we do not parse straight to disk
+ *
+ * Documents we take links from are rewritten before
+ * they are archived, which needs the whole document,
+ * so only the others (images, scripts, PDFs...) are
+ * streamed. They go to a part file that archive_page()
+ * renames over the old copy once it is complete.
+ */
+int
+archive_open_sink(struct http_t *http)
+{
+	assert(http);
+
+	buf_t path;
+	int fd = -1;
+
+	if (document_parseable(http))
+		return -1;
+
+	if (buf_get(&path, path_max) < 0)
+		return -1;
+
+	if (archive_doc_path(http, http->URL, &path) < 0
+	|| check_local_dirs(http, &path) < 0
+	|| buf_append(&path, ARCHIVE_PART_SUFFIX) < 0)
+		goto out;
+
+	if ((fd = open(path.buf_head, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, S_IRUSR|S_IWUSR)) < 0)
+		put_error_msg("Failed to create %s (%s)", path.buf_head, strerror(errno));
+
+out:
+
+	buf_put(&path);
+
+	return fd;
+}
+
+/**
+ * archive_discard_sink - throw away a body that went to a sink but is not wanted
+ */
+void
+archive_discard_sink(struct http_t *http)
+{
+	assert(http);
+
+	buf_t path;
+
+	if (http->bodySink < 0)
+		return;
+
+	close(http->bodySink);
+	http->bodySink = -1;
+
+	if (buf_get(&path, path_max) < 0)
+		return;
+
+	if (archive_part_path(http, &path) == 0)
+		unlink(path.buf_head);
+
+	buf_put(&path);
+
+	return;
+}
+
+/**
+ * archive_save_meta - record what we need to revisit HTTP->URL later
+ * @http: our HTTP object, with the response header parsed
+ * @links: links parse_URLs() found in the document (or NULL)
+ */
+static void
+archive_save_meta(struct http_t *http, buf_t *links)
+{
+	struct archive_meta meta;
+	buf_t path;
+	char *value;
+
+	if (buf_get(&path, path_max) < 0)
+		return;
+
+	if (archive_meta_init(&meta) < 0)
+		goto out_destroy_path;
+
+	if ((value = http->ops->fetch_header(http, "etag")))
+		snprintf(meta.etag, HTTP_VALIDATOR_MAX, "%s", value);
+
+	if ((value = http->ops->fetch_header(http, "last-modified")))
+		snprintf(meta.last_modified, HTTP_VALIDATOR_MAX, "%s", value);
+
+	if (links && links->data_len && buf_append(&meta.links, links->buf_head) < 0)
+		goto out;
+
+	if (archive_meta_path(http, http->URL, &path) < 0)
+		goto out;
+
+	if (archive_meta_save(path.buf_head, &meta) < 0)
+		Log("Failed to save metadata for %s\n", http->URL);
+
+out:
+
+	archive_meta_destroy(&meta);
+
+out_destroy_path:
+
+	buf_put(&path);
+
+	return;
+}
+
+/**
+ * archive_commit_sink - put a document that was streamed to disk in place
+ */
+static int
+archive_commit_sink(struct http_t *http, buf_t *links)
+{
+	buf_t part;
+	buf_t path;
+	int rv = -1;
+
+	close(http->bodySink);
+	http->bodySink = -1;
+
+	if (buf_get(&part, path_max) < 0)
+		return -1;
+
+	if (buf_get(&path, path_max) < 0)
+		goto out_destroy_part;
+
+	if (archive_part_path(http, &part) < 0 || archive_doc_path(http, http->URL, &path) < 0)
+		goto out;
+
+	if (rename(part.buf_head, path.buf_head) < 0)
+	{
+		put_error_msg("Failed to create local copy (%s)", strerror(errno));
+		unlink(part.buf_head);
+		goto out;
+	}
+
+	update_operation_status("Created %s", path.buf_head);
+	archive_save_meta(http, links);
+
+	rv = 0;
+
+out:
+
+	buf_put(&path);
+
+out_destroy_part:
+
+	buf_put(&part);
+
+	return rv;
+}
+
+/**
+ * archive_page - write the document in the read buffer to the local archive
+ * @http: our HTTP object
+ * @links: links parse_URLs() found in the document (or NULL)
+ * @edits: links to localise on the way out (or NULL)
+ *
+ * An existing copy is overwritten: we only get
+ * here with a full response if the document
+ * changed since we archived it (or if we had
+ * no validators to ask the server with).
+ */
+int
+archive_page(struct http_t *http, buf_t *links, struct URL_edits *edits)
 {
 	assert(http);
 
@@ -500,9 +712,13 @@ archive_page(struct http_t *http)
 	buf_t *buf = &http_rbuf(http);
 	buf_t tmp;
 	buf_t local_url;
+	off_t body_off;
 	char *p;
 	int rv;
 
+	if (http->bodySink >= 0)
+		return archive_commit_sink(http, links);
+
 	p = HTTP_EOH(buf);
 
 	if (!p)
@@ -511,12 +727,12 @@ archive_page(struct http_t *http)
 		goto fail;
 	}
 
-	buf_collapse(buf, (off_t)0, (p - buf->buf_head));
+	body_off = (p - buf->buf_head);
 
-	buf_init(&tmp, HTTP_URL_MAX);
+	buf_get(&tmp, HTTP_URL_MAX);
 	buf_clear(&tmp);
 
-	buf_init(&local_url, 1024);
+	buf_get(&local_url, 1024);
 	buf_append(&tmp, http->URL);
 
 	make_local_url(http, &tmp, &local_url);
@@ -531,11 +747,6 @@ archive_page(struct http_t *http)
 	if (rv < 0)
 		goto fail_free_bufs;
 
-	if (access(local_url.buf_head, F_OK) == 0)
-	{
-		goto out_free_bufs;
-	}
-
 	fd = open(local_url.buf_head, O_RDWR|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
 
 	if (fd == -1)
@@ -546,21 +757,35 @@ archive_page(struct http_t *http)
 
 	update_operation_status("Created %s", local_url.buf_head);
 
-	buf_write_fd(fd, buf);
+/*
+ * The offsets in EDITS are into the buffer as it
+ * is, so the header is skipped rather than cut.
+ */
+	if (edits)
+	{
+		if (URL_write_edits(fd, buf, body_off, edits) < 0)
+			put_error_msg("Failed to write local copy (%s)", strerror(errno));
+	}
+	else
+	{
+		buf_collapse(buf, (off_t)0, (size_t)body_off);
+		buf_write_fd(fd, buf);
+	}
+
 	close(fd);
 	fd = -1;
 
-out_free_bufs:
+	archive_save_meta(http, links);
 
-	buf_destroy(&tmp);
-	buf_destroy(&local_url);
+	buf_put(&tmp);
+	buf_put(&local_url);
 
 	return 0;
 
 fail_free_bufs:
 
-	buf_destroy(&tmp);
-	buf_destroy(&local_url);
+	buf_put(&tmp);
+	buf_put(&local_url);
 
 fail:
 
@@ -614,11 +839,6 @@ URL_acceptable(struct http_t *http, btree_obj_t *tree_archived, buf_t *url)
 #endif
 	}
 
-	if (local_archive_exists(http, url->buf_head))
-	{
-		return 0;
-	}
-
 	if (memchr(url->buf_head, '#', url->buf_tail - url->buf_head))
 		return 0;
 
@@ -650,9 +870,10 @@ URL_acceptable(struct http_t *http, btree_obj_t *tree_archived, buf_t *url)
  * @http our HTTP object with remote host info
  * @URL_queue our queue of URLs that we will add to
  * @tree_archived tree of already-archived URLs to search through before adding to queue
+ * @links if not NULL, every URL found is appended, one per line (for archive_page())
  */
 int
-parse_URLs(struct http_t *http, queue_obj_t *URL_queue, btree_obj_t *tree_archived)
+parse_URLs(struct http_t *http, queue_obj_t *URL_queue, btree_obj_t *tree_archived, buf_t *links)
 {
 	assert(http);
 	assert(URL_queue);
@@ -667,18 +888,19 @@ parse_URLs(struct http_t *http, queue_obj_t *URL_queue, btree_obj_t *tree_archiv
 	buf_t URL;
 	buf_t full_URL;
 	buf_t path;
+	char host[HTTP_HOST_MAX+1];
 
 	nr_urls_call = 0;
 
 	assert(buf->buf_head);
 
-	if (buf_init(&URL, HTTP_URL_MAX) < 0)
+	if (buf_get(&URL, HTTP_URL_MAX) < 0)
 		goto fail;
 
-	if (buf_init(&full_URL, HTTP_URL_MAX) < 0)
+	if (buf_get(&full_URL, HTTP_URL_MAX) < 0)
 		goto fail_destroy_bufs;
 
-	if (buf_init(&path, path_max) < 0)
+	if (buf_get(&path, path_max) < 0)
 		goto fail_destroy_bufs;
 
 	savep = buf->buf_head;
@@ -689,7 +911,7 @@ parse_URLs(struct http_t *http, queue_obj_t *URL_queue, btree_obj_t *tree_archiv
 		buf_clear(&full_URL);
 		buf_clear(&path);
 
-		p = strstr(savep, url_types[url_type_idx].string);
+		p = SCAN_find(savep, (buf->buf_tail - savep), url_types[url_type_idx].string, url_types[url_type_idx].len);
 		delim = url_types[url_type_idx].delim;
 
 		if (!p || p >= buf->buf_tail)
@@ -735,6 +957,25 @@ parse_URLs(struct http_t *http, queue_obj_t *URL_queue, btree_obj_t *tree_archiv
 		make_full_url(http, &URL, &full_URL);
 		//Log("\nMade full URL: %s\n", full_URL.buf_head);
 
+		if (links && full_URL.data_len && !memchr(full_URL.buf_head, '\n', full_URL.data_len))
+		{
+			if (buf_append(links, full_URL.buf_head) < 0 || buf_append(links, "\n") < 0)
+				goto fail_destroy_bufs;
+		}
+
+	/*
+	 * Have the address of another server looked up while
+	 * we get on with this one. This has to come before
+	 * URL_acceptable(), which turns away other hosts.
+	 */
+		if (nwctx.config.allow_xdomain
+		&& (!strncmp("http:", full_URL.buf_head, 5) || !strncmp("https:", full_URL.buf_head, 6))
+		&& http->ops->URL_parse_host(full_URL.buf_head, host)
+		&& strcmp(host, http->host))
+		{
+			DNS_prefetch(host);
+		}
+
 		if (!URL_acceptable(http, tree_archived, &full_URL))
 		{
 			//Log("\nURL is not acceptable\n");
@@ -751,9 +992,9 @@ parse_URLs(struct http_t *http, queue_obj_t *URL_queue, btree_obj_t *tree_archiv
 		++nr_urls_call;
 	}
 
-	buf_destroy(&URL);
-	buf_destroy(&full_URL);
-	buf_destroy(&path);
+	buf_put(&URL);
+	buf_put(&full_URL);
+	buf_put(&path);
 
 #ifdef DEBUG
 	fprintf(stderr, "parse_URLs: returning %d\n", nr_urls_call);
@@ -762,9 +1003,9 @@ parse_URLs(struct http_t *http, queue_obj_t *URL_queue, btree_obj_t *tree_archiv
 
 fail_destroy_bufs:
 
-	buf_destroy(&URL);
-	buf_destroy(&full_URL);
-	buf_destroy(&path);
+	buf_put(&URL);
+	buf_put(&full_URL);
+	buf_put(&path);
 #ifdef DEBUG
 	fprintf(stderr, "parse_URLs: failed\n");
 #endif
@@ -773,6 +1014,378 @@ fail:
 	return -1;
 }
 
+/**
+ * archive_revisit - our archived copy of HTTP->URL is still current (304)
+ * @http: our HTTP object
+ * @URL_queue: the queue of URLs to crawl
+ * @tree_archived: URLs we already archived
+ *
+ * Queue the links that were in the document when we
+ * archived it, as parse_URLs() would have done with
+ * a fresh copy.
+ */
+int
+archive_revisit(struct http_t *http, queue_obj_t *URL_queue, btree_obj_t *tree_archived)
+{
+	assert(http);
+	assert(URL_queue);
+	assert(tree_archived);
+
+	struct archive_meta meta;
+	buf_t path;
+	buf_t URL;
+	char *p;
+	char *e;
+	int nr = 0;
+
+	if (buf_get(&path, path_max) < 0)
+		goto fail;
+
+	if (buf_get(&URL, HTTP_URL_MAX) < 0)
+		goto fail_destroy_path;
+
+	if (archive_meta_init(&meta) < 0)
+		goto fail_destroy_bufs;
+
+	if (archive_meta_path(http, http->URL, &path) < 0
+	|| archive_meta_load(path.buf_head, &meta) < 0)
+	{
+		put_error_msg("No metadata for unmodified %s", http->URL);
+		goto fail_destroy_meta;
+	}
+
+	BTREE_put_data(tree_archived, (void *)http->URL, strlen(http->URL));
+
+	p = meta.links.buf_head;
+
+	while (p < meta.links.buf_tail && (e = memchr(p, '\n', meta.links.buf_tail - p)))
+	{
+		buf_clear(&URL);
+
+		if (buf_append_ex(&URL, p, (e - p)) < 0)
+			goto fail_destroy_meta;
+
+		BUF_NULL_TERMINATE(&URL);
+
+		p = e + 1;
+
+		if (!URL_acceptable(http, tree_archived, &URL))
+			continue;
+
+		if (QUEUE_enqueue(URL_queue, (void *)URL.buf_head, URL.data_len) < 0)
+			goto fail_destroy_meta;
+
+		++nr;
+	}
+
+	update_operation_status("Not modified: %s", http->URL);
+
+	archive_meta_destroy(&meta);
+	buf_put(&URL);
+	buf_put(&path);
+
+	return nr;
+
+fail_destroy_meta:
+
+	archive_meta_destroy(&meta);
+
+fail_destroy_bufs:
+
+	buf_put(&URL);
+
+fail_destroy_path:
+
+	buf_put(&path);
+
+fail:
+
+	return -1;
+}
+
+/**
+ * process_page - deal with the response we received for HTTP->URL
+ */
+static void
+process_page(struct http_t *http, queue_obj_t *URL_queue, btree_obj_t *tree_archived)
+{
+	int code = http->code;
+	struct URL_edits edits;
+	struct URL_edits *to_edit = NULL;
+	buf_t links;
+
+#ifdef DEBUG
+	fprintf(stderr, "Got response [%d]\n", code);
+#endif
+
+	if (code != HTTP_OK)
+		archive_discard_sink(http);
+
+/*
+ * Its type is one we do not want (or it was too big);
+ * keep it in the tree so we do not ask for it again.
+ */
+	if (HTTP_BODY_SKIP == http->bodyAction)
+	{
+		archive_discard_sink(http);
+		BTREE_put_data(tree_archived, (void *)http->URL, http->URL_len);
+		return;
+	}
+
+	switch (code)
+	{
+		case HTTP_OK:
+
+			break;
+
+		case HTTP_NOT_MODIFIED:
+
+			if (archive_revisit(http, URL_queue, tree_archived) < 0)
+			{
+				Log("Failed to revisit %s\n", http->URL);
+				BTREE_put_data(tree_archived, (void *)http->URL, http->URL_len);
+			}
+
+			return;
+
+		case HTTP_NOT_FOUND:
+
+			cache_dead_URL(Dead_URL_cache, http->URL, code);
+			Log("%d dead URLs cached\n", cache_nr_used(Dead_URL_cache));
+
+		default:
+
+			return;
+	}
+
+	Log("Adding URL to archived documents tree\n");
+	BTREE_put_data(tree_archived, (void *)http->URL, http->URL_len);
+#ifdef DEBUG
+	btree_node_t *node = BTREE_search_data(tree_archived, (void *)http->URL, http->URL_len);
+	assert(node);
+#endif
+	Log("%d archived documents\n", tree_archived->nr_nodes);
+
+	if (buf_init(&links, HTTP_URL_MAX) < 0)
+		return;
+
+	if (document_parseable(http))
+	{
+		parse_URLs(http, URL_queue, tree_archived, &links);
+
+		if (URL_edits_init(&edits) == 0)
+		{
+			if (URL_find_edits(http, &edits) == 0)
+				to_edit = &edits;
+			else
+				URL_edits_destroy(&edits);
+		}
+	}
+
+	archive_page(http, &links, to_edit);
+
+	if (to_edit)
+		URL_edits_destroy(to_edit);
+
+	buf_destroy(&links);
+
+	return;
+}
+
+static void
+free_queue_item(queue_item_t *item)
+{
+	free(item->data);
+	free(item);
+}
+
+/**
+ * crawl_filter - SCHED_filter_t: drop URLs we archived or know to be dead
+ */
+static int
+crawl_filter(char *URL, void *arg)
+{
+	btree_obj_t *tree_archived = (btree_obj_t *)arg;
+	Dead_URL_t *dead;
+
+	if (BTREE_search_data(tree_archived, (void *)URL, strlen(URL)))
+		return 1;
+
+	if ((dead = search_dead_URL(Dead_URL_cache, URL)))
+	{
+		++dead->times_seen;
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * __same_server - whether two URLs have the same scheme, host and port
+ */
+static int
+__same_server(char *a, char *b)
+{
+	char *p = strstr(a, "://");
+	size_t len;
+
+	if (!p)
+		return 0;
+
+	p += 3;
+	len = (p - a) + strcspn(p, "/?#");
+
+	return (!strncmp(a, b, len) && strchr("/?#", b[len]));
+}
+
+/**
+ * next_batch - take the next URLs to fetch from the scheduler
+ * @sched: the scheduler
+ * @batch: where to put the items
+ * @max: the most we want
+ *
+ * The first is for whichever server may be sent a
+ * request soonest, waiting until then if we must.
+ * The rest are more for the same server, to go out
+ * with it on the one connection. The batch ends at
+ * the first URL that is not (that one goes back to
+ * the queue).
+ */
+static int
+next_batch(struct scheduler *sched, queue_obj_t *URL_queue, queue_item_t **batch, int max)
+{
+	queue_item_t *item;
+	int nr = 0;
+	int i;
+
+	BLOCK_SIGNAL(SIGINT);
+	item = SCHED_take(sched);
+	UNBLOCK_SIGNAL(SIGINT);
+
+	if (!item)
+		return 0;
+
+	batch[nr++] = item;
+
+	while (nr < max && (item = SCHED_take_more(sched, (char *)batch[0]->data)))
+	{
+		for (i = 0; i < nr; ++i)
+		{
+			if (!strcmp((char *)batch[i]->data, (char *)item->data))
+				break;
+		}
+
+		if (i < nr)
+		{
+			free_queue_item(item);
+			continue;
+		}
+
+		if (!__same_server((char *)batch[0]->data, (char *)item->data))
+		{
+			QUEUE_enqueue(URL_queue, item->data, item->data_len);
+			free_queue_item(item);
+			break;
+		}
+
+		batch[nr++] = item;
+	}
+
+	return nr;
+}
+
+/**
+ * crawl_pipelined - fetch a batch of URLs with pipelined requests
+ *
+ * (or concurrent streams, with HTTP/2)
+ *
+ * Requests that went unanswered (the server closed
+ * the connection or sent something we could not
+ * parse) go back on the queue; by then the HTTP
+ * module will have reconnected, and switched off
+ * HTTP/1.1 pipelining so they are fetched one at
+ * a time. If it could not reconnect we give up on
+ * them, as Crawl_WebSite() does when a request
+ * cannot be sent.
+ */
+static int
+crawl_pipelined(struct http_t *http, queue_obj_t *URL_queue, btree_obj_t *tree_archived, queue_item_t **batch, int nr)
+{
+	char *URLs[HTTP_PIPELINE_MAX];
+	char *unanswered;
+	int retry_after = 0;
+	int nr_sent;
+	int i;
+
+	for (i = 0; i < nr; ++i)
+		URLs[i] = (char *)batch[i]->data;
+
+	if ((nr_sent = HTTP_pipeline_send(http, URLs, nr)) < 0)
+	{
+		for (i = 0; i < nr; ++i)
+		{
+			if (http_socket(http) < 0)
+			{
+				Log("Failed to send request for %s\n", URLs[i]);
+				BTREE_put_data(tree_archived, batch[i]->data, batch[i]->data_len);
+			}
+			else
+			{
+				QUEUE_enqueue(URL_queue, batch[i]->data, batch[i]->data_len);
+			}
+		}
+
+		return 0;
+	}
+
+	for (i = 0; i < nr_sent; ++i)
+	{
+		if (HTTP_pipeline_recv(http) < 0)
+		{
+			archive_discard_sink(http);
+			break;
+		}
+
+		if (HTTP_retry_after(http) > retry_after)
+			retry_after = HTTP_retry_after(http);
+
+		switch (http->code)
+		{
+		/*
+		 * The HTTP module does not follow redirects when
+		 * pipelining; HTTP->URL is the new location.
+		 */
+			case HTTP_MOVED_PERMANENTLY:
+			case HTTP_FOUND:
+			case HTTP_SEE_OTHER:
+
+				if (!BTREE_search_data(tree_archived, (void *)http->URL, strlen(http->URL)))
+					QUEUE_enqueue(URL_queue, (void *)http->URL, strlen(http->URL));
+
+				break;
+
+			default:
+
+				process_page(http, URL_queue, tree_archived);
+		}
+	}
+
+	while ((unanswered = HTTP_pipeline_unanswered(http)))
+	{
+		if (http_socket(http) < 0)
+		{
+			Log("Giving up on unanswered URL %s\n", unanswered);
+			BTREE_put_data(tree_archived, (void *)unanswered, strlen(unanswered));
+			continue;
+		}
+
+		Log("Requeueing unanswered URL %s\n", unanswered);
+		QUEUE_enqueue(URL_queue, (void *)unanswered, strlen(unanswered));
+	}
+
+	return retry_after;
+}
+
 int
 Crawl_WebSite(struct http_t *http, queue_obj_t *URL_queue, btree_obj_t *tree_archived)
 {
@@ -791,9 +1404,12 @@ Crawl_WebSite(struct http_t *http, queue_obj_t *URL_queue, btree_obj_t *tree_arc
 			URL_queue->nr_items,
 			tree_archived->nr_nodes);
 #endif
-	queue_item_t *item = NULL;
-	Dead_URL_t *dead = NULL;
-	int code;
+	queue_item_t *batch[HTTP_PIPELINE_MAX];
+	struct scheduler *sched;
+	int retry_after;
+	int batch_max;
+	int nr;
+	int i;
 
 	if (!(Dead_URL_cache = cache_create(
 			"dead_url_cache",
@@ -807,95 +1423,93 @@ Crawl_WebSite(struct http_t *http, queue_obj_t *URL_queue, btree_obj_t *tree_arc
 		goto fail;
 	}
 
-	btree_node_t *node = NULL;
+/*
+ * One request at a time, to whichever server may be
+ * sent one soonest; crawlDelay is the least time
+ * between requests to the same server.
+ */
+	if (!(sched = SCHED_new(nwctx.config.crawl_delay * 1000, 1, crawl_filter, (void *)tree_archived)))
+	{
+		put_error_msg("failed to create URL scheduler");
+		goto fail;
+	}
+
 	while (1)
 	{
 		buf_clear(&http_rbuf(http));
 		buf_clear(&http_wbuf(http));
 
-		do
-		{
-			Log("%d items in queue\n", URL_queue->nr_items);
-			item = QUEUE_dequeue(URL_queue);
-			Log("%d items in queue\n", URL_queue->nr_items);
-			if (NULL == item)
-				break;
-
-			Log("Dequeued item: %s\n", (char *)item->data);
-		}
-		while (NULL != (node = BTREE_search_data(tree_archived, item->data, strlen((char *)item->data))));
-
-		if (!item)
+		SCHED_admit(sched, URL_queue);
+
+	/*
+	 * HTTP/2 multiplexes requests whether or
+	 * not we were asked to pipeline them.
+	 */
+		if (http->pipelineDepth > 1)
+			batch_max = http->pipelineDepth;
+		else
+		if (HTTP_VERSION_2_0 == http->version)
+			batch_max = HTTP_PIPELINE_MAX;
+		else
+			batch_max = 1;
+
+	/*
+	 * With pipelining the crawl delay is between
+	 * batches of requests rather than each one.
+	 */
+		nr = next_batch(sched, URL_queue, batch, batch_max);
+
+		if (!nr)
 			break;
 
-		assert(item->data_len < HTTP_URL_MAX);
-		strcpy(http->URL, (char *)item->data);
-		http->URL_len = item->data_len;
-
-		if ((dead = search_dead_URL(Dead_URL_cache, http->URL)))
+		if (nr > 1)
 		{
-			++dead->times_seen;
-			continue;
+			retry_after = crawl_pipelined(http, URL_queue, tree_archived, batch, nr);
+			goto next;
 		}
 
+		strcpy(http->URL, (char *)batch[0]->data);
+		http->URL_len = batch[0]->data_len;
+
 		http->ops->URL_parse_host(http->URL, http->host);
 		http->ops->URL_parse_page(http->URL, http->page);
 
-		BLOCK_SIGNAL(SIGINT);
-		sleep(nwctx.config.crawl_delay);
-		UNBLOCK_SIGNAL(SIGINT);
-
 #ifdef DEBUG
 		fprintf(stderr, "Sending HTTP request for page\n");
 #endif
-		http->ops->send_request(http);
-#ifdef DEBUG
-		fprintf(stderr, "Receiving HTTP response\n");
-#endif
-		http->ops->recv_response(http);
-
-		code = http->code;
-#ifdef DEBUG
-		fprintf(stderr, "Got response [%d]\n", code);
-#endif
-
-		switch (code)
+	/*
+	 * Nothing went out if the URL is known to redirect
+	 * to itself or the connection failed; waiting for
+	 * a response would only run down the deadline. A
+	 * connection lost earlier gets one more try.
+	 */
+		if ((http_socket(http) < 0 && http_reconnect(http) < 0)
+		|| http->ops->send_request(http) < 0)
 		{
-			case HTTP_OK:
-
-				break;
-
-			case HTTP_NOT_FOUND:
-
-				cache_dead_URL(Dead_URL_cache, http->URL, code);
-				Log("%d dead URLs cached\n", cache_nr_used(Dead_URL_cache));
-
-			default:
-
-				goto next;
+			Log("Failed to send request for %s\n", http->URL);
+			BTREE_put_data(tree_archived, (void *)http->URL, http->URL_len);
+			retry_after = 0;
+			goto next;
 		}
-
-		Log("Adding URL to archived documents tree\n");
-		BTREE_put_data(tree_archived, (void *)http->URL, http->URL_len);
 #ifdef DEBUG
-		btree_node_t *node = BTREE_search_data(tree_archived, (void *)http->URL, http->URL_len);
-		assert(node);
+		fprintf(stderr, "Receiving HTTP response\n");
 #endif
-		Log("%d archived documents\n", tree_archived->nr_nodes);
+		if (http->ops->recv_response(http) < 0)
+			archive_discard_sink(http);
 
-		if (URL_parseable(http->URL))
-		{
-			parse_URLs(http, URL_queue, tree_archived);
-			transform_document_URLs(http);
-		}
-
-		archive_page(http);
+		retry_after = HTTP_retry_after(http);
+		process_page(http, URL_queue, tree_archived);
 
 	next:
 
-		(void)code;
+		SCHED_done(sched, (char *)batch[0]->data, retry_after);
+
+		for (i = 0; i < nr; ++i)
+			free_queue_item(batch[i]);
 	}
 
+	SCHED_delete(sched);
+
 fail:
 	return -1;
 }
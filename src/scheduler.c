@@ -0,0 +1,523 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "queue.h"
+#include "scheduler.h"
+
+/*
+ * Each server we have URLs for has its own queue of them.
+ * Servers that could be sent a request (URLs waiting, and
+ * fewer than MAX_PER_HOST in flight) are kept in a min-heap
+ * on the time they may next be sent one, so the next URL
+ * to go out is always that of the server at the top: if
+ * its time has come we take it, otherwise nothing can go
+ * before then and we wait for that long (or until a new
+ * URL or a finished request changes things).
+ */
+
+#define SCHED_HEAP_DEFAULT_SIZE 64
+
+static void
+sLog(char *fmt, ...)
+{
+#ifdef DEBUG
+	va_list args;
+
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+#else
+	(void)fmt;
+#endif
+}
+
+/**
+ * __host_key - get the host (and port) of URL
+ */
+static int
+__host_key(char *URL, char *host)
+{
+	char *p;
+	size_t len;
+
+	if ((p = strstr(URL, "://")))
+		p += 3;
+	else
+		p = URL;
+
+	len = strcspn(p, "/?#");
+
+	if (!len || len >= HTTP_HOST_MAX)
+		return -1;
+
+	memcpy(host, p, len);
+	host[len] = 0;
+
+	return 0;
+}
+
+static unsigned int
+__hash(char *name)
+{
+	unsigned int h = 5381;
+
+	while (*name)
+		h = (h * 33) ^ (unsigned char)*name++;
+
+	return (h % SCHED_HOST_BUCKETS);
+}
+
+static int
+__before(struct timespec *a, struct timespec *b)
+{
+	return (a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec));
+}
+
+static void
+__add_ms(struct timespec *ts, long ms)
+{
+	ts->tv_sec += (ms / 1000);
+	ts->tv_nsec += (ms % 1000) * 1000000L;
+
+	if (ts->tv_nsec >= 1000000000L)
+	{
+		++ts->tv_sec;
+		ts->tv_nsec -= 1000000000L;
+	}
+
+	return;
+}
+
+/*
+ * The following __functions are called with S->LOCK held.
+ */
+static void
+__heap_swap(struct scheduler *s, int i, int j)
+{
+	struct sched_host *h = s->heap[i];
+
+	s->heap[i] = s->heap[j];
+	s->heap[j] = h;
+	s->heap[i]->heap_idx = i;
+	s->heap[j]->heap_idx = j;
+
+	return;
+}
+
+static void
+__sift_up(struct scheduler *s, int i)
+{
+	int parent;
+
+	while (i > 0)
+	{
+		parent = (i - 1) / 2;
+
+		if (!__before(&s->heap[i]->next, &s->heap[parent]->next))
+			break;
+
+		__heap_swap(s, i, parent);
+		i = parent;
+	}
+
+	return;
+}
+
+static void
+__sift_down(struct scheduler *s, int i)
+{
+	int least;
+	int child;
+
+	while (1)
+	{
+		least = i;
+		child = (2 * i) + 1;
+
+		if (child < s->nr_heap && __before(&s->heap[child]->next, &s->heap[least]->next))
+			least = child;
+
+		if (child + 1 < s->nr_heap && __before(&s->heap[child + 1]->next, &s->heap[least]->next))
+			least = child + 1;
+
+		if (least == i)
+			break;
+
+		__heap_swap(s, i, least);
+		i = least;
+	}
+
+	return;
+}
+
+static int
+__heap_push(struct scheduler *s, struct sched_host *h)
+{
+	struct sched_host **heap;
+
+	if (s->nr_heap == s->heap_size)
+	{
+		if (!(heap = realloc(s->heap, (s->heap_size * 2) * sizeof(*heap))))
+			return -1;
+
+		s->heap = heap;
+		s->heap_size *= 2;
+	}
+
+	h->heap_idx = s->nr_heap;
+	s->heap[s->nr_heap++] = h;
+	__sift_up(s, h->heap_idx);
+
+	return 0;
+}
+
+static void
+__heap_remove(struct scheduler *s, struct sched_host *h)
+{
+	int i = h->heap_idx;
+
+	h->heap_idx = -1;
+
+	if (i != --s->nr_heap)
+	{
+		s->heap[i] = s->heap[s->nr_heap];
+		s->heap[i]->heap_idx = i;
+		__sift_up(s, i);
+		__sift_down(s, s->heap[i]->heap_idx);
+	}
+
+	return;
+}
+
+/**
+ * __reschedule - put H where it belongs after its queue, requests or time changed
+ */
+static void
+__reschedule(struct scheduler *s, struct sched_host *h)
+{
+	int ready = (h->URLs->nr_items && h->in_flight < s->max_per_host);
+
+	if (h->heap_idx < 0)
+	{
+		if (ready && __heap_push(s, h) < 0)
+			sLog("Failed to schedule %s\n", h->name);
+
+		return;
+	}
+
+	if (!ready)
+	{
+		__heap_remove(s, h);
+		return;
+	}
+
+	__sift_up(s, h->heap_idx);
+	__sift_down(s, h->heap_idx);
+
+	return;
+}
+
+static struct sched_host *
+__get_host(struct scheduler *s, char *URL, int create)
+{
+	struct sched_host *h;
+	char name[HTTP_HOST_MAX];
+	unsigned int bucket;
+
+	if (__host_key(URL, name) < 0)
+		return NULL;
+
+	bucket = __hash(name);
+
+	for (h = s->hosts[bucket]; h; h = h->hnext)
+	{
+		if (!strcmp(name, h->name))
+			return h;
+	}
+
+	if (!create)
+		return NULL;
+
+	if (!(h = calloc(1, sizeof(*h))))
+		return NULL;
+
+	if (!(h->URLs = QUEUE_object_new()))
+	{
+		free(h);
+		return NULL;
+	}
+
+	strcpy(h->name, name);
+	clock_gettime(CLOCK_MONOTONIC, &h->next);
+	h->heap_idx = -1;
+
+	h->hnext = s->hosts[bucket];
+	s->hosts[bucket] = h;
+
+	return h;
+}
+
+/**
+ * __dequeue - the next URL for H that the filter lets through
+ */
+static queue_item_t *
+__dequeue(struct scheduler *s, struct sched_host *h)
+{
+	queue_item_t *item;
+
+	while ((item = QUEUE_dequeue(h->URLs)))
+	{
+		if (!s->filter || !s->filter((char *)item->data, s->filter_arg))
+			return item;
+
+		free(item->data);
+		free(item);
+	}
+
+	return NULL;
+}
+
+/**
+ * SCHED_new - create a scheduler
+ * @delay: milliseconds to leave between requests to a server
+ * @max_per_host: requests a server may have in flight at once
+ * @filter: called for each URL before it is handed out (may be NULL)
+ * @arg: passed to FILTER
+ */
+struct scheduler *
+SCHED_new(int delay, int max_per_host, SCHED_filter_t filter, void *arg)
+{
+	struct scheduler *s;
+	pthread_condattr_t attr;
+
+	if (!(s = calloc(1, sizeof(*s))))
+		return NULL;
+
+	if (!(s->heap = calloc(SCHED_HEAP_DEFAULT_SIZE, sizeof(*s->heap))))
+		goto fail;
+
+	s->heap_size = SCHED_HEAP_DEFAULT_SIZE;
+	s->delay = (delay > 0 ? delay : 0);
+	s->max_per_host = (max_per_host > 0 ? max_per_host : 1);
+	s->filter = filter;
+	s->filter_arg = arg;
+
+/*
+ * We wait until a host's (monotonic) time comes.
+ */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&s->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	pthread_mutex_init(&s->lock, NULL);
+
+	return s;
+
+fail:
+
+	free(s);
+	return NULL;
+}
+
+void
+SCHED_delete(struct scheduler *s)
+{
+	assert(s);
+
+	struct sched_host *h;
+	struct sched_host *next;
+	queue_item_t *item;
+	int i;
+
+	for (i = 0; i < SCHED_HOST_BUCKETS; ++i)
+	{
+		for (h = s->hosts[i]; h; h = next)
+		{
+			next = h->hnext;
+
+			while ((item = QUEUE_dequeue(h->URLs)))
+			{
+				free(item->data);
+				free(item);
+			}
+
+			QUEUE_object_destroy(h->URLs);
+			free(h);
+		}
+	}
+
+	pthread_cond_destroy(&s->cond);
+	pthread_mutex_destroy(&s->lock);
+
+	free(s->heap);
+	free(s);
+
+	return;
+}
+
+int
+SCHED_admit(struct scheduler *s, queue_obj_t *queue)
+{
+	assert(s);
+	assert(queue);
+
+	struct sched_host *h;
+	queue_item_t *item;
+	int nr = 0;
+
+	if (!queue->nr_items)
+		return 0;
+
+	pthread_mutex_lock(&s->lock);
+
+	while ((item = QUEUE_dequeue(queue)))
+	{
+		if ((h = __get_host(s, (char *)item->data, 1))
+		&& QUEUE_enqueue(h->URLs, item->data, item->data_len) == 0)
+		{
+			__reschedule(s, h);
+			++nr;
+		}
+		else
+		{
+			sLog("Dropping URL %s\n", (char *)item->data);
+		}
+
+		free(item->data);
+		free(item);
+	}
+
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+
+	return nr;
+}
+
+queue_item_t *
+SCHED_take(struct scheduler *s)
+{
+	assert(s);
+
+	struct sched_host *h;
+	queue_item_t *item;
+	struct timespec now;
+
+	pthread_mutex_lock(&s->lock);
+
+	while (1)
+	{
+		if (!s->nr_heap)
+		{
+		/*
+		 * Nothing to hand out, and no request
+		 * in flight to bring us more URLs.
+		 */
+			if (!s->nr_in_flight)
+				goto out;
+
+			pthread_cond_wait(&s->cond, &s->lock);
+			continue;
+		}
+
+		h = s->heap[0];
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		if (__before(&now, &h->next))
+		{
+			pthread_cond_timedwait(&s->cond, &s->lock, &h->next);
+			continue;
+		}
+
+		if (!(item = __dequeue(s, h)))
+		{
+			__reschedule(s, h);
+			continue;
+		}
+
+		++h->in_flight;
+		++s->nr_in_flight;
+
+		h->next = now;
+		__add_ms(&h->next, s->delay);
+		__reschedule(s, h);
+
+		pthread_mutex_unlock(&s->lock);
+
+		return item;
+	}
+
+out:
+
+	pthread_mutex_unlock(&s->lock);
+
+	return NULL;
+}
+
+queue_item_t *
+SCHED_take_more(struct scheduler *s, char *URL)
+{
+	assert(s);
+	assert(URL);
+
+	struct sched_host *h;
+	queue_item_t *item = NULL;
+
+	pthread_mutex_lock(&s->lock);
+
+	if ((h = __get_host(s, URL, 0)))
+	{
+		item = __dequeue(s, h);
+		__reschedule(s, h);
+	}
+
+	pthread_mutex_unlock(&s->lock);
+
+	return item;
+}
+
+void
+SCHED_done(struct scheduler *s, char *URL, int retry_after)
+{
+	assert(s);
+	assert(URL);
+
+	struct sched_host *h;
+	struct timespec then;
+
+	pthread_mutex_lock(&s->lock);
+
+	if (!(h = __get_host(s, URL, 0)))
+		goto out;
+
+	assert(h->in_flight > 0);
+	--h->in_flight;
+	--s->nr_in_flight;
+
+	if (retry_after > 0)
+	{
+		if (retry_after > SCHED_BACKOFF_MAX)
+			retry_after = SCHED_BACKOFF_MAX;
+
+		sLog("Backing off %s for %d seconds\n", h->name, retry_after);
+
+		clock_gettime(CLOCK_MONOTONIC, &then);
+		then.tv_sec += retry_after;
+
+		if (__before(&h->next, &then))
+			h->next = then;
+	}
+
+	__reschedule(s, h);
+
+out:
+
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+
+	return;
+}
@@ -4,8 +4,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include "http.h"
+#include "scan.h"
 #include "utils_url.h"
 #include "netwasabi.h"
 
@@ -59,30 +61,37 @@ encode_url(buf_t *url)
 {
 	assert(url);
 
-	int url_eidx = 0;
+	char set[SCAN_SET_MAX];
+	int nr_set = 0;
+	int url_eidx;
+	off_t off;
 	char *p;
 	char *e;
 	char *tail = url->buf_tail;
 
-	while (url_encodings[url_eidx].old != 0)
+	while (url_encodings[nr_set].old != 0)
 	{
-		e = url->buf_head;
+		set[nr_set] = url_encodings[nr_set].old;
+		++nr_set;
+	}
 
-		while (1)
-		{
-			p = memchr(e, url_encodings[url_eidx].old, (tail - e));
+/*
+ * All the characters that need encoding
+ * are looked for in the one pass.
+ */
+	e = url->buf_head;
 
-			if (!p)
-			{
-				++url_eidx;
-				break;
-			}
+	while ((p = SCAN_find_any(e, (tail - e), set, (size_t)nr_set)))
+	{
+		for (url_eidx = 0; url_encodings[url_eidx].old != *p; ++url_eidx)
+			;
 
-			buf_shift(url, (off_t)(p - url->buf_head), (size_t)2);
-			tail = url->buf_tail;
-			strncpy(p, url_encodings[url_eidx].new, (size_t)3);
-			e = (p += 3);
-		}
+		off = (p - url->buf_head);
+		buf_shift(url, off, (size_t)2);
+		tail = url->buf_tail;
+		p = (url->buf_head + off);
+		strncpy(p, url_encodings[url_eidx].new, (size_t)3);
+		e = (p + 3);
 	}
 
 	/* Remove \"&amp;" */
@@ -92,9 +101,7 @@ encode_url(buf_t *url)
 
 	while (1)
 	{
-		p = strstr(e, "&amp;");
-
-		if (!p || p >= tail)
+		if (!(p = SCAN_find(e, (tail - e), "&amp;", 5)))
 			break;
 
 		++p;
@@ -109,9 +116,7 @@ encode_url(buf_t *url)
 
 	while (1)
 	{
-		p = strstr(e, "\\u0026");
-
-		if (!p || p >= tail)
+		if (!(p = SCAN_find(e, (tail - e), "\\u0026", 6)))
 			break;
 
 		*p++ = '&';
@@ -263,7 +268,7 @@ make_local_url(struct http_t *http, buf_t *url, buf_t *path)
 		assert(0);
 	}
 
-	buf_init(&tmp_full, HTTP_URL_MAX);
+	buf_get(&tmp_full, HTTP_URL_MAX);
 	http->ops->URL_parse_page(url->buf_head, tmp_page);
 
 	if (strncmp("http:", url->buf_head, 5) && strncmp("https:", url->buf_head, 6))
@@ -299,7 +304,7 @@ make_local_url(struct http_t *http, buf_t *url, buf_t *path)
 		buf_replace(path, ".git", ".html");
 	}
 
-	buf_destroy(&tmp_full);
+	buf_put(&tmp_full);
 
 	return 0;
 }
@@ -329,7 +334,7 @@ local_archive_exists(struct http_t *http, char *link)
 	char tmp_page[1024];
 	char tmp_host[1024];
 
-	buf_init(&tmp, path_max);
+	buf_get(&tmp, path_max);
 
 	http->ops->URL_parse_host(link, tmp_host);
 	http->ops->URL_parse_page(link, tmp_page);
@@ -355,7 +360,7 @@ local_archive_exists(struct http_t *http, char *link)
 	}
 
 	exists = access(tmp.buf_head, F_OK);
-	buf_destroy(&tmp);
+	buf_put(&tmp);
 
 	if (exists == 0)
 		return 1;
@@ -419,166 +424,355 @@ has_extension(char *page)
 		return 1;
 }
 
-/**
- * Transform embedded URLs in HTML into local
- * URLs (i.e., file:///path_to_archived_html_document)
+/*
+ * Links are localised by collecting a list of edits against
+ * the document as it was received, which is not touched;
+ * the edited document is then built, or written straight
+ * out to the archive, in one forward pass. Rewriting each
+ * link in place cost a move of the rest of the document.
  */
+
+#define URL_EDITS_DEFAULT_SIZE 64
+
+int
+URL_edits_init(struct URL_edits *edits)
+{
+	assert(edits);
+
+	memset(edits, 0, sizeof(*edits));
+
+	if (!(edits->list = calloc(URL_EDITS_DEFAULT_SIZE, sizeof(struct URL_edit))))
+		return -1;
+
+	edits->size = URL_EDITS_DEFAULT_SIZE;
+
+	if (buf_init(&edits->text, DEFAULT_BUFSIZE) < 0)
+	{
+		free(edits->list);
+		edits->list = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
 void
-transform_document_URLs(struct http_t *http)
+URL_edits_destroy(struct URL_edits *edits)
+{
+	assert(edits);
+
+	free(edits->list);
+	buf_destroy(&edits->text);
+	memset(edits, 0, sizeof(*edits));
+
+	return;
+}
+
+static int
+__edit_add(struct URL_edits *edits, off_t off, size_t len, buf_t *text)
+{
+	struct URL_edit *list;
+	struct URL_edit *e;
+
+	if (edits->nr == edits->size)
+	{
+		if (!(list = realloc(edits->list, (edits->size * 2) * sizeof(*list))))
+			return -1;
+
+		edits->list = list;
+		edits->size *= 2;
+	}
+
+	e = &edits->list[edits->nr];
+
+	e->off = off;
+	e->len = len;
+	e->text_off = (off_t)edits->text.data_len;
+	e->text_len = text->data_len;
+
+	if (buf_append_ex(&edits->text, text->buf_head, text->data_len) < 0)
+		return -1;
+
+	++edits->nr;
+
+	return 0;
+}
+
+static int
+__edit_cmp(const void *a, const void *b)
+{
+	off_t x = ((const struct URL_edit *)a)->off;
+	off_t y = ((const struct URL_edit *)b)->off;
+
+	return (x < y ? -1 : (x > y));
+}
+
+/**
+ * URL_find_edits - list the links in the document in HTTP's read buffer that are to be localised
+ * @http: our HTTP object
+ * @edits: the list, emptied first; sorted by offset on return
+ */
+int
+URL_find_edits(struct http_t *http, struct URL_edits *edits)
 {
 	assert(http);
+	assert(edits);
 
 	buf_t *buf = &http->conn.read_buf;
+	char *head = buf->buf_head;
 	char *tail = buf->buf_tail;
 	char *p;
-	char *savep;
 	char *url_start;
 	char *url_end;
-	off_t url_start_off;
-	off_t url_end_off;
-	off_t savep_off;
-	off_t poff;
 	size_t range;
 	buf_t url;
 	buf_t path;
 	buf_t full;
 	int url_type_idx;
+	int rv = -1;
 
-	buf_init(&url, HTTP_URL_MAX);
-	buf_init(&path, HTTP_URL_MAX);
-	buf_init(&full, HTTP_URL_MAX);
-
-#define save_pointers()\
-do {\
-	savep_off = (savep - buf->buf_head);\
-	poff = (savep - buf->buf_head);\
-	url_start_off = (url_start - buf->buf_head);\
-	url_end_off = (url_end - buf->buf_head);\
-} while (0)
-
-#define restore_pointers()\
-do {\
-	savep = (buf->buf_head + savep_off);\
-	p = (buf->buf_head + poff);\
-	url_start = (buf->buf_head + url_start_off);\
-	url_end = (buf->buf_head + url_end_off);\
-} while (0)
-
-	savep = buf->buf_head;
-	url_type_idx = 0;
+	edits->nr = 0;
+	buf_clear(&edits->text);
 
-	while (1)
-	{
-		buf_clear(&url);
+	if (buf_get(&url, HTTP_URL_MAX) < 0)
+		return -1;
+
+	if (buf_get(&path, HTTP_URL_MAX) < 0)
+		goto out_put_url;
 
-		assert(buf->buf_tail <= buf->buf_end);
-		assert(buf->buf_head >= buf->data);
+	if (buf_get(&full, HTTP_URL_MAX) < 0)
+		goto out_put_path;
 
-		p = strstr(savep, url_types[url_type_idx].string);
+	for (url_type_idx = 0; url_types[url_type_idx].delim != 0; ++url_type_idx)
+	{
+		p = head;
 
-		if (!p || p >= tail)
+		while ((p = SCAN_find(p, (tail - p), url_types[url_type_idx].string, url_types[url_type_idx].len)))
 		{
-			++url_type_idx;
+			url_start = (p + url_types[url_type_idx].len);
 
-			if (url_types[url_type_idx].delim == 0)
+			if (!(url_end = memchr(url_start, url_types[url_type_idx].delim, (tail - url_start))))
 				break;
 
-			savep = buf->buf_head;
-			continue;
-		}
+			p = (url_end + 1);
+			range = (url_end - url_start);
 
-		url_start = (p += url_types[url_type_idx].len);
-		url_end = memchr(url_start, url_types[url_type_idx].delim, (tail - url_start));
+			if (!range || range >= HTTP_URL_MAX)
+				continue;
 
-		if (!url_end)
-		{
-			++url_type_idx;
+			if (!strncmp("http://", url_start, range) || !strncmp("https://", url_start, range))
+				continue;
 
-			if (url_types[url_type_idx].delim == 0)
-				break;
+			buf_clear(&url);
 
-			savep = buf->buf_head;
-			continue;
+			if (buf_append_ex(&url, url_start, range) < 0)
+				goto out;
+
+			if (make_full_url(http, &url, &full) < 0 || make_local_url(http, &full, &path) < 0)
+				continue;
+
+			if (__edit_add(edits, (off_t)(url_start - head), range, &path) < 0)
+				goto out;
 		}
+	}
 
-		assert(buf->buf_tail <= buf->buf_end);
-		assert(url_start < buf->buf_tail);
-		assert(url_end < buf->buf_tail);
-		assert(p < buf->buf_tail);
-		assert(savep < buf->buf_tail);
-		assert((tail - buf->buf_head) == (buf->buf_tail - buf->buf_head));
+/*
+ * Each type of link was looked for in turn.
+ */
+	qsort(edits->list, (size_t)edits->nr, sizeof(struct URL_edit), __edit_cmp);
+
+	rv = 0;
+
+out:
+
+	buf_put(&full);
 
-		range = (url_end - url_start);
+out_put_path:
+
+	buf_put(&path);
+
+out_put_url:
+
+	buf_put(&url);
+
+	return rv;
+}
 
-		if (!range)
+/*
+ * Where __edit_iov() got to.
+ */
+struct __edit_pos
+{
+	off_t pos; /* in the original */
+	int idx; /* next edit */
+};
+
+/**
+ * __edit_iov - the next pieces of the edited document, up to NR of them
+ *
+ * Runs of the original alternate with replacements.
+ * An edit that overlaps the one before it is dropped.
+ * Returns the number of entries filled in (0 at the end).
+ */
+static int
+__edit_iov(buf_t *buf, struct URL_edits *edits, struct __edit_pos *at, struct iovec *iov, int nr)
+{
+	struct URL_edit *e;
+	off_t end = (buf->buf_tail - buf->buf_head);
+	off_t next;
+	int i = 0;
+
+	while (i < nr && at->pos < end)
+	{
+		e = (at->idx < edits->nr ? &edits->list[at->idx] : NULL);
+
+		if (e && e->off < at->pos)
 		{
-			++savep;
+			++at->idx;
 			continue;
 		}
 
-		if (!strncmp("http://", url_start, range) || !strncmp("https://", url_start, range))
+		next = (e ? e->off : end);
+
+		if (at->pos < next)
 		{
-			savep = ++url_end;
+			iov[i].iov_base = buf->buf_head + at->pos;
+			iov[i].iov_len = (size_t)(next - at->pos);
+			at->pos = next;
+			++i;
 			continue;
 		}
 
-		if (range >= HTTP_URL_MAX)
+		if (e->text_len)
 		{
-			savep = ++url_end;
-			continue;
+			iov[i].iov_base = edits->text.buf_head + e->text_off;
+			iov[i].iov_len = e->text_len;
+			++i;
 		}
 
-		assert(range < HTTP_URL_MAX);
+		at->pos += (off_t)e->len;
+		++at->idx;
+	}
+
+	return i;
+}
+
+/**
+ * URL_apply_edits - replace the contents of BUF with the edited document
+ */
+int
+URL_apply_edits(buf_t *buf, struct URL_edits *edits)
+{
+	assert(buf);
+	assert(edits);
+
+	struct iovec iov[URL_EDITS_IOV_MAX];
+	struct __edit_pos at = { 0, 0 };
+	buf_t out;
+	int nr;
+	int i;
+
+	if (!edits->nr)
+		return 0;
+
+	memset(&out, 0, sizeof(out));
 
-		buf_append_ex(&url, url_start, range);
-		BUF_NULL_TERMINATE(&url);
+	if (buf_init(&out, buf->data_len + edits->text.data_len + 1) < 0)
+		return -1;
 
-		if (range)
+	while ((nr = __edit_iov(buf, edits, &at, iov, URL_EDITS_IOV_MAX)) > 0)
+	{
+		for (i = 0; i < nr; ++i)
 		{
-			//fprintf(stderr, "turning %s into full url\n", url.buf_head);
-			make_full_url(http, &url, &full);
-			//fprintf(stderr, "made %s\n", full.buf_head);
+			if (buf_append_ex(&out, (char *)iov[i].iov_base, iov[i].iov_len) < 0)
+				goto fail;
+		}
+	}
 
-			if (make_local_url(http, &full, &path) == 0)
-			{
-				//fprintf(stderr, "made local url %s\n", path.buf_head);
-				buf_collapse(buf, (off_t)(url_start - buf->buf_head), range);
-				tail = buf->buf_tail;
+	buf_destroy(buf);
+	*buf = out;
 
-				save_pointers();
+	return 0;
 
-				assert(path.data_len < path_max);
+fail:
 
-				if (path.data_len >= buf->buf_size)
-				{
-					savep = ++url_end;
-					continue;
-				}
+	buf_destroy(&out);
+	return -1;
+}
 
-				buf_shift(buf, (off_t)(url_start - buf->buf_head), path.data_len);
-				tail = buf->buf_tail;
+/**
+ * URL_write_edits - write the edited document to FD without building it
+ * @fd: where to write it
+ * @buf: the original document
+ * @from: offset in BUF to start from (e.g., the end of the response header)
+ * @edits: from URL_find_edits() on BUF
+ */
+ssize_t
+URL_write_edits(int fd, buf_t *buf, off_t from, struct URL_edits *edits)
+{
+	assert(buf);
+	assert(edits);
+
+	struct iovec iov[URL_EDITS_IOV_MAX];
+	struct __edit_pos at = { from, 0 };
+	ssize_t n;
+	ssize_t total = 0;
+	int nr;
+	int i;
+
+	while ((nr = __edit_iov(buf, edits, &at, iov, URL_EDITS_IOV_MAX)) > 0)
+	{
+		i = 0;
+
+		while (i < nr)
+		{
+			n = writev(fd, iov + i, nr - i);
 
-				restore_pointers();
+			if (n < 0 && EINTR == errno)
+				continue;
 
-				assert((url_start - buf->buf_head) == url_start_off);
-				assert((url_end - buf->buf_head) == url_end_off);
-				assert((p - buf->buf_head) == poff);
-				assert((savep - buf->buf_head) == savep_off);
+			if (n <= 0)
+				return -1;
 
-				strncpy(url_start, path.buf_head, path.data_len);
+			total += n;
+
+			while (i < nr && (size_t)n >= iov[i].iov_len)
+			{
+				n -= (ssize_t)iov[i].iov_len;
+				++i;
+			}
+
+			if (i < nr)
+			{
+				iov[i].iov_base = (char *)iov[i].iov_base + n;
+				iov[i].iov_len -= (size_t)n;
 			}
 		}
+	}
+
+	return total;
+}
+
+/**
+ * Transform embedded URLs in HTML into local
+ * URLs (i.e., file:///path_to_archived_html_document)
+ */
+void
+transform_document_URLs(struct http_t *http)
+{
+	assert(http);
 
-		assert(buf_integrity(&url));
-		assert(buf_integrity(&full));
-		assert(buf_integrity(&path));
+	struct URL_edits edits;
 
-		//++savep;
-		savep = ++url_end;
+	if (URL_edits_init(&edits) < 0)
+		return;
 
-		if (savep >= tail)
-			break;
-	}
+	if (URL_find_edits(http, &edits) == 0 && URL_apply_edits(&http->conn.read_buf, &edits) < 0)
+		fprintf(stderr, "transform_document_URLs: failed to rewrite links in %s\n", http->URL);
+
+	URL_edits_destroy(&edits);
+
+	return;
 }
 
 int
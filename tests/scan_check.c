@@ -0,0 +1,286 @@
+/*
+ * Check the SIMD search kernels in src/mm/scan.c against the scalar
+ * ones, then time SCAN_find() and SCAN_find_any() against memmem(3)
+ * and memchr(3). The kernels are static, so scan.c is built in here.
+ *
+ *	make -C tests check
+ *	make -C tests bench
+ */
+#include "../src/mm/scan.c"
+#include <stdlib.h>
+#include <time.h>
+
+#define LEN_MAX 64
+#define ALIGN_MAX 32 /* base offsets tried, to cover unaligned loads */
+#define SPAN_MAX (LEN_MAX + ALIGN_MAX + 64)
+
+#define BENCH_LEN (1 << 20)
+#define BENCH_ROUNDS 200
+
+typedef char *(*kernel_t)(const char *, size_t, const char *, size_t);
+
+struct kernel
+{
+	const char *name;
+	kernel_t find;
+	kernel_t find_any;
+	int usable;
+};
+
+static struct kernel kernels_checked[] =
+{
+#ifdef SCAN_X86
+	{ "sse2", __find_sse2, __find_any_sse2, 1 },
+	{ "avx2", __find_avx2, __find_any_avx2, 0 },
+#endif
+	{ NULL, NULL, NULL, 0 }
+};
+
+static int nr_failed = 0;
+static int nr_checked = 0;
+
+static void
+fail(const char *what, const char *kname, size_t align, size_t len, size_t nlen, long want, long got)
+{
+	if (++nr_failed <= 20)
+	{
+		fprintf(stderr, "FAIL %s (%s): align=%lu len=%lu n=%lu: want %ld, got %ld\n",
+			what, kname, align, len, nlen, want, got);
+	}
+
+	return;
+}
+
+static long
+__off(const char *base, const char *p)
+{
+	return (p ? (long)(p - base) : -1L);
+}
+
+/*
+ * Compare every kernel with the scalar one on SPAN[ALIGN..ALIGN+LEN).
+ */
+static void
+check_span(char *span, size_t align, size_t len, const char *needle, size_t nlen)
+{
+	const char *p = span + align;
+	long want;
+	long got;
+	struct kernel *k;
+
+	if (nlen >= 2 && nlen <= len)
+	{
+		want = __off(p, __find_scalar(p, len, needle, nlen));
+
+		for (k = kernels_checked; k->name; ++k)
+		{
+			if (!k->usable)
+				continue;
+
+			got = __off(p, k->find(p, len, needle, nlen));
+			++nr_checked;
+
+			if (got != want)
+				fail("find", k->name, align, len, nlen, want, got);
+		}
+	}
+
+	if (nlen && nlen <= SCAN_SET_MAX)
+	{
+		want = __off(p, __find_any_scalar(p, len, needle, nlen));
+
+		for (k = kernels_checked; k->name; ++k)
+		{
+			if (!k->usable)
+				continue;
+
+			got = __off(p, k->find_any(p, len, needle, nlen));
+			++nr_checked;
+
+			if (got != want)
+				fail("find_any", k->name, align, len, nlen, want, got);
+		}
+	}
+
+/*
+ * And the public entry points, which take
+ * the short cuts for the edge cases.
+ */
+	want = __off(p, memmem(p, len, needle, nlen));
+	got = __off(p, SCAN_find(p, len, needle, nlen));
+	++nr_checked;
+
+	if (got != want)
+		fail("SCAN_find", kernels.name, align, len, nlen, want, got);
+
+	want = __off(p, __find_any_scalar(p, len, needle, nlen));
+	got = __off(p, SCAN_find_any(p, len, needle, nlen));
+	++nr_checked;
+
+	if (got != want)
+		fail("SCAN_find_any", kernels.name, align, len, nlen, want, got);
+
+	return;
+}
+
+static void
+run_checks(void)
+{
+	char span[SPAN_MAX];
+	char needle[SCAN_SET_MAX + 8];
+	size_t align;
+	size_t len;
+	size_t nlen;
+	size_t at;
+	size_t i;
+
+	srand(12345);
+
+	for (align = 0; align < ALIGN_MAX; ++align)
+	{
+		for (len = 0; len <= LEN_MAX; ++len)
+		{
+			for (nlen = 1; nlen <= SCAN_SET_MAX + 4; ++nlen)
+			{
+			/*
+			 * A small alphabet gives plenty of partial
+			 * matches (same first and last byte).
+			 */
+				for (i = 0; i < sizeof(needle); ++i)
+					needle[i] = 'a' + (rand() % 3);
+
+				memset(span, 'x', sizeof(span));
+
+				for (i = 0; i < len; ++i)
+					span[align + i] = 'a' + (rand() % 4);
+
+				check_span(span, align, len, needle, nlen);
+
+			/*
+			 * No match at all, then one match at every
+			 * place it fits, which includes across the
+			 * 16 and 32 byte block boundaries.
+			 */
+				memset(span + align, 'z', len);
+				check_span(span, align, len, needle, nlen);
+
+				for (at = 0; nlen <= len && at + nlen <= len; ++at)
+				{
+					memset(span + align, 'z', len);
+					memcpy(span + align + at, needle, nlen);
+					check_span(span, align, len, needle, nlen);
+				}
+			}
+		}
+	}
+
+	return;
+}
+
+static double
+__seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void
+__report(const char *what, double secs, size_t sink)
+{
+	double mb = ((double)BENCH_LEN * BENCH_ROUNDS) / (1024.0 * 1024.0);
+
+	printf("  %-28s %8.1f MiB/s  (%lu)\n", what, mb / secs, sink);
+
+	return;
+}
+
+/*
+ * A megabyte of text without the byte or string searched
+ * for, so each call runs the whole length of it.
+ */
+static void
+run_bench(void)
+{
+	char *text;
+	double t;
+	size_t sink;
+	size_t i;
+	int r;
+
+	if (!(text = malloc(BENCH_LEN)))
+	{
+		fprintf(stderr, "bench: out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < BENCH_LEN; ++i)
+		text[i] = "abcdefghijklmnopqrstuvwxyz =\"\n"[i % 30];
+
+	printf("kernels: %s\n", SCAN_kernel());
+
+#define BENCH(what, call) \
+	do { \
+		sink = 0; \
+		t = __seconds(); \
+		for (r = 0; r < BENCH_ROUNDS; ++r) \
+		{ \
+			__asm__ volatile("" : : "r"(text) : "memory"); /* not hoisted */ \
+			sink += (call) ? 1 : 0; \
+		} \
+		__report((what), __seconds() - t, sink); \
+	} while (0)
+
+	BENCH("memmem \"href=\"", memmem(text, BENCH_LEN, "href=", 5));
+	BENCH("SCAN_find \"href=\"", SCAN_find(text, BENCH_LEN, "href=", 5));
+	BENCH("memmem \"\\r\\n\\r\\n\"", memmem(text, BENCH_LEN, "\r\n\r\n", 4));
+	BENCH("SCAN_find \"\\r\\n\\r\\n\"", SCAN_find(text, BENCH_LEN, "\r\n\r\n", 4));
+	BENCH("memchr '<'", memchr(text, '<', BENCH_LEN));
+	BENCH("SCAN_find_any \"<\"", SCAN_find_any(text, BENCH_LEN, "<", 1));
+	BENCH("scalar find_any \"<>&\"", __find_any_scalar(text, BENCH_LEN, "<>&", 3));
+	BENCH("SCAN_find_any \"<>&\"", SCAN_find_any(text, BENCH_LEN, "<>&", 3));
+
+#undef BENCH
+
+	free(text);
+
+	return;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct kernel *k;
+
+#ifdef SCAN_X86
+	__builtin_cpu_init();
+
+	for (k = kernels_checked; k->name; ++k)
+	{
+		if (!strcmp(k->name, "avx2"))
+			k->usable = __builtin_cpu_supports("avx2");
+	}
+#endif
+
+	if (argc > 1 && !strcmp(argv[1], "bench"))
+	{
+		run_bench();
+		exit(EXIT_SUCCESS);
+	}
+
+	run_checks();
+
+	printf("scan_check: %d comparisons, %d failed (kernels: %s", nr_checked, nr_failed, "scalar");
+
+	for (k = kernels_checked; k->name; ++k)
+	{
+		if (k->usable)
+			printf(", %s", k->name);
+	}
+
+	printf(")\n");
+
+	exit(nr_failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}